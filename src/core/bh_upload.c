@@ -652,6 +652,9 @@ browse_host_open(
 		args.cb = deflate_cb;
 		args.nagle = FALSE;
 		args.reduced = FALSE;
+		args.low_memory = FALSE;
+		args.lazy = FALSE;
+		args.offload = FALSE;
 		args.gzip = 0 != (flags & BH_F_GZIP);
 		args.buffer_flush = INT_MAX;		/* Flush only at the end */
 		args.buffer_size = BH_BUFSIZ;
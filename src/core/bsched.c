@@ -2160,6 +2160,86 @@ bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 	return r;
 }
 
+/**
+ * Send several UDP datagrams, in order, as bandwidth permits.
+ *
+ * We send the largest prefix of the datagrams that fits in the available
+ * bandwidth, applying the same BW_UDP_OVERSIZE leniency as bio_sendto()
+ * does for a single datagram.  Each datagram sent is accounted for
+ * separately, with its own IP+UDP overhead.
+ *
+ * @param bio		the I/O source
+ * @param dg		the datagrams to send
+ * @param cnt		amount of datagrams in ``dg''
+ *
+ * @return the amount of datagrams sent, -1 with errno set if the first one
+ * could not be sent, EAGAIN meaning we lack bandwidth.
+ */
+int
+bio_sendmmsg(bio_source_t *bio, wrap_dgram_t *dg, unsigned cnt)
+{
+	size_t available, total = 0, len = 0, sent = 0;
+	unsigned i, n;
+	int r;
+
+	bio_check(bio);
+	g_assert(bio->flags & BIO_F_WRITE);
+	g_assert(dg != NULL);
+	g_assert(cnt != 0);
+
+	for (i = 0; i < cnt; i++)
+		total = size_saturate_add(total, dg[i].len);
+
+	available = bw_available(bio, total);
+
+	if (0 == available) {
+		errno = VAL_EAGAIN;
+		return -1;
+	}
+
+	for (n = 0; n < cnt; n++) {
+		size_t next = size_saturate_add(len, dg[n].len);
+
+		if (available + BW_UDP_OVERSIZE < next)
+			break;
+		len = next;
+	}
+
+	if (0 == n) {
+		errno = VAL_EAGAIN;
+		return -1;
+	}
+
+	if (GNET_PROPERTY(bsched_debug) > 7)
+		g_debug("BSCHED %s(wio=%d, cnt=%u, len=%zu) available=%zu",
+			G_STRFUNC, bio->wio->fd(bio->wio), n, len, available);
+
+	g_assert(bio->wio != NULL);
+	g_assert(bio->wio->sendmmsg != NULL);
+	r = (*bio->wio->sendmmsg)(bio->wio, dg, n);
+
+	if (-1 == r && 0 == errno) {
+		g_warning("wio->sendmmsg(fd=%d, cnt=%u) returned -1 with errno = 0, "
+			"assuming EAGAIN", bio->wio->fd(bio->wio), n);
+		errno = VAL_EAGAIN;
+	}
+
+	if (r <= 0)
+		return r;
+
+	g_assert(UNSIGNED(r) <= n);
+
+	for (i = 0, len = 0; i < UNSIGNED(r); i++) {
+		sent += dg[i].sent + BW_UDP_MSG;
+		len += dg[i].len + BW_UDP_MSG;
+	}
+
+	bsched_bw_update(bsched_get(bio->bws), sent, len);
+	bio_bw_update(bio, sent);
+
+	return r;
+}
+
 /**
  * Write at most `len' bytes to source's fd, as bandwidth permits.
  *
@@ -81,6 +81,7 @@ ssize_t bio_write(bio_source_t *bio, const void *data, size_t len);
 ssize_t bio_writev(bio_source_t *bio, iovec_t *iov, int iovcnt);
 ssize_t bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 	const void *data, size_t len);
+int bio_sendmmsg(bio_source_t *bio, wrap_dgram_t *dg, unsigned cnt);
 ssize_t bio_sendfile(sendfile_ctx_t *ctx, bio_source_t *bio, int in_fd,
 	fileoffset_t *offset, size_t len);
 ssize_t bio_read(bio_source_t *bio, void *data, size_t len);
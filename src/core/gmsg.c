@@ -770,6 +770,46 @@ gmsg_split_routeto_all_but_one(const gnutella_node_t *from,
 	pmsg_free(mb);
 }
 
+/**
+ * Route message from ``from'' consisting of header and data to the nodes
+ * held in the list, which is the target of a ROUTE_MULTI destination.
+ *
+ * The message is built once and each node gets a reference to the same
+ * data, instead of an individual copy.
+ */
+static void
+gmsg_split_routeto_multi(const gnutella_node_t *from, const pslist_t *sl,
+	const void *head, const void *data, uint32 size)
+{
+	pmsg_t *mb = NULL;
+
+	gmsg_header_check(head, size);
+
+	for (/* empty */; sl; sl = pslist_next(sl)) {
+		gnutella_node_t *dn = sl->data;
+
+		node_check(dn);
+
+		if (NODE_TALKS_G2(dn) || NODE_IS_UDP(dn))
+			continue;
+		if (from->header_flags && !NODE_CAN_SFLAG(dn))
+			continue;
+		if (!NODE_IS_WRITABLE(dn))
+			continue;
+
+		if (NULL == mb) {
+			if (GNET_PROPERTY(gmsg_debug) > 6)
+				gmsg_split_dump(stdout, head, data, size);
+			mb = gmsg_split_to_pmsg(head, data, size);
+		}
+
+		mq_tcp_putq(dn->outq, pmsg_clone(mb), from);
+	}
+
+	if (mb != NULL)
+		pmsg_free(mb);
+}
+
 /**
  * Route message consisting of header and data to all the nodes in the list.
  */
@@ -808,7 +848,6 @@ void
 gmsg_sendto_route(gnutella_node_t *n, struct route_dest *rt)
 {
 	gnutella_node_t *rt_node = rt->ur.u_node;
-	const pslist_t *sl;
 
 	/*
 	 * If during processing (e.g. in search_request_preprocess()) after
@@ -860,16 +899,8 @@ gmsg_sendto_route(gnutella_node_t *n, struct route_dest *rt)
 			&n->header, n->data, n->size + GTA_HEADER_SIZE);
 		return;
 	case ROUTE_MULTI:
-		PSLIST_FOREACH(rt->ur.u_nodes, sl) {
-			rt_node = sl->data;
-			node_check(rt_node);
-			if (NODE_TALKS_G2(rt_node))
-				continue;
-			if (n->header_flags && !NODE_CAN_SFLAG(rt_node))
-				continue;
-			gmsg_split_routeto_one(n, rt_node,
-				&n->header, n->data, n->size + GTA_HEADER_SIZE);
-		}
+		gmsg_split_routeto_multi(n, rt->ur.u_nodes,
+			&n->header, n->data, n->size + GTA_HEADER_SIZE);
 		return;
 	}
 
@@ -48,6 +48,7 @@
 #include "settings.h"
 #include "share.h"
 #include "spam.h"
+#include "tth_cache.h"
 #include "verify_sha1.h"
 #include "verify_tth.h"
 #include "version.h"
@@ -625,16 +626,38 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 		if (!huge_need_sha1(sf))
 			return FALSE;
 		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, TRUE);
+
+		/*
+		 * Compute the TTH in the same pass if we are going to need it,
+		 * to avoid reading the whole file a second time afterwards.
+		 */
+
+		if (
+			GNET_PROPERTY(sha1_with_tth) &&
+			shared_file_is_finished(sf) &&
+			!shared_file_tth_is_available(sf)
+		)
+			verify_sha1_want_tth(ctx);
 		return TRUE;
 	case VERIFY_PROGRESS:
 		return shared_file_indexed(sf);
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
-		request_tigertree(sf, TRUE);
+		{
+			const struct tth *tth = verify_sha1_tth(ctx);
+
+			if (tth != NULL) {
+				tth_cache_insert(tth, verify_sha1_tth_leaves(ctx),
+					verify_sha1_tth_leave_count(ctx));
+				huge_update_hashes(sf, verify_sha1_digest(ctx), tth);
+			} else {
+				huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
+				request_tigertree(sf, TRUE);
+			}
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
-		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, FALSE);
+		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, verify_pool_busy(ctx));
 		shared_file_unref(&sf);
 		return TRUE;
 	case VERIFY_INVALID:
@@ -38,15 +38,21 @@
 #include "lib/atoms.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
+#include "lib/htable.h"
 #include "lib/pattern.h"
 #include "lib/pslist.h"
 #include "lib/stringify.h"	/* For hex_escape() */
 #include "lib/utf8.h"
+#include "lib/vsort.h"
 #include "lib/walloc.h"
 #include "lib/wordvec.h"
 
 #include "if/gnet_property_priv.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "lib/override.h"		/* Must be the last header included */
 
 #define WOVEC_DFLT	10			/**< Default size of word-vectors */
@@ -88,6 +94,31 @@ typedef uint64 st_mask_t;
 
 #define ST_MIN_BIN_SIZE		4
 
+/*
+ * Trigram index.
+ *
+ * When the "search_trigram_index" property is set, each set also maintains
+ * posting lists for all the sequences of 3 consecutive non-space indexing
+ * chars found in the names.  The posting list of a trigram holds, in
+ * increasing order, the index in ``all_entries'' of each entry where that
+ * trigram appears.
+ *
+ * Given the query "arc", we'll only consider the entries listed under the
+ * trigram "arc".  With longer words, the posting lists of all the trigrams
+ * of all the query words are intersected, which yields far less candidates
+ * to run through entry_match() than the smallest 2-char bin does.
+ */
+
+#define ST_TRIGRAM_MIN_SIZE		4	/* Initial posting list size */
+#define ST_TRIGRAM_MAX_LISTS	32	/* Max posting lists to intersect */
+#define ST_TRIGRAM_THRESHOLD	64	/* Min best bin size to use trigrams */
+#define ST_GALLOP_RATIO			16	/* Size ratio to switch to galloping */
+
+struct st_postings {
+	uint32 *ids;					/* Sorted entry indices */
+	uint nids, size;
+};
+
 struct st_entry {
 	const char *string;				/* atom */
 	shared_file_t *sf;
@@ -103,6 +134,7 @@ struct st_set {
 	uint nentries, nchars, nbins;
 	struct st_bin **bins;
 	struct st_bin all_entries;
+	htable_t *trigrams;				/* trigram -> struct st_postings */
 	uchar index_map[MAX_INT_VAL(uchar)];
 	uchar fold_map[MAX_INT_VAL(uchar)];
 };
@@ -303,6 +335,9 @@ st_set_recreate(struct st_set *set)
 		set->bins[i] = NULL;
 
     bin_initialize(&set->all_entries, ST_MIN_BIN_SIZE);
+
+	set->trigrams = GNET_PROPERTY(search_trigram_index) ?
+		htable_create(HASH_KEY_SELF, 0) : NULL;
 }
 
 /**
@@ -317,6 +352,36 @@ st_recreate(search_table_t *table)
 	st_set_recreate(&table->alias);
 }
 
+/**
+ * htable_foreach() callback to free posting lists.
+ */
+static void
+st_postings_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct st_postings *p = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	HFREE_NULL(p->ids);
+	WFREE(p);
+}
+
+/**
+ * htable_foreach() callback to compact posting lists.
+ */
+static void
+st_postings_compact_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct st_postings *p = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	HREALLOC_ARRAY(p->ids, p->nids);
+	p->size = p->nids;
+}
+
 /**
  * Destroy a set.
  */
@@ -337,6 +402,11 @@ st_set_destroy(struct st_set *set)
 		HFREE_NULL(set->bins);
 	}
 
+	if (set->trigrams != NULL) {
+		htable_foreach(set->trigrams, st_postings_free_kv, NULL);
+		htable_free_null(&set->trigrams);
+	}
+
 	if (set->all_entries.vals) {
 		for (i = 0; i < set->all_entries.nvals; i++) {
 			destroy_entry(set->all_entries.vals[i]);
@@ -471,12 +541,70 @@ mask_hash(const char *s) {
  * Get key of two-char pair.
  */
 static inline uint
-st_key(struct st_set *set, const char k[2])
+st_key(const struct st_set *set, const char k[2])
 {
 	return set->index_map[(uchar) k[0]] * set->nchars +
 		set->index_map[(uchar) k[1]];
 }
 
+/**
+ * Get key of three-char sequence, for the trigram index.
+ */
+static inline uint
+st_trigram_key(const struct st_set *set, const char k[3])
+{
+	/* Offset by 1 to never use 0 as a key */
+	return 1 + (
+		(set->index_map[(uchar) k[0]] << 16) |
+		(set->index_map[(uchar) k[1]] << 8) |
+		set->index_map[(uchar) k[2]]);
+}
+
+/**
+ * Record entry in the posting lists of all the trigrams of its string.
+ *
+ * @param set		the set holding the trigram index
+ * @param s			the string of the entry
+ * @param len		length of the string
+ * @param id		the index of the entry in set->all_entries
+ */
+static void
+st_trigram_insert(struct st_set *set, const char *s, size_t len, uint32 id)
+{
+	size_t i;
+
+	if (len < 3)
+		return;
+
+	for (i = 0; i < len - 2; i++) {
+		struct st_postings *p;
+		uint key;
+
+		if (
+			is_ascii_space(s[i]) || is_ascii_space(s[i+1]) ||
+			is_ascii_space(s[i+2])
+		)
+			continue;
+
+		key = st_trigram_key(set, &s[i]);
+		p = htable_lookup(set->trigrams, int_to_pointer(key));
+
+		if (NULL == p) {
+			WALLOC0(p);
+			p->size = ST_TRIGRAM_MIN_SIZE;
+			HALLOC_ARRAY(p->ids, p->size);
+			htable_insert(set->trigrams, int_to_pointer(key), p);
+		} else if (p->ids[p->nids - 1] == id) {
+			continue;		/* Trigram repeated in the string */
+		} else if (p->nids == p->size) {
+			p->size *= 2;
+			HREALLOC_ARRAY(p->ids, p->size);
+		}
+
+		p->ids[p->nids++] = id;
+	}
+}
+
 /**
  * Insert an item into the search_table
  * one-char strings are silently ignored.
@@ -528,6 +656,10 @@ st_insert_item(search_table_t *table,
 
 		bin_insert_item(set->bins[key], entry);
 	}
+
+	if (set->trigrams != NULL)
+		st_trigram_insert(set, entry->string, len, set->all_entries.nvals);
+
 	bin_insert_item(&set->all_entries, entry);
 	set->nentries++;
 
@@ -552,6 +684,9 @@ st_set_compact(struct st_set *set)
 		if (set->bins[i])
 			bin_compact(set->bins[i]);
 	}
+
+	if (set->trigrams != NULL)
+		htable_foreach(set->trigrams, st_postings_compact_kv, NULL);
 }
 
 /**
@@ -656,6 +791,208 @@ st_bin_name(const char *str)
 	return buf;
 }
 
+/**
+ * Intersect two sorted arrays of distinct entry indices.
+ *
+ * The output array can be the first input array, for in-place intersection.
+ *
+ * @param a		the first array (should be the smallest)
+ * @param na	amount of items in the first array
+ * @param b		the second array
+ * @param nb	amount of items in the second array
+ * @param out	where common items are written, in increasing order
+ *
+ * @return amount of items written to ``out''.
+ */
+static uint G_HOT
+st_intersect(const uint32 *a, uint na, const uint32 *b, uint nb, uint32 *out)
+{
+	uint i = 0, j = 0, n = 0;
+
+	/*
+	 * When the second array is much larger, locate each item of the first
+	 * array in the second one by galloping (exponential search followed by
+	 * a binary search) instead of walking through the whole array.
+	 */
+
+	if (na * ST_GALLOP_RATIO < nb) {
+		for (i = 0; i < na && j < nb; i++) {
+			uint32 v = a[i];
+			uint lo = j, hi = j, step = 1;
+
+			/*
+			 * Find [lo, hi] such that b[lo - 1] < v and b[hi] >= v,
+			 * with hi = nb if all the remaining items are smaller.
+			 */
+
+			while (hi < nb && b[hi] < v) {
+				lo = hi + 1;
+				hi += step;
+				step *= 2;
+			}
+			hi = MIN(hi, nb);
+
+			while (lo < hi) {
+				uint mid = lo + (hi - lo) / 2;
+				if (b[mid] < v)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			j = lo;
+			if (j < nb && b[j] == v) {
+				out[n++] = v;
+				j++;
+			}
+		}
+
+		return n;
+	}
+
+#ifdef __SSE2__
+	/*
+	 * Compare blocks of 4 items from each array at once: each item from
+	 * the first block is compared to all the items of the second block by
+	 * rotating the latter, and the resulting mask flags the items of the
+	 * first block present in the second one.  We then move past the block
+	 * whose last item is the smallest.
+	 */
+
+	while (i + 4 <= na && j + 4 <= nb) {
+		__m128i va = _mm_loadu_si128((const __m128i *) &a[i]);
+		__m128i vb = _mm_loadu_si128((const __m128i *) &b[j]);
+		__m128i eq;
+		uint32 amax = a[i + 3], bmax = b[j + 3];
+		int mask;
+
+		eq = _mm_cmpeq_epi32(va, vb);
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+
+		mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+
+		while (mask != 0) {
+			int k = __builtin_ctz(mask);
+			out[n++] = a[i + k];
+			mask &= mask - 1;
+		}
+
+		if (amax <= bmax)
+			i += 4;
+		if (bmax <= amax)
+			j += 4;
+	}
+#endif	/* __SSE2__ */
+
+	while (i < na && j < nb) {
+		if (a[i] < b[j]) {
+			i++;
+		} else if (a[i] > b[j]) {
+			j++;
+		} else {
+			out[n++] = a[i];
+			i++;
+			j++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Compute the candidate entries for a query through the trigram index.
+ *
+ * @param set		the set whose trigram index we use
+ * @param wovec		the query words
+ * @param wocnt		amount of query words
+ * @param count		written with the amount of candidates
+ *
+ * @return the candidate entry indices (to be freed with hfree()), or NULL
+ * if there are no candidates or if the trigram index cannot be used for
+ * the query, in which case ``count'' is set to -1.
+ */
+static uint32 *
+st_trigram_candidates(const struct st_set *set,
+	const word_vec_t *wovec, uint wocnt, int *count)
+{
+	const struct st_postings *lists[ST_TRIGRAM_MAX_LISTS];
+	uint i, j, k, nlists = 0;
+	uint32 *result;
+	uint n;
+
+	*count = 0;
+
+	for (i = 0; i < wocnt; i++) {
+		const char *w = wovec[i].word;
+		size_t len = wovec[i].len;
+
+		if (len < 3)
+			continue;
+
+		for (j = 0; j < len - 2; j++) {
+			const struct st_postings *p;
+			uint key = st_trigram_key(set, &w[j]);
+
+			p = htable_lookup(set->trigrams, int_to_pointer(key));
+
+			if (NULL == p)
+				return NULL;	/* Trigram unknown, nothing can match */
+
+			/*
+			 * Insert list, keeping the array sorted by increasing size.
+			 * When too many lists, we drop the largest ones: we'll get more
+			 * candidates but entry_match() will sort them out.
+			 */
+
+			for (k = 0; k < nlists; k++) {
+				if (lists[k] == p || p->nids < lists[k]->nids)
+					break;
+			}
+
+			if (k < nlists && lists[k] == p)
+				continue;		/* Duplicate trigram */
+
+			if (k >= ST_TRIGRAM_MAX_LISTS)
+				continue;
+
+			if (nlists < ST_TRIGRAM_MAX_LISTS)
+				nlists++;
+
+			memmove(&lists[k + 1], &lists[k],
+				(nlists - k - 1) * sizeof lists[0]);
+			lists[k] = p;
+		}
+	}
+
+	if (0 == nlists) {
+		*count = -1;		/* Only short words, cannot use trigrams */
+		return NULL;
+	}
+
+	/*
+	 * Intersect all the lists, starting with the smallest ones.
+	 */
+
+	n = lists[0]->nids;
+	HALLOC_ARRAY(result, n);
+	memcpy(result, lists[0]->ids, n * sizeof result[0]);
+
+	for (k = 1; k < nlists && n != 0; k++)
+		n = st_intersect(result, n, lists[k]->ids, lists[k]->nids, result);
+
+	if (0 == n) {
+		HFREE_NULL(result);
+	}
+
+	*count = n;
+	return result;
+}
+
 enum search_mode {
 	SEARCH_NORMAL,		/* Original query string */
 	SEARCH_ALIAS		/* Query mangled with normalized aliases */
@@ -663,6 +1000,46 @@ enum search_mode {
 
 typedef size_t (*st_filename_len_fn_t)(const shared_file_t *sf);
 
+/**
+ * Find the smallest bin listing entries that can match the search string.
+ *
+ * @param set			set containing organized entries to search from
+ * @param search		the query string (canonized)
+ * @param len			length of the search string, at least 2
+ * @param start			where index of the best bin key in search is written
+ *
+ * @return the best bin, NULL if some 2-char sequence of the search string
+ * has no bin, meaning nothing can match.
+ */
+static struct st_bin *
+st_best_bin(const struct st_set *set, const char *search, uint len,
+	uint *start)
+{
+	struct st_bin *best_bin = NULL;
+	uint best_bin_size = UINT_MAX;
+	uint i;
+
+	g_assert(len >= 2);
+
+	*start = 0;
+
+	for (i = 0; i < len - 1; i++) {
+		struct st_bin *bin;
+		if (is_ascii_space(search[i]) || is_ascii_space(search[i+1]))
+			continue;
+		bin = set->bins[st_key(set, search + i)];
+		if (NULL == bin)
+			return NULL;
+		if (bin->nvals < best_bin_size) {
+			best_bin = bin;
+			best_bin_size = bin->nvals;
+			*start = i;		/* Best bin starting index */
+		}
+	}
+
+	return best_bin;
+}
+
 /**
  * Perform search.
  *
@@ -687,7 +1064,7 @@ st_run_search(
 	pslist_t **result,
 	query_hashvec_t *qhv)
 {
-	uint key, nres = 0;
+	uint nres = 0;
 	uint i, len;
 	struct st_bin *best_bin = NULL;
 	uint best_bin_size = UINT_MAX;
@@ -695,6 +1072,7 @@ st_run_search(
 	uint wocnt;
 	cpattern_t **pattern;
 	struct st_entry **vals;
+	uint32 *ids = NULL;
 	uint vcnt;
 	int scanned = 0;		/* measure search mask efficiency */
 	pslist_t *local;
@@ -712,23 +1090,11 @@ st_run_search(
 	 */
 
 	if (len >= 2) {
-		uint b = 0;
+		uint b;
 
-		for (i = 0; i < len - 1; i++) {
-			struct st_bin *bin;
-			if (is_ascii_space(search[i]) || is_ascii_space(search[i+1]))
-				continue;
-			key = st_key(set, search + i);
-			if ((bin = set->bins[key]) == NULL) {
-				best_bin = NULL;
-				break;
-			}
-			if (bin->nvals < best_bin_size) {
-				best_bin = bin;
-				best_bin_size = bin->nvals;
-				b = i;		/* Best bin starting index */
-			}
-		}
+		best_bin = st_best_bin(set, search, len, &b);
+		if (best_bin != NULL)
+			best_bin_size = best_bin->nvals;
 
 		if (GNET_PROPERTY(matching_debug) > 1) {
 			g_debug("MATCH %s(): mode=%s, str=\"%s\", len=%d, "
@@ -840,16 +1206,38 @@ st_run_search(
 		shared_file_name_canonic_len : shared_file_name_normalized_len;
 
 	/*
-	 * Search through the smallest bin
+	 * Search through the smallest bin, unless the trigram index can give
+	 * us a smaller set of candidates.
+	 *
+	 * When the trigram index is used, ``ids'' lists the candidates as indices
+	 * in the set->all_entries array.
 	 */
 
 	vcnt = best_bin->nvals;
 	vals = best_bin->vals;
 
+	if (
+		vcnt > ST_TRIGRAM_THRESHOLD && set->trigrams != NULL &&
+		GNET_PROPERTY(search_trigram_index)
+	) {
+		int count;
+
+		ids = st_trigram_candidates(set, wovec, wocnt, &count);
+
+		if (count >= 0) {
+			if (GNET_PROPERTY(matching_debug) > 1) {
+				g_debug("MATCH %s(): trigrams yield %d/%u candidate%s",
+					G_STRFUNC, count, vcnt, plural(count));
+			}
+			vcnt = count;
+			vals = set->all_entries.vals;
+		}
+	}
+
 	nres = 0;
 	local = *result;
 	for (i = 0; i < vcnt; i++) {
-		const struct st_entry *e = vals[i];
+		const struct st_entry *e = NULL == ids ? vals[i] : vals[ids[i]];
 		const shared_file_t *sf;
 		size_t filename_len;
 
@@ -926,6 +1314,7 @@ st_run_search(
 
 	WFREE_ARRAY(pattern, wocnt);
 	word_vec_free(wovec, wocnt);
+	HFREE_NULL(ids);
 
 	/* FALL THROUGH */
 
@@ -935,6 +1324,86 @@ finish:
 	return nres;
 }
 
+/**
+ * Run the search through the aliased names, if needed.
+ *
+ * @param table			table containing organized entries to search from
+ * @param search		the query string (canonized)
+ * @param sri			search meta-information, for applying query limits
+ * @param result		list where results from plain names were added
+ *
+ * @return number of hits added to the list
+ */
+static uint
+st_search_aliases(search_table_t *table, const char *search,
+	const search_request_info_t *sri, pslist_t **result)
+{
+	char *alias;
+	uint ares;
+
+	/*
+	 * If the alias set is empty, there is no need to attempt a search through
+	 * an aliased query.
+	 */
+
+	alias = 0 == table->alias.nentries ? NULL : alias_normalize(search, " ");
+
+	if (NULL == alias)
+		return 0;
+
+	gnet_stats_inc_general(GNR_QUERY_ALIASED_WORDS);
+
+	ares = st_run_search(SEARCH_ALIAS, &table->alias, alias, sri, result, NULL);
+	HFREE_NULL(alias);
+
+	if (ares != 0)
+		gnet_stats_count_general(GNR_LOCAL_ALIASED_HITS, ares);
+
+	return ares;
+}
+
+/**
+ * Randomly shuffle the results and deliver the first max_res items to
+ * the callback, freeing the result list.
+ *
+ * @param result		the list of matching entries
+ * @param nres			amount of items in the list
+ * @param max_res		maximum amount of results to return
+ * @param callback		routine to invoke for each match
+ * @param ctx			user-supplied data to pass on to callback
+ */
+static void
+st_deliver(pslist_t *result, uint nres, uint max_res,
+	st_search_callback callback, void *ctx)
+{
+	uint i;
+
+	if (NULL == result)
+		return;
+
+	if (nres > max_res)
+		result = pslist_shuffle(result);
+
+	for (i = 0; i < max_res; /* empty */) {
+		const shared_file_t *sf = pslist_shift(&result);
+
+		if (NULL == sf)
+			break;
+
+		/*
+		 * Because search_apply_limits() was already ran by st_run_search(),
+		 * we are certain that the entries in the list pass the limits.
+		 * Therefore, there is no need to check them again, hence the
+		 * trailing "FALSE" in the call here.
+		 */
+
+		if ((*callback)(ctx, sf, FALSE))
+			i++;						/* Entry retained */
+	}
+
+	pslist_free_null(&result);
+}
+
 /**
  * Do an actual search.
  *
@@ -959,9 +1428,8 @@ st_search(
 	query_hashvec_t *qhv)
 {
 	uint nres = 0;
-	uint i;
 	pslist_t *result = NULL;
-	char *search, *alias;
+	char *search;
 
 	/*
 	 * We use a canonic search string, which simplifies matching.
@@ -992,61 +1460,339 @@ st_search(
 	nres = st_run_search(
 				SEARCH_NORMAL, &table->plain, search, sri, &result, qhv);
 
+	nres += st_search_aliases(table, search, sri, &result);
+	st_deliver(result, nres, max_res, callback, ctx);
+
+	if (search != search_term)
+		HFREE_NULL(search);
+
+	return nres;
+}
+
+/*
+ * Batched searching.
+ *
+ * When several queries are evaluated together, the words they have in
+ * common are compiled only once, queries sharing the same best bin scan
+ * that bin only once (each entry being checked against all these queries
+ * whilst it is hot in the CPU cache), and the occurrences of a word within
+ * an entry are counted only once for all the queries using that word.
+ */
+
+/**
+ * A distinct query word within a batch.
+ */
+struct st_word {
+	cpattern_t *pattern;			/* Compiled word */
+	const struct st_entry *last;	/* Last entry where word was counted */
+	uint max;						/* Max amount wanted by queries */
+	uint count;						/* Occurrences in last entry, up to max */
+};
+
+/**
+ * A query within a batch.
+ */
+struct st_batch {
+	struct st_query *q;				/* The query, as supplied by caller */
+	char *search;					/* Canonized query string */
+	word_vec_t *wovec;
+	uint wocnt;
+	struct st_word **words;			/* Batch word for each wovec[] entry */
+	struct st_bin *bin;				/* Best bin, NULL if nothing can match */
+	uint32 *ids;					/* Trigram candidates in all_entries */
+	uint vcnt;						/* Amount of trigram candidates */
+	st_mask_t mask;					/* Query mask */
+	size_t minlen;					/* Minimum matching name length */
+	pslist_t *result;				/* Matching entries */
+	uint nres;						/* Amount of matches in result */
+};
+
+/**
+ * Free batch word, hash table iterator callback.
+ */
+static void
+st_word_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct st_word *w = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	pattern_free(w->pattern);
+	WFREE(w);
+}
+
+/**
+ * Count occurrences of word at the beginning of words in the entry, up to
+ * the maximum amount wanted by the queries of the batch.
+ */
+static uint
+st_word_count(struct st_word *w, const struct st_entry *e, size_t tlen)
+{
+	if (w->last != e) {
+		size_t offset = 0;
+		uint n;
+
+		for (n = 0; n < w->max; n++) {
+			const char *pos;
+
+			pos = pattern_search(w->pattern, e->string, tlen, offset, qs_begin);
+			if (NULL == pos)
+				break;
+			offset = ptr_diff(pos, e->string) + pattern_len(w->pattern);
+		}
+
+		w->last = e;
+		w->count = n;
+	}
+
+	return w->count;
+}
+
+/**
+ * Check whether an entry matches the query.
+ *
+ * @param b			the query within the batch
+ * @param e			the entry to check
+ * @param tlen		length of the entry's canonic name
+ */
+static bool
+st_batch_match(const struct st_batch *b, const struct st_entry *e, size_t tlen)
+{
+	uint i;
+
+	if ((e->mask & b->mask) != b->mask)
+		return FALSE;		/* Can't match */
+
+	if (tlen < b->minlen)
+		return FALSE;		/* Can't match */
+
+	if (!search_apply_limits(e->sf, b->q->sri))
+		return FALSE;		/* Does not pass limits the queryier has set */
+
+	for (i = 0; i < b->wocnt; i++) {
+		if (st_word_count(b->words[i], e, tlen) < b->wovec[i].amount)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Prepare a query for batched evaluation.
+ *
+ * @param set		set containing organized entries to search from
+ * @param b			the batch query to initialize
+ * @param words		batch words, indexed by word string
+ */
+static void
+st_batch_prepare(const struct st_set *set, struct st_batch *b, htable_t *words)
+{
+	uint i, len, start;
+
+	b->search = UNICODE_CANONIZE(b->q->search);
+	len = vstrlen(b->search);
+
+	if (len < 2)
+		return;
+
+	b->bin = st_best_bin(set, b->search, len, &start);
+
+	if (NULL == b->bin)
+		return;
+
+	b->wocnt = word_vec_make(b->search, &b->wovec);
+
+	if (0 == b->wocnt) {
+		b->bin = NULL;
+		return;
+	}
+
 	/*
-	 * Handle aliases if needed.
-	 *
-	 * If the alias set is empty, there is no need to attempt a search through
-	 * an aliased query.
+	 * Map each query word to the shared batch word.
 	 */
 
-	alias = 0 == table->alias.nentries ? NULL : alias_normalize(search, " ");
-
-	if (alias != NULL) {
-		uint ares;
+	WALLOC_ARRAY(b->words, b->wocnt);
 
-		gnet_stats_inc_general(GNR_QUERY_ALIASED_WORDS);
+	for (i = 0; i < b->wocnt; i++) {
+		const word_vec_t *wv = &b->wovec[i];
+		struct st_word *w = htable_lookup(words, wv->word);
 
-		ares = st_run_search(
-					SEARCH_ALIAS, &table->alias, alias, sri, &result, NULL);
-		nres += ares;
-		HFREE_NULL(alias);
+		if (NULL == w) {
+			WALLOC0(w);
+			w->pattern = pattern_compile_fast(wv->word, wv->len, FALSE);
+			htable_insert(words, wv->word, w);
+		}
 
-		if (ares != 0)
-			gnet_stats_count_general(GNR_LOCAL_ALIASED_HITS, ares);
+		w->max = MAX(w->max, wv->amount);
+		b->words[i] = w;
+		b->minlen += wv->len * wv->amount + 1;
 	}
 
+	b->minlen--;
+	b->mask = mask_hash(b->search);
+
 	/*
-	 * Randomly shuffle the results and pick the first max_res items.
+	 * Large bins are better handled through the trigram index, if possible,
+	 * at the cost of not sharing the bin scanning with other queries.
 	 */
 
-	if (result != NULL) {
-		if (nres > max_res)
-			result = pslist_shuffle(result);
+	if (
+		b->bin->nvals > ST_TRIGRAM_THRESHOLD && set->trigrams != NULL &&
+		GNET_PROPERTY(search_trigram_index)
+	) {
+		int count;
+
+		b->ids = st_trigram_candidates(set, b->wovec, b->wocnt, &count);
+
+		if (0 == count)
+			b->bin = NULL;			/* No candidates, nothing can match */
+		else if (count > 0)
+			b->vcnt = count;
+	}
+}
+
+/**
+ * Sort batch queries by best bin, the ones using trigram candidates last.
+ */
+static int
+st_batch_cmp(const void *a, const void *b)
+{
+	const struct st_batch * const *ba = a, * const *bb = b;
+	bool ta = (*ba)->ids != NULL, tb = (*bb)->ids != NULL;
+
+	if (ta != tb)
+		return ta ? +1 : -1;
+
+	return CMP((*ba)->bin, (*bb)->bin);
+}
+
+/**
+ * Check entry against a group of queries.
+ *
+ * @param e			the entry to check
+ * @param group		the queries to check entry against
+ * @param n			amount of queries in the group
+ */
+static void
+st_batch_check(const struct st_entry *e, struct st_batch **group, size_t n)
+{
+	const shared_file_t *sf = e->sf;
+	size_t i, tlen;
 
-		for (i = 0; i < max_res; /* empty */) {
-			const shared_file_t *sf = pslist_shift(&result);
+	if (!shared_file_is_shareable(sf))
+		return;			/* Cannot be shared */
 
-			if (NULL == sf)
+	tlen = shared_file_name_canonic_len(sf);
+
+	for (i = 0; i < n; i++) {
+		struct st_batch *b = group[i];
+
+		if (st_batch_match(b, e, tlen)) {
+			b->result = pslist_prepend_const(b->result, sf);
+			b->nres++;
+		}
+	}
+}
+
+/**
+ * Evaluate a batch of queries together.
+ *
+ * This is equivalent to calling st_search() for each query, without any
+ * query hash vector, but cheaper when queries have words in common or when
+ * they end-up scanning the same bins.
+ *
+ * @param table			table containing organized entries to search from
+ * @param qv			the queries to evaluate
+ * @param qcnt			amount of queries in qv[]
+ */
+void G_HOT
+st_search_batch(search_table_t *table, struct st_query *qv, size_t qcnt)
+{
+	struct st_batch *bv, **sorted;
+	htable_t *words;
+	size_t i, j, scans = 0;
+
+	search_table_check(table);
+
+	if (0 == qcnt)
+		return;
+
+	WALLOC0_ARRAY(bv, qcnt);
+	WALLOC_ARRAY(sorted, qcnt);
+	words = htable_create(HASH_KEY_STRING, 0);
+
+	for (i = 0; i < qcnt; i++) {
+		bv[i].q = &qv[i];
+		st_batch_prepare(&table->plain, &bv[i], words);
+		sorted[i] = &bv[i];
+	}
+
+	vsort(sorted, qcnt, sizeof sorted[0], st_batch_cmp);
+
+	/*
+	 * Scan each bin once for all the queries for which it is the best bin,
+	 * then each set of trigram candidates (which are never shared).
+	 */
+
+	for (i = 0; i < qcnt; i = j) {
+		const struct st_batch *b = sorted[i];
+		size_t k;
+
+		for (j = i + 1; j < qcnt; j++) {
+			if (b->ids != NULL || sorted[j]->ids != NULL)
 				break;
+			if (sorted[j]->bin != b->bin)
+				break;
+		}
 
-			/*
-			 * Because search_apply_limits() was already ran by st_run_search(),
-			 * we are certain that the entries in the list pass the limits.
-			 * Therefore, there is no need to check them again, hence the
-			 * trailing "FALSE" in the call here.
-			 */
+		if (NULL == b->bin)
+			continue;		/* Nothing can match */
+
+		scans++;
 
-			if ((*callback)(ctx, sf, FALSE))
-				i++;						/* Entry retained */
+		if (b->ids != NULL) {
+			for (k = 0; k < b->vcnt; k++) {
+				st_batch_check(table->plain.all_entries.vals[b->ids[k]],
+					&sorted[i], 1);
+			}
+		} else {
+			for (k = 0; k < b->bin->nvals; k++)
+				st_batch_check(b->bin->vals[k], &sorted[i], j - i);
 		}
+	}
 
-		pslist_free_null(&result);
+	if (GNET_PROPERTY(matching_debug) > 1) {
+		g_debug("MATCH %s(): %zu quer%s, %zu distinct word%s, %zu scan%s",
+			G_STRFUNC, qcnt, plural_y(qcnt),
+			PLURAL(htable_count(words)), PLURAL(scans));
 	}
 
-	if (search != search_term)
-		HFREE_NULL(search);
+	/*
+	 * Handle aliases and deliver results for each query.
+	 */
 
-	return nres;
+	for (i = 0; i < qcnt; i++) {
+		struct st_batch *b = &bv[i];
+		struct st_query *q = b->q;
+
+		b->nres += st_search_aliases(table, b->search, q->sri, &b->result);
+		st_deliver(b->result, b->nres, q->max_res, q->callback, q->ctx);
+		q->nres = b->nres;
+
+		if (b->wocnt != 0) {
+			WFREE_ARRAY(b->words, b->wocnt);
+			word_vec_free(b->wovec, b->wocnt);
+		}
+		HFREE_NULL(b->ids);
+		if (b->search != q->search)
+			HFREE_NULL(b->search);
+	}
+
+	htable_foreach(words, st_word_free_kv, NULL);
+	htable_free_null(&words);
+	WFREE_ARRAY(sorted, qcnt);
+	WFREE_ARRAY(bv, qcnt);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
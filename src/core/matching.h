@@ -107,6 +107,21 @@ int st_search(
 
 void st_fill_qhv(const char *search_term, struct query_hashvec *qhv);
 
+/**
+ * A query to evaluate through st_search_batch().
+ */
+struct st_query {
+	const char *search;						/**< The query string */
+	const struct search_request_info *sri;	/**< For applying query limits */
+	st_search_callback callback;			/**< Invoked on each match */
+	void *ctx;								/**< Callback context */
+	uint max_res;							/**< Max amount of results */
+	uint32 flags;							/**< Opaque for st_search_batch() */
+	uint nres;								/**< Filled: amount of hits */
+};
+
+void st_search_batch(search_table_t *table, struct st_query *qv, size_t qcnt);
+
 #endif	/* _core_matching_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
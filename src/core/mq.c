@@ -40,8 +40,8 @@
 #include "gmsg.h"
 #include "gnet_stats.h"
 
-#include "lib/array_util.h"
 #include "lib/cq.h"
+#include "lib/erbtree.h"
 #include "lib/halloc.h"
 #include "lib/htable.h"
 #include "lib/plist.h"
@@ -50,7 +50,6 @@
 #include "lib/stringify.h"		/* For plural() */
 #include "lib/unsigned.h"		/* For size_saturate_add() */
 #include "lib/walloc.h"
-#include "lib/xsort_data.h"
 
 #include "if/gnet_property_priv.h"
 
@@ -58,10 +57,51 @@
 
 #define MQ_DEBUG_LVL(q)	(*q->debug)
 
-static void qlink_free(mqueue_t *q);
+/*
+ * Priority index, used during flow-control.
+ *
+ * Queued messages are indexed in buckets, one per message priority, each
+ * bucket keeping its messages sorted by the user-supplied msg_cmp routine
+ * in a red-black tree, and counting the amount of bytes it holds.
+ *
+ * This allows make_room_internal() to only consider the messages that can
+ * be dropped, in the order they need to be dropped, and to know upfront
+ * whether enough room can be made.  Insertions and removals are done in
+ * O(log n), the entry of a queue link being found through a hash table.
+ */
+
+struct mq_entry {
+	rbnode_t node;				/**< Embedded tree node */
+	plist_t *link;				/**< Queue link holding the message */
+	uint32 seq;					/**< Insertion order, to break ties */
+	int size;					/**< Message size, when indexed */
+};
+
+struct mq_bucket {
+	union {
+		/*
+		 * See the comment in rbtree.c: we store an extended tree and read
+		 * it through the normal tree part.
+		 */
+		erbtree_t tree;			/**< The normal part of a tree, for reading */
+		erbtree_ext_t etree;	/**< The (extended) tree, actual data */
+	} u;
+	size_t bytes;				/**< Amount of bytes held in bucket */
+};
+
+struct mq_index {
+	struct mq_bucket bucket[PMSG_P_COUNT];
+	htable_t *entries;			/**< plist_t link -> struct mq_entry */
+	uint32 seq;					/**< Sequence number for next entry */
+};
+
+#define MQ_BUCKET_TREE(b)	(&(b)->u.tree)
+
+static void qindex_free(mqueue_t *q);
+static void qindex_remove(mqueue_t *q, plist_t *l);
 static void mq_update_flowc(mqueue_t *q);
 static bool make_room_header(
-	mqueue_t *q, const char *header, uint prio, int needed, int *offset);
+	mqueue_t *q, const char *header, uint prio, int needed);
 static void mq_swift_timer(cqueue_t *cq, void *obj);
 
 /**
@@ -281,7 +321,7 @@ void
 mq_check_track(mqueue_t *q, int offset, const char *where, int line)
 {
 	int qcount;
-	int qlink_alive = 0;
+	int indexed = 0;
 	int n;
 
 	g_assert(q);
@@ -298,38 +338,53 @@ mq_check_track(mqueue_t *q, int offset, const char *where, int line)
 			"%s has wrong q->count of %d (counted %d in list) at %s:%d",
 			mq_info(q), q->count, qcount, where, line);
 
-	if (q->qlink == NULL)
+	if (q->qindex == NULL)
 		return;
 
-	for (n = 0; n < q->qlink_count; n++) {
-		plist_t *item = q->qlink[n];
-		mqueue_t *owner;
-
-		if (item == NULL)
-			continue;
-
-		qlink_alive++;
-		if (item->data == NULL)
-			g_error("BUG: linkable #%d/%d from %s is NULL at %s:%d",
-				n, q->qlink_count, mq_info(q), where, line);
-
-		g_assert(qown);		/* If we have a qlink, we have added items */
+	for (n = 0; n < PMSG_P_COUNT; n++) {
+		const struct mq_bucket *b = &q->qindex->bucket[n];
+		const erbtree_t *tree = MQ_BUCKET_TREE(b);
+		const rbnode_t *rn;
+		size_t bytes = 0;
+
+		ERBTREE_FOREACH(tree, rn) {
+			const struct mq_entry *e = erbtree_data(tree, deconstify_pointer(rn));
+			const plist_t *item = e->link;
+			mqueue_t *owner;
+
+			indexed++;
+			if (item->data == NULL)
+				g_error("BUG: indexed linkable %p from %s is NULL at %s:%d",
+					(void *) item, mq_info(q), where, line);
+
+			if (pmsg_prio(item->data) != UNSIGNED(n))
+				g_error("BUG: linkable %p from %s is in wrong bucket #%d "
+					"at %s:%d", (void *) item, mq_info(q), n, where, line);
+
+			bytes += e->size;
+
+			g_assert(qown);		/* If we have an index, we have added items */
+
+			owner = htable_lookup(qown, item);
+			if (owner != q)
+				g_error("BUG: linkable %p from %s "
+					"%s at %s:%d",
+					(void *) item, mq_info(q),
+					owner == NULL ?
+						"does not belong to any queue" :
+						"belongs to foreign queue",
+					where, line);
+		}
 
-		owner = htable_lookup(qown, item);
-		if (owner != q)
-			g_error("BUG: linkable #%d/%d from %s "
-				"%s at %s:%d",
-				n, q->qlink_count, mq_info(q),
-				owner == NULL ?
-					"does not belong to any queue" :
-					"belongs to foreign queue",
-				where, line);
+		if (bytes != b->bytes)
+			g_error("BUG: bucket #%d of %s holds %zu bytes, counted %zu "
+				"at %s:%d", n, mq_info(q), b->bytes, bytes, where, line);
 	}
 
-	if (qlink_alive != qcount + offset)
-		g_error("BUG: qlink discrepancy for %s "
-		"(counted %d alive linkable, expected %d, queue has %d items) at %s:%d",
-		mq_info(q), qlink_alive, qcount + offset, qcount, where, line);
+	if (indexed != qcount + offset)
+		g_error("BUG: index discrepancy for %s "
+		"(counted %d indexed linkables, expected %d, queue has %d items) "
+		"at %s:%d", mq_info(q), indexed, qcount + offset, qcount, where, line);
 }
 #else	/* !MQ_DEBUG */
 
@@ -370,8 +425,8 @@ mq_free(mqueue_t *q)
 
 	g_assert(n == q->count);
 
-	if (q->qlink)
-		qlink_free(q);
+	if (q->qindex != NULL)
+		qindex_free(q);
 
 	cq_cancel(&q->swift_ev);
 	plist_free_null(&q->qhead);
@@ -393,6 +448,9 @@ mq_rmlink_prev(mqueue_t *q, plist_t *l, int size)
 {
 	plist_t *prev = plist_prev(l);
 
+	if (q->qindex != NULL)
+		qindex_remove(q, l);
+
 	mq_remove_linkable(q, l);
 	q->qhead = plist_remove_link(q->qhead, l);
 	if (q->qtail == l)
@@ -510,7 +568,7 @@ mq_swift_checkpoint(mqueue_t *q, bool initial)
 			int old_size = q->size;
 			const void *base = iovec_base(&templates[i]);
 
-			if (make_room_header(q, base, PMSG_P_DATA, needed, NULL))
+			if (make_room_header(q, base, PMSG_P_DATA, needed))
 				break;
 
 			needed -= old_size - q->size;		/* Amount we removed */
@@ -610,8 +668,8 @@ mq_leave_flowc(mqueue_t *q)
 			node_addr(q->node), q->size);
 
 	q->flags &= ~(MQ_FLOWC|MQ_SWIFT);	/* Under low watermark, clear */
-	if (q->qlink)
-		qlink_free(q);
+	if (q->qindex != NULL)
+		qindex_free(q);
 
 	cq_cancel(&q->swift_ev);
 	node_tx_leave_flowc(q->node);	/* Signal end flow control */
@@ -661,7 +719,7 @@ mq_clear(mqueue_t *q)
 	 * If there are extended message blocks in the queue, freeing them
 	 * could cause the callback to attempt to queue something again.  Hence
 	 * we must mark we're clearing the queue to avoid deadly recursions that
-	 * would corrupt the qlink array.
+	 * would corrupt the priority index.
 	 */
 
 	q->flags |= MQ_CLEAR;
@@ -683,8 +741,8 @@ mq_clear(mqueue_t *q)
 
 	g_assert(q->count >= 0 && q->count <= 1);	/* At most one message */
 
-	if (q->qlink)
-		qlink_free(q);
+	if (q->qindex != NULL)
+		qindex_free(q);
 
 	q->flags &= ~MQ_CLEAR;
 
@@ -734,354 +792,165 @@ mq_flush(mqueue_t *q)
 	tx_flush(q->tx_drv);
 }
 
-/**
- * Compare two pointers to links based on their relative priorities, then
- * based on their held Gnutella messages.
- * -- qsort() callback but with an extra data parameter
+/*
+ * Priority index management.
  */
-static int
-qlink_cmp(const void *a, const void *b, void *data)
-{
-	const plist_t * const *l1 = a, * const *l2 = b;
-	const pmsg_t *m1 = (*l1)->data, *m2 = (*l2)->data;
-
-	if (pmsg_prio(m1) == pmsg_prio(m2)) {
-		const mqueue_t *q = data;
-		return q->uops->msg_cmp(pmsg_phys_base(m1), pmsg_phys_base(m2));
-	} else
-		return pmsg_prio(m1) < pmsg_prio(m2) ? -1 : +1;
-}
 
 /**
- * Create the `qlink' sorted array of queued items.
+ * Free index entry -- erbtree_discard() callback.
  */
 static void
-qlink_create(mqueue_t *q)
+mq_entry_free(void *p)
 {
-	plist_t *l;
-	int n;
-
-	g_assert(q->qlink == NULL);
-
-	HALLOC_ARRAY(q->qlink, q->count);
+	struct mq_entry *e = p;
 
-	/*
-	 * Prepare sorting of queued messages.
-	 *
-	 * What's sorted is queue links, but the sorting criteria is the
-	 * user-supplied msg_cmp routine to compare the messages, when they
-	 * have the same priority.
-	 */
-
-	for (l = q->qhead, n = 0; l && n < q->count; l = plist_next(l), n++) {
-		g_assert(l->data != NULL);
-		q->qlink[n] = l;
-	}
-
-	if (l || n != q->count)
-		g_error("BUG: queue count of %d for %p is wrong (has %zd)",
-			q->count, (void *) q, plist_length(q->qhead));
-
-	/*
-	 * We use `n' and not `q->count' in case the warning above is emitted,
-	 * in which case we have garbage after the `n' first items.
-	 */
-
-	q->qlink_count = n;
-	xsort_with_data(q->qlink, n, sizeof q->qlink[0], qlink_cmp, q);
-
-	mq_check(q, 0);
+	WFREE(e);
 }
 
 /**
- * Free the `qlink' sorted array of queued items.
+ * Compare two index entries based on their held messages, then on their
+ * insertion order.  Entries within a bucket all have the same priority.
  */
-static void
-qlink_free(mqueue_t *q)
+static int
+mq_entry_cmp(const void *a, const void *b, void *data)
 {
-	g_assert(q->qlink);
+	const struct mq_entry *e1 = a, *e2 = b;
+	const pmsg_t *m1 = e1->link->data, *m2 = e2->link->data;
+	const mqueue_t *q = data;
+	int c;
+
+	c = q->uops->msg_cmp(pmsg_phys_base(m1), pmsg_phys_base(m2));
 
-	HFREE_NULL(q->qlink);
-	q->qlink_count = 0;
+	return 0 != c ? c : CMP(e1->seq, e2->seq);
 }
 
 /**
- * Insert linkable `l' within the sorted qlink array of linkables for the queue,
- * before the position indicated by `hint'.
+ * Index linkable `l' within the priority buckets.
  */
 static void
-qlink_insert_before(mqueue_t *q, int hint, plist_t *l)
+qindex_insert(mqueue_t *q, plist_t *l)
 {
-	g_assert(hint >= 0 && hint < q->qlink_count);
-	g_assert(qlink_cmp(&q->qlink[hint], &l, q) >= 0);	/* `hint' >= `l' */
-	g_assert(l->data != NULL);
+	struct mq_index *idx = q->qindex;
+	struct mq_bucket *b;
+	struct mq_entry *e;
+	const pmsg_t *mb = l->data;
 
-	mq_check(q, -1);
+	g_assert(idx != NULL);
+	g_assert(mb != NULL);
+	g_assert(pmsg_prio(mb) < PMSG_P_COUNT);
 
-	/*
-	 * Lookup before the message for a NULL entry that we could fill.
-	 */
+	WALLOC(e);
+	e->link = l;
+	e->seq = idx->seq++;
+	e->size = pmsg_size(mb);
 
-	if (hint > 0 && q->qlink[hint - 1] == NULL) {
-		q->qlink[hint - 1] = l;
-		return;
-	}
-
-	/*
-	 * Extend the array then, and insert right at `hint' in the new array.
-	 */
+	b = &idx->bucket[pmsg_prio(mb)];
+	erbtree_insert(MQ_BUCKET_TREE(b), &e->node);
+	b->bytes += e->size;
 
-	q->qlink_count++;
-	HREALLOC_ARRAY(q->qlink, q->qlink_count);
-
-	ARRAY_INSERT(q->qlink, hint, q->qlink_count, l);
+	htable_insert(idx->entries, l, e);
 }
 
 /**
- * Insert linkable `l' within the sorted qlink array of linkables.
+ * Remove linkable `l' from the priority buckets.
  */
 static void
-qlink_insert(mqueue_t *q, plist_t *l)
+qindex_remove(mqueue_t *q, plist_t *l)
 {
-	int low = 0;
-	int high = q->qlink_count - 1;
-	plist_t **qlink = q->qlink;
-
-	g_assert(l->data != NULL);
+	struct mq_index *idx = q->qindex;
+	struct mq_bucket *b;
+	struct mq_entry *e;
 
-	mq_check(q, -1);
+	g_assert(idx != NULL);
 
-	/*
-	 * If `qlink' is empty, create a slot for the new entry.
-	 */
+	e = htable_lookup(idx->entries, l);
 
-	if (high < 0) {
-		g_assert(q->count == 1);		/* `l' is already part of the queue */
-		q->qlink_count++;
-		HREALLOC_ARRAY(q->qlink, q->qlink_count);
-		q->qlink[0] = l;
-		return;
-	}
-
-	/*
-	 * If lower than the beginning, insert at the head.
-	 */
-
-	if (qlink[low] != NULL && qlink_cmp(&l, &qlink[low], q) <= 0) {
-		qlink_insert_before(q, low, l);
-		return;
-	}
-
-	/*
-	 * If higher than the tail, insert at the tail.
-	 */
-
-	if (qlink[high] != NULL && qlink_cmp(&l, &qlink[high], q) >= 0) {
-		q->qlink_count++;
-		HREALLOC_ARRAY(q->qlink, q->qlink_count);
-		q->qlink[q->qlink_count - 1] = l;
-		return;
+	if G_UNLIKELY(NULL == e) {
+		g_error("BUG: linkable %p not found in index of %s "
+			"(queue has %d counted items, really %zd) at %s:%d",
+			(void *) l, mq_info(q), q->count, plist_length(q->qhead),
+			_WHERE_, __LINE__);
 	}
 
-	/*
-	 * The array is sorted, so we're going to use a dichotomic search
-	 * to find the right insertion point.  However, there can be NULLified
-	 * entries in the array, so this is not a plain dichotomic search.
-	 */
-
-	while (low <= high) {
-		int mid = low + (high - low) / 2;
-		int c;
-
-		/*
-		 * If we end up in a NULL spot, inspect the [low, high] range.
-		 */
-
-		if (qlink[mid] == NULL) {
-			int n;
-			int lowest_non_null = -1;
-			int highest_non_null = -1;
-
-			/*
-			 * Go back towards `low' to find a non-NULL entry.
-			 */
-
-			for (n = mid - 1; n >= low; n--) {
-				if (qlink[n] != NULL) {
-					lowest_non_null = n;
-					break;
-				}
-			}
-
-			/*
-			 * Go forward towards `high' to find a non-NULL entry.
-			 */
-
-			for (n = mid + 1; n <= high; n++) {
-				if (qlink[n] != NULL) {
-					highest_non_null = n;
-					break;
-				}
-			}
-
-			/*
-			 * If both `lowest_non_null' and `highest_non_null' are -1, we
-			 * have only NULLs, and the boundaries are NULL as well.
-			 */
-
-			if (lowest_non_null == -1) {
-				if (highest_non_null == -1) {
-					qlink[mid] = l;
-					return;
-				}
-				low = mid + 1;
-				continue;
-			} else if (highest_non_null == -1) {
-				high = mid - 1;
-				continue;
-			}
-
-			/*
-			 * We know that the final insertion point will be after `low'
-			 * and before `high'.  If there are only NULL entries between
-			 * the two, we're done...
-			 */
-
-			if (lowest_non_null <= low + 1 && highest_non_null >= high - 1) {
-				qlink[mid] = l;			/* Insert at the middle of the range */
-				return;
-			}
-
-			if (qlink_cmp(&l, &qlink[lowest_non_null], q) < 0) {
-				high = lowest_non_null - 1;
-				continue;
-			}
+	b = &idx->bucket[pmsg_prio(l->data)];
+	erbtree_remove(MQ_BUCKET_TREE(b), &e->node);
+	g_assert(b->bytes >= UNSIGNED(e->size));
+	b->bytes -= e->size;
 
-			if (qlink_cmp(&l, &qlink[highest_non_null], q) > 0) {
-				low = highest_non_null + 1;
-				continue;
-			}
+	htable_remove(idx->entries, l);
+	WFREE(e);
+}
 
-			/*
-			 * `lowest_non_null' <= `l' <= `highest_non_null'
-			 */
+/**
+ * Create the priority index of queued items.
+ */
+static void
+qindex_create(mqueue_t *q)
+{
+	struct mq_index *idx;
+	plist_t *l;
+	int i, n;
 
-			low = lowest_non_null + 1;
-			high = highest_non_null - 1;
+	g_assert(q->qindex == NULL);
 
-			continue;
-		}
+	WALLOC0(idx);
+	idx->entries = htable_create(HASH_KEY_SELF, 0);
 
-		/*
-		 * Regular dichotomic case.
-		 */
+	for (i = 0; i < PMSG_P_COUNT; i++) {
+		erbtree_init_data(&idx->bucket[i].u.etree, mq_entry_cmp, q,
+			offsetof(struct mq_entry, node));
+	}
 
-		c = qlink_cmp(&qlink[mid], &l, q);
+	q->qindex = idx;
 
-		if (c == 0) {
-			qlink_insert_before(q, mid, l);
-			return;
-		} else if (c < 0)
-			low = mid + 1;
-		else
-			high = mid - 1;
+	for (l = q->qhead, n = 0; l && n < q->count; l = plist_next(l), n++) {
+		g_assert(l->data != NULL);
+		qindex_insert(q, l);
 	}
 
-	if (qlink[low] == NULL) {
-		qlink[low] = l;
-		return;
-	}
+	if (l || n != q->count)
+		g_error("BUG: queue count of %d for %p is wrong (has %zd)",
+			q->count, (void *) q, plist_length(q->qhead));
 
-	qlink_insert_before(q, low, l);
+	mq_check(q, 0);
 }
 
 /**
- * Remove the entry in the `qlink' linkable array, allowing compaction
- * when there are too many holes.
- *
- * @param q			the message queue
- * @param l			the linkable to remove from the qlink indexer
+ * Free the priority index of queued items.
  */
 static void
-qlink_remove(mqueue_t *q, plist_t *l)
+qindex_free(mqueue_t *q)
 {
-	plist_t **qlink = q->qlink;
-	int n = q->qlink_count;
+	struct mq_index *idx = q->qindex;
+	int i;
 
-	g_assert(qlink);
-	g_assert(n > 0);
-	g_assert(l->data != NULL);
+	g_assert(idx != NULL);
 
-	mq_check(q, 0);
+	for (i = 0; i < PMSG_P_COUNT; i++)
+		erbtree_discard(MQ_BUCKET_TREE(&idx->bucket[i]), mq_entry_free);
 
-	/*
-	 * If more entries in `qlink' than 3 times the amount of queued messages,
-	 * we have too many NULL in the array.
-	 */
-
-	if (n > q->count * 3) {
-		plist_t **dest = qlink;
-		int copied = 0;
-		bool found = FALSE;
-
-		while (n-- > 0) {
-			plist_t *entry = *qlink++;
-			if (entry == NULL)
-				continue;
-			else if (l == entry) {
-				found = TRUE;
-				continue;
-			}
-			*dest++ = entry;
-			copied++;
-		}
-
-		q->qlink_count = copied;
-
-		if (found)
-			return;
-	} else {
-		while (n-- > 0) {
-			if (l == *qlink) {
-				*qlink = NULL;
-				return;
-			}
-			qlink++;
-		}
-
-		/* Should have been found -- FALL THROUGH */
-	}
-
-	g_error("BUG: linkable %p for %s not found "
-		"(qlink has %d slots, queue has %d counted items, really %zd) at %s:%d",
-		(void *) l, mq_info(q),
-		q->qlink_count, q->count, plist_length(q->qhead),
-		_WHERE_, __LINE__);
+	htable_free_null(&idx->entries);
+	WFREE(idx);
+	q->qindex = NULL;
 }
 
 /**
  * Attempt to make room in the queue to be able to enqueue the new message
  * whose header is specified.
  *
- * If `offset' is not null, it may be set with the offset within qlink where
- * the message immediately more prioritary than the new one can be found.
- * It is up to the caller to initialize it with -1 and check whether it has
- * been set.
- *
  * @param q			the queue
  * @param header	pointer to the header of the new message
  * @param msglen	if non-zero, header points to a full PDU of msglen bytes
  * @param prio		the priority of the new message we want to enqueue
  * @param needed	the amount of room we want to make in the queue
- * @param offset	see above description
  *
  * @returns TRUE if we were able to make enough room.
  */
 static bool
 make_room_internal(mqueue_t *q,
-	const char *header, size_t msglen, uint prio, int needed, int *offset)
+	const char *header, size_t msglen, uint prio, int needed)
 {
-	int n;
+	uint n;
 	int dropped = 0;				/* Amount of messages dropped */
 
 	g_assert(needed > 0);
@@ -1095,118 +964,114 @@ make_room_internal(mqueue_t *q,
 	if (q->qhead == NULL)			/* Queue is empty */
 		return FALSE;
 
-	if (q->qlink == NULL)			/* No cached sorted queue links */
-		qlink_create(q);
+	if (q->qindex == NULL)			/* No priority index yet */
+		qindex_create(q);
 
-	g_assert(q->qlink);
+	g_assert(q->qindex != NULL);
 
 	/*
-	 * Traverse the sorted links and prune as many messages as necessary.
-	 * Note that we try to prune at least one byte more than needed, hence
-	 * we stay in the loop even when needed reaches 0.
+	 * A less prioritary message cannot supersede a higher priority one,
+	 * even if its embedded Gnet message is deemed less important: only the
+	 * buckets up to our own priority are candidates for dropping.
 	 *
-	 * To avoid freeing the qlink array every time we drop something, we
-	 * write NULLs at the entries we drop (which are then ignored
-	 * in the loop below).  When we break out because we found a more
-	 * prioritary message, we remember the index in the array and return it
-	 * to the caller.  If the message is finally inserted in the queue,
-	 * we can insert its plist_t link right before that index.
-	 *
-	 * This adds some complexity but it will avoid millions of calls to
-	 * qlink_cmp(), which is costly.
-	 *
-	 * The qlink array is freed when we leave flow control.  During FC, we
-	 * need to find the messages we're removing after writing them to the
-	 * network, so we can NULLify the corresponding slot in the qlink array.
+	 * When we are given a full message, we are called to make room for it
+	 * and partial success is useless: if these buckets do not hold enough
+	 * bytes, we would drop messages for nothing, so fail immediately.
+	 * Header-based pruning (in "swift" mode) accounts for what was removed
+	 * even if it was not enough, so it always proceeds.
 	 */
 
-	for (n = 0; needed >= 0 && n < q->qlink_count; n++) {
-		plist_t *item = q->qlink[n];
-		pmsg_t *cmb;
-		char *cmb_start;
-		int cmb_size;
+	prio = MIN(prio, PMSG_P_COUNT - 1);
 
-		/*
-		 * If slot was NULLified, skip it.
-		 */
+	if (msglen != 0) {
+		size_t available = 0;
 
-		if (item == NULL)
-			continue;
+		for (n = 0; n <= prio; n++)
+			available += q->qindex->bucket[n].bytes;
 
-		cmb = item->data;
-		cmb_start = pmsg_phys_base(cmb);
+		if (available < UNSIGNED(needed))
+			return FALSE;
+	}
 
-		/*
-		 * Any partially written message, however unimportant, cannot be
-		 * removed or we'd break the flow of messages.
-		 */
+	/*
+	 * Traverse the buckets by increasing priority, and within each bucket
+	 * the messages by increasing importance, pruning as many messages as
+	 * necessary.  Note that we try to prune at least one byte more than
+	 * needed, hence we stay in the loop even when needed reaches 0.
+	 *
+	 * The index is freed when we leave flow control.  During FC, messages
+	 * removed from the queue after being written to the network are also
+	 * removed from the index by mq_rmlink_prev().
+	 */
 
-		if (pmsg_start(cmb) != cmb_start)	/* Started to write it  */
-			continue;
+	for (n = 0; needed >= 0 && n <= prio; n++) {
+		erbtree_t *tree = MQ_BUCKET_TREE(&q->qindex->bucket[n]);
+		rbnode_t *rn, *next;
 
-		/*
-		 * If we reach a message equally or more important than the message
-		 * we're trying to enqueue, then we haven't removed enough.  Stop!
-		 *
-		 * This is the only case where we don't necessarily attempt to prune
-		 * more than requested, i.e. we'll return TRUE if needed == 0.
-		 * (it's necessarily >= 0 if we're in the loop)
-		 */
+		for (rn = erbtree_first(tree); needed >= 0 && rn != NULL; rn = next) {
+			struct mq_entry *e = erbtree_data(tree, rn);
+			plist_t *item = e->link;
+			pmsg_t *cmb = item->data;
+			char *cmb_start = pmsg_phys_base(cmb);
+			int cmb_size;
 
-		if (0 == msglen) {
-			if (q->uops->msg_headcmp(cmb_start, header) >= 0) {
-				if (offset != NULL)
-					*offset = n;
-				break;
-			}
-		} else {
-			if (q->uops->msg_cmp(cmb_start, header) >= 0) {
-				if (offset != NULL)
-					*offset = n;
-				break;
-			}
-		}
+			next = erbtree_next(rn);
 
-		/*
-		 * If we reach a message whose priority is higher than ours, stop.
-		 * A less prioritary message cannot supersede a higher priority one,
-		 * even if its embedded Gnet message is deemed less important.
-		 */
+			/*
+			 * Any partially written message, however unimportant, cannot be
+			 * removed or we'd break the flow of messages.
+			 */
 
-		if (pmsg_prio(cmb) > prio) {
-			if (offset != NULL)
-				*offset = n;
-			break;
-		}
+			if (pmsg_start(cmb) != cmb_start)	/* Started to write it  */
+				continue;
 
-		/*
-		 * Drop message.
-		 */
+			/*
+			 * If we reach a message equally or more important than the
+			 * message we're trying to enqueue, then we haven't removed enough.
+			 * Stop!  Messages in the higher priority buckets cannot be
+			 * dropped either, since they rank above this one.
+			 *
+			 * This is the only case where we don't necessarily attempt to
+			 * prune more than requested, i.e. we'll return TRUE if needed == 0.
+			 * (it's necessarily >= 0 if we're in the loop)
+			 */
 
-		if (MQ_DEBUG_LVL(q) > 4 && q->uops->msg_log != NULL) {
-			q->uops->msg_log(cmb, "to %s %s node %s, in favor of %s",
-				(q->flags & MQ_SWIFT) ? "SWIFT" : "FLOWC",
-				NODE_USES_UDP(q->node) ? "UDP" : "TCP",
-				node_addr(q->node), msglen ?
-					gmsg_infostr_full(header, msglen) : gmsg_infostr(header));
-		}
+			if (0 == msglen) {
+				if (q->uops->msg_headcmp(cmb_start, header) >= 0)
+					goto done;
+			} else {
+				if (q->uops->msg_cmp(cmb_start, header) >= 0)
+					goto done;
+			}
 
-		if (q->uops->msg_flowc != NULL)
-			q->uops->msg_flowc(q->node, cmb);
+			/*
+			 * Drop message.
+			 */
+
+			if (MQ_DEBUG_LVL(q) > 4 && q->uops->msg_log != NULL) {
+				q->uops->msg_log(cmb, "to %s %s node %s, in favor of %s",
+					(q->flags & MQ_SWIFT) ? "SWIFT" : "FLOWC",
+					NODE_USES_UDP(q->node) ? "UDP" : "TCP",
+					node_addr(q->node), msglen ?
+						gmsg_infostr_full(header, msglen) :
+						gmsg_infostr(header));
+			}
 
-		cmb_size = pmsg_size(cmb);
+			if (q->uops->msg_flowc != NULL)
+				q->uops->msg_flowc(q->node, cmb);
 
-		g_assert(q->qlink[n] == item);
+			cmb_size = pmsg_size(cmb);
 
-		needed -= cmb_size;
-		q->qlink[n] = NULL;
-		(void) mq_rmlink_prev(q, item, cmb_size);
+			needed -= cmb_size;
+			(void) mq_rmlink_prev(q, item, cmb_size);	/* Frees `e' as well */
 
-		dropped++;
+			dropped++;
 
-		mq_check(q, 0);
+			mq_check(q, 0);
+		}
 	}
 
+done:
 	if (dropped)
 		node_add_txdrop(q->node, dropped);	/* Dropped during TX */
 
@@ -1246,21 +1111,16 @@ make_room_internal(mqueue_t *q,
  * Remove from the queue enough messages that are less prioritary than
  * the current one, so as to make sure we can enqueue it.
  *
- * If `offset' is not null, it may be set with the offset within qlink where
- * the message immediately more prioritary than `mb' can be found.  It is
- * up to the caller to initialize it with -1 and check whether it has been
- * set.
- *
  * @returns TRUE if we were able to make enough room.
  */
 static bool
-make_room(mqueue_t *q, const pmsg_t *mb, int needed, int *offset)
+make_room(mqueue_t *q, const pmsg_t *mb, int needed)
 {
 	const char *header = pmsg_phys_base(mb);
 	uint prio = pmsg_prio(mb);
 	size_t msglen = pmsg_written_size(mb);
 
-	return make_room_internal(q, header, msglen, prio, needed, offset);
+	return make_room_internal(q, header, msglen, prio, needed);
 }
 
 /**
@@ -1268,10 +1128,9 @@ make_room(mqueue_t *q, const pmsg_t *mb, int needed, int *offset)
  * point but a Gnutella header and a message priority explicitly.
  */
 static bool
-make_room_header(
-	mqueue_t *q, const char *header, uint prio, int needed, int *offset)
+make_room_header(mqueue_t *q, const char *header, uint prio, int needed)
 {
-	return make_room_internal(q, header, 0, prio, needed, offset);
+	return make_room_internal(q, header, 0, prio, needed);
 }
 
 /**
@@ -1281,7 +1140,6 @@ static void
 mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 {
 	int needed;
-	int qlink_offset = -1;
 	plist_t *new = NULL;
 	bool make_room_called = FALSE;
 	bool has_normal_prio = (pmsg_prio(mb) == PMSG_P_DATA);
@@ -1299,7 +1157,7 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 		has_normal_prio &&
 		gmsg_can_drop(pmsg_phys_base(mb), msize) &&
 		((make_room_called = TRUE)) &&			/* Call make_room() once only */
-		!make_room(q, mb, msize, &qlink_offset)
+		!make_room(q, mb, msize)
 	) {
 		g_assert(pmsg_is_unread(mb));			/* Not partially written */
 		if (MQ_DEBUG_LVL(q) > 4 && q->uops->msg_log != NULL)
@@ -1326,7 +1184,7 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 
 	if (
 		needed > 0 &&
-		(make_room_called || !make_room(q, mb, needed, &qlink_offset))
+		(make_room_called || !make_room(q, mb, needed))
 	) {
 		/*
 		 * Close the connection only if the message is a prioritary one
@@ -1451,23 +1309,12 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 	q->count++;
 
 	/*
-	 * If `qlink' is not NULL, insert `new' within it.
-	 *
-	 * We have two options: we called make_room() and have `qlink_offset'
-	 * set to something other than -1.  In that case, this is the offset
-	 * of the message more prioritary that us.
-	 *
-	 * We have not called make_room() yet: we need to scan the `qlink' array
-	 * to find the proper insertion place.
+	 * If we have a priority index, insert `new' within it.
 	 */
 
-	if (q->qlink) {			/* Inserted something, `qlink' is stale */
+	if (q->qindex != NULL) {
 		g_assert(new != NULL);
-
-		if (qlink_offset != -1)
-			qlink_insert_before(q, qlink_offset, new);
-		else
-			qlink_insert(q, new);
+		qindex_insert(q, new);
 	}
 
 	/*
@@ -1493,7 +1340,6 @@ mq_putq(mqueue_t *q, pmsg_t *mb)
 
 static const struct mq_cops mq_cops = {
 	mq_puthere,				/**< puthere */
-	qlink_remove,			/**< qlink_remove */
 	mq_rmlink_prev,			/**< rmlink_prev */
 	mq_update_flowc,		/**< update_flowc */
 };
@@ -49,6 +49,7 @@
 typedef struct mqueue mqueue_t;
 
 struct mq_ops;
+struct mq_index;
 
 /**
  * When invoked from the message queue, this callback must return a vector
@@ -119,7 +120,6 @@ struct mq_ops {
 
 struct mq_cops {
 	void (*puthere)(mqueue_t *q, pmsg_t *mb, int msize);
-	void (*qlink_remove)(mqueue_t *q, plist_t *l);
 	plist_t *(*rmlink_prev)(mqueue_t *q, plist_t *l, int size);
 	void (*update_flowc)(mqueue_t *q);
 };
@@ -139,8 +139,9 @@ enum mq_magic {
  * and remains in effect until we reach the low watermark, thereby providing
  * the necessary hysteresis.
  *
- * The `qlink' field is used during flow-control.  It contains a sorted (by
- * priority) array of all the items in the list.  It is dynamically allocated
+ * The `qindex' field is used during flow-control.  It indexes all the items
+ * in the list by priority, sorted by importance within each priority, along
+ * with the amount of bytes held at each priority.  It is dynamically created
  * and freed as needed.
  *
  * The `header' is used to hold the function/hops/TTL of a reference message
@@ -153,12 +154,12 @@ struct mqueue {
 	const struct mq_cops *cops;		/**< Common operations */
 	const struct mq_uops *uops;		/**< User-defined operations */
 	txdrv_t *tx_drv;				/**< Network TX stack driver */
-	plist_t *qhead, *qtail, **qlink;
+	plist_t *qhead, *qtail;
+	struct mq_index *qindex;	/**< Priority index, during flow-control */
 	slist_t *qwait;			/**< Waiting queue during putq recursions */
 	cevent_t *swift_ev;		/**< Callout queue event in "swift" mode */
 	const uint32 *debug;	/**< Debug config variable for this queue */
 	int swift_elapsed;		/**< Scheduled elapsed time, in ms */
-	int qlink_count;		/**< Amount of entries in `qlink' */
 	int maxsize;			/**< Maximum size of this queue (total queued) */
 	int count;				/**< Amount of messages queued */
 	int hiwat;				/**< High watermark */
@@ -236,9 +236,6 @@ mq_udp_service(void *data)
 		 */
 
 	skip:
-		if (q->qlink)
-			q->cops->qlink_remove(q, l);
-
 		/* drop the message from queue, will be freed by mq_rmlink_prev() */
 		l = q->cops->rmlink_prev(q, l, mb_size);
 	}
@@ -315,7 +312,7 @@ again:
 
 	/*
 	 * Protect against recursion: we must not invoke puthere() whilst in
-	 * the middle of another putq() or we would corrupt the qlink array:
+	 * the middle of another putq() or we would corrupt the priority index:
 	 * Messages received during recursion are inserted into the qwait list
 	 * and will be stuffed back into the queue when the initial putq() ends.
 	 *		--RAM, 2006-12-29
@@ -185,6 +185,7 @@
 
 #define NODE_TX_BUFSIZ			1024	/**< Buffer size for TX deflation */
 #define NODE_TX_FLUSH			4096	/**< Flush deflator every 4K */
+#define NODE_TX_OFFLOAD_BUFSIZ	8192	/**< Buffer size when offloading */
 
 #define NODE_RX_VMSG_THRESH		50		/**< Limit to get vendor message info */
 
@@ -4982,7 +4983,11 @@ node_net_stack_create(gnutella_node_t *n)
 		args.nagle = TRUE;
 		args.gzip = FALSE;
 		args.reduced = settings_is_ultra() && NODE_IS_LEAF(n);
-		args.buffer_size = NODE_TX_BUFSIZ;
+		args.low_memory = GNET_PROPERTY(tx_deflate_low_memory);
+		args.lazy = TRUE;
+		args.offload = 0 != GNET_PROPERTY(tx_deflate_workers);
+		args.buffer_size = args.offload ?
+			NODE_TX_OFFLOAD_BUFSIZ : NODE_TX_BUFSIZ;
 		args.buffer_flush = NODE_TX_FLUSH;
 
 		ctx = tx_make_above(tx, tx_deflate_get_ops(), &args);
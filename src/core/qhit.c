@@ -104,6 +104,7 @@ struct found_struct {
 	qhit_process_t process;		/**< processor once query hit is built */
 	void *udata;				/**< processor argument */
 	unsigned flags;				/**< Set of QHIT_F_* flags */
+	uint8 hops;					/**< Hop count of query, for inbound hits */
 	unsigned open:1;			/**< Set if found_open() was used */
 };
 
@@ -120,6 +121,12 @@ found_file_count(void)
 	return found_get()->files;
 }
 
+static uint8
+found_hops(void)
+{
+	return found_get()->hops;
+}
+
 static size_t
 found_max_size(void)
 {
@@ -314,8 +321,9 @@ found_token(void)
 }
 
 static void
-found_init(size_t max_size, const struct guid *xuid, unsigned flags,
-	qhit_process_t proc, void *udata, const struct array *token)
+found_init(size_t max_size, const struct guid *xuid, uint8 hops,
+	unsigned flags, qhit_process_t proc, void *udata,
+	const struct array *token)
 {
 	struct found_struct *f = found_get();
 
@@ -327,6 +335,7 @@ found_init(size_t max_size, const struct guid *xuid, unsigned flags,
 
 	f->max_size = max_size;
 	f->muid = xuid;
+	f->hops = hops;
 	f->flags = flags;
 	f->process = proc;
 	f->udata = udata;
@@ -367,6 +376,7 @@ qhit_send_node(void *data, size_t len, void *udata)
 {
 	gnutella_node_t *n = udata;
 	gnutella_header_t *packet_head = data;
+	uint hops = found_hops();
 	uint ttl;
 
 	if (GNET_PROPERTY(dbg) > 3) {
@@ -387,13 +397,12 @@ qhit_send_node(void *data, size_t len, void *udata)
 	 *			 --RAM, 02/02/2001
 	 */
 
-	if (gnutella_header_get_hops(&n->header) == 0) {
+	if (0 == hops) {
 		g_warning("%s(): hops=0, bug in route_message()?", G_STRFUNC);
-		/* Can't send message with TTL=0 */
-		gnutella_header_set_hops(&n->header, 1);
+		hops = 1;		/* Can't send message with TTL=0 */
 	}
 
-	ttl = gnutella_header_get_hops(&n->header) + 5U;
+	ttl = hops + 5U;
 	ttl = MIN(ttl, GNET_PROPERTY(hard_ttl_limit));
 	gnutella_header_set_ttl(packet_head, ttl);
 
@@ -962,6 +971,9 @@ add_file(const shared_file_t *sf)
  * This must point to a memory location that is guaranteed to stay accurate
  * during all the processing.
  *
+ * @param hops is the hop count of the query, used to compute the TTL of hits
+ * sent inbound.
+ *
  * @param process the processor callback to invoke on each individually built
  * query hit message, along with `udata'.
  *
@@ -970,12 +982,13 @@ add_file(const shared_file_t *sf)
  * have to be sent out-of-bound
  */
 static void
-found_reset(size_t max_size, const struct guid *muid, unsigned flags,
-	qhit_process_t process, void *udata, const struct array *token)
+found_reset(size_t max_size, const struct guid *muid, uint8 hops,
+	unsigned flags, qhit_process_t process, void *udata,
+	const struct array *token)
 {
 	g_assert(process != NULL);
 	g_assert(max_size <= INT_MAX);
-	found_init(max_size, muid, flags, process, udata, token);
+	found_init(max_size, muid, hops, flags, process, udata, token);
 	found_clear();
 }
 
@@ -987,11 +1000,12 @@ found_reset(size_t max_size, const struct guid *muid, unsigned flags,
  * @param files			the list of shared_file_t entries that make up results
  * @param count			the amount of results
  * @param muid			the query's MUID
+ * @param hops			the query's hop count, to compute the hits TTL
  * @param flags			a combination of QHIT_F_* flags
  */
 void
 qhit_send_results(gnutella_node_t *n, pslist_t *files, int count,
-	const struct guid *muid, unsigned flags)
+	const struct guid *muid, uint8 hops, unsigned flags)
 {
 	pslist_t *sl;
 	int sent = 0;
@@ -1004,9 +1018,12 @@ qhit_send_results(gnutella_node_t *n, pslist_t *files, int count,
 	 * but the query can have been OOB-proxified already and therefore the
 	 * n->header.muid data have been mangled (since that is what we're going
 	 * to forward to other nodes).
+	 *
+	 * Likewise, the hop count must come from the query since n->header
+	 * may already hold a later message when replies are batched.
 	 */
 
-	found_reset(QHIT_SIZE_THRESHOLD, muid, flags, qhit_send_node, n,
+	found_reset(QHIT_SIZE_THRESHOLD, muid, hops, flags, qhit_send_node, n,
 		&zero_array);
 
 	PSLIST_FOREACH(files, sl) {
@@ -1062,7 +1079,7 @@ qhit_build_results(const pslist_t *files, int count, size_t max_msgsize,
 	g_assert(cb != NULL);
 	g_assert(token);
 
-	found_reset(max_msgsize, muid, flags, cb, udata, token);
+	found_reset(max_msgsize, muid, 0, flags, cb, udata, token);
 
 	for (sl = files, sent = 0; sl && sent < count; sl = pslist_next(sl)) {
 		const shared_file_t *sf = sl->data;
@@ -65,7 +65,7 @@ void qhit_init(void);
 void qhit_close(void);
 
 void qhit_send_results(struct gnutella_node *n, struct pslist *files, int count,
-	const struct guid *muid, unsigned flags);
+	const struct guid *muid, uint8 hops, unsigned flags);
 void qhit_build_results(const struct pslist *files,
 	int count, size_t max_msgsize,
 	qhit_process_t cb, void *udata, const struct guid *muid, unsigned flags,
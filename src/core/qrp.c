@@ -59,10 +59,14 @@
 
 #include "g2/node.h"
 
+#include "lib/aq.h"
+#include "lib/atomic.h"
 #include "lib/atoms.h"
 #include "lib/bg.h"
+#include "lib/cpufeat.h"
 #include "lib/cq.h"
 #include "lib/endian.h"
+#include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hset.h"
@@ -76,6 +80,8 @@
 #include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/teq.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/utf8.h"
@@ -86,6 +92,10 @@
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
 
+#ifdef CPUFEAT_X86
+#include <immintrin.h>
+#endif
+
 #include "lib/override.h"			/* Must be the last header included */
 
 #define MIN_SPARSE_RATIO	1		/**< At most 1% of slots used */
@@ -247,6 +257,7 @@ static struct routing_patch *routing_patch1;
 static struct routing_patch *routing_revpatch1;
 
 static void qrt_compress_cancel_all(void);
+static void qrt_compress_job_done(void *arg);
 static void qrt_patch_compute(
 	struct routing_patch *rp, struct routing_patch **rpp);
 static uint32 qrt_dump(struct routing_table *rt, bool full);
@@ -571,6 +582,226 @@ qrt_compact(struct routing_table *rt)
 	}
 }
 
+/*
+ * Operations on compacted arenas, where slot #0 is bit 7 of byte 0.
+ *
+ * Merging tables is a logical OR of their arenas, each slot of the smaller
+ * table being expanded to cover as many slots of the larger one as the ratio
+ * of their sizes: merging never needs to go back to one byte per slot.
+ */
+
+typedef void (qrt_or_fn_t)(uint8 *dst, const uint8 *src, size_t n);
+
+/**
+ * OR `n' bytes from `src' into `dst', one word at a time.
+ */
+static void
+qrt_or_generic(uint8 *dst, const uint8 *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(ulong) <= n; i += sizeof(ulong)) {
+		ulong d, v;
+
+		memcpy(&d, &dst[i], sizeof d);
+		memcpy(&v, &src[i], sizeof v);
+		d |= v;
+		memcpy(&dst[i], &d, sizeof d);
+	}
+
+	for (/* empty */; i < n; i++)
+		dst[i] |= src[i];
+}
+
+#ifdef CPUFEAT_X86
+/**
+ * OR `n' bytes from `src' into `dst', 16 bytes at a time.
+ */
+static void CPUFEAT_TARGET("sse2")
+qrt_or_sse2(uint8 *dst, const uint8 *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(__m128i) <= n; i += sizeof(__m128i)) {
+		__m128i d = _mm_loadu_si128((const __m128i *) &dst[i]);
+		__m128i v = _mm_loadu_si128((const __m128i *) &src[i]);
+		_mm_storeu_si128((__m128i *) &dst[i], _mm_or_si128(d, v));
+	}
+
+	qrt_or_generic(&dst[i], &src[i], n - i);
+}
+
+/**
+ * OR `n' bytes from `src' into `dst', 32 bytes at a time.
+ */
+static void CPUFEAT_TARGET("avx2")
+qrt_or_avx2(uint8 *dst, const uint8 *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(__m256i) <= n; i += sizeof(__m256i)) {
+		__m256i d = _mm256_loadu_si256((const __m256i *) &dst[i]);
+		__m256i v = _mm256_loadu_si256((const __m256i *) &src[i]);
+		_mm256_storeu_si256((__m256i *) &dst[i], _mm256_or_si256(d, v));
+	}
+
+	qrt_or_generic(&dst[i], &src[i], n - i);
+}
+#endif	/* CPUFEAT_X86 */
+
+/**
+ * OR `n' bytes from `src' into `dst', using the fastest routine the CPU
+ * supports.
+ */
+static void
+qrt_or(uint8 *dst, const uint8 *src, size_t n)
+{
+	static qrt_or_fn_t *or_fn;
+
+	if G_UNLIKELY(NULL == or_fn) {
+		qrt_or_fn_t *fn = qrt_or_generic;
+
+#ifdef CPUFEAT_X86
+		if (cpufeat_has(CPUFEAT_AVX2))
+			fn = qrt_or_avx2;
+		else if (cpufeat_has(CPUFEAT_SSE2))
+			fn = qrt_or_sse2;
+#endif
+
+		or_fn = fn;
+	}
+
+	(*or_fn)(dst, src, n);
+}
+
+/**
+ * Spread the bits of a byte, each bit being repeated `n' times, keeping
+ * the most significant bit first.
+ */
+static uint32
+qrt_spread_bits(uint8 b, uint n)
+{
+	uint32 v = 0;
+	uint i;
+
+	for (i = 0; i < 8; i++) {
+		v <<= n;
+		if (b & (0x80U >> i))
+			v |= (1U << n) - 1;
+	}
+
+	return v;
+}
+
+/**
+ * Merge compacted routing table into compacted arena.
+ *
+ * @param arena is a compacted arena
+ * @param slots is the number of slots in the arena
+ * @param rt is the routing table to merge
+ */
+static void
+qrt_merge_packed(uint8 *arena, int slots, const struct routing_table *rt)
+{
+	static uint16 spread2[256];
+	static uint32 spread4[256];
+	static bool inited;
+	const uint8 *src = rt->arena;
+	int expand, bytes, b;
+
+	/*
+	 * By construction, the size of the arena is the max of all the sizes
+	 * of the QRT tables, so the size of the routing table to merge can only
+	 * be smaller than the arena size.
+	 */
+
+	g_assert(rt->slots <= slots);
+	g_assert(rt->compacted);
+	g_assert(is_pow2(slots));
+	g_assert(is_pow2(rt->slots));
+	g_assert(rt->slots >= 8);
+
+	if G_UNLIKELY(!inited) {
+		uint i;
+
+		for (i = 0; i < N_ITEMS(spread2); i++) {
+			spread2[i] = qrt_spread_bits(i, 2);
+			spread4[i] = qrt_spread_bits(i, 4);
+		}
+		inited = TRUE;
+	}
+
+	expand = slots / rt->slots;
+	bytes = rt->slots / 8;
+
+	/*
+	 * With the same table sizes, this is a plain OR of the arenas.
+	 *
+	 * Otherwise, each source byte expands to `expand' destination bytes,
+	 * through lookup tables for the smallest factors.  From a factor of 8
+	 * onwards, each source bit covers whole destination bytes.
+	 *
+	 * Since "0 OR x = x", we skip zero source bytes.
+	 */
+
+	switch (expand) {
+	case 1:
+		qrt_or(arena, src, bytes);
+		break;
+	case 2:
+		for (b = 0; b < bytes; b++) {
+			if (src[b] != 0) {
+				uint16 v = spread2[src[b]];
+				uint8 *p = &arena[2 * b];
+				p[0] |= v >> 8;
+				p[1] |= v & 0xff;
+			}
+		}
+		break;
+	case 4:
+		for (b = 0; b < bytes; b++) {
+			if (src[b] != 0) {
+				uint32 v = spread4[src[b]];
+				uint8 *p = &arena[4 * b];
+				p[0] |= v >> 24;
+				p[1] |= (v >> 16) & 0xff;
+				p[2] |= (v >> 8) & 0xff;
+				p[3] |= v & 0xff;
+			}
+		}
+		break;
+	default:
+		{
+			int n = expand / 8;			/* Bytes covered by each source bit */
+
+			for (b = 0; b < bytes; b++) {
+				uint8 entry = src[b];
+				int i;
+
+				for (i = 0; entry != 0; i++, entry <<= 1) {
+					if (entry & 0x80)
+						memset(&arena[(8 * b + i) * n], 0xff, n);
+				}
+			}
+		}
+		break;
+	}
+}
+
+/**
+ * Count slots set in a compacted arena.
+ */
+static int
+qrt_count_set(const uint8 *arena, int slots)
+{
+	int i, count = 0;
+
+	for (i = 0; i < slots / 8; i++)
+		count += bits_set(arena[i]);
+
+	return count;
+}
+
 /**
  * Computes the SHA1 of a compacted routing table.
  * @returns a pointer to static data.
@@ -867,6 +1098,7 @@ struct qrt_compress_context {
 	enum qrt_compress_magic magic;	/**< Magic number */
 	struct routing_patch *rp;		/**< Routing table being compressed */
 	zlib_deflater_t *zd;			/**< Incremental deflater */
+	struct qrt_compress_job *job;	/**< Job for worker threads, if any */
 	bgdone_cb_t usr_done;			/**< User-defined callback */
 	void *usr_arg;					/**< Arg for user-defined callback */
 	uint allocated:1;				/**< Whether context was allocated */
@@ -874,6 +1106,254 @@ struct qrt_compress_context {
 	uint finished:1;				/**< Task is finished */
 };
 
+/*
+ * Patch compression workers.
+ *
+ * Compressing a large patch with zlib takes a while, and every node we
+ * connect to can require its own patch.  Patches are therefore deflated
+ * by a pool of worker threads, fed through an asynchronous queue.
+ *
+ * The compression task remains a background task of the main thread, which
+ * sleeps whilst its job is processed: the worker posts the completion back
+ * to the main thread, which then wakes up the task.  This preserves the
+ * synchronous cancellation semantics of the task for its users.
+ */
+
+enum qrt_compress_job_magic {
+	QRT_COMPRESS_JOB_MAGIC = 0x1d47e2a9
+};
+
+struct qrt_compress_job {
+	enum qrt_compress_job_magic magic;	/**< Magic number */
+	void *data;					/**< Private copy of the data to compress */
+	int len;					/**< Length of data */
+	int status;					/**< zlib_deflate_all() status, set by worker */
+	zlib_deflater_t *zd;		/**< Deflater, holding the output when done */
+	bgtask_t *task;				/**< Task to wakeup, NULL if task is gone */
+	bool cancelled;				/**< Set when task no longer needs result */
+	uint queued:1;				/**< Job was given to the workers */
+	uint done:1;				/**< Job was completed by a worker */
+};
+
+static inline void
+qrt_compress_job_check(const struct qrt_compress_job * const job)
+{
+	g_assert(job != NULL);
+	g_assert(QRT_COMPRESS_JOB_MAGIC == job->magic);
+}
+
+static aqueue_t *qrt_compress_aq;	/**< Jobs for the workers */
+static uint qrt_compress_workers;	/**< Amount of worker threads running */
+static bool qrt_compress_inited;
+
+/**
+ * Main loop of patch compression workers.
+ */
+static void *
+qrt_compress_thread_main(void *arg)
+{
+	aqueue_t *aq = arg;
+
+	thread_set_name("QRP deflate");
+
+	for (;;) {
+		struct qrt_compress_job *job;
+
+		job = aq_remove(aq);
+		if G_UNLIKELY(NULL == job)
+			break;
+
+		qrt_compress_job_check(job);
+
+		/*
+		 * Don't bother compressing if the task that requested it was
+		 * cancelled whilst the job was queued.
+		 */
+
+		if (atomic_bool_get(&job->cancelled))
+			job->status = -1;
+		else
+			job->status = zlib_deflate_all(job->zd);
+
+		teq_post(THREAD_MAIN_ID, qrt_compress_job_done, job);
+	}
+
+	aq_refcnt_dec(aq);
+
+	return NULL;
+}
+
+/**
+ * Launch the patch compression workers, once.
+ *
+ * @return whether there are workers to process compression jobs.
+ */
+static bool
+qrt_compress_workers_init(void)
+{
+	uint i, n;
+
+	if G_LIKELY(qrt_compress_inited)
+		return qrt_compress_workers != 0;
+
+	qrt_compress_inited = TRUE;
+
+	n = GNET_PROPERTY(qrp_compress_workers);
+	n = MIN(n, UNSIGNED(MAX(1, getcpucount() - 1)));
+
+	if (0 == n)
+		return FALSE;
+
+	qrt_compress_aq = aq_make();
+
+	for (i = 0; i < n; i++) {
+		int r;
+
+		r = thread_create(qrt_compress_thread_main,
+				aq_refcnt_inc(qrt_compress_aq),
+				THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_NO_POOL,
+				THREAD_STACK_MIN);
+
+		if (-1 == r) {
+			g_warning("%s(): cannot create QRP compression thread: %m",
+				G_STRFUNC);
+			aq_refcnt_dec(qrt_compress_aq);
+			break;
+		}
+
+		qrt_compress_workers++;
+	}
+
+	if (qrp_debugging(0)) {
+		g_debug("QRP started %u compression worker%s",
+			PLURAL(qrt_compress_workers));
+	}
+
+	return qrt_compress_workers != 0;
+}
+
+/**
+ * Stop the patch compression workers.
+ */
+static void
+qrt_compress_workers_close(void)
+{
+	uint i;
+
+	for (i = 0; i < qrt_compress_workers; i++)
+		aq_put(qrt_compress_aq, NULL);		/* Signals end of processing */
+
+	qrt_compress_workers = 0;
+
+	if (qrt_compress_aq != NULL) {
+		aq_refcnt_dec(qrt_compress_aq);
+		qrt_compress_aq = NULL;
+	}
+}
+
+/**
+ * Create a compression job for the workers.
+ *
+ * @param rp		the routing patch to compress
+ *
+ * @return new job, NULL if there are no workers.
+ */
+static struct qrt_compress_job *
+qrt_compress_job_make(const struct routing_patch *rp)
+{
+	struct qrt_compress_job *job;
+
+	if (!qrt_compress_workers_init())
+		return NULL;
+
+	/*
+	 * The data is copied because the patch could be freed by its owner
+	 * whilst the worker still processes a cancelled job.
+	 */
+
+	WALLOC0(job);
+	job->magic = QRT_COMPRESS_JOB_MAGIC;
+	job->len = rp->len;
+	job->data = hcopy(rp->arena, rp->len);
+	job->zd = zlib_deflater_make(job->data, job->len, Z_BEST_COMPRESSION);
+
+	if (NULL == job->zd)
+		g_error("%s(): unable to initialize patch compression", G_STRFUNC);
+
+	return job;
+}
+
+/**
+ * Free compression job.
+ */
+static void
+qrt_compress_job_free(struct qrt_compress_job *job)
+{
+	qrt_compress_job_check(job);
+	g_assert(NULL == job->task);
+
+	zlib_deflater_free(job->zd, TRUE);
+	HFREE_NULL(job->data);
+	job->magic = 0;
+	WFREE(job);
+}
+
+/**
+ * Give job to the workers, recording the task to wakeup upon completion.
+ */
+static void
+qrt_compress_job_queue(struct qrt_compress_job *job, bgtask_t *bt)
+{
+	qrt_compress_job_check(job);
+	g_assert(!job->queued);
+
+	job->task = bg_task_ref(bt);
+	job->queued = TRUE;
+	aq_put(qrt_compress_aq, job);
+}
+
+/**
+ * Detach job from its compression context, when the task is terminated.
+ */
+static void
+qrt_compress_job_detach(struct qrt_compress_job *job)
+{
+	qrt_compress_job_check(job);
+
+	if (job->task != NULL)
+		bg_task_unref(job->task);
+	job->task = NULL;
+
+	/*
+	 * If the job is still being processed by the workers, it will be freed
+	 * by qrt_compress_job_done() when they are done with it.
+	 */
+
+	if (job->queued && !job->done)
+		atomic_bool_set(&job->cancelled, TRUE);
+	else
+		qrt_compress_job_free(job);
+}
+
+/**
+ * Invoked in the main thread when a worker completed a job.
+ */
+static void
+qrt_compress_job_done(void *arg)
+{
+	struct qrt_compress_job *job = arg;
+
+	qrt_compress_job_check(job);
+	g_assert(thread_is_main());
+
+	job->done = TRUE;
+
+	if (NULL == job->task)
+		qrt_compress_job_free(job);		/* Task was terminated */
+	else
+		bg_task_wakeup(job->task);
+}
+
 /**
  * Free compression context.
  *
@@ -893,6 +1373,11 @@ qrt_compress_free(void *u)
 		ctx->zd = NULL;
 	}
 
+	if (ctx->job != NULL) {
+		qrt_compress_job_detach(ctx->job);
+		ctx->job = NULL;
+	}
+
 	if (ctx->allocated) {
 		ctx->magic = 0;
 		WFREE(ctx);
@@ -908,20 +1393,41 @@ static bgret_t
 qrt_step_compress(struct bgtask *h, void *u, int ticks)
 {
 	struct qrt_compress_context *ctx = u;
+	zlib_deflater_t *zd;
 	int ret;
-	int chunklen;
 	int status = 0;
 
 	g_assert(ctx->magic == QRT_COMPRESS_MAGIC);
 
-	chunklen = ticks * QRT_TICK_CHUNK;
+	if (ctx->job != NULL) {
+		struct qrt_compress_job *job = ctx->job;
 
-	if (qrp_debugging(4)) {
-		g_debug("QRP qrt_step_compress: ticks = %d => chunk = %d bytes",
-			ticks, chunklen);
-	}
+		/*
+		 * Give the job to the workers the first time, then sleep until
+		 * the main thread gets notified that the job was completed.
+		 */
+
+		if (!job->done) {
+			if (!job->queued)
+				qrt_compress_job_queue(job, h);
+			bg_task_sleep(h);
+			bg_task_ticks_used(h, 0);
+			return BGR_MORE;
+		}
+
+		zd = job->zd;
+		ret = job->status;
+	} else {
+		int chunklen = ticks * QRT_TICK_CHUNK;
+
+		if (qrp_debugging(4)) {
+			g_debug("QRP qrt_step_compress: ticks = %d => chunk = %d bytes",
+				ticks, chunklen);
+		}
 
-	ret = zlib_deflate(ctx->zd, chunklen);
+		zd = ctx->zd;
+		ret = zlib_deflate(zd, chunklen);
+	}
 
 	switch (ret) {
 	case -1:					/* Error occurred */
@@ -935,24 +1441,26 @@ qrt_step_compress(struct bgtask *h, void *u, int ticks)
 
 		if (qrp_debugging(1)) {
 			g_debug(
-				"QRP %s %p: len=%d, compressed=%d (ratio %.2f%%)",
+				"QRP %s %p: len=%d, compressed=%d (ratio %.2f%%)%s",
 				qrp_patch_to_string(ctx->rp), ctx->rp, ctx->rp->len,
-				zlib_deflater_outlen(ctx->zd),
-				100.0 * (ctx->rp->len - zlib_deflater_outlen(ctx->zd)) /
-					ctx->rp->len);
+				zlib_deflater_outlen(zd),
+				100.0 * (ctx->rp->len - zlib_deflater_outlen(zd)) /
+					ctx->rp->len, NULL == ctx->job ? "" : " by worker");
 		}
 
-		if (zlib_deflater_outlen(ctx->zd) < ctx->rp->len) {
+		if (zlib_deflater_outlen(zd) < ctx->rp->len) {
 			struct routing_patch *rp = ctx->rp;
 
 			g_assert(ROUTING_PATCH_MAGIC == rp->magic);
 			HFREE_NULL(rp->arena);
-			rp->len = zlib_deflater_outlen(ctx->zd);
-			rp->arena = hcopy(zlib_deflater_out(ctx->zd), rp->len);
+			rp->len = zlib_deflater_outlen(zd);
+			rp->arena = hcopy(zlib_deflater_out(zd), rp->len);
 			rp->compressed = TRUE;
 		}
-		zlib_deflater_free(ctx->zd, TRUE);
-		ctx->zd = NULL;
+		if (ctx->zd != NULL) {
+			zlib_deflater_free(ctx->zd, TRUE);
+			ctx->zd = NULL;
+		}
 		goto done;
 		/* NOTREACHED */
 	case 1:						/* More work required */
@@ -1021,26 +1529,31 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 	bgdone_cb_t done_cb, void *arg, struct qrt_compress_context *cp)
 {
 	struct qrt_compress_context *ctx;
-	zlib_deflater_t *zd;
+	struct qrt_compress_job *job;
+	zlib_deflater_t *zd = NULL;
 	struct bgtask *task;
 	bgstep_cb_t step = qrt_step_compress;
 
 	g_assert(rp != NULL);
 	g_assert(ROUTING_PATCH_MAGIC == rp->magic);
 
-	zd = zlib_deflater_make(rp->arena, rp->len, Z_BEST_COMPRESSION);
-
-	if (NULL == zd)
-		g_error("%s(): unable to initialize patch compression", G_STRFUNC);
-
 	/*
-	 * Because compression is possibly a CPU-intensive operation, it
-	 * is dealt with a background task that will be scheduled at regular
-	 * intervals.
+	 * Because compression is possibly a CPU-intensive operation, it is
+	 * handed to the compression workers.  When there are none, it is dealt
+	 * with a background task that will be scheduled at regular intervals.
 	 */
 
-	if (NULL == cp) {
-		WALLOC0(ctx);
+	job = qrt_compress_job_make(rp);
+
+	if (NULL == job) {
+		zd = zlib_deflater_make(rp->arena, rp->len, Z_BEST_COMPRESSION);
+
+		if (NULL == zd)
+			g_error("%s(): unable to initialize patch compression", G_STRFUNC);
+	}
+
+	if (NULL == cp) {
+		WALLOC0(ctx);
 		ctx->allocated = TRUE;
 	} else {
 		ctx = cp;
@@ -1050,6 +1563,7 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 	ctx->magic = QRT_COMPRESS_MAGIC;
 	ctx->rp = rp;
 	ctx->zd = zd;
+	ctx->job = job;
 	ctx->usr_done = done_cb;
 	ctx->usr_arg = arg;
 
@@ -1062,9 +1576,11 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 /**
  * Create a new query routing table, with supplied `arena' and `slots'.
  * The value used for infinity is given as `max'.
+ *
+ * When `compacted' is TRUE, the arena is already using one bit per slot.
  */
 static struct routing_table *
-qrt_create(const char *name, char *arena, int slots, int max)
+qrt_make(const char *name, uint8 *arena, int slots, int max, bool compacted)
 {
 	struct routing_table *rt;
 
@@ -1076,7 +1592,7 @@ qrt_create(const char *name, char *arena, int slots, int max)
 
 	rt->magic         = QRP_ROUTE_MAGIC;
 	rt->name          = h_strdup(name);
-	rt->arena         = (uchar *) arena;
+	rt->arena         = arena;
 	rt->slots         = slots;
 	rt->generation    = generation++;
 	rt->refcnt        = 0;
@@ -1087,7 +1603,14 @@ qrt_create(const char *name, char *arena, int slots, int max)
 	rt->can_route_urn = qrp_can_route_default;
 	rt->can_route     = qrp_can_route_default;
 
-	qrt_compact(rt);
+	if (compacted) {
+		g_assert(0 == (slots & 0x7));	/* Multiple of 8 */
+		rt->len = slots / 8;
+		rt->set_count = qrt_count_set(arena, slots);
+		rt->compacted = TRUE;
+	} else {
+		qrt_compact(rt);
+	}
 
 	gnet_prop_set_guint32_val(PROP_QRP_GENERATION, (uint32) rt->generation);
 	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
@@ -1105,6 +1628,26 @@ qrt_create(const char *name, char *arena, int slots, int max)
 	return rt;
 }
 
+/**
+ * Create a new query routing table, with supplied `arena' and `slots'.
+ * The value used for infinity is given as `max'.
+ */
+static struct routing_table *
+qrt_create(const char *name, char *arena, int slots, int max)
+{
+	return qrt_make(name, (uint8 *) arena, slots, max, FALSE);
+}
+
+/**
+ * Create a new query routing table from an already compacted `arena'
+ * holding `slots' slots.
+ */
+static struct routing_table *
+qrt_create_compacted(const char *name, uint8 *arena, int slots)
+{
+	return qrt_make(name, arena, slots, LOCAL_INFINITY, TRUE);
+}
+
 /**
  * Create small empty table.
  */
@@ -1139,20 +1682,22 @@ qrt_free(struct routing_table *rt)
 }
 
 /**
- * Shrink arena inplace to use only `new_slots' instead of `old_slots'.
- * The memory area is also shrunk and the new location of the arena is
- * returned.
+ * Shrink compacted arena inplace to use only `new_slots' instead of
+ * `old_slots'.  The memory area is also shrunk and the new location of the
+ * arena is returned.
  */
 static void *
-qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
+qrt_shrink_arena(uint8 *arena, int old_slots, int new_slots)
 {
 	int factor;		/* Shrink factor */
 	int ratio;
 	int i, j;
+	uint mask = 0;
 
 	g_assert(old_slots > new_slots);
 	g_assert(is_pow2(old_slots));
 	g_assert(is_pow2(new_slots));
+	g_assert(new_slots >= 8);
 
 	ratio = highest_bit_set(old_slots) - highest_bit_set(new_slots);
 
@@ -1163,21 +1708,35 @@ qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
 	/*
 	 * The shrinking algorithm: an entry is "set" to contain something if
 	 * any of the "factor" entries in the larger table contain something.
+	 *
+	 * New byte #b is only written once its 8 slots are computed, at which
+	 * point we have read all the old slots up to (8 * b + 8) * factor, i.e.
+	 * beyond the old byte #b: updating in place is safe.
 	 */
 
-	for (i = 0, j = 0; i < new_slots && j < old_slots; i++, j += factor) {
-		int k;
-		int set = FALSE;
+	for (i = 0, j = 0; i < new_slots; i++, j += factor) {
+		bool set = FALSE;
+
+		if (factor >= 8) {
+			int k;
 
-		for (k = 0; k < factor && !set; k++) {
-			if ((uchar) arena[j + k] != inf_val)
-				set = TRUE;
+			for (k = 0; k < factor / 8 && !set; k++)
+				set = 0 != arena[j / 8 + k];
+		} else {
+			/* The `factor' old slots are all within the same byte */
+			uint8 m = (uint8) (0xffU << (8 - factor)) >> (j & 0x7);
+			set = 0 != (arena[j >> 3] & m);
 		}
 
-		arena[i] = set ? 0 : inf_val;
+		mask = (mask << 1) | (set ? 1 : 0);
+
+		if (0x7 == (i & 0x7)) {
+			arena[i >> 3] = mask;
+			mask = 0;
+		}
 	}
 
-	return hrealloc(arena, new_slots);
+	return hrealloc(arena, new_slots / 8);
 }
 
 /**
@@ -1276,7 +1835,7 @@ enum merge_magic {
 struct merge_context {
 	enum merge_magic magic;
 	pslist_t *tables;			/* Leaf routing tables */
-	uchar *arena;				/* Working arena (not compacted) */
+	uint8 *arena;				/* Working arena (compacted) */
 	int slots;					/* Amount of slots used for merged table */
 };
 
@@ -1371,135 +1930,12 @@ mrg_step_get_list(struct bgtask *unused_h, void *u, int unused_ticks)
 	g_assert(max_size > 0 || ctx->tables == NULL);
 
 	ctx->slots = max_size;
-	if (max_size > 0) {
-		ctx->arena = halloc(max_size);
-		memset(ctx->arena, LOCAL_INFINITY, max_size);
-	}
+	if (max_size > 0)
+		ctx->arena = halloc0(max_size / 8);
 
 	return BGR_NEXT;
 }
 
-/**
- * Merge routing table into specified arena.
- *
- * @param rt is the routing table to merge
- * @param arena is a non-compacted arena
- * @param slots is the number of slots in the arena
- */
-static void
-merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
-{
-	int ratio;
-	int expand;
-	int i;
-	int b;
-	int bytes;
-
-	/*
-	 * By construction, the size of the arena is the max of all the sizes
-	 * of the QRT tables, so the size of the routing table to merge can only
-	 * be smaller than the arena size.
-	 */
-
-	g_assert(rt->slots <= slots);
-	g_assert(rt->compacted);
-	g_assert(is_pow2(slots));
-	g_assert(is_pow2(rt->slots));
-	g_assert(rt->slots >= 8);
-
-	ratio = highest_bit_set(slots) - highest_bit_set(rt->slots);
-
-	g_assert(ratio >= 0);
-
-	expand = 1 << ratio;
-	bytes = rt->slots / 8;
-
-	g_assert(rt->slots * expand <= slots);	/* Won't overflow */
-
-	/*
-	 * Loop over the supplied QRT, and expand each slot `expand' times into
-	 * the arena, doing an "OR" merging.
-	 *
-	 * Since this is going to be a tight loop, try to optimize the smallest
-	 * expansion factors by avoiding memset() calls.
-	 *
-	 * Furthermore, we avoid repeated RT_SLOT_READ() calls by accessing the
-	 * compacted table one byte at a time and then looping on each of its bits.
-	 */
-
-#define RT_FOR_EACH_BIT_SET(ON_CHANGE)				\
-for (b = 0, i = 0; b < bytes; b++) {				\
-	uint8 entry = rt->arena[b];						\
-	unsigned mask = 0x80;							\
-													\
-	do {											\
-		/* "0 OR x = x", hence skip unset bits */	\
-		if (entry & mask) {							\
-			ON_CHANGE								\
-		}											\
-		i++;										\
-		mask >>= 1;									\
-	} while (mask);									\
-}
-
-	switch (expand) {
-	case 1:
-		RT_FOR_EACH_BIT_SET(
-			arena[i] = 0;		/* less than "inf" => indicates presence */
-		);
-		break;
-	case 2:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 2;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j] = 0;
-		);
-		break;
-	case 4:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 4;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j] = 0;
-		);
-		break;
-	case 8:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 8;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j] = 0;
-		);
-		break;
-	case 16:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * 16], 0, 16);
-		);
-		break;
-	case 32:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * 32], 0, 32);
-		);
-		break;
-	default:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * expand], 0, expand);
-		);
-		break;
-	}
-
-#undef RT_FOR_EACH_BIT_SET
-}
-
 /**
  * Merge next leaf QRT table if node is still there.
  */
@@ -1531,7 +1967,7 @@ mrg_step_merge_one(struct bgtask *unused_h, void *u, int ticks)
 		 */
 
 		if (rt->refcnt > 1) {
-			merge_table_into_arena(rt, ctx->arena, ctx->slots);
+			qrt_merge_packed(ctx->arena, ctx->slots, rt);
 			ticks_used++;
 		}
 
@@ -1561,8 +1997,7 @@ mrg_step_install_table(struct bgtask *unused_h, void *u, int unused_ticks)
 	if (settings_is_ultra()) {
 		struct routing_table *mt;
 		if (ctx->slots != 0)
-			mt = qrt_create("Merged table",
-				cast_to_pointer(ctx->arena), ctx->slots, LOCAL_INFINITY);
+			mt = qrt_create_compacted("Merged table", ctx->arena, ctx->slots);
 		else {
 			g_assert(ctx->arena == NULL);
 			mt = qrt_empty_table("Empty merged table");
@@ -1684,10 +2119,41 @@ qrp_prepare_computation(void)
 }
 
 /**
- * Add shared file to our QRP.
+ * Account for `word' in the `words' table, adding `delta' to its count.
+ *
+ * Entries whose count drops back to zero are removed from the table.
  */
-void
-qrp_add_file(const shared_file_t *sf, htable_t *words)
+static void
+qrp_account_word(htable_t *words, const char *word, int delta)
+{
+	const void *key;
+	void *value;
+	int count;
+
+	if (htable_lookup_extended(words, word, &key, &value)) {
+		count = pointer_to_int(value) + delta;
+		if (0 == count) {
+			htable_remove(words, key);
+			wfree(deconstify_pointer(key), 1 + vstrlen(key));
+		} else {
+			htable_insert(words, key, int_to_pointer(count));
+		}
+	} else {
+		size_t n = 1 + vstrlen(word);
+
+		htable_insert(words, wcopy(word, n), int_to_pointer(delta));
+	}
+}
+
+/**
+ * Account for the words of shared file in our QRP.
+ *
+ * @param sf		the shared file
+ * @param words		the word table to update
+ * @param delta		+1 when adding the file, -1 when removing it
+ */
+static void
+qrp_account_file(const shared_file_t *sf, htable_t *words, int delta)
 {
 	word_vec_t *wovec;
 	uint wocnt;
@@ -1704,7 +2170,8 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 
 	if (qrp_debugging(1)) {
 		bool completed = shared_file_is_finished(sf);
-		g_debug("QRP adding %sfile \"%s\"%s",
+		g_debug("QRP %s %sfile \"%s\"%s",
+			delta > 0 ? "adding" : "removing",
 			shared_file_is_partial(sf) ?
 				(completed ? "seeded " : "partial ") : "",
 			shared_file_name_canonic(sf),
@@ -1722,7 +2189,7 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 		return;
 
 	/*
-	 * Identify unique words we have not already seen in `words'.
+	 * Each word making up the filename is accounted for once.
 	 */
 
 	for (i = 0; i < wocnt; i++) {
@@ -1730,22 +2197,11 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 
 		g_assert(word[0] != '\0');
 
-		/*
-		 * Record word if we haven't seen it yet.
-		 */
-
-		if (htable_contains(words, word)) {
-			continue;
-		} else {
-			size_t word_len = vstrlen(word);
-			size_t n = 1 + word_len;
-
-			htable_insert(words, wcopy(word, n), size_to_pointer(n));
-		}
+		qrp_account_word(words, word, delta);
 
 		if (qrp_debugging(8)) {
-			g_debug("new QRP word \"%s\" [from %s]",
-				word, shared_file_name_nfc(sf));
+			g_debug("QRP word \"%s\" %+d [from %s]",
+				word, delta, shared_file_name_nfc(sf));
 		}
 	}
 
@@ -1765,79 +2221,102 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 	for (a = aliases; *a != NULL; a++) {
 		const char *word = *a;
 
-		if (htable_contains(words, word)) {
-			continue;
-		} else {
-			size_t word_len = vstrlen(word);
-			size_t n = 1 + word_len;
-
-			htable_insert(words, wcopy(word, n), size_to_pointer(n));
-		}
+		qrp_account_word(words, word, delta);
 
 		if (qrp_debugging(8)) {
-			g_debug("new QRP word \"%s\" [alias from %s]",
-				word, shared_file_name_nfc(sf));
+			g_debug("QRP word \"%s\" %+d [alias from %s]",
+				word, delta, shared_file_name_nfc(sf));
 		}
 	}
 
 	h_strfreev(aliases);
 }
 
+/**
+ * Add shared file to our QRP.
+ *
+ * @param sf		the shared file to add
+ * @param words		the word table being filled for the computation
+ */
+void
+qrp_add_file(const shared_file_t *sf, htable_t *words)
+{
+	qrp_account_file(sf, words, +1);
+}
+
+/**
+ * Remove shared file from our QRP.
+ *
+ * The file must have been previously added to the QRP through qrp_add_file()
+ * in a computation that was finalized.
+ *
+ * @param sf		the shared file to remove
+ * @param words		the word table being filled for the computation
+ */
+void
+qrp_remove_file(const shared_file_t *sf, htable_t *words)
+{
+	qrp_account_file(sf, words, -1);
+}
+
 /*
  * Hash table iterator callbacks
  */
 
 static void
-free_word(const void *key, void *value, void *unused_udata)
+free_word(const void *key, void *unused_value, void *unused_udata)
 {
-	g_assert(size_is_positive(pointer_to_size(value)));
-
+	(void) unused_value;
 	(void) unused_udata;
-	wfree(deconstify_pointer(key), pointer_to_size(value));
+	wfree(deconstify_pointer(key), 1 + vstrlen(key));
 }
 
-struct unique_substrings {		/* User data for unique_subtr() callback */
-	hset_t *unique;
-	pslist_t *head;
-};
+/*
+ * Index of the words making up our local QRP.
+ *
+ * It is kept across computations so that adding or removing a few files
+ * only requires updating the slots touched by the words that appeared or
+ * disappeared, instead of hashing all the substrings of all the words again.
+ *
+ * Each word yields several substrings (all anchored at the start of the
+ * word), which are hashed into the table slots.  We keep reference counts
+ * at each level so that we know when a slot becomes empty again.
+ *
+ * This is only accessed from the main thread.
+ */
+static struct qrp_index {
+	htable_t *words;		/**< word -> amount of references from files */
+	htable_t *substrings;	/**< substring -> amount of words yielding it */
+	uint32 *slot_refs;		/**< Amount of substrings hashed to each slot */
+	int bits;				/**< Slots in `slot_refs' are 2^bits, 0 if none */
+	int filled;				/**< Amount of non-zero entries in `slot_refs' */
+	int touched;			/**< Slots that flipped during last update */
+} qrp_index;
 
-static inline void
-insert_substr(struct unique_substrings *u, const char *word, size_t size)
-{
-	if (!hset_contains(u->unique, word)) {
-		void *s;
-
-		s = wcopy(word, size);
-		hset_insert(u->unique, s);
-		u->head = pslist_prepend(u->head, s);
-	}
-}
+typedef void (*qrp_substr_cb_t)(const char *s, size_t size);
 
 /**
- * Iteration callback on the hashtable containing keywords.
+ * Invoke callback on all the substrings of `word' we need to insert in the
+ * QRP, i.e. all the substrings anchored at the start of the word whose
+ * length range from QRP_MIN_WORD_LENGTH to the word length, with at most
+ * QRP_MAX_CUT_CHARS characters removed.
+ *
+ * The callback is given the substring and its size, including the trailing
+ * NUL.
  */
 static void
-unique_substr(const void *key, void *value, void *udata)
+qrp_substrings_foreach(const char *word, qrp_substr_cb_t cb)
 {
-	struct unique_substrings *u = udata;
-	const char *word = key;
 	char *s;
 	size_t len, size, i;
 
-	g_assert(size_is_positive(pointer_to_size(value)));
-
-	/*
-	 * Add all unique (i.e. not already seen) substrings from word, all
-	 * anchored at the start, whose length range from 3 to the word length.
-	 */
-
-	size = pointer_to_size(value);
+	size = 1 + vstrlen(word);
 	s = wcopy(word, size);
 	len = size - 1;				/* Trailing NUL included in size */
 
 	for (i = 0; i <= QRP_MAX_CUT_CHARS; i++) {
 
-		insert_substr(u, s, len + 1);
+		(*cb)(s, len + 1);
 
 		while (len > QRP_MIN_WORD_LENGTH) {
 			uint retlen;
@@ -1855,23 +2334,179 @@ unique_substr(const void *key, void *value, void *udata)
 }
 
 /**
- * Create a list of all unique substrings at least QRP_MIN_WORD_LENGTH long,
- * from words held in `ht' (keys are words, values are the word's length plus
- * the trailing NUL).
+ * Substring callback: record new substring in the index.
+ */
+static void
+qrp_index_substr_add(const char *s, size_t size)
+{
+	struct qrp_index *qi = &qrp_index;
+	const void *key;
+	void *value;
+
+	if (htable_lookup_extended(qi->substrings, s, &key, &value)) {
+		htable_insert(qi->substrings, key,
+			uint_to_pointer(pointer_to_uint(value) + 1));
+		return;
+	}
+
+	htable_insert(qi->substrings, wcopy(s, size), uint_to_pointer(1));
+
+	if (qi->bits != 0) {
+		uint idx = qrp_hash(s, qi->bits);
+
+		if (0 == qi->slot_refs[idx]++) {
+			qi->filled++;
+			qi->touched++;
+		}
+	}
+}
+
+/**
+ * Substring callback: remove substring from the index.
+ */
+static void
+qrp_index_substr_remove(const char *s, size_t size)
+{
+	struct qrp_index *qi = &qrp_index;
+	const void *key;
+	void *value;
+	uint count;
+
+	if (!htable_lookup_extended(qi->substrings, s, &key, &value)) {
+		s_carp("%s(): substring \"%s\" not indexed", G_STRFUNC, s);
+		return;
+	}
+
+	count = pointer_to_uint(value);
+
+	if (count > 1) {
+		htable_insert(qi->substrings, key, uint_to_pointer(count - 1));
+		return;
+	}
+
+	htable_remove(qi->substrings, key);
+	wfree(deconstify_pointer(key), size);
+
+	if (qi->bits != 0) {
+		uint idx = qrp_hash(s, qi->bits);
+
+		g_assert(qi->slot_refs[idx] != 0);
+
+		if (0 == --qi->slot_refs[idx]) {
+			qi->filled--;
+			qi->touched++;
+		}
+	}
+}
+
+/**
+ * Iteration callback on the old words of the index, when resetting it:
+ * removes the words that are no longer present in the new set of words.
+ */
+static void
+qrp_index_reset_old(const void *key, void *unused_value, void *data)
+{
+	const htable_t *words = data;
+
+	(void) unused_value;
+
+	if (!htable_contains(words, key))
+		qrp_substrings_foreach(key, qrp_index_substr_remove);
+}
+
+/**
+ * Iteration callback on the new words when resetting the index: adds the
+ * words that were not already present in the index.
+ */
+static void
+qrp_index_reset_new(const void *key, void *value, void *unused_data)
+{
+	(void) unused_data;
+
+	g_assert(pointer_to_int(value) > 0);
+
+	if (!htable_contains(qrp_index.words, key))
+		qrp_substrings_foreach(key, qrp_index_substr_add);
+}
+
+/**
+ * Iteration callback on the word deltas to apply to the index.
+ */
+static void
+qrp_index_apply(const void *key, void *value, void *unused_data)
+{
+	struct qrp_index *qi = &qrp_index;
+	const char *word = key;
+	int delta = pointer_to_int(value);
+	int count = pointer_to_int(htable_lookup(qi->words, word));
+
+	(void) unused_data;
+
+	if (count + delta < 0) {
+		s_carp("%s(): word \"%s\" removed more than added (%d %+d)",
+			G_STRFUNC, word, count, delta);
+		delta = -count;
+		if (0 == delta)
+			return;
+	}
+
+	if (0 == count && delta > 0)
+		qrp_substrings_foreach(word, qrp_index_substr_add);
+	else if (count != 0 && 0 == count + delta)
+		qrp_substrings_foreach(word, qrp_index_substr_remove);
+
+	qrp_account_word(qi->words, word, delta);
+}
+
+/**
+ * Update the QRP index with the words collected by a computation.
  *
- * @returns created list, and count in `retcount'.
+ * @param words		the words collected (takes ownership of it)
+ * @param reset		if TRUE, `words' is the whole new set of words
  */
-static pslist_t *
-unique_substrings(htable_t *ht, int *retcount)
+static void
+qrp_index_update(htable_t *words, bool reset)
 {
-	struct unique_substrings u = { NULL, NULL };		/* Callback args */
+	struct qrp_index *qi = &qrp_index;
+
+	if (NULL == qi->words) {
+		qi->words = htable_create(HASH_KEY_STRING, 0);
+		qi->substrings = htable_create(HASH_KEY_STRING, 0);
+	}
+
+	qi->touched = 0;
 
-	u.unique = hset_create(HASH_KEY_STRING, 0);
-	htable_foreach(ht, unique_substr, &u);
-	*retcount = hset_count(u.unique);
-	hset_free_null(&u.unique);		/* Created words ref'ed by u.head */
+	if (reset) {
+		htable_foreach(qi->words, qrp_index_reset_old, words);
+		htable_foreach(words, qrp_index_reset_new, NULL);
+		qrp_dispose_words(&qi->words);
+		qi->words = words;
+	} else {
+		htable_foreach(words, qrp_index_apply, NULL);
+		qrp_dispose_words(&words);
+	}
+
+	if (qrp_debugging(1)) {
+		g_debug("QRP index %s: %zu word%s, %zu substring%s, %d slot%s changed",
+			reset ? "rebuilt" : "updated",
+			PLURAL(htable_count(qi->words)),
+			PLURAL(htable_count(qi->substrings)),
+			PLURAL(qi->touched));
+	}
+}
+
+/**
+ * Release the QRP index.
+ */
+static void
+qrp_index_free(void)
+{
+	struct qrp_index *qi = &qrp_index;
 
-	return u.head;
+	qrp_dispose_words(&qi->words);
+	qrp_dispose_words(&qi->substrings);
+	HFREE_NULL(qi->slot_refs);
+	qi->bits = qi->filled = 0;
 }
 
 /*
@@ -1891,18 +2526,14 @@ struct qrp_context {
 	enum qrp_magic magic;
 	struct routing_table **rtp;	/**< Points to routing table variable to fill */
 	struct routing_patch **rpp;	/**< Points to routing patch variable to fill */
-	pslist_t *sl_substrings;	/**< List of all substrings */
-	htable_t *words;			/**< Words making up the files */
 	bgtask_t *compress_bt;		/**< Task launched to compress patch */
-	int substrings;				/**< Amount of substrings */
-	char *table;				/**< Computed routing table */
+	uint8 *table;				/**< Computed routing table (compacted) */
 	int slots;					/**< Amount of slots in table */
+	int bits;					/**< Table size being tried, as a power of 2 */
+	bool rebuild;				/**< Whether to recompute table size */
 	struct routing_table *rt;	/**< The routing table object we computed */
 	struct routing_table *st;	/**< Smaller table */
 	struct routing_table *lt;	/**< Larger table for merging (destination) */
-	int sidx;					/**< Source index in `st' */
-	int lidx;					/**< Merging index in `lt' */
-	int expand;					/**< Expansion ratio from `st' to `lt' */
 	int npatch;					/**< Index of next patch to compute */
 	struct qrt_compress_context compress_ctx;
 };
@@ -1911,8 +2542,9 @@ static struct bgtask *qrp_comp;	/**< Background computation handle */
 static struct bgtask *qrp_merge;/**< Background merging handle */
 
 /**
- * Free the "seen words" hash table we're filling up in qrp_add_file()
- * and perusing in qrp_finalize_computation(), then nullify pointer.
+ * Free the word hash table we're filling up in qrp_add_file() and
+ * qrp_remove_file() and perusing in qrp_finalize_computation(), then
+ * nullify pointer.
  */
 void
 qrp_dispose_words(htable_t **h_ptr)
@@ -1932,22 +2564,9 @@ static void
 qrp_context_free(void *p)
 {
 	struct qrp_context *ctx = p;
-	pslist_t *sl;
 
 	g_assert(ctx->magic == QRP_MAGIC);
 
-	qrp_dispose_words(&ctx->words);
-
-	PSLIST_FOREACH(ctx->sl_substrings, sl) {
-		char *word = sl->data;
-		size_t size;
-
-		size = 1 + vstrlen(word);
-		g_assert(size_is_positive(size));
-		wfree(word, size);
-	}
-	pslist_free_null(&ctx->sl_substrings);
-
 	HFREE_NULL(ctx->table);
 
 	if (ctx->rt)
@@ -2005,35 +2624,13 @@ qrp_cancel_computation(void)
 }
 
 /**
- * Compute all the substrings we need to insert.
- */
-static bgret_t
-qrp_step_substring(struct bgtask *unused_h, void *u, int unused_ticks)
-{
-	struct qrp_context *ctx = u;
-
-	(void) unused_h;
-	(void) unused_ticks;
-	g_assert(ctx->magic == QRP_MAGIC);
-	g_assert(ctx->words != NULL);
-
-	ctx->sl_substrings = unique_substrings(ctx->words, &ctx->substrings);
-	qrp_dispose_words(&ctx->words);
-
-	if (qrp_debugging(1))
-		g_debug("QRP unique subwords: %d", ctx->substrings);
-
-	return BGR_NEXT;		/* All done for this step */
-}
-
-/**
- * Compare possibly compacted table `rt' with expanded table arena `arena'
- * having `slots' slots.
+ * Compare compacted table arena `arena' having `slots' slots with the
+ * possibly compacted table `rt'.
  *
  * @returns whether tables are identical.
  */
 static bool
-qrt_eq(const struct routing_table *rt, const char *arena, int slots)
+qrt_eq(const struct routing_table *rt, const uint8 *arena, int slots)
 {
 	int i;
 
@@ -2044,12 +2641,12 @@ qrt_eq(const struct routing_table *rt, const char *arena, int slots)
 	if (rt->slots != slots)
 		return FALSE;
 
-	if (!rt->compacted)
-		return 0 == memcmp(rt->arena, arena, slots);
+	if (rt->compacted)
+		return 0 == memcmp(rt->arena, arena, slots / 8);
 
 	for (i = 0; i < slots; i++) {
-		bool s1 = RT_SLOT_READ(rt->arena, i);
-		bool s2 = arena[i] != LOCAL_INFINITY;
+		bool s1 = rt->arena[i] != rt->infinity;
+		bool s2 = RT_SLOT_READ(arena, i);
 		if (!s1 != !s2)
 			return FALSE;
 	}
@@ -2057,6 +2654,37 @@ qrt_eq(const struct routing_table *rt, const char *arena, int slots)
 	return TRUE;
 }
 
+/**
+ * Compute the insertion conflict ratio of a table.
+ *
+ * @param substrings	amount of substrings hashed
+ * @param filled		amount of slots filled
+ *
+ * @return conflict ratio, as a percentage.
+ */
+static int
+qrp_conflict_ratio(int substrings, int filled)
+{
+	return 0 == substrings ? 0 :
+		(int) (100.0 * (substrings - filled) / substrings);
+}
+
+/**
+ * Is table of 2^bits slots filled with `filled' slots for `substrings'
+ * hashed substrings acceptable?
+ */
+static bool
+qrp_table_acceptable(int bits, int filled, int substrings)
+{
+	if (bits >= MAX_TABLE_BITS)
+		return TRUE;
+
+	if (100 * filled > MIN_SPARSE_RATIO * (1 << bits))
+		return FALSE;		/* Table is full */
+
+	return qrp_conflict_ratio(substrings, filled) < MAX_CONFLICT_RATIO;
+}
+
 /**
  * Compute QRP table, iteration step.
  */
@@ -2064,134 +2692,186 @@ static bgret_t
 qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
-	char *table = NULL;
+	struct qrp_index *qi = &qrp_index;
+	uint8 *table = NULL;
 	int slots;
 	int bits;
-	const pslist_t *sl;
 	int upper_thresh;
 	int hashed = 0;
 	int filled = 0;
+	int substrings;
 	int conflict_ratio;
+	int i;
 	bool full = FALSE;
 
 	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
+	g_assert(qi->substrings != NULL);
+
+	substrings = htable_count(qi->substrings);
+
+	/*
+	 * The first time, see whether the slots we maintain incrementally in
+	 * the index are still suitable for the current amount of substrings.
+	 * If they are, we're done, we do not need to hash all the substrings.
+	 */
+
+	if (0 == ctx->bits) {
+		ctx->bits = MIN_TABLE_BITS;
+
+		if (
+			!ctx->rebuild && qi->bits != 0 &&
+			qrp_table_acceptable(qi->bits, qi->filled, substrings)
+		) {
+			bits = qi->bits;
+			filled = qi->filled;
+			hashed = substrings;
+			slots = 1 << bits;
+
+			if (qrp_debugging(1)) {
+				g_debug("QRP incremental update: size=%d, filled=%d, "
+					"changed=%d", slots, filled, qi->touched);
+			}
+			goto keep;
+		}
+	}
 
 	/*
 	 * Build QR table: we try to achieve a minimum sparse ratio (empty
 	 * slots filled with INFINITY) whilst limiting the size of the table,
 	 * so we incrementally try and double the size until we reach the maximum.
+	 *
+	 * The table records how many substrings hash to each slot, so that we
+	 * can later update it incrementally when substrings come and go.
 	 */
 
-	bits = MIN_TABLE_BITS + bg_task_seqno(h);
+	bits = ctx->bits++;
 	slots = 1 << bits;
 
 	upper_thresh = MIN_SPARSE_RATIO * slots;
 
-	table = halloc(slots);
-	memset(table, LOCAL_INFINITY, slots);
+	{
+		uint32 *refs = halloc0(slots * sizeof refs[0]);
+		htable_iter_t *iter = htable_iter_new(qi->substrings);
+		const void *key;
 
-	PSLIST_FOREACH(ctx->sl_substrings, sl) {
-		const char *word = sl->data;
-		uint idx = qrp_hash(word, bits);
+		while (htable_iter_next(iter, &key, NULL)) {
+			const char *word = key;
+			uint idx = qrp_hash(word, bits);
 
-		hashed++;
+			hashed++;
 
-		if (table[idx] == LOCAL_INFINITY) {
-			table[idx] = 1;
-			filled++;
-			if (qrp_debugging(7))
-				g_debug("QRP added subword: \"%s\"", word);
+			if (0 == refs[idx]++) {
+				filled++;
+				if (qrp_debugging(7))
+					g_debug("QRP added subword: \"%s\"", word);
+			}
+
+			/*
+			 * We won't be removing the slot we already filled, so if we
+			 * already filled more than our threshold ratio, there's no
+			 * need to continue: the table is full and we must double the
+			 * size -- unless we've reached our maximum size.
+			 */
+
+			if (bits < MAX_TABLE_BITS && 100*filled > upper_thresh) {
+				full = TRUE;
+				break;
+			}
 		}
 
+		htable_iter_release(&iter);
+
+		conflict_ratio = qrp_conflict_ratio(substrings, filled);
+
+		if (qrp_debugging(1))
+			g_debug("QRP [seqno=%d] size=%d, filled=%d, hashed=%d, "
+				"ratio=%d%%, conflicts=%d%%%s",
+				bg_task_seqno(h), slots, filled, hashed,
+				(int) (100.0 * filled / slots),
+				conflict_ratio, full ? " FULL" : "");
+
 		/*
-		 * We won't be removing the slot we already filled, so if we
-		 * already filled more than our threshold ratio, there's no
-		 * need to continue: the table is full and we must double the
-		 * size -- unless we've reached our maximum size.
+		 * Decide whether we can keep the table we've just built.
 		 */
 
-		if (bits < MAX_TABLE_BITS && 100*filled > upper_thresh) {
-			full = TRUE;
-			break;
+		if (
+			bits < MAX_TABLE_BITS &&
+			(full || conflict_ratio >= MAX_CONFLICT_RATIO)
+		) {
+			HFREE_NULL(refs);
+			return BGR_MORE;			/* More work required */
 		}
-	}
 
-	conflict_ratio = ctx->substrings == 0 ? 0 :
-		(int) (100.0 * (ctx->substrings - filled) / ctx->substrings);
+		HFREE_NULL(qi->slot_refs);
+		qi->slot_refs = refs;
+		qi->bits = bits;
+		qi->filled = filled;
+	}
 
+keep:
 	if (qrp_debugging(1))
-		g_debug("QRP [seqno=%d] size=%d, filled=%d, hashed=%d, "
-			"ratio=%d%%, conflicts=%d%%%s",
-			bg_task_seqno(h), slots, filled, hashed,
-			(int) (100.0 * filled / slots),
-			conflict_ratio, full ? " FULL" : "");
+		g_debug("QRP final table size: %d slots", slots);
+
+	conflict_ratio = qrp_conflict_ratio(substrings, filled);
+
+	gnet_prop_set_guint32_val(PROP_QRP_SLOTS, (uint32) slots);
+	gnet_prop_set_guint32_val(PROP_QRP_SLOTS_FILLED, (uint32) filled);
+	gnet_prop_set_guint32_val(PROP_QRP_HASHED_KEYWORDS, (uint32) hashed);
+	gnet_prop_set_guint32_val(PROP_QRP_FILL_RATIO,
+		(uint32) (100.0 * filled / slots));
+	gnet_prop_set_guint32_val(PROP_QRP_CONFLICT_RATIO,
+		(uint32) conflict_ratio);
 
 	/*
-	 * Decide whether we can keep the table we've just built.
+	 * Build the compacted table from the slot reference counts.
 	 */
 
-	if (
-		bits >= MAX_TABLE_BITS ||
-		(!full && conflict_ratio < MAX_CONFLICT_RATIO)
-	) {
-		if (qrp_debugging(1))
-			g_debug("QRP final table size: %d slots", slots);
+	table = halloc0(slots / 8);
 
-		gnet_prop_set_guint32_val(PROP_QRP_SLOTS, (uint32) slots);
-		gnet_prop_set_guint32_val(PROP_QRP_SLOTS_FILLED, (uint32) filled);
-		gnet_prop_set_guint32_val(PROP_QRP_HASHED_KEYWORDS, (uint32) hashed);
-		gnet_prop_set_guint32_val(PROP_QRP_FILL_RATIO,
-			(uint32) (100.0 * filled / slots));
-		gnet_prop_set_guint32_val(PROP_QRP_CONFLICT_RATIO,
-			(uint32) conflict_ratio);
+	for (i = 0; i < slots; i++) {
+		if (qi->slot_refs[i] != 0)
+			table[i >> 3] |= 0x80U >> (i & 0x7);
+	}
 
-		/*
-		 * If we had already a table, compare it to the one we just built.
-		 * If they are identical, discard the new one.
-		 *
-		 * Can't do a direct memcmp() on the tables though, as the routing
-		 * table arena may be compressed and our table is not.
-		 */
+	/*
+	 * If we had already a table, compare it to the one we just built.
+	 * If they are identical, discard the new one.
+	 */
 
-		if (routing_table != NULL) {
-			if (routing_table->cancelled) {
-				/*
-				 * Routing table was canceleld because the computation of the
-				 * global routing patch was cancelled when we began a new
-				 * computation.  Therefore, even if the new table is the same
-				 * as the old one, we need to keep the new one and continue
-				 * the process to propagate the table to our Gnutella peers
-				 * and recompute the default patch.
-				 *		--RAM, 2011-05-16
-				 */
-				if (qrp_debugging(1)) {
-					g_debug("QRP table at generation #%d was cancelled",
-						routing_table->generation);
-				}
-			} else if (qrt_eq(routing_table, table, slots)) {
-				if (qrp_debugging(1)) {
-					g_debug("QRP no change in table, keeping generation #%d",
-						routing_table->generation);
-				}
-				HFREE_NULL(table);
-				bg_task_exit(h, 0);	/* Abort processing */
+	if (routing_table != NULL) {
+		if (routing_table->cancelled) {
+			/*
+			 * Routing table was canceleld because the computation of the
+			 * global routing patch was cancelled when we began a new
+			 * computation.  Therefore, even if the new table is the same
+			 * as the old one, we need to keep the new one and continue
+			 * the process to propagate the table to our Gnutella peers
+			 * and recompute the default patch.
+			 *		--RAM, 2011-05-16
+			 */
+			if (qrp_debugging(1)) {
+				g_debug("QRP table at generation #%d was cancelled",
+					routing_table->generation);
 			}
+		} else if (qrt_eq(routing_table, table, slots)) {
+			if (qrp_debugging(1)) {
+				g_debug("QRP no change in table, keeping generation #%d",
+					routing_table->generation);
+			}
+			HFREE_NULL(table);
+			bg_task_exit(h, 0);	/* Abort processing */
 		}
-
-		/*
-		 * OK, we keep the table.
-		 */
-
-		ctx->table = table;
-		ctx->slots = slots;
-
-		return BGR_NEXT;		/* Done! */
 	}
 
-	HFREE_NULL(table);
+	/*
+	 * OK, we keep the table.
+	 */
+
+	ctx->table = table;
+	ctx->slots = slots;
 
-	return BGR_MORE;			/* More work required */
+	return BGR_NEXT;		/* Done! */
 }
 
 /**
@@ -2212,7 +2892,7 @@ qrp_step_create_table(struct bgtask *unused_h, void *u, int unused_ticks)
 	 * Install new routing table and notify the nodes that it has changed.
 	 */
 
-	ctx->rt = qrt_create("Local table", ctx->table, ctx->slots, LOCAL_INFINITY);
+	ctx->rt = qrt_create_compacted("Local table", ctx->table, ctx->slots);
 	qrt_ref(ctx->rt);		/* Created with refcnt=0 */
 	ctx->table = NULL;		/* Don't free table when freeing context */
 
@@ -2415,7 +3095,6 @@ static bgret_t
 qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
-	int ratio;
 
 	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
@@ -2446,8 +3125,8 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 	 * Prepare the iteration for the next step.
 	 *
 	 * Identify the smallest of the two tables, and put the smallest in `st'
-	 * and the largest in `lt'.  Then compute the expansion factor between
-	 * the two and allocate the arena for the merging.
+	 * and the largest in `lt'.  The merging arena starts as a copy of the
+	 * compacted larger table, into which the smaller one gets OR-ed.
 	 */
 
 	g_assert(local_table != NULL);
@@ -2463,17 +3142,11 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 		ctx->lt = qrt_ref(local_table);
 	}
 
-	ratio = highest_bit_set(ctx->lt->slots) - highest_bit_set(ctx->st->slots);
-
-	g_assert(ratio >= 0);		/* By construction, lt is larger than st */
-
-	ctx->expand = 1 << ratio;
-	ctx->sidx = ctx->lidx = 0;
-
+	g_assert(ctx->lt->compacted);
+	g_assert(ctx->lt->slots >= ctx->st->slots);
 	g_assert(ctx->table == NULL);
 
-	ctx->table = halloc(ctx->slots);
-	memset(ctx->table, LOCAL_INFINITY, ctx->slots);
+	ctx->table = hcopy(ctx->lt->arena, ctx->slots / 8);
 
 	/* Ready for iterating */
 
@@ -2484,18 +3157,14 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
  * Merge `local_table' with `merged_table'.
  */
 static bgret_t
-qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int ticks)
+qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
-	int used;
 	struct routing_table *st = ctx->st;
 	struct routing_table *lt = ctx->lt;
-	int max;
-	int i = ctx->sidx;
-	int expand = ctx->expand;
-	int j;
 
 	(void) unused_h;
+	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
 
 	/*
@@ -2510,29 +3179,16 @@ qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int ticks)
 	g_assert(st->compacted);
 	g_assert(lt->compacted);
 
-	max = st->slots;
-
-	for (used = 0; used < ticks && i < max; i++, used++, ctx->sidx++) {
-		bool vs = RT_SLOT_READ(st->arena, i);
-
-		/*
-		 * Since `lt', the larger table, has the same size as the merged
-		 * table, the `ctx->lidx' also points to the next area to be merged
-		 * in the result.
-		 */
-
-		g_assert(ctx->lidx + expand <= lt->slots);	/* Won't overflow */
+	/*
+	 * Since `lt', the larger table, has the same size as the merged
+	 * table, our arena already holds its slots: we only need to OR-in
+	 * the expanded smaller table, which is done in compacted form and is
+	 * fast enough to not require splitting the work across several ticks.
+	 */
 
-		for (j = 0; j < expand; j++) {
-			bool vl = RT_SLOT_READ(lt->arena, ctx->lidx);
-			if (vl || vs)
-				ctx->table[ctx->lidx++] = 0;	/* Present, less than oo */
-			else
-				ctx->table[ctx->lidx++] = LOCAL_INFINITY;	/* Absent => oo */
-		}
-	}
+	qrt_merge_packed(ctx->table, ctx->slots, st);
 
-	return (ctx->sidx < max) ? BGR_MORE : BGR_NEXT;
+	return BGR_NEXT;
 }
 
 /**
@@ -2568,7 +3224,7 @@ qrp_step_install_ultra(struct bgtask *h, void *u, int ticks)
 
 	if (ctx->slots > MAX_UP_TABLE_SIZE) {
 		ctx->table = qrt_shrink_arena(
-			ctx->table, ctx->slots, MAX_UP_TABLE_SIZE, LOCAL_INFINITY);
+			ctx->table, ctx->slots, MAX_UP_TABLE_SIZE);
 		ctx->slots = MAX_UP_TABLE_SIZE;
 	}
 
@@ -2576,7 +3232,8 @@ qrp_step_install_ultra(struct bgtask *h, void *u, int ticks)
 	 * Install merged table as `routing_table'.
 	 */
 
-	rt = qrt_create("Routing table", ctx->table, ctx->slots, LOCAL_INFINITY);
+	rt = qrt_create_compacted("Routing table",
+		ctx->table, ctx->slots);
 	ctx->table = NULL;			/* Don't free arena when freeing context */
 
 	install_routing_table(rt);
@@ -2592,7 +3249,6 @@ qrp_step_install_ultra(struct bgtask *h, void *u, int ticks)
 }
 
 static bgstep_cb_t qrp_compute_steps[] = {
-	qrp_step_substring,
 	qrp_step_compute,
 	qrp_step_create_table,
 	qrp_step_create_patches,
@@ -2643,14 +3299,28 @@ qrp_comp_done(bgtask_t *bt, void *p, bgstatus_t u_status, void *u_arg)
  * If the routing table has changed, the node_qrt_changed() routine will
  * be called once we have finished its computation.
  *
+ * When `reset' is FALSE, `words' only holds the changes made through
+ * qrp_add_file() and qrp_remove_file() since the last finalized computation,
+ * and only the slots touched by these words are updated.  Otherwise, all
+ * the shared files were added and `words' supersedes the previous set.
+ *
  * @param words		the words making up the filenames (takes ownership of it)
+ * @param reset		whether all the shared files were added to `words'
  */
 void
-qrp_finalize_computation(htable_t *words)
+qrp_finalize_computation(htable_t *words, bool reset)
 {
 	struct qrp_context *ctx;
 
 	g_assert(words != NULL);
+	g_assert(thread_is_main());
+
+	/*
+	 * The index is updated synchronously, so that a cancelled computation
+	 * does not lose the changes: only the table computation is deferred.
+	 */
+
+	qrp_index_update(words, reset);
 
 	/*
 	 * Because QRP computation is possibly a CPU-intensive operation, it
@@ -2661,7 +3331,7 @@ qrp_finalize_computation(htable_t *words)
 	WALLOC0(ctx);
 	ctx->magic = QRP_MAGIC;
 	ctx->rtp = &local_table;	/* NOT routing_table, this is for local files */
-	ctx->words = words;			/* Will free it, caller must forget about it */
+	ctx->rebuild = reset;
 
 	gnet_prop_set_timestamp_val(PROP_QRP_TIMESTAMP, tm_time());
 
@@ -5115,6 +5785,8 @@ qrp_close(void)
 	if (merged_table)
 		qrt_unref(merged_table);
 
+	qrp_index_free();
+	qrt_compress_workers_close();
 	HFREE_NULL(buffer.arena);
 }
 
@@ -79,7 +79,8 @@ void qrp_peermode_changed(void);
 
 void qrp_prepare_computation(void);
 void qrp_add_file(const struct shared_file *sf, struct htable *words);
-void qrp_finalize_computation(struct htable *words);
+void qrp_remove_file(const struct shared_file *sf, struct htable *words);
+void qrp_finalize_computation(struct htable *words, bool reset);
 void qrp_dispose_words(struct htable **h_ptr);
 
 struct qrt_update *qrt_update_create(struct gnutella_node *n,
@@ -56,9 +56,11 @@
 #include "lib/host_addr.h"
 #include "lib/hset.h"
 #include "lib/htable.h"
+#include "lib/pow2.h"
 #include "lib/pslist.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/walloc.h"
 
@@ -96,6 +98,7 @@ routing_udp_node_check(const struct routing_udp_node * const un)
 }
 
 #define ROUTE_UDP_LIFETIME	180		/**< Keep UDP routes for 3 minutes */
+#define ROUTE_INLINE		2		/**< Routes stored within message entry */
 
 /**
  * An entry in the routing table.
@@ -107,17 +110,121 @@ routing_udp_node_check(const struct routing_udp_node * const un)
  * Query hit routes and push routes are precious, therefore they are
  * moved to the tail of the "message_array[]" when they get used to increase
  * their liftime.
+ *
+ * The routes (along with the TTL seen on each route) are stored inline in
+ * the entry, since most messages reach us through one or two nodes only.
+ * When more routes are needed, they spill into a separately allocated array
+ * holding the route_data pointers followed by the TTLs.
  */
 struct message {
 	struct guid muid;		/**< Message UID */
 	struct message **slot;	/**< Place where we're referenced from */
-	pslist_t *routes;		/**< route_data from where the message came */
-	pslist_t *ttls;			/**< For broadcasted messages: TTL by route */
+	union {
+		struct route_data *inline_routes[ROUTE_INLINE];
+		struct route_data **spilled;
+	} r;					/**< route_data from where the message came */
+	uint8 inline_ttls[ROUTE_INLINE];	/**< TTL by route, when inlined */
+	uint8 nroutes;			/**< Amount of routes */
+	uint8 rcap;				/**< Capacity of spilled routes, 0 if inlined */
 	uint8 function;			/**< Type of the message */
 	uint8 ttl;				/**< Max TTL we saw for this message */
 	uint8 chunk_idx;		/**< Index of chunk holding the slot */
+	uint8 shard;			/**< Index of shard holding the message */
 };
 
+/**
+ * @return the array of routes for the message.
+ */
+static inline struct route_data **
+message_routes(struct message *m)
+{
+	return 0 == m->rcap ? m->r.inline_routes : m->r.spilled;
+}
+
+/**
+ * @return the array of TTLs for each of the routes of the message.
+ */
+static inline uint8 *
+message_ttls(struct message *m)
+{
+	return 0 == m->rcap ?
+		m->inline_ttls : (uint8 *) &m->r.spilled[m->rcap];
+}
+
+/**
+ * @return whether message has any route recorded.
+ */
+static inline bool
+message_has_routes(const struct message *m)
+{
+	return 0 != m->nroutes;
+}
+
+/**
+ * Resize the spilled route array to hold the given amount of routes.
+ */
+static void
+message_routes_resize(struct message *m, uint cap)
+{
+	struct route_data **routes;
+
+	g_assert(cap > ROUTE_INLINE);
+	g_assert(cap <= MAX_INT_VAL(uint8));
+	g_assert(cap >= m->nroutes);
+
+	routes = halloc(cap * (sizeof routes[0] + sizeof(uint8)));
+
+	memcpy(routes, message_routes(m), m->nroutes * sizeof routes[0]);
+	memcpy(&routes[cap], message_ttls(m), m->nroutes * sizeof(uint8));
+
+	if (m->rcap != 0)
+		hfree(m->r.spilled);
+
+	m->r.spilled = routes;
+	m->rcap = cap;
+}
+
+/**
+ * Append route to the message, along with the TTL seen on that route.
+ *
+ * @return TRUE if the route was recorded.
+ */
+static bool
+message_route_append(struct message *m, struct route_data *rd, uint8 ttl)
+{
+	uint cap = 0 == m->rcap ? ROUTE_INLINE : m->rcap;
+
+	if G_UNLIKELY(m->nroutes == cap) {
+		if G_UNLIKELY(MAX_INT_VAL(uint8) == cap)
+			return FALSE;
+		message_routes_resize(m, MIN(2 * cap, MAX_INT_VAL(uint8)));
+	}
+
+	message_routes(m)[m->nroutes] = rd;
+	message_ttls(m)[m->nroutes] = ttl;
+	m->nroutes++;
+
+	return TRUE;
+}
+
+/**
+ * Remove the route at the given index, preserving the order of the others.
+ */
+static void
+message_route_remove(struct message *m, uint i)
+{
+	struct route_data **routes = message_routes(m);
+	uint8 *ttls = message_ttls(m);
+	uint n;
+
+	g_assert(i < m->nroutes);
+
+	n = m->nroutes - i - 1;
+	memmove(&routes[i], &routes[i + 1], n * sizeof routes[0]);
+	memmove(&ttls[i], &ttls[i + 1], n * sizeof ttls[0]);
+	m->nroutes--;
+}
+
 /**
  * We don't store a list of nodes in the message structure, but a list of
  * route_data: the reason is that nodes can go away, but we don't want to
@@ -164,25 +271,268 @@ static const char *debug_msg[256];
  * Each chunk contains pointers to dynamically allocated message entries,
  * each pointer being called a "slot" whilst the message structure is called
  * the "entry".
+ *
+ * The table is partitioned into shards, based on the MUID hash.  Each shard
+ * has its own chunks, its own hash set and rotates independently, so that
+ * cycling over a shard only discards a fraction of the routing information
+ * at a time.  A shard is only ever accessed by the thread owning it, which
+ * is why no locking is necessary: to process messages in parallel, shards
+ * can be handed over to different threads without changing the routing
+ * logic.  For now, the main thread owns all the shards.
+ *
+ * The overall capacity is the same as the one of the former single table,
+ * each shard getting smaller chunks.
  */
 
-#define CHUNK_BITS			14 	  /**< log2 of # messages stored  in a chunk */
-#define MAX_CHUNKS			64	  /**< Max # of chunks */
+#define ROUTING_SHARD_BITS	3	  /**< log2 of # of shards */
+#define ROUTING_SHARDS		(1 << ROUTING_SHARD_BITS)
+
+#define CHUNK_BITS			(14 - ROUTING_SHARD_BITS) /**< log2 of chunk size */
+#define MAX_CHUNKS			64	  /**< Max # of chunks per shard */
 #define TABLE_MIN_CYCLE		3600  /**< 1 hour at least */
 
 #define CHUNK_MESSAGES		(1 << CHUNK_BITS)
 #define CHUNK_INDEX(x)		(((x) & ~(CHUNK_MESSAGES - 1)) >> CHUNK_BITS)
 #define ENTRY_INDEX(x)		((x) & (CHUNK_MESSAGES - 1))
 
-static struct {
+/*
+ * The messages held in a shard are indexed by an open-addressed hash table,
+ * using linear probing and backward-shift deletion (no tombstones).
+ *
+ * Each slot holds the hashed key and the message function along with the
+ * message entry, so that a lookup only needs to dereference the entry (to
+ * compare the MUID) when the 32-bit hash matches, i.e. almost only when it is
+ * the entry we are looking for, which the caller is going to access anyway.
+ * Slots are 16 bytes long, hence four slots share a cache line and a probe
+ * sequence rarely touches more than one line.
+ */
+
+#define ROUTE_IX_MIN		1024	/**< Minimum amount of index slots */
+
+struct route_ix_slot {
+	struct message *m;		/**< Message entry, NULL if slot is free */
+	uint32 hash;			/**< Hashed key */
+	uint8 function;			/**< Type of the message */
+};
+
+struct route_index {
+	struct route_ix_slot *slots;
+	size_t size;			/**< Amount of slots, a power of 2 */
+	size_t count;			/**< Amount of used slots */
+};
+
+/**
+ * Hash routing key.
+ */
+static inline uint32
+route_ix_hash(const struct guid *muid, uint8 function)
+{
+	return integer_hash_fast(function) ^ universal_hash(muid, GUID_RAW_SIZE);
+}
+
+/**
+ * Find slot holding given key.
+ *
+ * @return the slot index, or (size_t) -1 if not found.
+ */
+static size_t
+route_ix_find(const struct route_index *ix,
+	uint32 hash, const struct guid *muid, uint8 function)
+{
+	size_t mask = ix->size - 1;
+	size_t i;
+
+	for (i = hash & mask; /* empty */; i = (i + 1) & mask) {
+		const struct route_ix_slot *slot = &ix->slots[i];
+
+		if (NULL == slot->m)
+			return (size_t) -1;
+
+		if (
+			slot->hash == hash && slot->function == function &&
+			guid_eq(&slot->m->muid, muid)
+		)
+			return i;
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Store slot data in the first free slot of its probe sequence.
+ */
+static void
+route_ix_put(struct route_index *ix, const struct route_ix_slot *data)
+{
+	size_t mask = ix->size - 1;
+	size_t i;
+
+	for (i = data->hash & mask; ix->slots[i].m != NULL; i = (i + 1) & mask)
+		/* empty */;
+
+	ix->slots[i] = *data;
+}
+
+/**
+ * Allocate index with given amount of slots, re-inserting existing entries.
+ */
+static void
+route_ix_resize(struct route_index *ix, size_t size)
+{
+	struct route_ix_slot *old = ix->slots;
+	size_t i, osize = ix->size;
+
+	g_assert(is_pow2(size));
+	g_assert(size >= ROUTE_IX_MIN);
+	g_assert(ix->count < size);
+
+	ix->slots = halloc0(size * sizeof ix->slots[0]);
+	ix->size = size;
+
+	for (i = 0; i < osize; i++) {
+		if (old[i].m != NULL)
+			route_ix_put(ix, &old[i]);
+	}
+
+	HFREE_NULL(old);
+}
+
+/**
+ * Lookup message in the index.
+ *
+ * @return the message entry, NULL if not found.
+ */
+static struct message *
+route_ix_lookup(const struct route_index *ix,
+	const struct guid *muid, uint8 function)
+{
+	size_t i;
+
+	i = route_ix_find(ix, route_ix_hash(muid, function), muid, function);
+
+	return (size_t) -1 == i ? NULL : ix->slots[i].m;
+}
+
+/**
+ * Insert new message in the index, growing it when more than 3/4 full.
+ */
+static void
+route_ix_insert(struct route_index *ix, struct message *m)
+{
+	struct route_ix_slot data;
+
+	if G_UNLIKELY(4 * (ix->count + 1) > 3 * ix->size)
+		route_ix_resize(ix, 2 * ix->size);
+
+	data.m = m;
+	data.hash = route_ix_hash(&m->muid, m->function);
+	data.function = m->function;
+
+	g_assert((size_t) -1 == route_ix_find(ix, data.hash, &m->muid, m->function));
+
+	route_ix_put(ix, &data);
+	ix->count++;
+}
+
+/**
+ * Remove message from the index, if present.
+ *
+ * The following entries in the probe sequence are shifted backwards so that
+ * no tombstone is ever needed.
+ */
+static void
+route_ix_remove(struct route_index *ix, const struct message *m)
+{
+	size_t mask = ix->size - 1;
+	size_t i, j;
+
+	i = route_ix_find(ix,
+		route_ix_hash(&m->muid, m->function), &m->muid, m->function);
+
+	if ((size_t) -1 == i)
+		return;
+
+	g_assert(m == ix->slots[i].m);
+
+	for (j = (i + 1) & mask; ix->slots[j].m != NULL; j = (j + 1) & mask) {
+		size_t k = ix->slots[j].hash & mask;	/* Home slot */
+
+		/*
+		 * Entry at `j' can be moved to the hole at `i' only if its home
+		 * slot `k' does not lie cyclically within ]i, j].
+		 */
+
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		ix->slots[i] = ix->slots[j];
+		i = j;
+	}
+
+	ix->slots[i].m = NULL;
+	ix->count--;
+}
+
+/**
+ * Shrink index when it has become sparse, e.g. after clearing chunks.
+ */
+static void
+route_ix_shrink(struct route_index *ix)
+{
+	size_t size = ix->size;
+
+	while (size > ROUTE_IX_MIN && 8 * ix->count < size)
+		size /= 2;
+
+	if (size != ix->size)
+		route_ix_resize(ix, size);
+}
+
+/**
+ * @return amount of memory used by the index.
+ */
+static inline size_t
+route_ix_memory(const struct route_index *ix)
+{
+	return ix->size * sizeof ix->slots[0];
+}
+
+enum routing_shard_magic { ROUTING_SHARD_MAGIC = 0x5e2a7d19 };
+
+static struct routing_shard {
+	enum routing_shard_magic magic;
+	unsigned index;				 /**< Index of this shard */
+	unsigned owner;				 /**< Thread owning the shard */
 	struct message **chunks[MAX_CHUNKS];
 	int next_idx;				 /**< Next slot to use in "message_array[]" */
 	int capacity;				 /**< Capacity in terms of messages */
 	int count;					 /**< Amount really stored */
 	unsigned nchunks;			 /**< Amount of allocated chunks */
-	hset_t *messages_hashed;	 /**< All messages (key = struct message) */
+	struct route_index ix;		 /**< All messages, indexed by MUID */
 	time_t last_rotation;		 /**< Last time we restarted from idx=0 */
-} routing;
+} routing[ROUTING_SHARDS];
+
+static inline void
+routing_shard_check(const struct routing_shard * const rs)
+{
+	g_assert(rs != NULL);
+	g_assert(ROUTING_SHARD_MAGIC == rs->magic);
+	g_assert(thread_small_id() == rs->owner);
+}
+
+/**
+ * @return the routing table shard holding messages with given MUID.
+ */
+static inline struct routing_shard *
+routing_shard_get(const struct guid *muid)
+{
+	struct routing_shard *rs;
+
+	rs = &routing[guid_hash(muid) & (ROUTING_SHARDS - 1)];
+	routing_shard_check(rs);
+
+	return rs;
+}
 
 /**
  * "banned" GUIDs for push routing.
@@ -829,16 +1179,17 @@ init_routing_data(gnutella_node_t *node)
  * Make sure slot belongs to specified chunk index.
  */
 static void
-slot_check(struct message * const * const slot, unsigned chunk_idx)
+slot_check(const struct routing_shard *rs,
+	struct message * const * const slot, unsigned chunk_idx)
 {
 	const void *chunk_base;
 	const void *chunk_end;
 
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk_idx < routing.nchunks);
+	g_assert(chunk_idx < rs->nchunks);
 
-	chunk_base = routing.chunks[chunk_idx];
+	chunk_base = rs->chunks[chunk_idx];
 	chunk_end = const_ptr_add_offset(chunk_base, CHUNK_MESSAGES * sizeof *slot);
 
 	g_assert(ptr_cmp(slot, chunk_base) >= 0);
@@ -849,10 +1200,12 @@ slot_check(struct message * const * const slot, unsigned chunk_idx)
  * Asserts that a message entry is consistent and belongs to the correct chunk.
  */
 static void
-message_check(const struct message * const m, unsigned chunk_idx)
+message_check(const struct routing_shard *rs,
+	const struct message * const m, unsigned chunk_idx)
 {
 	g_assert(m != NULL);
-	slot_check(m->slot, chunk_idx);
+	g_assert(rs->index == m->shard);
+	slot_check(rs, m->slot, chunk_idx);
 	g_assert(chunk_idx == m->chunk_idx);
 }
 
@@ -864,7 +1217,8 @@ message_check(const struct message * const m, unsigned chunk_idx)
  * to reflect the new chunk location).
  */
 static void
-message_check_chunk(const struct message * const m, unsigned chunk_idx,
+message_check_chunk(const struct routing_shard *rs,
+	const struct message * const m, unsigned chunk_idx,
 	struct message * const *chunk)
 {
 	const void *chunk_end;
@@ -873,13 +1227,13 @@ message_check_chunk(const struct message * const m, unsigned chunk_idx,
 	g_assert(chunk_idx == m->chunk_idx);
 
 	/*
-	 * Expand a variant of slot_check() since routing.chunks[chunk_idx]
+	 * Expand a variant of slot_check() since rs->chunks[chunk_idx]
 	 * has been re-allocated and the old chunk address is given.
 	 */
 
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk_idx < routing.nchunks);
+	g_assert(chunk_idx < rs->nchunks);
 
 	chunk_end = const_ptr_add_offset(chunk, CHUNK_MESSAGES * sizeof m);
 
@@ -891,17 +1245,17 @@ message_check_chunk(const struct message * const m, unsigned chunk_idx,
  * Clean already allocated entry.
  */
 static void
-clean_entry(struct message *entry)
+clean_entry(struct routing_shard *rs, struct message *entry)
 {
 	g_assert(entry != NULL);
 
-	hset_remove(routing.messages_hashed, entry);
+	route_ix_remove(&rs->ix, entry);
 
-	if (entry->routes != NULL)
+	if (message_has_routes(entry) || entry->rcap != 0)
 		free_route_list(entry);
 
-	g_assert(entry->ttls == NULL);		/* Cleaned by free_route_list() */
-	g_assert(entry->routes == NULL);	/* Idem */
+	g_assert(0 == entry->nroutes);		/* Cleaned by free_route_list() */
+	g_assert(0 == entry->rcap);			/* Idem */
 
 	entry->ttl = 0;
 }
@@ -913,7 +1267,8 @@ clean_entry(struct message *entry)
  * @return message entry to use
  */
 static struct message *
-prepare_entry(struct message **entryp, unsigned chunk_idx)
+prepare_entry(struct routing_shard *rs,
+	struct message **entryp, unsigned chunk_idx)
 {
 	struct message *entry = *entryp;
 
@@ -921,14 +1276,15 @@ prepare_entry(struct message **entryp, unsigned chunk_idx)
 
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	slot_check(entryp, chunk_idx);
+	slot_check(rs, entryp, chunk_idx);
 
 	if (entry == NULL) {
 		WALLOC0(entry);
 		*entryp = entry;
 		entry->slot = entryp;
 		entry->chunk_idx = chunk_idx;	/* 8-bit value, must fit */
-		routing.count++;
+		entry->shard = rs->index;		/* Idem */
+		rs->count++;
 		gnet_stats_inc_general(GNR_ROUTING_TABLE_COUNT);
 		goto done;
 	}
@@ -941,7 +1297,7 @@ prepare_entry(struct message **entryp, unsigned chunk_idx)
 
 	g_assert(entryp == entry->slot);	/* Invariant we ensure */
 
-	clean_entry(entry);
+	clean_entry(rs, entry);
 
 	/*
 	 * Attempt to move the object around if it can help compacting.
@@ -959,7 +1315,7 @@ prepare_entry(struct message **entryp, unsigned chunk_idx)
 
 done:
 	g_assert(entryp == entry->slot);
-	message_check(entry, chunk_idx);
+	message_check(rs, entry, chunk_idx);
 
 	return entry;
 }
@@ -969,7 +1325,8 @@ done:
  * can relocate a fragment.
  */
 static struct message **
-routing_chunk_move(struct message **chunk, unsigned chunk_idx)
+routing_chunk_move(struct routing_shard *rs,
+	struct message **chunk, unsigned chunk_idx)
 {
 	struct message **nchunk;
 	struct message **p;
@@ -978,7 +1335,7 @@ routing_chunk_move(struct message **chunk, unsigned chunk_idx)
 	g_assert(chunk != NULL);
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk == routing.chunks[chunk_idx]);
+	g_assert(chunk == rs->chunks[chunk_idx]);
 
 	nchunk = hrealloc(chunk, CHUNK_MESSAGES * sizeof(struct message *));
 	if (nchunk == chunk)
@@ -989,20 +1346,20 @@ routing_chunk_move(struct message **chunk, unsigned chunk_idx)
 	 */
 
 	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT moving chunk #%u from %p to %p",
-			chunk_idx, (void *) chunk, (void *) nchunk);
+		g_debug("RT shard #%u moving chunk #%u from %p to %p",
+			rs->index, chunk_idx, (void *) chunk, (void *) nchunk);
 	}
 
 	for (p = &nchunk[0], i = 0; i < CHUNK_MESSAGES; i++, p++) {
 		struct message *m = *p;
 
 		if (m != NULL) {
-			message_check_chunk(m, chunk_idx, chunk);
+			message_check_chunk(rs, m, chunk_idx, chunk);
 			m->slot = p;
 		}
 	}
 
-	return routing.chunks[chunk_idx] = nchunk;
+	return rs->chunks[chunk_idx] = nchunk;
 }
 
 /**
@@ -1012,12 +1369,12 @@ routing_chunk_move(struct message **chunk, unsigned chunk_idx)
  * VM space for more volatile data and possibly defragmenting.
  */
 static void
-routing_chunk_move_attempt(void)
+routing_chunk_move_attempt(struct routing_shard *rs)
 {
 	size_t i;
 
-	for (i = 0; i < routing.nchunks; i++) {
-		routing.chunks[i] = routing_chunk_move(routing.chunks[i], i);
+	for (i = 0; i < rs->nchunks; i++) {
+		rs->chunks[i] = routing_chunk_move(rs, rs->chunks[i], i);
 	}
 }
 
@@ -1026,17 +1383,17 @@ routing_chunk_move_attempt(void)
  * next available slot.
  */
 static void
-advance_slot(void)
+advance_slot(struct routing_shard *rs)
 {
 	/*
 	 * It's OK to go beyond the last allocated chunk (a new chunk will
 	 * be allocated next time) unless we already reached the last chunk.
 	 */
 
-	routing.next_idx++;
+	rs->next_idx++;
 
-	if (CHUNK_INDEX(routing.next_idx) >= MAX_CHUNKS)
-		routing.next_idx = 0;		/* Will force cycling over next time */
+	if (CHUNK_INDEX(rs->next_idx) >= MAX_CHUNKS)
+		rs->next_idx = 0;		/* Will force cycling over next time */
 }
 
 /**
@@ -1045,48 +1402,72 @@ advance_slot(void)
  * @param idx	the index of the first chunk to clear
  */
 static void
-routing_clear(unsigned idx)
+routing_clear(struct routing_shard *rs, unsigned idx)
 {
 	size_t i;
+	int freed = 0;
 
-	for (i = idx; i < routing.nchunks; i++) {
-		struct message **rchunk = routing.chunks[i];
+	for (i = idx; i < rs->nchunks; i++) {
+		struct message **rchunk = rs->chunks[i];
 		size_t j;
 
 		if (GNET_PROPERTY(routing_debug)) {
-			g_debug("RT freeing chunk #%zu at %p, now holds %d / %d",
-				i, (void *) rchunk, routing.count, routing.capacity);
+			g_debug("RT shard #%u freeing chunk #%zu at %p, now holds %d / %d",
+				rs->index, i, (void *) rchunk, rs->count, rs->capacity);
 		}
 
 		for (j = 0; j < CHUNK_MESSAGES; j++) {
 			struct message *m = rchunk[j];
 
 			if (m != NULL) {
-				message_check(m, i);
+				message_check(rs, m, i);
 				g_assert(m->slot == &rchunk[j]);
-				clean_entry(m);
+				clean_entry(rs, m);
 				WFREE(m);
-				routing.count--;
+				rs->count--;
+				freed++;
 			}
 		}
 
-		routing.capacity -= CHUNK_MESSAGES;
-		HFREE_NULL(routing.chunks[i]);
+		rs->capacity -= CHUNK_MESSAGES;
+		HFREE_NULL(rs->chunks[i]);
+	}
+
+	/*
+	 * Statistics cover all the shards, hence are updated incrementally.
+	 */
+
+	if (rs->nchunks > idx) {
+		int n = rs->nchunks - idx;
+
+		gnet_stats_count_general(GNR_ROUTING_TABLE_CHUNKS, -n);
+		gnet_stats_count_general(GNR_ROUTING_TABLE_CAPACITY,
+			-n * CHUNK_MESSAGES);
+		gnet_stats_count_general(GNR_ROUTING_TABLE_COUNT, -freed);
 	}
 
-	routing.nchunks = idx;
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CHUNKS, routing.nchunks);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CAPACITY, routing.capacity);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_COUNT, routing.count);
+	rs->nchunks = idx;
+	route_ix_shrink(&rs->ix);
 
-	g_assert(uint_is_non_negative(routing.nchunks));
+	g_assert(uint_is_non_negative(rs->nchunks));
 
 	/*
 	 * After freeing chunks, we may be able to move around some of the
 	 * remaining ones.
 	 */
 
-	routing_chunk_move_attempt();
+	routing_chunk_move_attempt(rs);
+}
+
+/**
+ * Compute the amount of memory used by a shard, excluding spilled routes.
+ */
+static size_t
+routing_shard_memory(const struct routing_shard *rs)
+{
+	return rs->count * sizeof(struct message) +
+		rs->nchunks * CHUNK_MESSAGES * sizeof(struct message *) +
+		route_ix_memory(&rs->ix);
 }
 
 /**
@@ -1095,15 +1476,39 @@ routing_clear(unsigned idx)
 void
 routing_clear_all(void)
 {
-	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT clearing whole table (holds %d / %d)",
-			routing.capacity, routing.count);
+	uint i, count = 0;
+	size_t memory = 0;
+	tm_t start;
+
+	if (GNET_PROPERTY(routing_debug))
+		tm_now_exact(&start);
+
+	for (i = 0; i < N_ITEMS(routing); i++) {
+		struct routing_shard *rs = &routing[i];
+
+		routing_shard_check(rs);
+
+		if (GNET_PROPERTY(routing_debug)) {
+			g_debug("RT clearing whole shard #%u (holds %d / %d)",
+				rs->index, rs->capacity, rs->count);
+			count += rs->count;
+			memory += routing_shard_memory(rs);
+		}
+
+		routing_clear(rs, 0);
+		rs->next_idx = 0;
+		rs->last_rotation = tm_time();
+		g_assert(0 == rs->ix.count);
 	}
 
-	routing_clear(0);
-	routing.next_idx = 0;
-	routing.last_rotation = tm_time();
-	hset_clear(routing.messages_hashed);	/* Paranoid */
+	if (GNET_PROPERTY(routing_debug)) {
+		tm_t end;
+
+		tm_now_exact(&end);
+		g_debug("RT cleared %u entr%s using %s in %'lu usecs",
+			PLURAL_Y(count), short_size(memory, FALSE),
+			(ulong) tm_elapsed_us(&end, &start));
+	}
 }
 
 /**
@@ -1123,21 +1528,21 @@ routing_clear_all(void)
  * @return the address of the allocated slot.
  */
 static struct message **
-get_next_slot(bool advance, unsigned *cidx)
+get_next_slot(struct routing_shard *rs, bool advance, unsigned *cidx)
 {
 	unsigned idx;
 	unsigned chunk_idx;
 	struct message **chunk;
 	struct message **slot = NULL;
 	time_t now = tm_time();
-	time_delta_t elapsed = delta_time(now, routing.last_rotation);
+	time_delta_t elapsed = delta_time(now, rs->last_rotation);
 
-	idx = routing.next_idx;
+	idx = rs->next_idx;
 	chunk_idx = CHUNK_INDEX(idx);
 
 	g_assert(UNSIGNED(chunk_idx) < MAX_CHUNKS);
 
-	chunk = routing.chunks[chunk_idx];
+	chunk = rs->chunks[chunk_idx];
 
 	/*
 	 * If we get back here with a next index of zero and the chunk is
@@ -1148,9 +1553,9 @@ get_next_slot(bool advance, unsigned *cidx)
 	if G_UNLIKELY(0 == idx && NULL != chunk) {
 		if (GNET_PROPERTY(routing_debug)) {
 			g_debug("RT cycled naturally over table, elapsed=%u, holds %d / %d",
-				(unsigned) elapsed, routing.count, routing.capacity);
+				(unsigned) elapsed, rs->count, rs->capacity);
 		}
-		routing.last_rotation = now;	/* Just cycled over */
+		rs->last_rotation = now;	/* Just cycled over */
 		elapsed = 0;
 	}
 
@@ -1168,14 +1573,14 @@ get_next_slot(bool advance, unsigned *cidx)
 		 */
 
 		if G_UNLIKELY(chunk != NULL && 0 == ENTRY_INDEX(idx)) {
-			routing_clear(chunk_idx);
+			routing_clear(rs, chunk_idx);
 			chunk = NULL;
 		}
 	}
 
 	if (chunk == NULL) {
 
-		g_assert(idx >= UNSIGNED(routing.capacity));
+		g_assert(idx >= UNSIGNED(rs->capacity));
 
 		/*
 		 * Chunk does not exist yet, determine whether we should create
@@ -1185,26 +1590,26 @@ get_next_slot(bool advance, unsigned *cidx)
 		if (idx > 0 && elapsed > TABLE_MIN_CYCLE) {
 			if (GNET_PROPERTY(routing_debug)) {
 				g_debug("RT cycling over table, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
+					(unsigned) elapsed, rs->count, rs->capacity);
 			}
 
 			chunk_idx = 0;
-			idx = routing.next_idx = 0;
-			routing.last_rotation = now;
-			slot = routing.chunks[0];
+			idx = rs->next_idx = 0;
+			rs->last_rotation = now;
+			slot = rs->chunks[0];
 		} else {
 			/*
 			 * Allocate new chunk, expanding the capacity of the table.
 			 */
 
 			g_assert(idx == 0 || chunk_idx > 0);
-			g_assert(chunk_idx == routing.nchunks);
+			g_assert(chunk_idx == rs->nchunks);
 
-			routing_chunk_move_attempt();		/* Compact before allocating */
+			routing_chunk_move_attempt(rs);		/* Compact before allocating */
 
-			routing.nchunks++;
-			routing.capacity += CHUNK_MESSAGES;
-			routing.chunks[chunk_idx] =
+			rs->nchunks++;
+			rs->capacity += CHUNK_MESSAGES;
+			rs->chunks[chunk_idx] =
 				halloc0(CHUNK_MESSAGES * sizeof(struct message *));
 
 			gnet_stats_inc_general(GNR_ROUTING_TABLE_CHUNKS);
@@ -1213,11 +1618,11 @@ get_next_slot(bool advance, unsigned *cidx)
 
 			if (GNET_PROPERTY(routing_debug)) {
 				g_debug("RT created new chunk #%d at %p, now holds %d / %d",
-					chunk_idx, (void *) routing.chunks[chunk_idx],
-					routing.count, routing.capacity);
+					chunk_idx, (void *) rs->chunks[chunk_idx],
+					rs->count, rs->capacity);
 			}
 
-			slot = routing.chunks[chunk_idx];	/* First slot in new chunk */
+			slot = rs->chunks[chunk_idx];	/* First slot in new chunk */
 		}
 	} else {
 		unsigned entry_idx = ENTRY_INDEX(idx);
@@ -1228,8 +1633,8 @@ get_next_slot(bool advance, unsigned *cidx)
 		 */
 
 		if (0 == entry_idx) {
-			routing_chunk_move_attempt();
-			chunk = routing.chunks[chunk_idx];	/* In case it moved */
+			routing_chunk_move_attempt(rs);
+			chunk = rs->chunks[chunk_idx];	/* In case it moved */
 		}
 
 		/*
@@ -1238,29 +1643,29 @@ get_next_slot(bool advance, unsigned *cidx)
 		 * because we have already allocated the maximum amount of chunks.
 		 */
 
-		if (0 == idx && MAX_CHUNKS == routing.nchunks) {
+		if (0 == idx && MAX_CHUNKS == rs->nchunks) {
 			if (GNET_PROPERTY(routing_debug)) {
 				g_warning("RT cycling over FORCED, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
+					(unsigned) elapsed, rs->count, rs->capacity);
 			}
-			routing.last_rotation = now;
+			rs->last_rotation = now;
 		}
 
 		slot = &chunk[entry_idx];
 	}
 
 	g_assert(slot != NULL);
-	g_assert(idx == UNSIGNED(routing.next_idx));
-	g_assert(idx < UNSIGNED(routing.capacity));
-	g_assert(routing.nchunks <= MAX_CHUNKS);
+	g_assert(idx == UNSIGNED(rs->next_idx));
+	g_assert(idx < UNSIGNED(rs->capacity));
+	g_assert(rs->nchunks <= MAX_CHUNKS);
 
 	if (advance)
-		advance_slot();
+		advance_slot(rs);
 
 	if (cidx != NULL)
 		*cidx = chunk_idx;
 
-	slot_check(slot, chunk_idx);
+	slot_check(rs, slot, chunk_idx);
 
 	return slot;
 }
@@ -1269,13 +1674,13 @@ get_next_slot(bool advance, unsigned *cidx)
  * Fetch next routing table entry to be able to store routing information.
  */
 static struct message *
-get_next_entry(void)
+get_next_entry(struct routing_shard *rs)
 {
 	struct message **slot;
 	unsigned chunk_idx;
 
-	slot = get_next_slot(TRUE, &chunk_idx);
-	return prepare_entry(slot, chunk_idx);
+	slot = get_next_slot(rs, TRUE, &chunk_idx);
+	return prepare_entry(rs, slot, chunk_idx);
 }
 
 /**
@@ -1288,6 +1693,7 @@ get_next_entry(void)
 static void
 revitalize_entry(struct message *entry, bool force)
 {
+	struct routing_shard *rs = &routing[entry->shard];
 	struct message **relocated;
 	struct message *prev;
 	unsigned chunk_idx;
@@ -1305,7 +1711,7 @@ revitalize_entry(struct message *entry, bool force)
 	 * Relocate at the end of the table, preventing early expiration.
 	 */
 
-	relocated = get_next_slot(FALSE, &chunk_idx);
+	relocated = get_next_slot(rs, FALSE, &chunk_idx);
 
 	/*
 	 * If slot is allocated in the same chunk, there's no need to revitalize
@@ -1319,15 +1725,15 @@ revitalize_entry(struct message *entry, bool force)
 	 * Clean and reclaim new slot content, if present.
 	 */
 
-	advance_slot();							/* Keeping the slot */
+	advance_slot(rs);						/* Keeping the slot */
 	prev = *relocated;
 
 	if (prev != NULL) {
-		message_check(prev, chunk_idx);
+		message_check(rs, prev, chunk_idx);
 		g_assert(prev->slot == relocated);
-		clean_entry(prev);
+		clean_entry(rs, prev);
 		WFREE(prev);
-		routing.count--;
+		rs->count--;
 		gnet_stats_dec_general(GNR_ROUTING_TABLE_COUNT);
 	}
 
@@ -1340,7 +1746,7 @@ revitalize_entry(struct message *entry, bool force)
 	entry->slot = relocated;				/* Entry now at new slot */
 	entry->chunk_idx = chunk_idx;			/* Entry moved to new chunk */
 
-	message_check(entry, chunk_idx);
+	message_check(rs, entry, chunk_idx);
 }
 
 /**
@@ -1349,8 +1755,8 @@ revitalize_entry(struct message *entry, bool force)
 static bool
 route_node_sent_message(gnutella_node_t *n, struct message *m)
 {
-	struct route_data *route;
-	pslist_t *sl;
+	struct route_data *route, **routes;
+	uint i;
 
 	if (n == fake_node)
 		route = &fake_route;
@@ -1365,8 +1771,10 @@ route_node_sent_message(gnutella_node_t *n, struct message *m)
 	if (route == NULL)
 		return FALSE;
 
-	PSLIST_FOREACH(m->routes, sl) {
-		if (route == sl->data)
+	routes = message_routes(m);
+
+	for (i = 0; i < m->nroutes; i++) {
+		if (route == routes[i])
 			return TRUE;
 	}
 
@@ -1384,9 +1792,8 @@ route_node_sent_message(gnutella_node_t *n, struct message *m)
 static bool
 route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 {
-	pslist_t *l;
-	int i;
-	struct route_data *route;
+	struct route_data *route, **routes;
+	uint i;
 
 	g_assert(n != fake_node);
 
@@ -1401,7 +1808,6 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 	if (GTA_MSG_G2_SEARCH == m->function)
 		return FALSE;		/* As a G2 leaf, we do not care, it's a dup */
 
-	g_assert(m->ttls != NULL);
 	g_assert(
 		m->function == GTA_MSG_PUSH_REQUEST || m->function == GTA_MSG_SEARCH);
 
@@ -1409,17 +1815,16 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 
 	g_assert(route != NULL);
 
-	for (l = m->routes, i = 0; l; l = pslist_next(l), i++) {
-		if (route == l->data) {
-			pslist_t *t = pslist_nth(m->ttls, i);
-			uint8 old_ttl;
+	routes = message_routes(m);
 
-			g_assert(t != NULL);
-			old_ttl = GPOINTER_TO_INT(t->data);
-			if (old_ttl >= ttl)
+	for (i = 0; i < m->nroutes; i++) {
+		if (route == routes[i]) {
+			uint8 *ttls = message_ttls(m);
+
+			if (ttls[i] >= ttl)
 				return FALSE;
 
-			t->data = GUINT_TO_POINTER((uint) ttl);
+			ttls[i] = ttl;
 			return TRUE;
 		}
 	}
@@ -1428,40 +1833,6 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 	return FALSE;
 }
 
-/**
- * compares two message structures
- */
-static int
-message_compare_func(const void *p, const void *q)
-{
-	const struct message *a = p, *b = q;
-
-	return a->function == b->function && guid_eq(&a->muid, &b->muid);
-}
-
-/**
- * Hashes message structures for storage in a hash table.
- */
-static uint
-message_hash_func(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash_fast(msg->function) ^
-		universal_hash(&msg->muid, GUID_RAW_SIZE);
-}
-
-/**
- * Alternate hashing of message structures for storage in a hash table.
- */
-static uint
-message_hash_func2(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash2(msg->function) ^ guid_hash(&msg->muid);
-}
-
 /**
  * Reset this node's GUID.
  */
@@ -1561,9 +1932,17 @@ routing_init(void)
 	 * need to be deallocated
 	 */
 
-	routing.messages_hashed = hset_create_any(message_hash_func,
-		message_hash_func2, message_compare_func);
-	routing.last_rotation = tm_time();
+	STATIC_ASSERT(ROUTING_SHARDS <= MAX_INT_VAL(uint8));
+
+	for (i = 0; i < N_ITEMS(routing); i++) {
+		struct routing_shard *rs = &routing[i];
+
+		rs->magic = ROUTING_SHARD_MAGIC;
+		rs->index = i;
+		rs->owner = thread_small_id();
+		route_ix_resize(&rs->ix, ROUTE_IX_MIN);
+		rs->last_rotation = tm_time();
+	}
 
 	/*
 	 * Push proxification and starving GUIDs.
@@ -1638,22 +2017,23 @@ remove_one_message_reference(struct route_data *rd)
 static void
 free_route_list(struct message *m)
 {
-	pslist_t *sl;
+	struct route_data **routes;
+	uint i;
 
 	g_assert(m);
 
-	PSLIST_FOREACH(m->routes, sl) {
-		remove_one_message_reference(sl->data);
-	}
+	routes = message_routes(m);
 
-	pslist_free_null(&m->routes);
+	for (i = 0; i < m->nroutes; i++) {
+		remove_one_message_reference(routes[i]);
+	}
 
-	/*
-	 * If the message was a broadcasted one, we kept track of the TTL of
-	 * each message along the route.  This needs to be freed as well.
-	 */
+	if (m->rcap != 0) {
+		hfree(m->r.spilled);
+		m->rcap = 0;
+	}
 
-	pslist_free_null(&m->ttls);	/* Data are ints, nothing to free */
+	m->nroutes = 0;
 }
 
 /**
@@ -1701,6 +2081,7 @@ void
 message_add(const struct guid *muid, uint8 function,
 	gnutella_node_t *node)
 {
+	struct routing_shard *rs = routing_shard_get(muid);
 	struct route_data *route;
 	struct message *entry;
 	struct message *m;
@@ -1749,8 +2130,8 @@ message_add(const struct guid *muid, uint8 function,
 	if (found)			/* Dup message forwarded due to higher TTL */
 		entry = m;		/* Reuse existing entry */
 	else {
-		entry = get_next_entry();
-		g_assert(entry->routes == NULL);
+		entry = get_next_entry(rs);
+		g_assert(0 == entry->nroutes);
 
 		/* fill in that storage space */
 		entry->muid = *muid;
@@ -1769,13 +2150,10 @@ message_add(const struct guid *muid, uint8 function,
 	if (!found || !route_node_sent_message(node, m)) {
 		uint ttl;
 
-		route->saved_messages++;
-		entry->routes = pslist_append(entry->routes, route);
-
 		/*
-		 * If message is typically broadcasted, also record the TTL of
-		 * that route, since a node is allowed to resend us a message
-		 * if it comes with a higher TTL than previously seen.
+		 * Also record the TTL of that route, since a node is allowed to
+		 * resend us a broadcasted message if it comes with a higher TTL
+		 * than previously seen.
 		 *		--RAM, 2005-10-02
 		 */
 
@@ -1783,12 +2161,8 @@ message_add(const struct guid *muid, uint8 function,
 				? GNET_PROPERTY(my_ttl)
 				: gnutella_header_get_ttl(&node->header);
 
-		switch (function) {
-		case GTA_MSG_PUSH_REQUEST:
-		case GTA_MSG_SEARCH:
-			entry->ttls = pslist_append(entry->ttls, GUINT_TO_POINTER(ttl));
-			break;
-		}
+		if (message_route_append(entry, route, ttl))
+			route->saved_messages++;
 	}
 
 	if (found)
@@ -1804,7 +2178,7 @@ message_add(const struct guid *muid, uint8 function,
 		entry->ttl = GNET_PROPERTY(my_ttl);
 
 	/* insert the new message into the hash table */
-	hset_insert(routing.messages_hashed, entry);
+	route_ix_insert(&rs->ix, entry);
 }
 
 /**
@@ -1814,29 +2188,17 @@ message_add(const struct guid *muid, uint8 function,
 static void
 purge_dangling_references(struct message *m)
 {
-	pslist_t *sl;
-	pslist_t *t;
+	struct route_data **routes = message_routes(m);
+	uint i;
 
-	for (sl = m->routes, t = m->ttls; sl; /* empty */) {
-		struct route_data *rd = sl->data;
+	for (i = 0; i < m->nroutes; /* empty */) {
+		struct route_data *rd = routes[i];
 
 		if (rd->node == NULL) {
-			pslist_t *next = pslist_next(sl);
-			m->routes = pslist_remove_link(m->routes, sl);
+			message_route_remove(m, i);
 			remove_one_message_reference(rd);
-			pslist_free_1(sl);
-			sl = next;
-
-			if (t) {
-				next = pslist_next(t);
-				m->ttls = pslist_remove_link(m->ttls, t);
-				pslist_free_1(t);
-				t = next;
-			}
 		} else {
-			sl = pslist_next(sl);
-			if (t)
-				t = pslist_next(t);
+			i++;
 		}
 	}
 }
@@ -1853,9 +2215,8 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 {
 	bool found;
 	struct message *m;
-	pslist_t *sl;
-	pslist_t *t;
-	struct route_data *route;
+	struct route_data *route, **routes;
+	uint i;
 
 	g_assert(muid != NULL);
 	node_check(node);
@@ -1867,17 +2228,13 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 	route = get_routing_data(node);
 	g_return_unless(route != NULL);
 
-	for (
-		sl = m->routes, t = m->ttls;
-		sl != NULL;
-		sl = pslist_next(sl), t = pslist_next(t)
-	) {
-		struct route_data *rd = sl->data;
+	routes = message_routes(m);
+
+	for (i = 0; i < m->nroutes; i++) {
+		struct route_data *rd = routes[i];
 
 		if (route == rd) {
-			m->routes = pslist_remove_link(m->routes, sl);
-			if (t != NULL)
-				m->ttls = pslist_remove_link(m->ttls, t);
+			message_route_remove(m, i);
 			remove_one_message_reference(rd);
 			break;
 		}
@@ -1888,22 +2245,19 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
  * Look for a particular message in the routing tables.
  *
  * If none of the nodes that sent us the message are still present, then
- * m->routes will be NULL.
+ * the message will have no routes.
  *
  * @return TRUE if the message is found.
  */
 static bool
 find_message(const struct guid *muid, uint8 function, struct message **m)
 {
-	struct message dummy;
-	const void *orig_key;
+	struct routing_shard *rs = routing_shard_get(muid);
+	struct message *msg;
 
-	dummy.muid = *muid;
-	dummy.function = function;
-
-	if (hset_contains_extended(routing.messages_hashed, &dummy, &orig_key)) {
-		struct message *msg = deconstify_pointer(orig_key);
+	msg = route_ix_lookup(&rs->ix, muid, function);
 
+	if (msg != NULL) {
 		/* wipe out dead references to old nodes */
 		purge_dangling_references(msg);
 
@@ -2011,9 +2365,9 @@ route_max_forward_ttl(const gnutella_node_t *sender)
  * The message is not physically sent yet, but the `dest' structure is filled
  * with proper routing information.
  *
- * `routes' is normally NULL unless we're forwarding a PUSH request.  In that
- * case, it must be sent to the whole list of routes we have, and `target' will
- * be NULL.
+ * `via' is normally NULL unless we're forwarding a PUSH request.  In that
+ * case, it must be sent to the whole list of routes we have for that message,
+ * and `target' will be NULL.
  *
  * @attention
  * NB: we're just *recording* routing information for the message into `dest',
@@ -2025,11 +2379,11 @@ static bool
 forward_message(
 	struct route_log *route_log,
 	gnutella_node_t **node,
-	gnutella_node_t *target, struct route_dest *dest, pslist_t *routes)
+	gnutella_node_t *target, struct route_dest *dest, struct message *via)
 {
 	gnutella_node_t *sender = *node;
 
-	g_assert(routes == NULL || target == NULL);
+	g_assert(via == NULL || target == NULL);
 	g_assert(settings_is_ultra());
 
 	/* Drop messages that would travel way too many nodes --RAM */
@@ -2081,19 +2435,20 @@ forward_message(
 	} else {
 		/*
 		 * Forward message to all others nodes, or the the ones specified
-		 * by the `routes' parameter if not NULL.
+		 * by the routes of the `via' message if not NULL.
 		 */
 
-		if (routes != NULL) {
-			pslist_t *l;
+		if (via != NULL) {
+			struct route_data **routes = message_routes(via);
 			pslist_t *nodes = NULL;
 			int count = 0;
+			uint i;
 
 			g_assert(gnutella_header_get_function(&sender->header)
 					== GTA_MSG_PUSH_REQUEST);
 
-			PSLIST_FOREACH(routes, l) {
-				struct route_data *rd = l->data;
+			for (i = 0; i < via->nroutes; i++) {
+				struct route_data *rd = routes[i];
 				if (rd->node == sender)
 					continue;
 
@@ -2237,7 +2592,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 	 * each route.
 	 */
 
-	if (m->routes && route_node_sent_message(sender, m)) {
+	if (message_has_routes(m) && route_node_sent_message(sender, m)) {
 		bool higher_ttl;
 
 		/*
@@ -2303,7 +2658,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 				gmsg_log_bad(sender, "dup message from same node");
 		}
 	} else {
-		if (m->routes == NULL) {
+		if (!message_has_routes(m)) {
 			routing_log_extra(route_log, "all routes lost");
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
@@ -2313,13 +2668,13 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 			}
 		} else {
 			if (GNET_PROPERTY(log_gnutella_routing)) {
-				unsigned count = pslist_length(m->routes);
+				unsigned count = m->nroutes;
 				routing_log_extra(route_log, "%u remaining route%s",
 					PLURAL(count));
 			}
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
-				unsigned count = pslist_length(m->routes);
+				unsigned count = m->nroutes;
 				gmsg_log_duplicate(sender,
 					"from %s: %sother node, %u route%s (dups=%u)",
 					node_infostr(sender), oob ? "OOB, " : "",
@@ -2485,7 +2840,9 @@ route_push(struct route_log *route_log,
 
 		forward_message(route_log, node, neighbour, dest, NULL);
 
-	} else if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
+	} else if (
+		find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && message_has_routes(m)
+	) {
 		gnet_stats_inc_general(GNR_PUSH_RELAYED_VIA_TABLE_ROUTE);
 
 		/*
@@ -2494,10 +2851,10 @@ route_push(struct route_log *route_log,
 		 */
 
 		revitalize_entry(m, FALSE);
-		forward_message(route_log, node, NULL, dest, m->routes);
+		forward_message(route_log, node, NULL, dest, m);
 
 	} else {
-		if (m && m->routes == NULL) {
+		if (m != NULL && !message_has_routes(m)) {
 			routing_log_extra(route_log, "route to target GUID %s gone",
 				guid_hex_str(guid));
 			gnet_stats_count_dropped(sender, MSG_DROP_ROUTE_LOST);
@@ -2670,7 +3027,9 @@ route_query_hit(struct route_log *route_log,
 				message_add(origin_guid, QUERY_HIT_ROUTE_SAVE, sender);
 				route_starving_check(origin_guid);
 			}
-		} else if (m->routes == NULL || !route_node_sent_message(sender, m)) {
+		} else if (
+			!message_has_routes(m) || !route_node_sent_message(sender, m)
+		) {
 			struct route_data *route;
 
 			/*
@@ -2686,14 +3045,12 @@ route_query_hit(struct route_log *route_log,
 			g_assert(route != NULL);
 
 			/*
-			 * A query hit is not a broadcasted message, so there's
-			 * no recording of the TTLs at which we see it.
+			 * A query hit is not a broadcasted message, so the TTL at
+			 * which we see it does not matter.
 			 */
 
-			g_assert(m->ttls == NULL);
-
-			m->routes = pslist_append(m->routes, route);
-			route->saved_messages++;
+			if (message_route_append(m, route, 0))
+				route->saved_messages++;
 
 			/*
 			 * We just made use of this routing data: make it persist
@@ -2741,11 +3098,11 @@ route_query_hit(struct route_log *route_log,
 	revitalize_entry(m, FALSE);
 
 	/*
-	 * If `m->routes' is NULL, we have seen the request, but unfortunately
+	 * If there are no routes, we have seen the request, but unfortunately
 	 * none of the nodes that sent us the request are connected any more.
 	 */
 
-	if (m->routes == NULL)
+	if (!message_has_routes(m))
 		goto route_lost;
 
 	if (route_node_sent_message(fake_node, m)) {
@@ -2782,12 +3139,13 @@ route_query_hit(struct route_log *route_log,
 	 * XXX route for relaying. --RAM, 2004-08-29
 	 */
 	{
-		pslist_t *sl;
+		struct route_data **routes = message_routes(m);
 		bool skipped_transient = FALSE;
+		uint i;
 
 		found = NULL;
-		PSLIST_FOREACH(m->routes, sl) {
-			struct route_data *route = sl->data;
+		for (i = 0; i < m->nroutes; i++) {
+			struct route_data *route = routes[i];
 
 			g_assert(route);
 			g_assert(route->node);
@@ -2810,7 +3168,7 @@ route_query_hit(struct route_log *route_log,
 				 * will be logged as a message targeted to a transient node.
 				 */
 
-				if (NULL != pslist_next(sl)) {
+				if (i + 1 < m->nroutes) {
 					gnutella_node_t *rn;
 
 					rn = route_node_get_gnutella(route->node);
@@ -3081,7 +3439,7 @@ route_exists_for_reply(const struct guid *muid, uint8 function)
 {
 	struct message *m;
 
-	if (!find_message(muid, function & ~0x01, &m) || m->routes == NULL)
+	if (!find_message(muid, function & ~0x01, &m) || !message_has_routes(m))
 		return FALSE;
 
 	return TRUE;
@@ -3119,13 +3477,14 @@ route_towards_guid(const struct guid *guid)
 	if (node)
 		return pslist_prepend(NULL, node);
 
-	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
-		pslist_t *iter, *nodes = NULL;
+	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && message_has_routes(m)) {
+		struct route_data **routes = message_routes(m);
+		pslist_t *nodes = NULL;
+		uint i;
 
 		revitalize_entry(m, TRUE);
-		PSLIST_FOREACH(m->routes, iter) {
-			struct route_data *rd = iter->data;
-			nodes = pslist_prepend(nodes, rd->node);
+		for (i = 0; i < m->nroutes; i++) {
+			nodes = pslist_prepend(nodes, routes[i]->node);
 		}
 		return nodes;
 	}
@@ -3194,26 +3553,31 @@ free_banned_push(const void *key, void *unused_udata)
 void G_COLD
 routing_close(void)
 {
-	uint cnt;
+	uint cnt, s;
 
-	g_assert(routing.messages_hashed != NULL);
+	for (s = 0; s < N_ITEMS(routing); s++) {
+		struct routing_shard *rs = &routing[s];
 
-	hset_free_null(&routing.messages_hashed);
+		routing_shard_check(rs);
+		g_assert(rs->ix.slots != NULL);
 
-	for (cnt = 0; cnt < MAX_CHUNKS; cnt++) {
-		struct message **chunk = routing.chunks[cnt];
-		if (chunk != NULL) {
-			int i;
-			for (i = 0; i < CHUNK_MESSAGES; i++) {
-				struct message *m = chunk[i];
-				if (m != NULL) {
-					message_check(m, cnt);
-					free_route_list(m);
-					WFREE(m);
+		for (cnt = 0; cnt < MAX_CHUNKS; cnt++) {
+			struct message **chunk = rs->chunks[cnt];
+			if (chunk != NULL) {
+				int i;
+				for (i = 0; i < CHUNK_MESSAGES; i++) {
+					struct message *m = chunk[i];
+					if (m != NULL) {
+						message_check(rs, m, cnt);
+						free_route_list(m);
+						WFREE(m);
+					}
 				}
+				HFREE_NULL(rs->chunks[cnt]);
 			}
-			HFREE_NULL(chunk);
 		}
+
+		HFREE_NULL(rs->ix.slots);
 	}
 
 	hset_foreach(ht_banned_push, free_banned_push, NULL);
@@ -269,6 +269,7 @@ static const char WHATS_NEW[] = "What's New?";
 static time_t search_last_whats_new;	/**< When we last sent "What's New?" */
 
 static bool search_reissue_timeout_callback(void *data);
+static void search_batch_discard(void);
 
 static uint
 query_desc_hash(const void *key)
@@ -5518,6 +5519,8 @@ search_init(void)
 void G_COLD
 search_shutdown(void)
 {
+	search_batch_discard();
+
 	while (sl_search_ctrl != NULL) {
 		search_ctrl_t *sch = sl_search_ctrl->data;
 
@@ -9116,6 +9119,312 @@ drop:
 	return TRUE;
 }
 
+/**
+ * Report on the local matches of a query and send back query hits, if any.
+ *
+ * @param n				the node from which the query comes from (relay)
+ * @param sri			the information gathered during the pre-processing stage
+ * @param search		the query string
+ * @param safe_search	the escaped query string, for logging
+ * @param qctx			the query context, holding the matches (freed)
+ * @param muid			the query MUID
+ * @param hops			the query hop count
+ * @param ttl			the query TTL
+ */
+static void
+search_request_reply(gnutella_node_t *n, const search_request_info_t *sri,
+	const char *search, const char *safe_search, struct query_context *qctx,
+	const guid_t *muid, uint8 hops, uint8 ttl)
+{
+	if (GNET_PROPERTY(query_trace)) {
+		g_info("Q #%s %s [%c %u/%u] hit=%03d \"%s\" (%s)%s%s%s%s%s",
+			guid_hex_str(muid),
+			search_request_info_as_bits(sri),
+			NODE_IS_UDP(n) ? 'G' : NODE_IS_LEAF(n) ? 'L' : 'U',
+			hops, ttl, qctx->found,
+			sri->whats_new ? WHATS_NEW : lazy_safe_search(search),
+			search_media_mask_to_string(sri->media_types),
+			sri->skip_file_search ? " (skipped local)" : "",
+			sri->exv_sha1cnt > 0 ? " (SHA1)" : "",
+			sri->oob ? " <" : "",
+			sri->oob ? host_addr_port_to_string(sri->addr, sri->port) : "",
+			sri->oob ? ">" : "");
+	}
+
+	if (qctx->found > 0) {
+		if (
+			(settings_is_leaf() && node_ultra_received_qrp(n)) ||
+			(NODE_TALKS_G2(n) && node_hub_received_qrp(n))
+		)
+			node_inc_qrp_match(n);
+
+		if (GNET_PROPERTY(share_debug) > 3) {
+			g_debug("share HIT %u file%s '%s'%s for #%s%s",
+				PLURAL(qctx->found),
+				sri->whats_new ? WHATS_NEW : safe_search,
+				sri->skip_file_search ? " (skipped)" : "",
+				guid_hex_str(muid),
+				NODE_TALKS_G2(n) ? " (G2)" : "");
+			if (sri->exv_sha1cnt) {
+				int i;
+				for (i = 0; i < sri->exv_sha1cnt; i++)
+					g_debug("\t%c(%32s)",
+						sri->exv_sha1[i].matched ? '+' : '-',
+						sha1_base32(&sri->exv_sha1[i].sha1));
+			}
+			g_debug("\tflags=0x%04x max-hits=%u (%s) "
+				"ttl=%u hops=%u",
+				(uint) sri->flags,
+				(uint) (sri->flags & QUERY_F_MAX_HITS),
+				search_flags_to_string(sri->flags), ttl, hops);
+		}
+	}
+
+	if (GNET_PROPERTY(query_debug) > 14) {
+		g_debug("QUERY #%s \"%s\" [hops=%u, TTL=%u] has %u hit%s%s%s (%s)",
+				guid_hex_str(muid),
+				sri->whats_new ? WHATS_NEW : lazy_safe_search(search),
+				hops, ttl, PLURAL(qctx->found),
+				sri->skip_file_search ? " (skipped local)" : "",
+				sri->exv_sha1cnt > 0 ? " (SHA1)" : "",
+				search_media_mask_to_string(sri->media_types));
+	}
+
+	/*
+	 * If we got a query marked for OOB results delivery, send them
+	 * a reply out-of-band but only if the query's hops is > 1.  Otherwise,
+	 * we have a direct link to the queryier.
+	 */
+
+	if (qctx->found) {
+		bool should_oob;
+		unsigned flags = 0;
+
+		flags |= (sri->flags & QUERY_F_GGEP_H) ? QHIT_F_GGEP_H : 0;
+		flags |= sri->ipv6 ? QHIT_F_IPV6 : 0;
+		flags |= sri->ipv6_only ? QHIT_F_IPV6_ONLY : 0;
+
+		should_oob = sri->oob && !sri->g2_query &&
+						GNET_PROPERTY(process_oob_queries) &&
+						GNET_PROPERTY(recv_solicited_udp) &&
+						udp_active() &&
+						hops > 1 &&
+						settings_running_same_net(sri->addr);
+
+		if (should_oob) {
+			oob_got_results(n, muid, qctx->files, qctx->found,
+				sri->addr, sri->port, sri->secure_oob, sri->sr_udp, flags);
+		} else if (sri->g2_query) {
+			gnutella_node_t *g = n;
+			if (sri->oob)
+				g = node_udp_g2_get_addr_port(sri->addr, sri->port);
+			flags |= sri->g2_wants_url ? QHIT_F_G2_URL : 0;
+			flags |= sri->g2_wants_dn  ? QHIT_F_G2_DN  : 0;
+			flags |= sri->g2_wants_alt ? QHIT_F_G2_ALT : 0;
+			g2_build_send_qh2(n, g, qctx->files, qctx->found, muid, flags);
+		} else {
+			qhit_send_results(n, qctx->files, qctx->found, muid, hops, flags);
+		}
+	}
+
+	share_query_context_free(qctx);
+}
+
+/*
+ * Batched query matching.
+ *
+ * Queries received from connected nodes are not matched against the library
+ * immediately but deferred until the callout queue runs, so that all the
+ * queries received during the same event loop tick are evaluated together
+ * by shared_files_match_batch(), which shares the work between queries with
+ * common words or scanning the same bins.
+ *
+ * Queries coming from UDP are never deferred: the UDP pseudo-node is reused
+ * for each incoming datagram and would no longer describe the sender of the
+ * query by the time we reply.
+ */
+
+#define SEARCH_BATCH_MAX	64		/**< Max amount of queries per batch */
+
+/**
+ * A query whose library matching was deferred.
+ */
+struct search_batch_query {
+	struct nid *node_id;		/**< Node from which query came (relay) */
+	search_request_info_t sri;	/**< Copy of the query information */
+	guid_t muid;				/**< Query MUID */
+	char *search;				/**< Query string */
+	char *safe_search;			/**< Escaped query string, NULL if same */
+	struct query_context *qctx;	/**< Query context, holding the matches */
+	uint32 max_replies;			/**< Max amount of hits to produce */
+	uint32 flags;				/**< SHARE_FM_* flags */
+	uint8 hops, ttl;			/**< Query hop count and TTL */
+};
+
+static struct search_batch_query *search_batch[SEARCH_BATCH_MAX];
+static size_t search_batch_count;
+static cevent_t *search_batch_ev;
+
+/**
+ * Can we defer library matching of a query from that node?
+ */
+static inline bool
+search_batch_can_defer(const gnutella_node_t *n)
+{
+	return GNET_PROPERTY(search_batch_queries) && !NODE_USES_UDP(n);
+}
+
+/**
+ * Free deferred query.
+ */
+static void
+search_batch_free(struct search_batch_query *bq)
+{
+	nid_unref(bq->node_id);
+	HFREE_NULL(bq->search);
+	HFREE_NULL(bq->safe_search);
+	WFREE(bq);
+}
+
+/**
+ * Match all the deferred queries against the library and reply to them.
+ */
+static void
+search_batch_flush(void)
+{
+	struct search_batch_query *batch[SEARCH_BATCH_MAX];
+	struct st_query qv[SEARCH_BATCH_MAX];
+	size_t i, count = search_batch_count;
+
+	cq_cancel(&search_batch_ev);
+
+	if (0 == count)
+		return;
+
+	/*
+	 * Sending replies could cause new queries to be deferred, so we work
+	 * on a copy of the batch.
+	 */
+
+	memcpy(batch, search_batch, count * sizeof batch[0]);
+	search_batch_count = 0;
+
+	for (i = 0; i < count; i++) {
+		struct search_batch_query *bq = batch[i];
+		struct st_query *q = &qv[i];
+
+		ZERO(q);
+		q->search   = bq->search;
+		q->sri      = &bq->sri;
+		q->callback = got_match;
+		q->ctx      = bq->qctx;
+		q->max_res  = bq->max_replies;
+		q->flags    = bq->flags;
+	}
+
+	shared_files_match_batch(qv, count);
+
+	for (i = 0; i < count; i++) {
+		struct search_batch_query *bq = batch[i];
+		gnutella_node_t *n = node_active_by_id(bq->node_id);
+
+		if (NULL == n) {
+			/* Node vanished whilst query was pending, cannot reply */
+			shared_file_slist_free_null(&bq->qctx->files);
+			share_query_context_free(bq->qctx);
+		} else {
+			search_request_reply(n, &bq->sri, bq->search,
+				NULL == bq->safe_search ? bq->search : bq->safe_search,
+				bq->qctx, &bq->muid, bq->hops, bq->ttl);
+		}
+
+		search_batch_free(bq);
+	}
+}
+
+/**
+ * Callout queue callback to process deferred queries.
+ */
+static void
+search_batch_timer(cqueue_t *cq, void *unused_obj)
+{
+	(void) unused_obj;
+
+	cq_zero(cq, &search_batch_ev);
+	search_batch_flush();
+}
+
+/**
+ * Defer library matching of a query, to process it along with the other
+ * queries received during the same event loop tick.
+ *
+ * @param n				the node from which the query comes from (relay)
+ * @param sri			the information gathered during the pre-processing stage
+ * @param search		the query string
+ * @param safe_search	the escaped query string, for logging
+ * @param qctx			the query context (ownership transferred)
+ * @param max_replies	max amount of hits to produce
+ * @param flags			SHARE_FM_* flags for shared_files_match_batch()
+ */
+static void
+search_batch_add(gnutella_node_t *n, const search_request_info_t *sri,
+	const char *search, const char *safe_search, struct query_context *qctx,
+	uint32 max_replies, uint32 flags)
+{
+	struct search_batch_query *bq;
+
+	g_assert(search_batch_count < SEARCH_BATCH_MAX);
+
+	WALLOC0(bq);
+	bq->node_id = nid_ref(node_get_id(n));
+	bq->muid = *gnutella_header_get_muid(&n->header);
+	bq->hops = gnutella_header_get_hops(&n->header);
+	bq->ttl = gnutella_header_get_ttl(&n->header);
+	bq->search = h_strdup(search);
+	bq->safe_search = safe_search == search ? NULL : h_strdup(safe_search);
+	bq->max_replies = max_replies;
+	bq->flags = flags;
+
+	/*
+	 * The original query information will be freed by our caller, so we
+	 * keep a copy of it.  The extended query, when present, is the query
+	 * string we matched.
+	 */
+
+	bq->sri = *sri;
+	bq->sri.extended_query = NULL == sri->extended_query ? NULL : bq->search;
+	bq->qctx = qctx;
+	qctx->sri = &bq->sri;
+
+	search_batch[search_batch_count++] = bq;
+
+	if (SEARCH_BATCH_MAX == search_batch_count)
+		search_batch_flush();
+	else if (NULL == search_batch_ev)
+		search_batch_ev = cq_main_insert(1, search_batch_timer, NULL);
+}
+
+/**
+ * Discard all the deferred queries, at shutdown time.
+ */
+static void
+search_batch_discard(void)
+{
+	size_t i;
+
+	cq_cancel(&search_batch_ev);
+
+	for (i = 0; i < search_batch_count; i++) {
+		struct search_batch_query *bq = search_batch[i];
+
+		shared_file_slist_free_null(&bq->qctx->files);
+		share_query_context_free(bq->qctx);
+		search_batch_free(bq);
+	}
+
+	search_batch_count = 0;
+}
+
 /**
  * Searches requests (from others nodes)
  * Basic matching. The search request is made lowercase and
@@ -9364,110 +9673,21 @@ search_request(gnutella_node_t *n,
 			flags |= sri->partials ? SHARE_FM_PARTIALS : 0;
 			flags |= NODE_TALKS_G2(n) ? SHARE_FM_G2 : 0;
 
+			if (search_batch_can_defer(n)) {
+				search_batch_add(n, sri, search, safe_search, qctx,
+					max_replies, flags);
+				goto finish;		/* Will reply when batch is processed */
+			}
+
 			shared_files_match(search, sri,
 				got_match, qctx, max_replies, flags, qhv);
 
 			qhv_filled = TRUE;		/* A side effect of st_search() */
 		}
 
-		if (GNET_PROPERTY(query_trace)) {
-			g_info("Q #%s %s [%c %u/%u] hit=%03d \"%s\" (%s)%s%s%s%s%s",
-				guid_hex_str(gnutella_header_get_muid(&n->header)),
-				search_request_info_as_bits(sri),
-				NODE_IS_UDP(n) ? 'G' : NODE_IS_LEAF(n) ? 'L' : 'U',
-				gnutella_header_get_hops(&n->header),
-				gnutella_header_get_ttl(&n->header),
-				qctx->found,
-				sri->whats_new ? WHATS_NEW : lazy_safe_search(search),
-				search_media_mask_to_string(sri->media_types),
-				sri->skip_file_search ? " (skipped local)" : "",
-				sri->exv_sha1cnt > 0 ? " (SHA1)" : "",
-				sri->oob ? " <" : "",
-				sri->oob ? host_addr_port_to_string(sri->addr, sri->port) : "",
-				sri->oob ? ">" : "");
-		}
-
-		if (qctx->found > 0) {
-			if (
-				(settings_is_leaf() && node_ultra_received_qrp(n)) ||
-				(NODE_TALKS_G2(n) && node_hub_received_qrp(n))
-			)
-				node_inc_qrp_match(n);
-
-			if (GNET_PROPERTY(share_debug) > 3) {
-				g_debug("share HIT %u file%s '%s'%s for #%s%s",
-					PLURAL(qctx->found),
-					sri->whats_new ? WHATS_NEW : safe_search,
-					sri->skip_file_search ? " (skipped)" : "",
-					guid_hex_str(gnutella_header_get_muid(&n->header)),
-					NODE_TALKS_G2(n) ? " (G2)" : "");
-				if (sri->exv_sha1cnt) {
-					int i;
-					for (i = 0; i < sri->exv_sha1cnt; i++)
-						g_debug("\t%c(%32s)",
-							sri->exv_sha1[i].matched ? '+' : '-',
-							sha1_base32(&sri->exv_sha1[i].sha1));
-				}
-				g_debug("\tflags=0x%04x max-hits=%u (%s) "
-					"ttl=%u hops=%u",
-					(uint) sri->flags,
-					(uint) (sri->flags & QUERY_F_MAX_HITS),
-					search_flags_to_string(sri->flags),
-					gnutella_header_get_ttl(&n->header),
-					gnutella_header_get_hops(&n->header));
-			}
-		}
-
-		if (GNET_PROPERTY(query_debug) > 14) {
-			g_debug("QUERY #%s \"%s\" [hops=%u, TTL=%u] has %u hit%s%s%s (%s)",
-					guid_hex_str(gnutella_header_get_muid(&n->header)),
-					sri->whats_new ? WHATS_NEW : lazy_safe_search(search),
-					gnutella_header_get_hops(&n->header),
-					gnutella_header_get_ttl(&n->header),
-					PLURAL(qctx->found),
-					sri->skip_file_search ? " (skipped local)" : "",
-					sri->exv_sha1cnt > 0 ? " (SHA1)" : "",
-					search_media_mask_to_string(sri->media_types));
-		}
-
-		/*
-		 * If we got a query marked for OOB results delivery, send them
-		 * a reply out-of-band but only if the query's hops is > 1.  Otherwise,
-		 * we have a direct link to the queryier.
-		 */
-
-		if (qctx->found) {
-			bool should_oob;
-			unsigned flags = 0;
-
-			flags |= (sri->flags & QUERY_F_GGEP_H) ? QHIT_F_GGEP_H : 0;
-			flags |= sri->ipv6 ? QHIT_F_IPV6 : 0;
-			flags |= sri->ipv6_only ? QHIT_F_IPV6_ONLY : 0;
-
-			should_oob = oob && !sri->g2_query &&
-							GNET_PROPERTY(process_oob_queries) &&
-							GNET_PROPERTY(recv_solicited_udp) &&
-							udp_active() &&
-							gnutella_header_get_hops(&n->header) > 1 &&
-							settings_running_same_net(sri->addr);
-
-			if (should_oob) {
-				oob_got_results(n, qctx->files, qctx->found,
-					sri->addr, sri->port, sri->secure_oob, sri->sr_udp, flags);
-			} else if (sri->g2_query) {
-				gnutella_node_t *g = n;
-				if (sri->oob)
-					g = node_udp_g2_get_addr_port(sri->addr, sri->port);
-				flags |= sri->g2_wants_url ? QHIT_F_G2_URL : 0;
-				flags |= sri->g2_wants_dn  ? QHIT_F_G2_DN  : 0;
-				flags |= sri->g2_wants_alt ? QHIT_F_G2_ALT : 0;
-				g2_build_send_qh2(n, g, qctx->files, qctx->found, muid, flags);
-			} else {
-				qhit_send_results(n, qctx->files, qctx->found, muid, flags);
-			}
-		}
-
-		share_query_context_free(qctx);
+		search_request_reply(n, sri, search, safe_search, qctx, muid,
+			gnutella_header_get_hops(&n->header),
+			gnutella_header_get_ttl(&n->header));
 	}
 
 finish:
@@ -177,6 +177,22 @@ static hset_t *extensions;	/* Shared filename extensions */
 static pslist_t *shared_dirs;
 static cevent_t *share_qrp_rebuild_ev;
 
+/*
+ * State of the last QRP computation, allowing QRP updates to only account
+ * for the changes in the partial files when the library did not change.
+ *
+ * These are only accessed from the library thread, or from the main thread
+ * whilst the library thread waits for it.
+ */
+static bool share_qrp_synced;		/* QRP covers the current library */
+static slist_t *share_qrp_partials;	/* Partial files present in the QRP */
+
+/*
+ * Set when a library file is removed outside of a rescan, from any thread,
+ * since its words are then still present in the QRP.
+ */
+static bool share_qrp_stale;		/* Library shrank since last QRP walk */
+
 static hset_t *partial_files;	/* Contains partial files, thread-safe */
 
 /*
@@ -482,6 +498,13 @@ shared_file_deindex(shared_file_t *sf)
 	shared_file_check(sf);
 	shared_file_name_check(sf);
 
+	/*
+	 * An incremental QRP update would not remove the words of that file.
+	 */
+
+	if (SHARE_F_INDEXED & sf->flags)
+		atomic_bool_set(&share_qrp_stale, TRUE);
+
 	if (SHARE_F_BASENAME & sf->flags) {
 		if (shared_libfile.file_basenames != NULL) {
 			htable_remove(shared_libfile.file_basenames, sf->name_nfc);
@@ -796,6 +819,75 @@ shared_files_match(const char *query,
 	st_free(&pt);
 }
 
+/**
+ * Apply a batch of queries to our library, each query's matches being
+ * delivered to its own callback, as shared_files_match() would.
+ *
+ * The query hash vectors are not filled, use st_fill_qhv() for that.
+ *
+ * @param qv			the queries, with SHARE_FM_* flags in their ``flags''
+ * @param qcnt			amount of queries in the batch
+ */
+void
+shared_files_match_batch(struct st_query *qv, size_t qcnt)
+{
+	search_table_t *gt, *pt;
+	bool partials = FALSE;
+	size_t i;
+
+	for (i = 0; i < qcnt; i++) {
+		if (qv[i].flags & SHARE_FM_PARTIALS)
+			partials = TRUE;
+	}
+
+	/*
+	 * Take snapshots of the global search and partial tables, in case
+	 * they are reset by a background rescan.
+	 */
+
+	SHARED_LIBFILE_LOCK;
+	gt = st_refcnt_inc(shared_libfile.search_table);
+	pt = partials ? st_refcnt_inc(shared_libfile.partial_table) : NULL;
+	SHARED_LIBFILE_UNLOCK;
+
+	/*
+	 * First search from the library, all queries at once.
+	 */
+
+	st_search_batch(gt, qv, qcnt);
+
+	/*
+	 * Then look whether we have partial files matching, for the queries
+	 * that want them and can still get some hits.  This is rare enough
+	 * to not warrant any batching.
+	 */
+
+	for (i = 0; i < qcnt; i++) {
+		struct st_query *q = &qv[i];
+		bool g2_query = booleanize(q->flags & SHARE_FM_G2);
+		uint remain;
+		int n;
+
+		gnet_stats_count_general(
+			g2_query ? GNR_LOCAL_G2_HITS : GNR_LOCAL_HITS, q->nres);
+
+		if (
+			0 == (q->flags & SHARE_FM_PARTIALS) ||
+			q->nres >= q->max_res ||
+			!share_can_answer_partials()
+		)
+			continue;
+
+		remain = q->max_res - q->nres;
+		n = st_search(pt, q->search, q->sri, q->callback, q->ctx, remain, NULL);
+		gnet_stats_count_general(
+			g2_query ? GNR_LOCAL_G2_PARTIAL_HITS : GNR_LOCAL_PARTIAL_HITS, n);
+	}
+
+	st_free(&gt);
+	st_free(&pt);
+}
+
 /**
  * Initialize the special files we're sharing.
  */
@@ -1512,6 +1604,7 @@ struct recursive_scan {
 	slist_t *partial_files;		/* list of struct shared_file */
 	slist_iter_t *iter;			/* list iterator */
 	htable_t *words;			/* records words making up filenames, for QRP */
+	slist_t *qrp_partials;		/* partial files added to the QRP */
 	htable_t *basenames;		/* known file basenames */
 	pslist_t *shared;				/* the new shared_files variable */
 	shared_file_t **files;		/* the new file_table, sorted by mtime */
@@ -1525,6 +1618,8 @@ struct recursive_scan {
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
 	size_t ftable_capacity;		/* Amount of entries in ftable[] */
+	unsigned qrp_update:1;		/* QRP update only, library unchanged */
+	unsigned qrp_incremental:1;	/* QRP only updated with partial changes */
 };
 
 static inline void
@@ -1552,6 +1647,7 @@ recursive_scan_new(const pslist_t *base_dirs, time_t now)
 	ctx->shared_files = slist_new();
 	ctx->partial_files = slist_new();
 	ctx->words = htable_create(HASH_KEY_STRING, 0);
+	ctx->qrp_partials = slist_new();
 	ctx->basenames = htable_create(HASH_KEY_STRING, 0);
 	PSLIST_FOREACH(base_dirs, iter) {
 		const char *dir = atom_str_get(iter->data);
@@ -1625,6 +1721,7 @@ recursive_scan_context_free(void *data)
 	slist_free_all(&ctx->sub_dirs, do_hfree);
 	slist_free_all(&ctx->shared_files, recursive_sf_unref);
 	slist_free_all(&ctx->partial_files, recursive_sf_unref);
+	slist_free_all(&ctx->qrp_partials, recursive_sf_unref);
 
 	htable_free_null(&ctx->basenames);
 	st_free(&ctx->search_tb);
@@ -2376,6 +2473,13 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 		sf->flags |= SHARE_F_INDEXED | SHARE_F_BASENAME;
 	}
 
+	/*
+	 * The QRP no longer reflects the library until we finalize its
+	 * computation, at the end of this task.
+	 */
+
+	share_qrp_synced = FALSE;
+
 	SHARED_LIBFILE_LOCK;
 
 	/*
@@ -2716,6 +2820,16 @@ recursive_prepare_qrp(void *data)
 	return NULL;
 }
 
+static void
+recursive_qrp_remove(void *data, void *udata)
+{
+	const shared_file_t *sf = data;
+	struct recursive_scan *ctx = udata;
+
+	shared_file_check(sf);
+	qrp_remove_file(sf, ctx->words);
+}
+
 static bgret_t
 recursive_scan_step_prepare_qrp(struct bgtask *bt, void *data, int ticks)
 {
@@ -2733,6 +2847,24 @@ recursive_scan_step_prepare_qrp(struct bgtask *bt, void *data, int ticks)
 	qrp_prepare_computation();
 	ctx->idx = 0;
 
+	/*
+	 * When the library has not changed since the last QRP computation, we
+	 * only need to replace the partial files we had with the current ones.
+	 * Files present in both will add and remove the same words, leaving
+	 * only the actual changes for the QRP to process.
+	 *
+	 * Should a library file have been removed since, we need to walk the
+	 * library again to get rid of its words.
+	 */
+
+	ctx->qrp_incremental = ctx->qrp_update && share_qrp_synced &&
+		!atomic_bool_get(&share_qrp_stale);
+
+	if (ctx->qrp_incremental)
+		slist_foreach(share_qrp_partials, recursive_qrp_remove, ctx);
+	else
+		atomic_bool_set(&share_qrp_stale, FALSE);
+
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -2747,6 +2879,16 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 
 	ctx->ticks = 0;
 
+	/*
+	 * The words of the library files are already in the QRP if we're only
+	 * accounting for the partial files.
+	 */
+
+	if (ctx->qrp_incremental) {
+		bg_task_ticks_used(bt, 0);
+		return BGR_NEXT;
+	}
+
 	/*
 	 * If we're coming from a rescan, then we have already loaded the ftable[]
 	 * copy in the context.
@@ -2765,7 +2907,7 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 			SHARED_LIBFILE_UNLOCK;
 			break;
 		}
-		sf = shared_libfile.sorted_file_table[ctx->idx];
+		sf = shared_libfile.sorted_file_table[ctx->idx++];
 		if (sf != NULL)
 			sf = shared_file_ref(sf);
 
@@ -2774,6 +2916,11 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 		if (NULL == sf)
 			continue;
 
+		/*
+		 * The index is moved past the file before we can return, since
+		 * adding the same file twice would count its words twice.
+		 */
+
 		qrp_add_file(sf, ctx->words);
 		shared_file_unref(&sf);
 
@@ -2782,8 +2929,6 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 
 		if (0 == (ctx->ticks & 0xf))
 			bg_task_cancel_test(ctx->task);
-
-		ctx->idx++;
 	}
 
 	bg_task_ticks_used(bt, ctx->ticks);
@@ -2815,7 +2960,7 @@ recursive_scan_step_update_qrp_partial(struct bgtask *bt, void *data, int ticks)
 			slist_length(ctx->partial_files);
 
 		qrp_add_file(sf, ctx->words);
-		shared_file_unref(&sf);
+		slist_append(ctx->qrp_partials, sf);	/* Transfers reference */
 
 		if (ctx->ticks++ >= ticks)
 			return BGR_MORE;
@@ -2842,9 +2987,19 @@ recursive_scan_finalize(void *arg)
 
 	gnet_prop_set_guint32_val(PROP_QRP_INDEXING_DURATION, elapsed);
 
-	qrp_finalize_computation(ctx->words);
+	qrp_finalize_computation(ctx->words, !ctx->qrp_incremental);
 	ctx->words = NULL;		/* Gave pointer, QRP computation will free it */
 
+	/*
+	 * Remember which partial files are now part of the QRP, for the next
+	 * incremental update.
+	 */
+
+	slist_free_all(&share_qrp_partials, recursive_sf_unref);
+	share_qrp_partials = ctx->qrp_partials;
+	ctx->qrp_partials = slist_new();
+	share_qrp_synced = TRUE;
+
 	/*
 	 * The very first time we are scanning the library, make sure we
 	 * prune the SHA1 cache to remove entries listed there that do not
@@ -2972,6 +3127,7 @@ share_update_qrp_create_task(bgsched_t *bs)
 	struct recursive_scan *ctx;
 
 	ctx = recursive_scan_new(NULL, tm_time());
+	ctx->qrp_update = TRUE;
 
 	return ctx->task = bg_task_create(bs, "QRP update",
 				steps, N_ITEMS(steps),
@@ -3282,6 +3438,7 @@ share_close(void)
 	st_free(&shared_libfile.partial_table);
 	htable_free_null(&share_media_types);
 	hset_free_null(&partial_files);
+	slist_free_all(&share_qrp_partials, recursive_sf_unref);
 	hikset_free_null(&sha1_to_share);
 	cq_cancel(&share_qrp_rebuild_ev);
 }
@@ -165,6 +165,7 @@ void shared_files_match(const char *query,
 		const struct search_request_info *sri,
 		st_search_callback callback, void *user_data,
 		int max_res, uint32 partials, struct query_hashvec *qhv);
+void shared_files_match_batch(struct st_query *qv, size_t qcnt);
 
 size_t share_fill_newest(shared_file_t **sfvec, size_t sfcount, unsigned mask,
 	bool size_restrict, filesize_t minsize, filesize_t maxsize);
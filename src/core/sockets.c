@@ -114,6 +114,8 @@
 #define MAX_UDP_LOOP_MS		37		/**< Amount of CPU time we can spend */
 #define UDP_QUEUED_GUESS	65536	/**< Guess amount of pending RX input */
 #define UDP_QUEUE_DELAY_MS	250		/**< RX queue processing delay */
+#define UDP_BATCH			16		/**< Datagrams read per recvmmsg() call */
+#define SOCK_SENDMMSG_MAX	32		/**< Datagrams sent per sendmmsg() call */
 #define TLS_BAN_FREQ		300		/**< Avoid TLS for 5 minutes */
 
 enum {
@@ -1538,6 +1540,8 @@ socket_udp_qfree(void *item, void *unused_data)
 	socket_udpq_free(item);
 }
 
+static void socket_udp_batch_free(struct udpctx *uctx);
+
 /**
  * Dispose of socket, closing connection, removing input callback, and
  * reclaiming attached getline buffer.
@@ -1560,6 +1564,7 @@ socket_free(struct gnutella_socket *s)
 			WFREE_NULL(uctx->socket_addr, sizeof(socket_addr_t));
 			eslist_foreach(&uctx->queue, socket_udp_qfree, NULL);
 			cq_cancel(&uctx->queue_ev);
+			socket_udp_batch_free(uctx);
 			WFREE(s->resource.udp);
 		}
 	} else {
@@ -2770,9 +2775,10 @@ socket_udp_extract_dst_addr(const struct msghdr *msg, host_addr_t *dst_addr)
  * Note: for the Gnutella datagram socket this is udp_received().
  */
 static inline void
-socket_udp_process(gnutella_socket_t *s, bool truncated)
+socket_udp_process(gnutella_socket_t *s,
+	const void *data, size_t len, bool truncated)
 {
-	(*s->resource.udp->data_ind)(s, s->buf, s->pos, truncated);
+	(*s->resource.udp->data_ind)(s, data, len, truncated);
 }
 
 /**
@@ -2838,28 +2844,306 @@ socket_udp_is_old(const gnutella_socket_t *s)
 	return booleanize(s->flags & SOCK_F_OLD);
 }
 
+/**
+ * Record the origin and the destination of a datagram we just received.
+ *
+ * @param s				the socket which received the datagram
+ * @param from_addr		the address of the sender
+ * @param r				the size of the datagram
+ * @param truncated		whether datagram was truncated
+ * @param msg			the reception message header, NULL if none
+ *
+ * @return -1 on error with errno set, the size of the datagram otherwise.
+ */
+static ssize_t
+socket_udp_received(struct gnutella_socket *s, const socket_addr_t *from_addr,
+	ssize_t r, bool truncated, const struct msghdr *msg)
+{
+	bool has_dst_addr = FALSE;
+	host_addr_t dst_addr;
+
+	/*
+	 * We're too low level to account for the proper bandwidth here as we
+	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
+	 *
+	 * This will be done in udp_receieved() which we're about to call.
+	 */
+
+	if (msg != NULL && !GNET_PROPERTY(force_local_ip))
+		has_dst_addr = socket_udp_extract_dst_addr(msg, &dst_addr);
+
+	/*
+	 * Record remote address.
+	 */
+
+	s->addr = socket_addr_get_addr(from_addr);
+	s->port = socket_addr_get_port(from_addr);
+
+	if (!is_host_addr(s->addr)) {
+		gnet_stats_inc_general(GNR_UDP_BOGUS_SOURCE_IP);
+		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
+		errno = EINVAL;
+		return (ssize_t) -1;
+	}
+
+	if (has_dst_addr) {
+		static host_addr_t last_addr;
+
+		settings_addr_changed(dst_addr, s->addr);
+
+		/*
+		 * Show the destination address only when it differs from
+		 * the last seen or if the debug level is higher than 1.
+		 */
+
+		if (
+			GNET_PROPERTY(socket_debug) > 1 ||
+			!host_addr_equiv(last_addr, dst_addr)
+		) {
+			last_addr = dst_addr;
+			if (GNET_PROPERTY(socket_debug)) {
+				g_debug("%s(): dst_addr=%s",
+					G_STRFUNC, host_addr_to_string(dst_addr));
+			}
+		}
+	}
+
+	if (truncated)
+		gnet_stats_inc_general(GNR_UDP_RX_TRUNCATED);
+
+	return r;
+}
+
+#if defined(HAS_RECVMMSG) && defined(CMSG_LEN) && defined(CMSG_SPACE)
+#define USE_RECVMMSG
+#endif
+
+#ifdef USE_RECVMMSG
+/**
+ * Ring of datagrams read in one single recvmmsg() call, which are then
+ * handed out one by one by socket_udp_accept().
+ */
+struct udpbatch {
+	struct mmsghdr msg[UDP_BATCH];		/**< Message headers for recvmmsg() */
+	iovec_t iov[UDP_BATCH];				/**< One I/O vector per message */
+	socket_addr_t from[UDP_BATCH];		/**< Sender of each message */
+	union {
+		struct cmsghdr hdr;
+		size_t align;
+		char bytes[CMSG_SPACE(512)];
+	} cmsg[UDP_BATCH];					/**< Ancillary data of each message */
+	char *arena;						/**< Datagram buffers */
+	unsigned count;						/**< Amount of messages read */
+	unsigned next;						/**< Next message to hand out */
+};
+
+/**
+ * Reset the first ``n'' message headers of the batch before they are
+ * handed to recvmmsg(), since the kernel updates some of the fields.
+ */
+static void
+socket_udp_batch_reset(struct udpbatch *b, enum net_type net, unsigned n)
+{
+	unsigned i;
+
+	g_assert(n <= UDP_BATCH);
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &b->msg[i].msg_hdr;
+		socklen_t from_len;
+
+		from_len = socket_addr_init(&b->from[i], net);
+		g_assert(from_len > 0);
+
+		ZERO(&b->cmsg[i].hdr);
+		msg->msg_name = socket_addr_get_sockaddr(&b->from[i]);
+		msg->msg_namelen = from_len;
+		msg->msg_iov = &b->iov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = b->cmsg[i].bytes;
+		msg->msg_controllen = sizeof b->cmsg[i].bytes;
+		msg->msg_flags = 0;
+		b->msg[i].msg_len = 0;
+	}
+}
+
+/**
+ * Allocate the batched reception ring of an UDP socket.
+ */
+static struct udpbatch *
+socket_udp_batch_alloc(const struct gnutella_socket *s)
+{
+	struct udpbatch *b;
+	unsigned i;
+
+	WALLOC0(b);
+	b->arena = halloc(UDP_BATCH * s->buf_size);
+
+	for (i = 0; i < UDP_BATCH; i++)
+		iovec_set(&b->iov[i], &b->arena[i * s->buf_size], s->buf_size);
+
+	socket_udp_batch_reset(b, s->net, UDP_BATCH);
+
+	return b;
+}
+
+/**
+ * Free the batched reception ring of an UDP socket, if any.
+ */
+static void
+socket_udp_batch_free(struct udpctx *uctx)
+{
+	struct udpbatch *b = uctx->batch;
+
+	if (b != NULL) {
+		HFREE_NULL(b->arena);
+		WFREE(b);
+		uctx->batch = NULL;
+	}
+}
+
+/**
+ * @return whether datagrams read by the last recvmmsg() remain to be handed
+ * out by socket_udp_accept().
+ */
+static inline bool
+socket_udp_batch_pending(const struct gnutella_socket *s)
+{
+	const struct udpbatch *b = s->resource.udp->batch;
+
+	return b != NULL && b->next < b->count;
+}
+
+/**
+ * Hand out the next datagram from the batched reception ring, refilling
+ * the ring with a single recvmmsg() call when it is empty.
+ *
+ * @param s				the socket which receives datagrams
+ * @param data			written with the start of the datagram
+ * @param truncation	written with whether datagram was truncated
+ *
+ * @return -1 on error, the size of the datagram otherwise.
+ */
+static ssize_t
+socket_udp_batch_accept(struct gnutella_socket *s,
+	const void **data, bool *truncation)
+{
+	struct udpctx *uctx = s->resource.udp;
+	struct udpbatch *b;
+	struct mmsghdr *m;
+	unsigned i;
+
+	if G_UNLIKELY(NULL == uctx->batch)
+		uctx->batch = socket_udp_batch_alloc(s);
+
+	b = uctx->batch;
+
+	if (b->next >= b->count) {
+		int n;
+
+		socket_udp_batch_reset(b, s->net, b->count);
+		b->count = b->next = 0;
+
+		n = recvmmsg(s->file_desc, b->msg, UDP_BATCH, 0, NULL);
+
+		if (-1 == n) {
+			if (ENOSYS == errno) {
+				/* Kernel lacks support, revert to recvmsg() for good */
+				socket_udp_batch_free(uctx);
+				uctx->no_batch = TRUE;
+			}
+			return (ssize_t) -1;
+		}
+
+		g_assert(n <= UDP_BATCH);
+		b->count = n;
+
+		if G_UNLIKELY(0 == n) {
+			errno = VAL_EAGAIN;
+			return (ssize_t) -1;
+		}
+	}
+
+	i = b->next++;
+	m = &b->msg[i];
+
+	g_assert(m->msg_len <= s->buf_size);
+
+	*data = &b->arena[i * s->buf_size];
+	*truncation = 0 != (MSG_TRUNC & m->msg_hdr.msg_flags);
+
+	return socket_udp_received(s,
+		&b->from[i], m->msg_len, *truncation, &m->msg_hdr);
+}
+#else	/* !USE_RECVMMSG */
+static inline void
+socket_udp_batch_free(struct udpctx *uctx)
+{
+	(void) uctx;
+}
+
+static inline bool
+socket_udp_batch_pending(const struct gnutella_socket *s)
+{
+	(void) s;
+	return FALSE;
+}
+#endif	/* USE_RECVMMSG */
+
 /**
  * Someone is sending us a datagram.  Read it into the socket's buffer.
  *
+ * When recvmmsg() is available, datagrams are read in batches into a
+ * ring of buffers attached to the socket, and the data returned no longer
+ * lies in the socket's buffer.  Sockets configured to read one single
+ * datagram at a time are never batched, but they will still consume any
+ * datagram already present in the ring.
+ *
  * @param s				the socket which receives a datagram
+ * @param data			written with the start of the datagram
  * @param truncation	written with whether datagram was truncated
  *
  * @return -1 on error, the size of the datagram otherwise.
  */
 static ssize_t
-socket_udp_accept(struct gnutella_socket *s, bool *truncation)
+socket_udp_accept(struct gnutella_socket *s,
+	const void **data, bool *truncation)
 {
 	socket_addr_t *from_addr;
 	struct sockaddr *from;
 	socklen_t from_len;
 	ssize_t r;
-	bool truncated = FALSE, has_dst_addr = FALSE;
-	host_addr_t dst_addr;
+	bool truncated = FALSE;
+	const struct msghdr *hdr = NULL;
+#ifdef HAS_RECVMSG
+	static const struct msghdr zero_msg;
+	struct msghdr msg;
+	iovec_t iov;
+#if defined(CMSG_LEN) && defined(CMSG_SPACE)
+	union {
+		struct cmsghdr hdr;
+		size_t align;
+		char bytes[CMSG_SPACE(512)];
+	} cmsg_buf;
+#endif	/* CMSG_LEN && CMSG_SPACE */
+#endif	/* HAS_RECVMSG */
 
 	socket_check(s);
 	g_assert(s->flags & SOCK_F_UDP);
 	g_assert(s->type == SOCK_TYPE_UDP);
 
+#ifdef USE_RECVMMSG
+	if (
+		socket_udp_batch_pending(s) ||
+		!(s->resource.udp->no_batch || (s->flags & SOCK_F_SINGLE))
+	) {
+		r = socket_udp_batch_accept(s, data, truncation);
+		if ((ssize_t) -1 != r || !s->resource.udp->no_batch)
+			return r;
+		/* FALL THROUGH -- recvmmsg() not supported */
+	}
+#endif	/* USE_RECVMMSG */
+
 	/*
 	 * Receive the datagram in the socket's buffer.
 	 */
@@ -2883,10 +3167,6 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 	 * whether the message is truncated.
 	 */
 	{
-		static const struct msghdr zero_msg;
-		struct msghdr msg;
-		iovec_t iov;
-
 		iovec_set(&iov, s->buf, s->buf_size);
 
 		msg = zero_msg;
@@ -2899,17 +3179,9 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 		 * instead of msg_control and msg_controllen.
 		 */
 #if defined(CMSG_LEN) && defined(CMSG_SPACE)
-		{
-			union {
-				struct cmsghdr hdr;
-				size_t align;
-				char bytes[CMSG_SPACE(512)];
-			} cmsg_buf;
-
-			ZERO(&cmsg_buf.hdr);
-			msg.msg_control = cmsg_buf.bytes;
-			msg.msg_controllen = sizeof cmsg_buf.bytes;
-		}
+		ZERO(&cmsg_buf.hdr);
+		msg.msg_control = cmsg_buf.bytes;
+		msg.msg_controllen = sizeof cmsg_buf.bytes;
 #endif /* CMSG_LEN && CMSG_SPACE */
 
 		r = recvmsg(s->file_desc, &msg, 0);
@@ -2919,9 +3191,7 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 		truncated = 0 != (MSG_TRUNC & msg.msg_flags);
 #endif
 
-		if ((ssize_t) -1 != r && !GNET_PROPERTY(force_local_ip)) {
-			has_dst_addr = socket_udp_extract_dst_addr(&msg, &dst_addr);
-		}
+		hdr = &msg;
 	}
 #else	/* !HAS_RECVMSG */
 	r = recvfrom(s->file_desc, s->buf, s->buf_size, 0,
@@ -2933,63 +3203,24 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 
 	g_assert((size_t) r <= s->buf_size);
 
-	/*
-	 * We're too low level to account for the proper bandwidth here as we
-	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
-	 *
-	 * This will be done in udp_receieved() which we're about to call.
-	 */
-
 	s->pos = r;
-
-	/*
-	 * Record remote address.
-	 */
-
-	s->addr = socket_addr_get_addr(from_addr);
-	s->port = socket_addr_get_port(from_addr);
-
-	if (!is_host_addr(s->addr)) {
-		gnet_stats_inc_general(GNR_UDP_BOGUS_SOURCE_IP);
-		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
-		errno = EINVAL;
-		return (ssize_t) -1;
-	}
-
-	if (has_dst_addr) {
-		static host_addr_t last_addr;
-
-		settings_addr_changed(dst_addr, s->addr);
-
-		/*
-		 * Show the destination address only when it differs from
-		 * the last seen or if the debug level is higher than 1.
-		 */
-
-		if (
-			GNET_PROPERTY(socket_debug) > 1 ||
-			!host_addr_equiv(last_addr, dst_addr)
-		) {
-			last_addr = dst_addr;
-			if (GNET_PROPERTY(socket_debug)) {
-				g_debug("%s(): dst_addr=%s",
-					G_STRFUNC, host_addr_to_string(dst_addr));
-			}
-		}
-	}
-
-	if (truncated)
-		gnet_stats_inc_general(GNR_UDP_RX_TRUNCATED);
-
+	*data = s->buf;
 	*truncation = truncated;
-	return r;
+
+	return socket_udp_received(s, from_addr, r, truncated, hdr);
 }
 
 /**
  * Enqueue UDP datagram for deferred processing.
+ *
+ * @param s			the UDP socket
+ * @param data		start of received data
+ * @param len		length of received data
+ * @param truncated	whether datagram was truncated
  */
 static void
-socket_udp_queue(gnutella_socket_t *s, bool truncated)
+socket_udp_queue(gnutella_socket_t *s,
+	const void *data, size_t len, bool truncated)
 {
 	struct udpctx *uctx;
 	struct udpq *uq;
@@ -2999,8 +3230,8 @@ socket_udp_queue(gnutella_socket_t *s, bool truncated)
 	uctx = s->resource.udp;
 
 	WALLOC0(uq);
-	uq->buf = wcopy(s->buf, s->pos);
-	uq->len = s->pos;
+	uq->buf = wcopy(data, len);
+	uq->len = len;
 	uq->queued = tm_time();
 	uq->truncated = booleanize(truncated);
 	uq->addr = s->addr;
@@ -3114,6 +3345,7 @@ static void
 socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 {
 	struct gnutella_socket *s = data;
+	const void *dgram;
 	size_t avail, rd, qd, qn;
 	bool guessed, truncated, enqueue;
 	unsigned i;
@@ -3166,7 +3398,7 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 		ssize_t r;
 
 		i++;
-		r = socket_udp_accept(s, &truncated);		/* Read datagram */
+		r = socket_udp_accept(s, &dgram, &truncated);	/* Read datagram */
 
 		if ((ssize_t) -1 == r) {
 			/* ECONNRESET is meaningless with UDP but happens on Windows */
@@ -3174,6 +3406,16 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 				g_warning("%s(): ignoring datagram reception error: %m",
 					G_STRFUNC);
 			}
+
+			/*
+			 * A datagram rejected from the reception ring must not prevent
+			 * us from handling the ones that follow: only a failed read
+			 * from the kernel ends the loop.
+			 */
+
+			if (socket_udp_batch_pending(s))
+				goto next;
+
 			break;
 		}
 
@@ -3193,24 +3435,31 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 		 */
 
 		if (enqueue) {
-			socket_udp_queue(s, truncated);				/* Enqueue it */
+			socket_udp_queue(s, dgram, r, truncated);	/* Enqueue it */
 			qd += r;
 			qn++;
 		} else {
-			socket_udp_process(s, truncated);			/* Process it */
+			socket_udp_process(s, dgram, r, truncated);	/* Process it */
 		}
 
 		avail = size_saturate_sub(avail, r);
 
-		/* kevent() reports 32 more bytes than there are, maybe
-		 * it refers to header or control msg data. */
-		if (avail <= 32)
+		/*
+		 * kevent() reports 32 more bytes than there are, maybe
+		 * it refers to header or control msg data.
+		 *
+		 * We must never leave datagrams in the reception ring when we
+		 * return though, since they are no longer visible to the kernel
+		 * and would not trigger any further I/O event.
+		 */
+
+		if (avail <= 32 && !socket_udp_batch_pending(s))
 			break;
 
 	next:
 
 		/* Process one event at a time if configured as such */
-		if (s->flags & SOCK_F_SINGLE)
+		if ((s->flags & SOCK_F_SINGLE) && !socket_udp_batch_pending(s))
 			break;
 
 		if (!enqueue) {
@@ -4355,8 +4604,8 @@ socket_set_single(struct gnutella_socket *s, bool on)
 /**
  * Creates a non-blocking listening UDP socket.
  *
- * Upon datagram reception, the ``data_ind'' callback is invoked. The received
- * data will be held in s->buf, being s->pos byte-long.
+ * Upon datagram reception, the ``data_ind'' callback is invoked with the
+ * received data, which is not necessarily held in s->buf.
  */
 struct gnutella_socket *
 socket_udp_listen(host_addr_t bind_addr, uint16 port,
@@ -4716,6 +4965,30 @@ socket_plain_readv(struct wrap_io *wio, iovec_t *iov, int iovcnt)
 	return s_readv(s->file_desc, iov, iovcnt);
 }
 
+/**
+ * Fill the socket address to which we must send a datagram for ``to''.
+ *
+ * @return the length of the socket address, 0 with errno set on error.
+ */
+static socklen_t
+socket_sendto_addr(const struct gnutella_socket *s, const gnet_host_t *to,
+	socket_addr_t *addr)
+{
+	host_addr_t ha;
+
+	if (!host_addr_convert(gnet_host_get_addr(to), &ha, s->net)) {
+		if (GNET_PROPERTY(udp_debug)) {
+			g_carp("%s(): cannot convert %s to %s",
+				G_STRFUNC, host_addr_to_string(gnet_host_get_addr(to)),
+				net_type_to_string(s->net));
+		}
+		errno = EINVAL;
+		return 0;
+	}
+
+	return socket_addr_set(addr, ha, gnet_host_get_port(to));
+}
+
 static ssize_t
 socket_plain_sendto(
 	struct wrap_io *wio, const gnet_host_t *to, const void *buf, size_t size)
@@ -4723,23 +4996,15 @@ socket_plain_sendto(
 	struct gnutella_socket *s = wio->ctx;
 	socklen_t len;
 	socket_addr_t addr;
-	host_addr_t ha;
 	ssize_t ret;
 
 	socket_check(s);
 	g_assert(!socket_uses_tls(s));
 
-	if (!host_addr_convert(gnet_host_get_addr(to), &ha, s->net)) {
-		if (GNET_PROPERTY(udp_debug)) {
-			g_carp("%s(): cannot convert %s to %s",
-				G_STRFUNC, host_addr_to_string(gnet_host_get_addr(to)),
-				net_type_to_string(s->net));
-		}
-		errno = EINVAL;
+	len = socket_sendto_addr(s, to, &addr);
+	if (0 == len)
 		return -1;
-	}
 
-	len = socket_addr_set(&addr, ha, gnet_host_get_port(to));
 	ret = sendto(s->file_desc, buf, size, 0,
 			socket_addr_get_const_sockaddr(&addr), len);
 
@@ -4751,6 +5016,98 @@ socket_plain_sendto(
 	return ret;
 }
 
+/**
+ * Send several datagrams, with a single system call when possible.
+ *
+ * Datagrams are sent in order, and we stop at the first one which cannot
+ * be sent.  The ``sent'' field of each datagram sent is filled with the
+ * amount of bytes the kernel accepted.
+ *
+ * @param wio		the I/O wrapper of the UDP socket
+ * @param dg		the datagrams to send
+ * @param cnt		amount of datagrams in ``dg''
+ *
+ * @return the amount of datagrams sent, -1 with errno set if the first
+ * datagram could not be sent.
+ */
+static int
+socket_plain_sendmmsg(struct wrap_io *wio, wrap_dgram_t *dg, unsigned cnt)
+{
+	struct gnutella_socket *s = wio->ctx;
+	unsigned i;
+
+	socket_check(s);
+	g_assert(!socket_uses_tls(s));
+	g_assert(dg != NULL);
+	g_assert(cnt != 0);
+
+#ifdef HAS_SENDMMSG
+	{
+		static bool unsupported;
+
+		if G_LIKELY(!unsupported) {
+			static const struct msghdr zero_msg;
+			struct mmsghdr msg[SOCK_SENDMMSG_MAX];
+			iovec_t iov[SOCK_SENDMMSG_MAX];
+			socket_addr_t addr[SOCK_SENDMMSG_MAX];
+			unsigned n = MIN(cnt, SOCK_SENDMMSG_MAX);
+			int r;
+
+			for (i = 0; i < n; i++) {
+				socklen_t len = socket_sendto_addr(s, dg[i].to, &addr[i]);
+
+				if (0 == len)
+					break;		/* Send what we have so far */
+
+				iovec_set(&iov[i], deconstify_pointer(dg[i].data), dg[i].len);
+				msg[i].msg_hdr = zero_msg;
+				msg[i].msg_hdr.msg_name = socket_addr_get_sockaddr(&addr[i]);
+				msg[i].msg_hdr.msg_namelen = len;
+				msg[i].msg_hdr.msg_iov = &iov[i];
+				msg[i].msg_hdr.msg_iovlen = 1;
+				msg[i].msg_len = 0;
+			}
+
+			if (0 == i)
+				return -1;		/* errno set by socket_sendto_addr() */
+
+			r = sendmmsg(s->file_desc, msg, i, 0);
+
+			if (r > 0) {
+				int j;
+
+				for (j = 0; j < r; j++)
+					dg[j].sent = msg[j].msg_len;
+
+				return r;
+			}
+
+			if (-1 == r && ENOSYS != errno) {
+				if (GNET_PROPERTY(udp_debug)) {
+					int e = errno;
+					g_warning("sendmmsg() failed: %m");
+					errno = e;
+				}
+				return -1;
+			}
+
+			unsupported = TRUE;		/* Use sendto() from now on */
+		}
+	}
+#endif	/* HAS_SENDMMSG */
+
+	for (i = 0; i < cnt; i++) {
+		ssize_t r = socket_plain_sendto(wio, dg[i].to, dg[i].data, dg[i].len);
+
+		if ((ssize_t) -1 == r)
+			return 0 == i ? -1 : (int) i;
+
+		dg[i].sent = r;
+	}
+
+	return cnt;
+}
+
 static ssize_t
 socket_no_sendto(struct wrap_io *unused_wio, const gnet_host_t *unused_to,
 	const void *unused_buf, size_t unused_size)
@@ -4763,6 +5120,17 @@ socket_no_sendto(struct wrap_io *unused_wio, const gnet_host_t *unused_to,
 	return -1;
 }
 
+static int
+socket_no_sendmmsg(struct wrap_io *unused_wio, wrap_dgram_t *unused_dg,
+	unsigned unused_cnt)
+{
+	(void) unused_wio;
+	(void) unused_dg;
+	(void) unused_cnt;
+	g_error("no sendmmsg() routine allowed");
+	return -1;
+}
+
 static ssize_t
 socket_no_write(struct wrap_io *unused_wio,
 		const void *unused_buf, size_t unused_size)
@@ -4824,6 +5192,7 @@ socket_wio_link(struct gnutella_socket *s)
 	s->wio.fd = socket_get_fd;
 	s->wio.flush = socket_no_flush;
 	s->wio.bufsize = socket_get_bufsize;
+	s->wio.sendmmsg = socket_no_sendmmsg;
 
 	if (s->flags & SOCK_F_UDP) {
 		s->wio.write = socket_no_write;
@@ -4831,6 +5200,7 @@ socket_wio_link(struct gnutella_socket *s)
 		s->wio.writev = socket_no_writev;
 		s->wio.readv = socket_plain_readv;
 		s->wio.sendto = socket_plain_sendto;
+		s->wio.sendmmsg = socket_plain_sendmmsg;
 	} else if (SOCK_CONN_LISTENING == s->direction) {
 		s->wio.write = socket_no_write;
 		s->wio.read = socket_no_read;
@@ -175,6 +175,8 @@ struct udpctx {
 	struct cevent *queue_ev;			/**< Queue processing event */
 	eslist_t queue;						/**< Queued items (read-ahead) */
 	size_t queued;						/**< Amount of bytes queued */
+	struct udpbatch *batch;				/**< Batched reception ring */
+	unsigned no_batch:1;				/**< Batched reception unsupported */
 };
 
 static inline void
@@ -39,14 +39,21 @@
 
 #include "tx.h"
 #include "tx_deflate.h"
+#include "gnet_stats.h"
 #include "hosts.h"
 #include "sockets.h"
 
 #include "if/gnet_property_priv.h"
 
+#include "lib/aq.h"
+#include "lib/atomic.h"
 #include "lib/cq.h"
 #include "lib/endian.h"
+#include "lib/getcpucount.h"
 #include "lib/mempcpy.h"
+#include "lib/stringify.h"
+#include "lib/teq.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/walloc.h"
 #include "lib/zlib_util.h"
@@ -69,6 +76,8 @@
 #define BUFFER_NAGLE	500		/**< 500 ms */
 #define BUFFER_DELAY	2		/**< 2 secs -- max Nagle delay */
 
+#define DEFLATE_IDLE	60		/**< 60 secs -- release idle lazy stream */
+
 struct buffer {
 	char *arena;				/**< Buffer arena */
 	char *end;					/**< First byte outside buffer */
@@ -100,14 +109,57 @@ struct attr {
 	tx_closed_t closed;			/**< Callback to invoke when layer closed */
 	void *closed_arg;			/**< Argument for closing routine */
 	time_t nagle_start;			/**< When we started the Nagle timer */
+	time_t last_input;			/**< When we last compressed data */
+	cevent_t *idle_ev;			/**< Idle stream release check */
+	struct deflate_job *job;	/**< Job for worker threads, if offloading */
+	char *stage;				/**< Input staged for the next job */
+	size_t staged;				/**< Amount of staged input bytes */
+	size_t stage_size;			/**< Size of the staging arena */
+	int window_bits;			/**< Compression window, in bits */
+	int mem_level;				/**< Memory level for compression state */
+	int level;					/**< Compression level */
 	struct {
 		bool		enabled;	/**< Whether to use gzip encapsulation */
 		uint32		size;		/**< Payload size counter for gzip */
 		uLong		crc;		/**< CRC-32 accumlator for gzip */
 	} gzip;
 	unsigned nagle:1;			/**< Whether to use Nagle or not */
+	unsigned lazy:1;			/**< Allocate stream lazily, free when idle */
+	unsigned resumed:1;			/**< Stream released once already */
 };
 
+/*
+ * Compression job, when offloading to the worker threads.
+ */
+
+enum deflate_job_magic { DEFLATE_JOB_MAGIC = 0x4be0a1f7 };
+
+struct deflate_job {
+	enum deflate_job_magic magic;	/**< Magic number */
+	txdrv_t *tx;				/**< Owning link, NULL when orphaned */
+	z_streamp outz;				/**< Stream, set whilst being processed */
+	char *arena;				/**< Input arena */
+	size_t arena_size;			/**< Size of the input arena */
+	size_t in_off;				/**< Offset of first unconsumed input byte */
+	size_t in_len;				/**< Total amount of input in arena */
+	char *out;					/**< Where output goes */
+	size_t out_len;				/**< Room available for output */
+	char *out_arena;			/**< Output arena, freed by orphaned job */
+	size_t out_size;			/**< Size of the output arena */
+	size_t consumed;			/**< Input consumed by worker */
+	size_t produced;			/**< Output produced by worker */
+	int flush;					/**< Flushing mode for deflate() */
+	int ret;					/**< Status of deflate(), set by worker */
+	bool cancelled;				/**< Set when the owning link is gone */
+};
+
+static inline void
+deflate_job_check(const struct deflate_job * const job)
+{
+	g_assert(job != NULL);
+	g_assert(DEFLATE_JOB_MAGIC == job->magic);
+}
+
 /*
  * Operating flags.
  */
@@ -116,14 +168,206 @@ struct attr {
 #define DF_NAGLE		0x00000002	/**< Nagle timer started */
 #define DF_FLUSH		0x00000004	/**< Flushing started */
 #define DF_SHUTDOWN		0x00000008	/**< Stack has shut down */
+#define DF_FLUSH_REQ	0x00000010	/**< Flush requested (offloading) */
+#define DF_JOB			0x00000020	/**< Job processed by workers */
 
 static void deflate_nagle_timeout(cqueue_t *cq, void *arg);
+static void deflate_offload_flush(txdrv_t *tx);
 static size_t tx_deflate_pending(txdrv_t *tx);
 
 #define tx_deflate_debugging(lvl) \
 	G_UNLIKELY(GNET_PROPERTY(tx_deflate_debug) > (lvl) && \
 		tx_debug_host(&tx->host))
 
+/**
+ * Compute the approximate amount of memory used by a compressing stream.
+ *
+ * As documented in zconf.h, this is:
+ *
+ *	(1 << (window_bits + 2)) + (1 << (mem_level + 9))
+ *
+ * to which zlib adds a few KiB for its internal state, which we ignore.
+ */
+static size_t
+deflate_stream_memory(int window_bits, int mem_level)
+{
+	return ((size_t) 1 << (window_bits + 2)) + ((size_t) 1 << (mem_level + 9));
+}
+
+/**
+ * @return memory that a stream would use with default zlib parameters.
+ */
+static size_t
+deflate_stream_full_memory(void)
+{
+	return deflate_stream_memory(MAX_WBITS, MAX_MEM_LEVEL);
+}
+
+/**
+ * Account for the allocation or the release of the compressing stream.
+ */
+static void
+deflate_stream_account(const struct attr *attr, bool allocated)
+{
+	int memory = deflate_stream_memory(attr->window_bits, attr->mem_level);
+	int sign = allocated ? +1 : -1;
+
+	gnet_stats_count_general(GNR_TX_DEFLATE_STREAMS, sign);
+	gnet_stats_count_general(GNR_TX_DEFLATE_MEMORY, sign * memory);
+	gnet_stats_count_general(GNR_TX_DEFLATE_MEMORY_SAVED, -sign * memory);
+}
+
+/**
+ * Allocate the compressing stream.
+ *
+ * @return TRUE if OK, FALSE on error.
+ */
+static bool
+deflate_stream_alloc(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz;
+	int window_bits;
+	int ret;
+
+	g_assert(NULL == attr->outz);
+
+	WALLOC(outz);
+	outz->zalloc = zlib_alloc_func;
+	outz->zfree = zlib_free_func;
+	outz->opaque = NULL;
+
+	/*
+	 * With gzip encapsulation, we emit the header ourselves and need a
+	 * raw deflate stream.
+	 *
+	 * When we resume compression after having released an idle stream,
+	 * the zlib header was already sent with the first stream, so the new
+	 * one must also be raw: since the previous stream was fully flushed
+	 * but not finished, the remote inflater sees the new deflate blocks
+	 * as a mere continuation.
+	 */
+
+	window_bits = (attr->gzip.enabled || attr->resumed) ?
+		-attr->window_bits : attr->window_bits;
+
+	ret = deflateInit2(outz, attr->level, Z_DEFLATED,
+			window_bits, attr->mem_level, Z_DEFAULT_STRATEGY);
+
+	if (Z_OK != ret) {
+		g_warning("unable to initialize compressor for peer %s: %s",
+			gnet_host_to_string(&tx->host), zlib_strerror(ret));
+		WFREE(outz);
+		return FALSE;
+	}
+
+	attr->outz = outz;
+	deflate_stream_account(attr, TRUE);
+
+	return TRUE;
+}
+
+/**
+ * Free the compressing stream.
+ */
+static void
+deflate_stream_free(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	int ret;
+
+	g_assert(NULL != attr->outz);
+
+	/*
+	 * We ignore Z_DATA_ERROR errors (discarded data, probably).
+	 */
+
+	ret = deflateEnd(attr->outz);
+
+	if (Z_OK != ret && Z_DATA_ERROR != ret)
+		g_warning("while freeing compressor for peer %s: %s",
+			gnet_host_to_string(&tx->host), zlib_strerror(ret));
+
+	WFREE(attr->outz);
+	attr->outz = NULL;
+	deflate_stream_account(attr, FALSE);
+}
+
+/**
+ * Called from the callout queue to check whether the stream is idle.
+ *
+ * When nothing was compressed for DEFLATE_IDLE seconds and everything was
+ * flushed, the compressing stream is released.  It will be allocated again
+ * when new data come.
+ */
+static void
+deflate_idle_timeout(cqueue_t *cq, void *arg)
+{
+	txdrv_t *tx = arg;
+	struct attr *attr = tx->opaque;
+	time_delta_t elapsed;
+
+	cq_zero(cq, &attr->idle_ev);
+
+	g_assert(attr->lazy);
+
+	if (NULL == attr->outz)
+		return;
+
+	elapsed = delta_time(tm_time(), attr->last_input);
+
+	if (
+		elapsed < DEFLATE_IDLE ||
+		0 != attr->unflushed ||
+		0 != attr->staged ||
+		(attr->job != NULL && attr->job->in_off != attr->job->in_len) ||
+		(attr->flags & (DF_NAGLE | DF_FLUSH | DF_FLUSH_REQ | DF_JOB)) ||
+		(tx->flags & (TX_ERROR | TX_CLOSING))
+	) {
+		int delay = elapsed < DEFLATE_IDLE ? DEFLATE_IDLE - elapsed : DEFLATE_IDLE;
+		attr->idle_ev =
+			cq_insert(attr->cq, delay * 1000, deflate_idle_timeout, tx);
+		return;
+	}
+
+	if (tx_deflate_debugging(4)) {
+		g_debug("TX %s: (%s) releasing stream idle for %s",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			compact_time(elapsed));
+	}
+
+	deflate_stream_free(tx);
+	attr->resumed = TRUE;
+	gnet_stats_inc_general(GNR_TX_DEFLATE_STREAMS_RELEASED);
+}
+
+/**
+ * Make sure the compressing stream is allocated before we compress data.
+ *
+ * @return TRUE if OK, FALSE on error, the layer being shutdown.
+ */
+static bool
+deflate_stream_ensure(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+
+	if G_LIKELY(attr->outz != NULL)
+		return TRUE;
+
+	if (!deflate_stream_alloc(tx)) {
+		attr->flags |= DF_SHUTDOWN;
+		(*attr->cb->shutdown)(tx->owner, "Compression setup failed");
+		return FALSE;
+	}
+
+	if (attr->lazy && NULL == attr->idle_ev) {
+		attr->idle_ev = cq_insert(attr->cq, DEFLATE_IDLE * 1000,
+			deflate_idle_timeout, tx);
+	}
+
+	return TRUE;
+}
+
 /**
  * Write ready-to-be-sent buffer to the lower layer.
  */
@@ -391,6 +635,16 @@ deflate_flush(txdrv_t *tx)
 	int ret;
 	int old_avail;
 
+	/*
+	 * If the stream was released (or not allocated yet), there is nothing
+	 * pending within zlib.
+	 */
+
+	if (NULL == outz) {
+		g_assert(0 == attr->unflushed);
+		goto done;
+	}
+
 retry:
 	b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
 
@@ -418,7 +672,14 @@ retry:
 
 	g_assert(outz->avail_out > 0);
 
-	ret = deflate(outz, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
+	/*
+	 * A resumed stream is a continuation of the first one, which cannot be
+	 * properly finished: the trailer would not match what the remote end
+	 * got from the first stream.
+	 */
+
+	ret = deflate(outz, ((tx->flags & TX_CLOSING) && !attr->resumed) ?
+		Z_FINISH : Z_SYNC_FLUSH);
 
 	switch (ret) {
 	case Z_BUF_ERROR:				/* Nothing to flush */
@@ -483,6 +744,11 @@ deflate_flush_send(txdrv_t *tx)
 {
 	struct attr *attr = tx->opaque;
 
+	if (attr->job != NULL) {
+		deflate_offload_flush(tx);
+		return;
+	}
+
 	/*
 	 * During deflate_flush(), we can fill the current buffer, then call
 	 * deflate_rotate_and_send() and finish the flush.  But it is possible
@@ -545,13 +811,17 @@ deflate_nagle_timeout(cqueue_t *cq, void *arg)
  * Compress as much data as possible to the output buffer, sending data
  * as we go along.
  *
+ * The data is fed to zlib directly from the caller's buffer: there is no
+ * intermediate copy.  Once all the input has been consumed, the caller
+ * must invoke deflate_fed() to handle Nagle and flushing.
+ *
  * @return the amount of input bytes that were consumed ("added"), -1 on error.
  */
 static int
-deflate_add(txdrv_t *tx, const void *data, int len)
+deflate_feed(txdrv_t *tx, const void *data, int len)
 {
 	struct attr *attr = tx->opaque;
-	z_streamp outz = attr->outz;
+	z_streamp outz;
 	int added = 0;
 
 	if (tx_deflate_debugging(9)) {
@@ -572,6 +842,12 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 	if G_UNLIKELY(tx->flags & TX_ERROR)
 		return -1;
 
+	if (!deflate_stream_ensure(tx))
+		return -1;
+
+	outz = attr->outz;
+	attr->last_input = tm_time();
+
 	while (added < len) {
 		struct buffer *b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
 		int ret;
@@ -678,6 +954,19 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 
 	g_assert(0 == outz->avail_in);
 
+	return added;
+}
+
+/**
+ * Called once all the data given by the upper layer has been compressed.
+ *
+ * @return FALSE on error.
+ */
+static bool
+deflate_fed(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+
 	/*
 	 * Start Nagle if not already on.
 	 */
@@ -695,12 +984,502 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 
 	if (attr->unflushed > attr->buffer_flush) {
 		if (!deflate_flush(tx))
-			return -1;
+			return FALSE;
 	}
 
+	return TRUE;
+}
+
+/**
+ * Compress data, handling Nagle and flushing when all the data was taken.
+ *
+ * @return the amount of input bytes that were consumed ("added"), -1 on error.
+ */
+static int
+deflate_add(txdrv_t *tx, const void *data, int len)
+{
+	int added;
+
+	added = deflate_feed(tx, data, len);
+
+	if (added == len && !deflate_fed(tx))
+		return -1;
+
 	return added;
 }
 
+/***
+ *** Compression offloading to worker threads.
+ ***/
+
+/*
+ * When offloading, compression is performed by a pool of worker threads.
+ *
+ * Each link has a single job, which is either idle or being processed by
+ * the workers, hence completions for a given link are handled in order.
+ *
+ * Data given by the upper layer are copied into a staging arena, which is
+ * handed over to the job when it is idle.  The worker compresses straight
+ * into the filling buffer, which the main thread leaves alone whilst the
+ * job is being processed.  When the job completes, the main thread updates
+ * the buffer, then handles Nagle, flushing and flow-control exactly as it
+ * does when compressing by itself.
+ */
+
+static aqueue_t *deflate_aq;		/**< Jobs for the workers */
+static uint deflate_workers;		/**< Amount of worker threads running */
+static bool deflate_workers_inited;
+
+static void deflate_job_done(void *arg);
+
+/**
+ * Main loop of compression workers.
+ */
+static void *
+deflate_thread_main(void *arg)
+{
+	aqueue_t *aq = arg;
+
+	thread_set_name("TX deflate");
+
+	for (;;) {
+		struct deflate_job *job;
+		z_streamp outz;
+
+		job = aq_remove(aq);
+		if G_UNLIKELY(NULL == job)
+			break;
+
+		deflate_job_check(job);
+
+		if (atomic_bool_get(&job->cancelled)) {
+			job->ret = Z_OK;
+			job->consumed = job->produced = 0;
+			goto done;
+		}
+
+		outz = job->outz;
+		outz->next_in = cast_to_pointer(&job->arena[job->in_off]);
+		outz->avail_in = job->in_len - job->in_off;
+		outz->next_out = cast_to_pointer(job->out);
+		outz->avail_out = job->out_len;
+
+		job->ret = deflate(outz, job->flush);
+		job->consumed = job->in_len - job->in_off - outz->avail_in;
+		job->produced = job->out_len - outz->avail_out;
+
+	done:
+		teq_post(THREAD_MAIN_ID, deflate_job_done, job);
+	}
+
+	aq_refcnt_dec(aq);
+
+	return NULL;
+}
+
+/**
+ * Launch the compression workers, once.
+ *
+ * @return whether there are workers to process compression jobs.
+ */
+static bool
+deflate_workers_init(void)
+{
+	uint i, n;
+
+	if G_LIKELY(deflate_workers_inited)
+		return deflate_workers != 0;
+
+	deflate_workers_inited = TRUE;
+
+	n = GNET_PROPERTY(tx_deflate_workers);
+	n = MIN(n, UNSIGNED(MAX(1, getcpucount() - 1)));
+
+	if (0 == n)
+		return FALSE;
+
+	deflate_aq = aq_make();
+
+	for (i = 0; i < n; i++) {
+		int r;
+
+		r = thread_create(deflate_thread_main, aq_refcnt_inc(deflate_aq),
+				THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_NO_POOL,
+				THREAD_STACK_MIN);
+
+		if (-1 == r) {
+			g_warning("%s(): cannot create TX compression thread: %m",
+				G_STRFUNC);
+			aq_refcnt_dec(deflate_aq);
+			break;
+		}
+
+		deflate_workers++;
+	}
+
+	if (GNET_PROPERTY(tx_deflate_debug)) {
+		g_debug("TX deflate started %u compression worker%s",
+			PLURAL(deflate_workers));
+	}
+
+	return deflate_workers != 0;
+}
+
+/**
+ * Stop the compression workers.
+ */
+void
+tx_deflate_close_workers(void)
+{
+	uint i;
+
+	for (i = 0; i < deflate_workers; i++)
+		aq_put(deflate_aq, NULL);		/* Signals end of processing */
+
+	deflate_workers = 0;
+
+	if (deflate_aq != NULL) {
+		aq_refcnt_dec(deflate_aq);
+		deflate_aq = NULL;
+	}
+}
+
+/**
+ * Create compression job for link.
+ */
+static struct deflate_job *
+deflate_job_make(txdrv_t *tx, size_t size)
+{
+	struct deflate_job *job;
+
+	WALLOC0(job);
+	job->magic = DEFLATE_JOB_MAGIC;
+	job->tx = tx;
+	job->arena = walloc(size);
+	job->arena_size = size;
+
+	return job;
+}
+
+/**
+ * Free compression job, along with the resources it was given when orphaned.
+ */
+static void
+deflate_job_free(struct deflate_job *job)
+{
+	deflate_job_check(job);
+
+	if (job->outz != NULL) {
+		(void) deflateEnd(job->outz);
+		WFREE(job->outz);
+	}
+	if (job->out_arena != NULL)
+		wfree(job->out_arena, job->out_size);
+	wfree(job->arena, job->arena_size);
+	job->magic = 0;
+	WFREE(job);
+}
+
+/**
+ * Detach the job from its link, which is being destroyed.
+ *
+ * If the job is still processed by the workers, it takes ownership of the
+ * stream and the filling buffer, and will be freed upon completion.
+ */
+static void
+deflate_job_detach(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_job *job = attr->job;
+
+	deflate_job_check(job);
+
+	attr->job = NULL;
+
+	if (!(attr->flags & DF_JOB)) {
+		job->outz = NULL;
+		deflate_job_free(job);
+		return;
+	}
+
+	g_assert(job->outz == attr->outz);
+
+	job->tx = NULL;
+	job->out_arena = attr->buf[attr->fill_idx].arena;
+	job->out_size = attr->buffer_size;
+	attr->buf[attr->fill_idx].arena = NULL;
+	deflate_stream_account(attr, FALSE);
+	attr->outz = NULL;
+	atomic_bool_set(&job->cancelled, TRUE);
+}
+
+/**
+ * Give pending work to the compression workers, if any.
+ */
+static void
+deflate_offload_run(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_job *job = attr->job;
+	struct buffer *b;
+
+	deflate_job_check(job);
+
+	if (attr->flags & (DF_JOB | DF_SHUTDOWN))
+		return;
+
+	if (tx->flags & TX_ERROR)
+		return;
+
+	/*
+	 * When the job consumed all its input, it can be given the staged data,
+	 * the staging arena being replaced by the now empty job arena.
+	 */
+
+	if (job->in_off == job->in_len) {
+		if (attr->flags & DF_FLUSH_REQ) {
+			attr->flags &= ~DF_FLUSH_REQ;
+			attr->flags |= DF_FLUSH;
+		}
+
+		if (0 == attr->staged && !(attr->flags & DF_FLUSH))
+			return;				/* Nothing to do */
+
+		g_assert(job->arena_size == attr->stage_size);
+
+		{
+			char *arena = job->arena;
+			job->arena = attr->stage;
+			attr->stage = arena;
+		}
+		job->in_off = 0;
+		job->in_len = attr->staged;
+		attr->staged = 0;
+	}
+
+	/*
+	 * We need room in the filling buffer.  If it is full and the send buffer
+	 * is still busy, we'll be called again by the service routine.
+	 */
+
+	b = &attr->buf[attr->fill_idx];
+
+	if (b->wptr >= b->end) {
+		if (-1 != attr->send_idx)
+			return;
+
+		deflate_rotate_and_send(tx);	/* Can set TX_ERROR */
+
+		if (tx->flags & TX_ERROR)
+			return;
+
+		b = &attr->buf[attr->fill_idx];
+	}
+
+	if (!deflate_stream_ensure(tx))
+		return;
+
+	job->outz = attr->outz;
+	job->out = b->wptr;
+	job->out_len = b->end - b->wptr;
+	job->consumed = job->produced = 0;
+
+	if (attr->flags & DF_FLUSH) {
+		job->flush = ((tx->flags & TX_CLOSING) && !attr->resumed) ?
+			Z_FINISH : Z_SYNC_FLUSH;
+	} else {
+		job->flush = Z_NO_FLUSH;
+	}
+
+	g_assert(job->out_len > 0);
+
+	attr->flags |= DF_JOB;
+	aq_put(deflate_aq, job);
+}
+
+/**
+ * Request a flush of the compressed data when offloading.
+ */
+static void
+deflate_offload_flush(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+
+	/*
+	 * If there is no stream, there is nothing to flush.  We still need to
+	 * send the filling buffer if it holds data.
+	 */
+
+	if (NULL == attr->outz && 0 == attr->staged) {
+		struct buffer *b = &attr->buf[attr->fill_idx];
+
+		if (-1 == attr->send_idx && b->rptr != b->wptr)
+			deflate_rotate_and_send(tx);
+		return;
+	}
+
+	attr->flags |= DF_FLUSH_REQ;
+	deflate_offload_run(tx);
+}
+
+/**
+ * Invoked in the main thread when a worker completed a job.
+ */
+static void
+deflate_job_done(void *arg)
+{
+	struct deflate_job *job = arg;
+	struct attr *attr;
+	struct buffer *b;
+	txdrv_t *tx;
+	int ret;
+
+	deflate_job_check(job);
+	g_assert(thread_is_main());
+
+	if (NULL == job->tx) {		/* Link was destroyed meanwhile */
+		deflate_job_free(job);
+		return;
+	}
+
+	tx = job->tx;
+	attr = tx->opaque;
+
+	g_assert(attr->flags & DF_JOB);
+	g_assert(job == attr->job);
+
+	attr->flags &= ~DF_JOB;
+	job->outz = NULL;
+
+	b = &attr->buf[attr->fill_idx];
+
+	g_assert(b->wptr == job->out);
+
+	b->wptr += job->produced;
+	job->in_off += job->consumed;
+	attr->unflushed += job->consumed;
+	attr->flushed += job->produced;
+
+	if (NULL != attr->cb->add_tx_deflated)
+		attr->cb->add_tx_deflated(tx->owner, job->produced);
+
+	/*
+	 * Z_BUF_ERROR is returned when flushing with nothing to flush.
+	 */
+
+	ret = job->ret;
+
+	if (Z_OK != ret && Z_STREAM_END != ret && Z_BUF_ERROR != ret) {
+		attr->flags |= DF_SHUTDOWN;
+		tx_error(tx);
+
+		/* XXX: The callback must not destroy the tx! */
+		(*attr->cb->shutdown)(tx->owner, "Compression failed: %s",
+			zlib_strerror(ret));
+		return;
+	}
+
+	/*
+	 * The flush is complete when all the input was consumed and deflate()
+	 * did not run out of output space.
+	 */
+
+	if (
+		(attr->flags & DF_FLUSH) &&
+		job->in_off == job->in_len && job->produced < job->out_len
+	) {
+		deflate_flushed(tx);
+
+		if (-1 == attr->send_idx && b->rptr != b->wptr)
+			deflate_rotate_and_send(tx);	/* Can set TX_ERROR */
+	} else if (b->wptr >= b->end && -1 == attr->send_idx) {
+		deflate_rotate_and_send(tx);		/* Can set TX_ERROR */
+	}
+
+	if (tx->flags & TX_ERROR)
+		return;
+
+	if ((tx->flags & TX_CLOSING) && 0 != attr->staged)
+		attr->flags |= DF_FLUSH_REQ;
+
+	deflate_offload_run(tx);
+
+	if (tx->flags & TX_CLOSING) {
+		if (NULL != attr->closed && 0 == tx_deflate_pending(tx))
+			(*attr->closed)(tx, attr->closed_arg);
+		return;
+	}
+
+	/*
+	 * Leave flow-control if we have room for more data, and service the
+	 * upper layer, which could have been waiting on us.
+	 */
+
+	if ((attr->flags & DF_FLOWC) && attr->staged < attr->stage_size)
+		deflate_set_flowc(tx, FALSE);
+
+	if (!(attr->flags & DF_FLOWC) && (tx->flags & TX_SERVICE)) {
+		g_assert(tx->srv_routine);
+		tx->srv_routine(tx->srv_arg);
+	}
+}
+
+/**
+ * Stage data for compression by the workers.
+ *
+ * @return amount of bytes accepted.
+ */
+static ssize_t
+deflate_offload_writev(txdrv_t *tx, const iovec_t *iov, int iovcnt)
+{
+	struct attr *attr = tx->opaque;
+	size_t sent = 0;
+	bool fed = FALSE, partial = FALSE;
+
+	if (attr->flags & (DF_FLOWC|DF_SHUTDOWN))
+		return 0;
+
+	if G_UNLIKELY(tx->flags & TX_ERROR)
+		return -1;
+
+	while (iovcnt-- > 0) {
+		size_t len = iovec_len(iov);
+		size_t n = MIN(len, attr->stage_size - attr->staged);
+
+		memcpy(&attr->stage[attr->staged], iovec_base(iov), n);
+		attr->staged += n;
+		sent += n;
+
+		if (n < len) {
+			partial = TRUE;
+			break;
+		}
+
+		fed = TRUE;
+		iov++;
+	}
+
+	if (sent != 0)
+		attr->last_input = tm_time();
+
+	if (fed) {
+		if (attr->flags & DF_NAGLE)
+			deflate_nagle_delay(tx);
+		else
+			deflate_nagle_start(tx);
+
+		if (attr->unflushed + attr->staged > attr->buffer_flush)
+			attr->flags |= DF_FLUSH_REQ;
+	}
+
+	deflate_offload_run(tx);
+
+	if (partial)
+		deflate_set_flowc(tx, TRUE);
+
+	return sent;
+}
+
 /**
  * Service routine for the compressing stage.
  *
@@ -766,12 +1545,23 @@ deflate_service(void *data)
 	if (-1 == attr->send_idx)
 		tx_srv_disable(tx->lower);
 
+	/*
+	 * When offloading, resume the job if it was waiting for a free buffer.
+	 */
+
+	if (attr->job != NULL)
+		deflate_offload_run(tx);
+
 	/*
 	 * If we entered flow control, we can now safely leave it, since we
-	 * have at least a free `fill' buffer.
+	 * have at least a free `fill' buffer.  When offloading, we also need
+	 * room in the staging arena.
 	 */
 
-	if (attr->flags & DF_FLOWC)
+	if (
+		(attr->flags & DF_FLOWC) &&
+		(NULL == attr->job || attr->staged < attr->stage_size)
+	)
 		deflate_set_flowc(tx, FALSE);	/* Leave flow control state */
 
 	/*
@@ -825,17 +1615,13 @@ tx_deflate_init(txdrv_t *tx, void *args)
 {
 	struct attr *attr;
 	struct tx_deflate_args *targs = args;
-	z_streamp outz;
-	int ret;
 	int i;
 
 	g_assert(tx);
 	g_assert(NULL != targs->cb);
+	g_assert(!(targs->lazy && targs->gzip));
 
-	WALLOC(outz);
-	outz->zalloc = zlib_alloc_func;
-	outz->zfree = zlib_free_func;
-	outz->opaque = NULL;
+	WALLOC0(attr);
 
 	/*
 	 * Reduce memory requirements for deflation when running as an ultrapeer.
@@ -868,6 +1654,13 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	 * of compression).
 	 *
 	 *		--RAM, 2011-11-29
+	 *
+	 * When "low_memory" is requested, windows are shrunk further: 16 KiB +
+	 * 16 KiB for reduced connections and 64 KiB + 128 KiB for the others.
+	 *
+	 * Moreover, a "lazy" stream is only allocated when the first data come
+	 * and is released after DEFLATE_IDLE seconds without traffic, which
+	 * saves the whole compression state on quiet connections.
 	 */
 
 	{
@@ -877,38 +1670,51 @@ tx_deflate_init(txdrv_t *tx, void *args)
 
 		if (targs->reduced) {
 			/* Ultra -> Leaf connection */
-			window_bits = 14;
-			mem_level = 6;
+			window_bits = targs->low_memory ? 12 : 14;
+			mem_level = targs->low_memory ? 5 : 6;
 			level = Z_DEFAULT_COMPRESSION;
+		} else if (targs->low_memory) {
+			window_bits = 14;
+			mem_level = 8;
 		}
 
-		g_assert(window_bits >= 8 && window_bits <= MAX_WBITS);
+		g_assert(window_bits >= 9 && window_bits <= MAX_WBITS);
 		g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
 		g_assert(level == Z_DEFAULT_COMPRESSION ||
 			(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION));
 
-		ret = deflateInit2(outz, level, Z_DEFLATED,
-				targs->gzip ? (-window_bits) : window_bits, mem_level,
-				Z_DEFAULT_STRATEGY);
+		attr->window_bits = window_bits;
+		attr->mem_level = mem_level;
+		attr->level = level;
 	}
 
-	if (Z_OK != ret) {
-		g_warning("unable to initialize compressor for peer %s: %s",
-			gnet_host_to_string(&tx->host), zlib_strerror(ret));
-		WFREE(outz);
-		return NULL;
-	}
-
-	WALLOC0(attr);
 	attr->cq = targs->cq;
 	attr->cb = targs->cb;
 	attr->buffer_size = targs->buffer_size;
 	attr->buffer_flush = targs->buffer_flush;
 	attr->nagle = booleanize(targs->nagle);
+	attr->lazy = booleanize(targs->lazy);
 	attr->gzip.enabled = targs->gzip;
 
-	attr->outz = outz;
+	attr->outz = NULL;
 	attr->tm_ev = NULL;
+	attr->idle_ev = NULL;
+
+	tx->opaque = attr;
+
+	if (!attr->lazy && !deflate_stream_alloc(tx)) {
+		WFREE(attr);
+		tx->opaque = NULL;
+		return NULL;
+	}
+
+	/*
+	 * We account memory savings relative to a full stream, which would
+	 * otherwise have been allocated upfront.
+	 */
+
+	gnet_stats_count_general(GNR_TX_DEFLATE_MEMORY_SAVED,
+		deflate_stream_full_memory());
 
 	for (i = 0; i < BUFFER_COUNT; i++) {
 		struct buffer *b = &attr->buf[i];
@@ -920,6 +1726,17 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	attr->fill_idx = 0;
 	attr->send_idx = -1;		/* Signals: none ready */
 
+	/*
+	 * When offloading compression to the workers, we stage up to two
+	 * buffers worth of input whilst the previous data are compressed.
+	 */
+
+	if (targs->offload && !attr->gzip.enabled && deflate_workers_init()) {
+		attr->stage_size = 2 * attr->buffer_size;
+		attr->stage = walloc(attr->stage_size);
+		attr->job = deflate_job_make(tx, attr->stage_size);
+	}
+
 	if (attr->gzip.enabled) {
 		/* See RFC 1952 - GZIP file format specification version 4.3 */
 		static const unsigned char header[] = {
@@ -940,8 +1757,6 @@ tx_deflate_init(txdrv_t *tx, void *args)
 		attr->gzip.size = 0;
 	}
 
-	tx->opaque = attr;
-
 	/*
 	 * Register our service routine to the lower layer.
 	 */
@@ -959,27 +1774,26 @@ tx_deflate_destroy(txdrv_t *tx)
 {
 	struct attr *attr = tx->opaque;
 	int i;
-	int ret;
 
-	g_assert(attr->outz);
+	if (attr->job != NULL) {
+		wfree(attr->stage, attr->stage_size);
+		deflate_job_detach(tx);
+	}
 
 	for (i = 0; i < BUFFER_COUNT; i++) {
 		struct buffer *b = &attr->buf[i];
-		wfree(b->arena, attr->buffer_size);
+		if (b->arena != NULL)
+			wfree(b->arena, attr->buffer_size);
 	}
 
-	/*
-	 * We ignore Z_DATA_ERROR errors (discarded data, probably).
-	 */
+	if (attr->outz != NULL)
+		deflate_stream_free(tx);
 
-	ret = deflateEnd(attr->outz);
+	gnet_stats_count_general(GNR_TX_DEFLATE_MEMORY_SAVED,
+		-deflate_stream_full_memory());
 
-	if (Z_OK != ret && Z_DATA_ERROR != ret)
-		g_warning("while freeing compressor for peer %s: %s",
-			gnet_host_to_string(&tx->host), zlib_strerror(ret));
-
-	WFREE(attr->outz);
 	cq_cancel(&attr->tm_ev);
+	cq_cancel(&attr->idle_ev);
 	WFREE(attr);
 }
 
@@ -1007,6 +1821,15 @@ tx_deflate_write(txdrv_t *tx, const void *data, size_t len)
 	if (attr->flags & (DF_FLOWC|DF_SHUTDOWN))
 		return 0;
 
+	if (attr->job != NULL) {
+		iovec_t iov;
+
+		iovec_set_base(&iov, deconstify_pointer(data));
+		iovec_set_len(&iov, len);
+
+		return deflate_offload_writev(tx, &iov, 1);
+	}
+
 	return deflate_add(tx, data, len);
 }
 
@@ -1020,6 +1843,7 @@ tx_deflate_writev(txdrv_t *tx, iovec_t *iov, int iovcnt)
 {
 	struct attr *attr = tx->opaque;
 	int sent = 0;
+	bool fed = FALSE;
 
 	if (tx_deflate_debugging(9)) {
 		g_debug("TX %s: (%s) (buffer #%d, nagle %s, unflushed %zu) [%c%c]",
@@ -1029,6 +1853,15 @@ tx_deflate_writev(txdrv_t *tx, iovec_t *iov, int iovcnt)
 			(attr->flags & DF_FLUSH) ? 'f' : '-');
 	}
 
+	if (attr->job != NULL)
+		return deflate_offload_writev(tx, iov, iovcnt);
+
+	/*
+	 * Each message is compressed straight from the I/O vector, and the
+	 * Nagle and flushing logic is only run once for the whole vector,
+	 * provided at least one message could be entirely compressed.
+	 */
+
 	while (iovcnt-- > 0) {
 		int ret;
 
@@ -1039,7 +1872,7 @@ tx_deflate_writev(txdrv_t *tx, iovec_t *iov, int iovcnt)
 		if (attr->flags & (DF_FLOWC|DF_SHUTDOWN))
 			break;
 
-		ret = deflate_add(tx, iovec_base(iov), iovec_len(iov));
+		ret = deflate_feed(tx, iovec_base(iov), iovec_len(iov));
 
 		if (-1 == ret)
 			return -1;
@@ -1049,9 +1882,13 @@ tx_deflate_writev(txdrv_t *tx, iovec_t *iov, int iovcnt)
 			/* Could not write all, flow-controlled */
 			break;
 		}
+		fed = TRUE;
 		iov++;
 	}
 
+	if (fed && !deflate_fed(tx))
+		return -1;
+
 	if (tx_deflate_debugging(9)) {
 		g_debug("TX %s: (%s) sent %lu bytes (buffer #%d, nagle %s, "
 			"unflushed %zu) [%c%c]", G_STRFUNC,
@@ -1094,6 +1931,17 @@ tx_deflate_pending(txdrv_t *tx)
 
 	pending = deflate_buffered(tx);
 
+	/*
+	 * When offloading, account for the data not yet compressed and make
+	 * sure a running job keeps us from being considered empty.
+	 */
+
+	if (attr->job != NULL) {
+		pending += attr->staged + (attr->job->in_len - attr->job->in_off);
+		if (0 == pending && (attr->flags & DF_JOB))
+			pending = 1;
+	}
+
 	/*
 	 * Account for deflation of pending bytes, using the current compression
 	 * ratio (EMA) to estimate how much we're going to emit.
@@ -40,6 +40,7 @@
 #include "lib/cq.h"
 
 const struct txdrv_ops *tx_deflate_get_ops(void);
+void tx_deflate_close_workers(void);
 
 /**
  * Callbacks used by the deflating layer.
@@ -61,6 +62,9 @@ struct tx_deflate_args {
 	bool nagle;					/**< Whether to use Nagle or not */
 	bool gzip;					/**< Whether to use gzip encapsulation */
 	bool reduced;				/**< Whether to use reduced compression */
+	bool low_memory;			/**< Whether to use smaller windows */
+	bool lazy;					/**< Allocate stream lazily, free when idle */
+	bool offload;				/**< Compress in worker threads if possible */
 };
 
 #endif	/* _core_tx_deflate_h_ */
@@ -111,6 +111,20 @@ static const enum net_type udp_sched_net_type[UDP_SCHED_NET_CNT] = {
 	NET_TYPE_IPV6,			/* UDP_SCHED_IPv6 */
 };
 
+#define UDP_SCHED_BATCH		32	/**< Max messages sent in one batch */
+
+struct udp_tx_desc;
+
+/**
+ * Batch of messages gathered for sending through the same I/O source.
+ */
+struct udp_sched_batch {
+	struct udp_tx_desc *txd[UDP_SCHED_BATCH];	/**< Gathered messages */
+	wrap_dgram_t dg[UDP_SCHED_BATCH];			/**< Datagrams to send */
+	bio_source_t *bio;							/**< I/O source to use */
+	unsigned cnt;								/**< Amount gathered */
+};
+
 /**
  * The UDP TX scheduler object.
  *
@@ -132,6 +146,8 @@ struct udp_sched {
 	udp_sched_socket_cb_t get_socket;		/**< Get the UDP socket by net */
 	eslist_t lifo[PMSG_P_COUNT];	/**< LIFO stacks of TX descriptors */
 	eslist_t tx_released;			/**< Deferred TX descriptor freeing */
+	eslist_t unsent;				/**< Gathered but unsent descriptors */
+	struct udp_sched_batch batch;	/**< Messages gathered for sending */
 	bsched_bws_t bws;				/**< Bandwidth scheduler to use */
 	hset_t *seen;					/**< Remembers destinations processed */
 	hash_list_t *stacks;			/**< TX stacks using us */
@@ -433,7 +449,9 @@ udp_tx_drop(const txdrv_t *tx, const struct tx_dgram_cb *cb)
 }
 
 /**
- * Send message block to IP:port.
+ * Select the I/O source through which a message block must be sent.
+ *
+ * Messages that can no longer be sent are dropped.
  *
  * @param us		the UDP scheduler
  * @param mb		the message to send
@@ -441,20 +459,17 @@ udp_tx_drop(const txdrv_t *tx, const struct tx_dgram_cb *cb)
  * @param tx		the TX stack sending the message
  * @param cb		callback actions on the datagram
  *
- * @return TRUE if message was sent or dropped, FALSE if there is no more
- * bandwidth to send anything.
+ * @return the I/O source to use, NULL if the message was dropped.
  */
-static bool
-udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+static bio_source_t *
+udp_sched_mb_source(const udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	const txdrv_t *tx, const struct tx_dgram_cb *cb)
 {
-	ssize_t r;
-	int len = pmsg_size(mb);
 	bio_source_t *bio = NULL;
 
 	if (0 == gnet_host_get_port(to)) {
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_ZERO_PORT);
-		return TRUE;
+		return NULL;
 	}
 
 	/*
@@ -463,7 +478,7 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 
 	if (!pmsg_can_transmit(mb)) {
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_NO_LONGER_NEEDED);
-		return TRUE;			/* Dropped */
+		return NULL;			/* Dropped */
 	}
 
 	/*
@@ -491,31 +506,53 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 		udp_sched_log(4, "%p: discarding mb=%p (%d bytes) to %s",
 			us, mb, pmsg_written_size(mb), gnet_host_to_string(to));
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_NO_SOCKET);
-		return udp_tx_drop(tx, cb);		/* TRUE, for "sent" */
+		udp_tx_drop(tx, cb);
 	}
 
-	/*
-	 * OK, proceed if we have bandwidth.
-	 */
-
-	r = bio_sendto(bio, to, pmsg_phys_base(mb), len);
+	return bio;
+}
 
-	if (r < 0) {		/* Error, or no bandwidth */
-		if (udp_sched_write_error(us, to, mb, G_STRFUNC)) {
-			udp_sched_log(4, "%p: dropped mb=%p (%d bytes): %m",
-				us, mb, pmsg_written_size(mb));
-			gnet_stats_inc_general(GNR_UDP_SCHED_DROP_IO_ERROR);
-			return udp_tx_drop(tx, cb);	/* TRUE, for "sent" */
-		}
-		udp_sched_log(3, "%p: no bandwidth for mb=%p (%d bytes)",
+/**
+ * Handle failure to send a message block, errno being set.
+ *
+ * @return TRUE if message was dropped, FALSE if there is no more
+ * bandwidth to send anything.
+ */
+static bool
+udp_sched_mb_failed(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb)
+{
+	if (udp_sched_write_error(us, to, mb, G_STRFUNC)) {
+		udp_sched_log(4, "%p: dropped mb=%p (%d bytes): %m",
 			us, mb, pmsg_written_size(mb));
-		us->used_all = TRUE;
-		return FALSE;
+		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_IO_ERROR);
+		return udp_tx_drop(tx, cb);	/* TRUE, for "sent" */
 	}
+	udp_sched_log(3, "%p: no bandwidth for mb=%p (%d bytes)",
+		us, mb, pmsg_written_size(mb));
+	us->used_all = TRUE;
+	return FALSE;
+}
 
-	if (r != len) {
+/**
+ * Account for a message block that was sent.
+ *
+ * @param us		the UDP scheduler
+ * @param mb		the message sent
+ * @param to		the IP:port destination of the message
+ * @param tx		the TX stack sending the message
+ * @param cb		callback actions on the datagram
+ * @param r			amount of bytes sent
+ */
+static void
+udp_sched_mb_sent(const udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb, size_t r)
+{
+	int len = pmsg_size(mb);
+
+	if (r != UNSIGNED(len)) {
 		/* This should never happen with UDP/IP since datagrams are atomic */
-		g_warning("%s: partial UDP write (%zd bytes) to %s "
+		g_warning("%s: partial UDP write (%zu bytes) to %s "
 			"for %d-byte datagram",
 			G_STRFUNC, r, gnet_host_to_string(to), len);
 	} else {
@@ -543,20 +580,140 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 
 		inet_udp_record_sent(gnet_host_get_addr(to));
 	}
+}
+
+/**
+ * Send message block to IP:port.
+ *
+ * @param us		the UDP scheduler
+ * @param mb		the message to send
+ * @param to		the IP:port destination of the message
+ * @param tx		the TX stack sending the message
+ * @param cb		callback actions on the datagram
+ *
+ * @return TRUE if message was sent or dropped, FALSE if there is no more
+ * bandwidth to send anything.
+ */
+static bool
+udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb)
+{
+	ssize_t r;
+	bio_source_t *bio;
+
+	bio = udp_sched_mb_source(us, mb, to, tx, cb);
+
+	if (NULL == bio)
+		return TRUE;			/* Dropped */
+
+	/*
+	 * OK, proceed if we have bandwidth.
+	 */
+
+	r = bio_sendto(bio, to, pmsg_phys_base(mb), pmsg_size(mb));
+
+	if (r < 0)			/* Error, or no bandwidth */
+		return udp_sched_mb_failed(us, mb, to, tx, cb);
+
+	udp_sched_mb_sent(us, mb, to, tx, cb, r);
 
 	return TRUE;		/* Message sent */
 }
 
 /**
- * Send message (eslist iterator callback).
+ * Forget that we processed a destination in this scheduling round.
+ */
+static void
+udp_sched_seen_remove(udp_sched_t *us, const gnet_host_t *to)
+{
+	const void *atom;
+
+	if (hset_contains_extended(us->seen, to, &atom)) {
+		hset_remove(us->seen, atom);
+		atom_host_free(atom);
+	}
+}
+
+/**
+ * Flush the batch of messages gathered by udp_tx_desc_gather().
  *
- * @return TRUE if message was sent and freed up.
+ * Messages are handed to the kernel in as few system calls as possible,
+ * in the order in which they were gathered.  Messages we could not send
+ * for lack of bandwidth are moved to the ``unsent'' list, to be put back
+ * at the head of the LIFO they were taken from.
+ */
+static void
+udp_sched_batch_flush(udp_sched_t *us)
+{
+	struct udp_sched_batch *b = &us->batch;
+	unsigned i = 0;
+
+	while (i < b->cnt) {
+		int r;
+		unsigned j;
+
+		r = bio_sendmmsg(b->bio, &b->dg[i], b->cnt - i);
+
+		if (r < 0) {
+			struct udp_tx_desc *txd = b->txd[i];
+
+			if (!udp_sched_mb_failed(us, txd->mb, txd->to, txd->tx, txd->cb))
+				break;		/* No more bandwidth */
+
+			if (PMSG_P_DATA == pmsg_prio(txd->mb))
+				udp_sched_seen_remove(us, txd->to);
+
+			us->buffered = size_saturate_sub(us->buffered, b->dg[i].len);
+			udp_tx_desc_flag_release(txd, us);
+			i++;
+			continue;
+		}
+
+		for (j = 0; j < UNSIGNED(r); j++, i++) {
+			struct udp_tx_desc *txd = b->txd[i];
+
+			udp_sched_mb_sent(us, txd->mb, txd->to, txd->tx, txd->cb,
+				b->dg[i].sent);
+			us->buffered = size_saturate_sub(us->buffered, b->dg[i].len);
+			udp_tx_desc_flag_release(txd, us);
+		}
+	}
+
+	/*
+	 * Whatever remains could not be sent: un-remember their destination
+	 * since we did not send anything there, and keep them for later.
+	 */
+
+	for (/* empty */; i < b->cnt; i++) {
+		struct udp_tx_desc *txd = b->txd[i];
+
+		if (PMSG_P_DATA == pmsg_prio(txd->mb))
+			udp_sched_seen_remove(us, txd->to);
+
+		eslist_mark_removed(&us->unsent, txd);		/* For assertions */
+		eslist_append(&us->unsent, txd);
+	}
+
+	b->cnt = 0;
+	b->bio = NULL;
+}
+
+/**
+ * Gather message for sending (eslist iterator callback).
+ *
+ * Messages are not sent immediately but collected into a batch which is
+ * flushed when full, or when the next message needs to go through another
+ * I/O source.  The batch is also flushed at the end of the LIFO traversal.
+ *
+ * @return TRUE if message was removed from the LIFO.
  */
 static bool
-udp_tx_desc_send(void *data, void *udata)
+udp_tx_desc_gather(void *data, void *udata)
 {
 	struct udp_tx_desc *txd = data;
 	udp_sched_t *us = udata;
+	struct udp_sched_batch *b = &us->batch;
+	bio_source_t *bio;
 	unsigned prio;
 
 	udp_sched_check(us);
@@ -576,6 +733,9 @@ udp_tx_desc_send(void *data, void *udata)
 	 *
 	 * 2- It somehow delays consecutive packets to a given host thereby reducing
 	 *    flooding and hopefully avoiding saturation of its RX flow.
+	 *
+	 * Destinations are recorded as soon as the message is gathered, and
+	 * forgotten by udp_sched_batch_flush() if the message cannot be sent.
 	 */
 
 	prio = pmsg_prio(txd->mb);
@@ -586,15 +746,33 @@ udp_tx_desc_send(void *data, void *udata)
 		return FALSE;
 	}
 
-	if (udp_sched_mb_sendto(us, txd->mb, txd->to, txd->tx, txd->cb)) {
-		if (PMSG_P_DATA == prio && pmsg_was_sent(txd->mb))
-			hset_insert(us->seen, atom_host_get(txd->to));
-	} else {
-		return FALSE;		/* Unsent, leave it in the queue */
+	bio = udp_sched_mb_source(us, txd->mb, txd->to, txd->tx, txd->cb);
+
+	if (NULL == bio) {
+		us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
+		udp_tx_desc_flag_release(txd, us);
+		return TRUE;		/* Dropped */
 	}
 
-	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
-	udp_tx_desc_flag_release(txd, us);
+	if (b->cnt != 0 && (bio != b->bio || N_ITEMS(b->txd) == b->cnt)) {
+		udp_sched_batch_flush(us);
+		if (us->used_all) {
+			/* Bandwidth exhausted, leave message in the LIFO */
+			return FALSE;
+		}
+	}
+
+	if (PMSG_P_DATA == prio)
+		hset_insert(us->seen, atom_host_get(txd->to));
+
+	b->bio = bio;
+	b->txd[b->cnt] = txd;
+	b->dg[b->cnt].to = txd->to;
+	b->dg[b->cnt].data = pmsg_phys_base(txd->mb);
+	b->dg[b->cnt].len = pmsg_size(txd->mb);
+	b->dg[b->cnt].sent = 0;
+	b->cnt++;
+
 	return TRUE;
 }
 
@@ -746,13 +924,26 @@ udp_sched_send(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 
 /**
  * Process LIFO queue, sending out messages until we have no more bandwidth.
+ *
+ * Messages are sent in batches to limit the amount of system calls.
  */
 static void
 udp_sched_process(udp_sched_t *us, eslist_t *list)
 {
 	udp_sched_check(us);
 
-	eslist_foreach_remove(list, udp_tx_desc_send, us);
+	eslist_foreach_remove(list, udp_tx_desc_gather, us);
+
+	if (us->batch.cnt != 0)
+		udp_sched_batch_flush(us);
+
+	/*
+	 * Messages gathered but left unsent for lack of bandwidth are put back
+	 * at the head of the LIFO, where they were taken from.
+	 */
+
+	if (0 != eslist_count(&us->unsent))
+		eslist_prepend_list(list, &us->unsent);
 }
 
 /**
@@ -1023,6 +1214,7 @@ udp_sched_make(
 		eslist_init(&us->lifo[i], offsetof(struct udp_tx_desc, lnk));
 	}
 	eslist_init(&us->tx_released, offsetof(struct udp_tx_desc, lnk));
+	eslist_init(&us->unsent, offsetof(struct udp_tx_desc, lnk));
 	us->seen =
 		hset_create_any(gnet_host_hash, gnet_host_hash2, gnet_host_equal);
 	us->stacks = hash_list_new(udp_tx_stack_hash, udp_tx_stack_eq);
@@ -80,6 +80,7 @@
 #include "if/dht/dht.h"		/* For dht_enabled() */
 
 #include "lib/aging.h"
+#include "lib/aio.h"
 #include "lib/array_util.h"
 #include "lib/ascii.h"
 #include "lib/atoms.h"
@@ -1576,6 +1577,10 @@ upload_free_resources(struct upload *u)
 	}
 #endif /* HAS_MMAP */
 
+	if (u->aio != NULL) {
+		aio_cancel(&u->aio, u->buffer, hfree);	/* Engine frees buffer */
+		u->buffer = NULL;
+	}
 	HFREE_NULL(u->buffer);
 	if (u->io_opaque) {				/* I/O data */
 		io_free(u->io_opaque);
@@ -1625,6 +1630,7 @@ upload_clone(struct upload *u)
 
 	upload_check(u);
 	g_assert(NULL == u->reply);
+	g_assert(NULL == u->aio);
 
 	entropy_harvest_time();
 
@@ -6638,6 +6644,64 @@ upload_handle_exception(struct upload *u, inputevt_cond_t cond)
 	return FALSE;
 }
 
+/**
+ * Completion callback for the asynchronous read of the next file chunk.
+ */
+static void
+upload_aio_read_done(void *arg, ssize_t r, int error)
+{
+	struct upload *u = cast_to_upload(arg);
+
+	g_assert(u->aio != NULL);
+
+	u->aio = NULL;		/* Request freed by the engine on return */
+
+	if ((ssize_t) -1 == r) {
+		upload_remove(u, N_("File read error: %s"), g_strerror(error));
+		return;
+	}
+	if (0 == r) {
+		upload_remove(u, N_("File EOF?"));
+		return;
+	}
+
+	u->bsize = (size_t) r;
+	u->bpos = 0;
+
+	/*
+	 * Data is available again, resume sending.
+	 */
+
+	bio_add_callback(u->bio, upload_writable, u);
+}
+
+/**
+ * Attempt to read the next chunk of the file asynchronously.
+ *
+ * On success, the output source is paused until the read completes so that
+ * we do not block the event loop on a slow disk.
+ *
+ * @return TRUE if the read was submitted, FALSE if the caller must read
+ * synchronously.
+ */
+static bool
+upload_aio_read(struct upload *u)
+{
+	g_assert(NULL == u->aio);
+
+	if (!aio_is_active())
+		return FALSE;
+
+	u->aio = aio_pread(file_object_fd(u->file), u->buffer, u->buf_size,
+		u->pos, upload_aio_read_done, u);
+
+	if (NULL == u->aio)
+		return FALSE;
+
+	bio_remove_callback(u->bio);
+	return TRUE;
+}
+
 /**
  * Called when output source can accept more data.
  */
@@ -6706,6 +6770,10 @@ upload_writable(void *obj, int unused_source, inputevt_cond_t cond)
 
 			g_assert(u->buffer != NULL);
 			g_assert(u->buf_size > 0);
+
+			if (upload_aio_read(u))
+				return;		/* Resumed by upload_aio_read_done() */
+
 			ret = file_object_pread(u->file, u->buffer, u->buf_size, u->pos);
 			if ((ssize_t) -1 == ret) {
 				upload_remove(u, N_("File read error: %s"), g_strerror(errno));
@@ -96,6 +96,7 @@ struct upload {
 	int bpos;
 	int bsize;
 	int buf_size;
+	struct aio_req *aio;			/**< Pending asynchronous file read */
 
 	uint file_index;
 	uint reqnum;				/**< Request number, incremented when serving */
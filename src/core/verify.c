@@ -47,6 +47,14 @@
  * so each thread can use almost all its processing ticks to actually compute
  * the hash value.
  *
+ * Each verification context is actually a pool of workers sharing the same
+ * work queue, so that several files can be hashed concurrently.  Every worker
+ * runs in its own thread, with its own hashing state, and processes the next
+ * file in the queue as soon as it is done with the current one: high-priority
+ * requests, which are put at the head of the queue, are therefore handled by
+ * the first worker becoming available.  The amount of workers is configured
+ * by the "verify_workers" property.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003, 2013
  */
@@ -72,35 +80,52 @@
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hashlist.h"
+#include "lib/pow2.h"
 #include "lib/str.h"
 #include "lib/stringify.h"		/* For short_time_ascii() */
 #include "lib/teq.h"
 #include "lib/thread.h"
 #include "lib/tm.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"	/* Must be the last header included */
 
-#define HASH_BUF_SIZE		(128 * 1024)	/**< Size of the reading buffer */
+#define HASH_BUF_SIZE		(512 * 1024)	/**< Size of the reading buffer */
 
-#define HASH_THREAD_MAX			2			/**< At most 2 hashing threads */
+#define VERIFY_WORKERS_MAX		8			/**< Max workers per verification */
+#define HASH_THREAD_MAX			(2 * VERIFY_WORKERS_MAX)	/**< SHA-1 + TTH */
 #define VERIFY_DEFERRED			10			/**< ms: deferred free timeout */
 #define VERIFY_PROGRESS_NOTIFY	1			/**< s: progress notification */
 
 #define VERIFY_INVALID_LOCAL_ID -1U
 
 enum verify_magic { VERIFY_MAGIC = 0x2dc84379U };
+enum verify_pool_magic { VERIFY_POOL_MAGIC = 0x7b10e52aU };
+
+/**
+ * Pool of verification workers, all processing the same work queue.
+ */
+struct verify_pool {
+	enum verify_pool_magic magic;	/**< Magic number. */
+	hash_list_t *files_to_hash;	/**< Work queue, shared by all workers */
+	struct verify **workers;	/**< Workers, the first one being the handle */
+	uint count;					/**< Amount of workers */
+};
 
 /**
- * Verification task context.
+ * Verification task context, one per worker.
  */
 struct verify {
 	enum verify_magic magic;	/**< Magic number. */
-	hash_list_t *files_to_hash;	/**< Work queue */
+	struct verify_pool *pool;	/**< Pool to which this worker belongs */
 	const struct verify_hash hash;	/**< Hash-specific processing callbacks */
+	void *hctx;					/**< Hash-specific computation context */
 	struct bgtask *task;		/**< Background task handling the processing */
 	bgsched_t *sched;			/**< Task scheduler for this thread */
 	unsigned verify_stid;		/**< Verification thread ID */
+	uint id;					/**< Worker index within the pool */
+	int wakeup;					/**< Whether a wakeup event is pending */
 
 	file_object_t *file;		/**< The file object to access the file. */
 	filesize_t offset;			/**< Current offset into the file. */
@@ -126,22 +151,29 @@ verify_check(const struct verify * const ctx)
 	g_assert(VERIFY_MAGIC == ctx->magic);
 }
 
+static inline void
+verify_pool_check(const struct verify_pool * const vp)
+{
+	g_assert(vp);
+	g_assert(VERIFY_POOL_MAGIC == vp->magic);
+}
+
 static inline void
 verify_hash_init(const struct verify * const ctx)
 {
-	ctx->hash.init(ctx->end - ctx->start);
+	ctx->hash.init(ctx->hctx, ctx->end - ctx->start);
 }
 
 static inline int
 verify_hash_update(const struct verify * const ctx, const void *data, size_t n)
 {
-	return ctx->hash.update(data, n);
+	return ctx->hash.update(ctx->hctx, data, n);
 }
 
 static inline int
 verify_hash_final(const struct verify * const ctx)
 {
-	return ctx->hash.final();
+	return ctx->hash.final(ctx->hctx);
 }
 
 static inline const char *
@@ -335,6 +367,48 @@ verify_elapsed(const struct verify *ctx)
 	return d;
 }
 
+/**
+ * The callback function may call this to get at the hash-specific context
+ * of the worker that processed the file, to fetch the computed digest.
+ */
+void *
+verify_hash_context(const struct verify *ctx)
+{
+	verify_check(ctx);
+	return ctx->hctx;
+}
+
+/**
+ * Check whether other workers of the pool are still hashing a file.
+ *
+ * This is meant to be called from the callback, when processing of the
+ * current file is over, to determine whether hashing is still going on.
+ *
+ * @return TRUE if another worker than ``ctx'' is hashing a file.
+ */
+bool
+verify_pool_busy(const struct verify *ctx)
+{
+	const struct verify_pool *vp;
+	uint i;
+
+	verify_check(ctx);
+	vp = ctx->pool;
+	verify_pool_check(vp);
+
+	for (i = 0; i < vp->count; i++) {
+		const struct verify *w = vp->workers[i];
+
+		if (w == ctx)
+			continue;
+
+		if (VERIFY_START == w->status || VERIFY_PROGRESS == w->status)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 static uint
 verify_item_hash(const void *key)
 {
@@ -566,10 +640,11 @@ verify_thread_create_if_needed(struct verify *v)
 	/*
 	 * When there are more than 2 CPUs, we are on a multi-core system and we
 	 * create one thread per verification.  If they have only 2 CPUs, then we
-	 * just create a single thread to handle all the verifications.
+	 * just create a single thread to handle all the verifications, unless
+	 * they explicitly configured more than one worker.
 	 */
 
-	if (cpus <= 2) {
+	if (cpus <= 2 && 1 == v->pool->count) {
 		if G_UNLIKELY(NULL == verify_bs) {
 			static const char name[] = "verify";
 
@@ -580,7 +655,9 @@ verify_thread_create_if_needed(struct verify *v)
 			v->verify_stid = verify_id;
 		}
 	} else {
-		const char *tname = str_smsg("verify %s", verify_hash_name(v));
+		const char *tname = 1 == v->pool->count ?
+			str_smsg("verify %s", verify_hash_name(v)) :
+			str_smsg("verify %s #%u", verify_hash_name(v), v->id + 1);
 		const char *name = constant_str(tname);
 
 		bgsched_t *bs = bg_sched_create(name, 1000000);		/* 1 sec */
@@ -588,6 +665,56 @@ verify_thread_create_if_needed(struct verify *v)
 	}
 }
 
+/**
+ * @return the amount of workers to create for each verification context.
+ */
+static uint
+verify_worker_count(void)
+{
+	uint n = GNET_PROPERTY(verify_workers);
+
+	/*
+	 * By default, keep one CPU for the main thread and share the remaining
+	 * ones between the SHA-1 and TTH verifications, which can run at the
+	 * same time during library rescans.
+	 */
+
+	if (0 == n) {
+		long cpus = getcpucount();
+		n = MAX(cpus - 1, 0) / 2;
+	}
+
+	return MAX(1, MIN(n, VERIFY_WORKERS_MAX));
+}
+
+/**
+ * Create a new verification worker.
+ *
+ * @param vp		the pool to which the worker belongs
+ * @param hash		hash-specific callbacks for this hash verification
+ * @param id		worker index within the pool
+ *
+ * @return the new worker context.
+ */
+static struct verify *
+verify_worker_new(struct verify_pool *vp, const struct verify_hash *hash,
+	uint id)
+{
+	struct verify *ctx;
+
+	WALLOC0(ctx);
+	ctx->magic = VERIFY_MAGIC;
+	ctx->pool = vp;
+	ctx->id = id;
+	ctx->buffer_size = HASH_BUF_SIZE;
+	ctx->buffer = vmm_alloc(ctx->buffer_size);	/* Page-aligned */
+	STATIC_ASSERT(sizeof ctx->hash == sizeof(struct verify_hash));
+	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
+	ctx->hctx = hash->alloc();
+
+	return ctx;
+}
+
 /**
  * Create a new verification context.
  *
@@ -599,22 +726,29 @@ verify_thread_create_if_needed(struct verify *v)
 struct verify *
 verify_new(const struct verify_hash *hash)
 {
-	struct verify *ctx;
+	struct verify_pool *vp;
+	uint i;
 
 	g_assert(hash);
 
-	WALLOC0(ctx);
-	ctx->magic = VERIFY_MAGIC;
-	ctx->buffer_size = HASH_BUF_SIZE;
-	ctx->buffer = halloc(ctx->buffer_size);
-	STATIC_ASSERT(sizeof ctx->hash == sizeof(struct verify_hash));
-	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
-	ctx->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
-	hash_list_thread_safe(ctx->files_to_hash);
+	WALLOC0(vp);
+	vp->magic = VERIFY_POOL_MAGIC;
+	vp->count = verify_worker_count();
+	vp->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
+	hash_list_thread_safe(vp->files_to_hash);
+	HALLOC_ARRAY(vp->workers, vp->count);
 
-	verify_thread_create_if_needed(ctx);
+	for (i = 0; i < vp->count; i++) {
+		vp->workers[i] = verify_worker_new(vp, hash, i);
+		verify_thread_create_if_needed(vp->workers[i]);
+	}
 
-	return ctx;
+	if (GNET_PROPERTY(verify_debug)) {
+		g_debug("created %u worker%s for %s verification",
+			PLURAL(vp->count), hash->name());
+	}
+
+	return vp->workers[0];
 }
 
 /**
@@ -623,73 +757,103 @@ verify_new(const struct verify_hash *hash)
 static void
 verify_deferred_free(cqueue_t *cq, void *data)
 {
-	struct verify *ctx = data;
+	struct verify_pool *vp = data;
 	unsigned i;
 
-	verify_check(ctx);
+	verify_pool_check(vp);
 
 	/*
-	 * We do not free the verification context until the thread that uses it
-	 * has not marked it was about to exit by clearing its corresponding
+	 * We do not free the verification context until the threads that use it
+	 * have all marked they were about to exit by clearing their corresponding
 	 * entry in verify_threads[].
 	 */
 
-	i = verify_thread_local_id(ctx->verify_stid, FALSE);
+	for (i = 0; i < vp->count; i++) {
+		struct verify *ctx = vp->workers[i];
 
-	if (i != VERIFY_INVALID_LOCAL_ID) {
-		/*
-		 * Thread has not terminated yet, could have pending RPCs...
-		 */
+		verify_check(ctx);
 
-		if (GNET_PROPERTY(verify_debug) > 1) {
-			g_debug("verification %s for %s not terminated yet",
-				thread_id_name(ctx->verify_stid), verify_hash_name(ctx));
-		}
+		if (
+			VERIFY_INVALID_LOCAL_ID !=
+				verify_thread_local_id(ctx->verify_stid, FALSE)
+		) {
+			/*
+			 * Thread has not terminated yet, could have pending RPCs...
+			 */
+
+			if (GNET_PROPERTY(verify_debug) > 1) {
+				g_debug("verification %s for %s not terminated yet",
+					thread_id_name(ctx->verify_stid), verify_hash_name(ctx));
+			}
 
-		cq_insert(cq, VERIFY_DEFERRED, verify_deferred_free, ctx);
-	} else {
-		if (GNET_PROPERTY(verify_debug) > 1) {
-			g_debug("freeing %s verification context", verify_hash_name(ctx));
+			cq_insert(cq, VERIFY_DEFERRED, verify_deferred_free, vp);
+			return;
 		}
+	}
 
-		hash_list_free(&ctx->files_to_hash);
+	if (GNET_PROPERTY(verify_debug) > 1) {
+		g_debug("freeing %s verification context",
+			verify_hash_name(vp->workers[0]));
+	}
+
+	for (i = 0; i < vp->count; i++) {
+		struct verify *ctx = vp->workers[i];
+
+		ctx->hash.free(ctx->hctx);
+		VMM_FREE_NULL(ctx->buffer, ctx->buffer_size);
 		ctx->magic = 0;
 		WFREE(ctx);
 	}
+
+	hash_list_free(&vp->files_to_hash);
+	HFREE_NULL(vp->workers);
+	vp->magic = 0;
+	WFREE(vp);
 }
 
 /**
  * Free verification context and nullify its pointer.
  *
  * The actual physical disposal of the verification context is deferred until
- * the thread responsible for handling the work has terminated.
+ * the threads responsible for handling the work have terminated.
  */
 void
 verify_free(struct verify **ptr)
 {
-	struct verify *ctx = *ptr;
+	struct verify *handle = *ptr;
 
-	if (ctx != NULL) {
-		verify_check(ctx);
-		g_assert(!ctx->shutdowned);
+	if (handle != NULL) {
+		struct verify_pool *vp = handle->pool;
+		uint i;
+
+		verify_check(handle);
+		verify_pool_check(vp);
+		g_assert(handle == vp->workers[0]);
 
-		if (ctx->task != NULL) {
-			bg_task_cancel(ctx->task);
-			ctx->task = NULL;
+		for (i = 0; i < vp->count; i++) {
+			struct verify *ctx = vp->workers[i];
+
+			g_assert(!ctx->shutdowned);
+
+			if (ctx->task != NULL) {
+				bg_task_cancel(ctx->task);
+				ctx->task = NULL;
+			}
+
+			ctx->shutdowned = TRUE;
+			thread_kill(ctx->verify_stid, TSIG_TERM);
 		}
 
-		ctx->shutdowned = TRUE;
-		thread_kill(ctx->verify_stid, TSIG_TERM);
 		*ptr = NULL;
 
 		/*
-		 * Defer freeing of the context until the thread is dead
+		 * Defer freeing of the context until the threads are dead
 		 *
-		 * We leave the ctx->files_to_hash list around as well because
+		 * We leave the vp->files_to_hash list around as well because
 		 * it could still be accessed by other threads.
 		 */
 
-		cq_main_insert(VERIFY_DEFERRED, verify_deferred_free, ctx);
+		cq_main_insert(VERIFY_DEFERRED, verify_deferred_free, vp);
 	}
 }
 
@@ -724,7 +888,7 @@ verify_next_file(struct verify *ctx)
 	verify_check(ctx);
 	g_assert(NULL == ctx->file);
 
-	item = hash_list_shift(ctx->files_to_hash);
+	item = hash_list_shift(ctx->pool->files_to_hash);
 	if (item != NULL) {
 		verify_file_check(item);
 
@@ -734,6 +898,14 @@ verify_next_file(struct verify *ctx)
 		ctx->end = item->offset + item->amount;
 		ctx->offset = ctx->start;
 
+		/*
+		 * Initialize the hashing context before notifying the start, so
+		 * that the callback may tune the processing for this file through
+		 * the hash-specific context.
+		 */
+
+		verify_hash_init(ctx);
+
 		if (verify_start(ctx)) {
 			ctx->file = file_object_open(item->pathname, O_RDONLY);
 			if (NULL == ctx->file) {
@@ -759,7 +931,6 @@ verify_next_file(struct verify *ctx)
 			g_debug("verifying %s digest for %s",
 				verify_hash_name(ctx), file_object_pathname(ctx->file));
 		}
-		verify_hash_init(ctx);
 		file_object_fadvise_sequential(ctx->file);
 		ctx->last_progress = ctx->started = tm_time_exact();
 	}
@@ -803,8 +974,18 @@ verify_update(struct verify *ctx)
 		filesize_t amount;
 		size_t n;
 
+		/*
+		 * Read large chunks into our page-aligned buffer, aligning the
+		 * file offsets on the buffer size (a power of 2) so that all the
+		 * reads but the first one start on a page boundary, which is the
+		 * most efficient way to get data from the kernel.
+		 */
+
+		STATIC_ASSERT(IS_POWER_OF_2(HASH_BUF_SIZE));
+
 		amount = ctx->end - ctx->offset;
-		n = MIN(amount, ctx->buffer_size);
+		n = ctx->buffer_size - (ctx->offset & (ctx->buffer_size - 1));
+		n = MIN(amount, n);
 		r = file_object_pread(ctx->file, ctx->buffer, n, ctx->offset);
 	} else {
 		r = 0;
@@ -868,7 +1049,7 @@ verify_queue_flush(void *data)
 	verify_check(ctx);
 	g_assert(thread_is_main());
 
-	while (NULL != (item = hash_list_shift(ctx->files_to_hash))) {
+	while (NULL != (item = hash_list_shift(ctx->pool->files_to_hash))) {
 		/* Setup minimal context to call verify_shutdown() */
 		ctx->user_data = item->user_data;
 		ctx->callback = item->callback;
@@ -905,7 +1086,7 @@ verify_bg_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
 		verify_shutdown(ctx);
 		file_object_close(&ctx->file);
 	}
-	HFREE_NULL(ctx->buffer);
+	VMM_FREE_NULL(ctx->buffer, ctx->buffer_size);
 
 	/*
 	 * Flush the queue.
@@ -940,6 +1121,7 @@ static bgret_t
 verify_step_compute(struct bgtask *bt, void *data, int ticks)
 {
 	struct verify *ctx = data;
+	hash_list_t *queue;
 	int i = ticks;
 	int used = 0;		/* Amount used for CPU-intensive tasks */
 	int light = 0;		/* Amount used for system-intensive tasks */
@@ -947,6 +1129,8 @@ verify_step_compute(struct bgtask *bt, void *data, int ticks)
 	verify_check(ctx);
 	(void) bt;
 
+	queue = ctx->pool->files_to_hash;
+
 	while (i-- > 0) {
 		bg_task_cancel_test(bt);
 		if (NULL == ctx->file) {
@@ -958,7 +1142,7 @@ verify_step_compute(struct bgtask *bt, void *data, int ticks)
 		} else {
 			light++;	/* Did not open file, still processed something */
 		}
-		if (NULL == ctx->file && 0 == hash_list_length(ctx->files_to_hash))
+		if (NULL == ctx->file && 0 == hash_list_length(queue))
 			break;
 	}
 
@@ -974,7 +1158,7 @@ verify_step_compute(struct bgtask *bt, void *data, int ticks)
 	if (used < ticks)
 		bg_task_ticks_used(bt, used);
 
-	if (ctx->file || hash_list_length(ctx->files_to_hash) > 0) {
+	if (ctx->file || hash_list_length(queue) > 0) {
 		return BGR_MORE;
 	} else {
 		return BGR_DONE;
@@ -1044,7 +1228,12 @@ verify_create_task(struct verify *ctx)
 static void
 verify_enqueued(void *arg)
 {
-	verify_create_task(arg);
+	struct verify *ctx = arg;
+
+	verify_check(ctx);
+
+	atomic_int_set(&ctx->wakeup, 0);
+	verify_create_task(ctx);
 }
 
 /**
@@ -1054,7 +1243,7 @@ verify_enqueued(void *arg)
  * not from the verification thread, so that multi-threading be transparent
  * for the calling thread.
  *
- * @param ctx			the verification context
+ * @param handle		the verification context, as returned by verify_new()
  * @param high_priority	whether item should be treated quickly
  * @param pathname		file to be verified
  * @param offset		starting offset where verification should start
@@ -1070,61 +1259,76 @@ verify_enqueued(void *arg)
  * already enqueued.
  */
 bool
-verify_enqueue(struct verify *ctx, int high_priority,
+verify_enqueue(struct verify *handle, int high_priority,
 	const char *pathname, filesize_t offset, filesize_t amount,
 	verify_callback callback, void *user_data)
 {
 	struct verify_file *item;
+	struct verify_pool *vp;
 	int inserted;
 
-	verify_check(ctx);
+	verify_check(handle);
 	g_return_val_if_fail(pathname, FALSE);
 	g_return_val_if_fail(callback, FALSE);
-	g_return_val_if_fail(!ctx->shutdowned, FALSE);
+	g_return_val_if_fail(!handle->shutdowned, FALSE);
+
+	vp = handle->pool;
+	verify_pool_check(vp);
 
 	entropy_harvest_many(
-		PTRLEN(ctx), VARLEN(high_priority),
+		PTRLEN(handle), VARLEN(high_priority),
 		pathname, strsize(pathname),
 		VARLEN(amount), NULL);
 
 	item = verify_file_new(pathname, offset, amount, callback, user_data);
 
-	hash_list_lock(ctx->files_to_hash);
+	hash_list_lock(vp->files_to_hash);
 
-	if (hash_list_contains(ctx->files_to_hash, item)) {
+	if (hash_list_contains(vp->files_to_hash, item)) {
 		if (high_priority)
-			hash_list_moveto_head(ctx->files_to_hash, item);
+			hash_list_moveto_head(vp->files_to_hash, item);
 		inserted = FALSE;
 	} else {
 		if (high_priority) {
-			hash_list_prepend(ctx->files_to_hash, item);
+			hash_list_prepend(vp->files_to_hash, item);
 		} else {
-			hash_list_append(ctx->files_to_hash, item);
+			hash_list_append(vp->files_to_hash, item);
 		}
 		inserted = TRUE;
 	}
 
-	hash_list_unlock(ctx->files_to_hash);
+	hash_list_unlock(vp->files_to_hash);
 
 	if (GNET_PROPERTY(verify_debug)) {
 		g_debug("%s %s digest verification for %s",
 			inserted ? "enqueued" : "already had queued",
-			verify_hash_name(ctx), pathname);
+			verify_hash_name(handle), pathname);
 	}
 
 	/*
 	 * When work was inserted into the queue (represented by the hash list
-	 * here), we signal the thread handling the verification so that it can
-	 * be awoken if it was sleeping: the TSIG_TEQ signal will let the thread
-	 * out of the teq_wait() call in its main processing loop, and the
+	 * here), we signal the threads handling the verification so that they
+	 * can be awoken if they were sleeping: the TSIG_TEQ signal will let each
+	 * thread out of the teq_wait() call in its main processing loop, and the
 	 * verify_enqueued() event callback will make sure we have a background
 	 * task to actually process the work.
+	 *
+	 * Workers that have not processed their previous wakeup event yet are
+	 * not signalled again: they will see the new work anyway.
 	 */
 
-	if (inserted)
-		teq_post(ctx->verify_stid, verify_enqueued, ctx);
-	else
+	if (inserted) {
+		uint i;
+
+		for (i = 0; i < vp->count; i++) {
+			struct verify *ctx = vp->workers[i];
+
+			if (atomic_int_xchg_if_eq(&ctx->wakeup, 0, 1))
+				teq_post(ctx->verify_stid, verify_enqueued, ctx);
+		}
+	} else {
 		verify_file_free(&item);
+	}
 
 	return inserted;
 }
@@ -54,11 +54,19 @@ struct verify;
 typedef bool (*verify_callback)(const struct verify *,
 										enum verify_status, void *user_data);
 
+/**
+ * Hash-specific processing callbacks.
+ *
+ * Each verification worker gets its own hashing state, created by alloc()
+ * and released by free(), which is then given to the other callbacks.
+ */
 struct verify_hash {
 	const char *	(*name)(void);
-	void 			(*init)(filesize_t amount);
-	int  			(*update)(const void *data, size_t size);
-	int 			(*final)(void);
+	void *			(*alloc)(void);
+	void			(*free)(void *hctx);
+	void 			(*init)(void *hctx, filesize_t amount);
+	int  			(*update)(void *hctx, const void *data, size_t size);
+	int 			(*final)(void *hctx);
 };
 
 struct verify *verify_new(const struct verify_hash *);
@@ -71,6 +79,8 @@ bool verify_enqueue(struct verify *, int high_priority,
 enum verify_status verify_status(const struct verify *);
 filesize_t verify_hashed(const struct verify *);
 uint verify_elapsed(const struct verify *);
+void *verify_hash_context(const struct verify *);
+bool verify_pool_busy(const struct verify *);
 
 #endif	/* _core_verify_h_ */
 
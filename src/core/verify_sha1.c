@@ -35,9 +35,12 @@
 
 #include "verify.h"
 
+#include "lib/halloc.h"
 #include "lib/misc.h"
 #include "lib/once.h"
 #include "lib/sha1.h"
+#include "lib/tigertree.h"
+#include "lib/walloc.h"
 
 #include "core/verify_sha1.h"
 
@@ -45,9 +48,22 @@
 
 static struct {
 	struct verify	*verify;
+} verify_sha1;
+
+/**
+ * Per-worker SHA-1 computation state.
+ *
+ * When requested, the TTH is computed along with the SHA-1, from the same
+ * data, so that files needing both hashes are only read once.
+ */
+struct verify_sha1_state {
 	SHA1_context	context;
 	struct sha1		digest;
-} verify_sha1;
+	TTH_CONTEXT		*tth_context;	/**< Allocated on first use */
+	struct tth		tth_digest;
+	filesize_t		amount;			/**< Amount of data to hash */
+	bool			with_tth;		/**< Also compute TTH for current file */
+};
 
 static const char *
 verify_sha1_name(void)
@@ -55,36 +71,69 @@ verify_sha1_name(void)
 	return "SHA-1";
 }
 
+static void *
+verify_sha1_alloc(void)
+{
+	struct verify_sha1_state *vs;
+
+	WALLOC0(vs);
+	return vs;
+}
+
 static void
-verify_sha1_reset(filesize_t amount)
+verify_sha1_free(void *hctx)
 {
+	struct verify_sha1_state *vs = hctx;
+
+	HFREE_NULL(vs->tth_context);
+	WFREE(vs);
+}
+
+static void
+verify_sha1_reset(void *hctx, filesize_t amount)
+{
+	struct verify_sha1_state *vs = hctx;
 	int ret;
 
-	(void) amount;
-	ret = SHA1_reset(&verify_sha1.context);
+	ret = SHA1_reset(&vs->context);
 	g_assert(SHA_SUCCESS == ret);
+
+	vs->amount = amount;
+	vs->with_tth = FALSE;		/* Until verify_sha1_want_tth() is called */
 }
 
 static int
-verify_sha1_update(const void *data, size_t size)
+verify_sha1_update(void *hctx, const void *data, size_t size)
 {
+	struct verify_sha1_state *vs = hctx;
 	int ret;
 
-	ret = SHA1_input(&verify_sha1.context, data, size);
+	ret = SHA1_input(&vs->context, data, size);
+
+	if (vs->with_tth)
+		tt_update(vs->tth_context, data, size);
+
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
 static int
-verify_sha1_final(void)
+verify_sha1_final(void *hctx)
 {
+	struct verify_sha1_state *vs = hctx;
 	int ret;
 
-	ret = SHA1_result(&verify_sha1.context, &verify_sha1.digest);
+	ret = SHA1_result(&vs->context, &vs->digest);
+
+	if (vs->with_tth)
+		tt_digest(vs->tth_context, &vs->tth_digest);
+
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
 static const struct verify_hash verify_hash_sha1 = {
 	verify_sha1_name,
+	verify_sha1_alloc,
+	verify_sha1_free,
 	verify_sha1_reset,
 	verify_sha1_update,
 	verify_sha1_final,
@@ -102,8 +151,81 @@ verify_sha1_enqueue(int high_priority,
 const struct sha1 *
 verify_sha1_digest(const struct verify *ctx)
 {
+	const struct verify_sha1_state *vs;
+
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+
+	vs = verify_hash_context(ctx);
+	return &vs->digest;
+}
+
+/**
+ * Request that the TTH of the file be computed along with its SHA-1.
+ *
+ * This can only be called from the callback, upon reception of the
+ * VERIFY_START notification.  When the VERIFY_DONE notification comes,
+ * the TTH can be fetched through verify_sha1_tth().
+ */
+void
+verify_sha1_want_tth(const struct verify *ctx)
+{
+	struct verify_sha1_state *vs;
+
+	g_return_if_fail(verify_status(ctx) == VERIFY_START);
+
+	vs = verify_hash_context(ctx);
+
+	if (NULL == vs->tth_context)
+		vs->tth_context = halloc(tt_size());
+
+	tt_init(vs->tth_context, vs->amount);
+	vs->with_tth = TRUE;
+}
+
+/**
+ * @return the TTH computed along with the SHA-1, NULL if it was not requested.
+ */
+const struct tth *
+verify_sha1_tth(const struct verify *ctx)
+{
+	const struct verify_sha1_state *vs;
+
 	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_sha1.digest;
+
+	vs = verify_hash_context(ctx);
+	return vs->with_tth ? &vs->tth_digest : NULL;
+}
+
+/**
+ * @return the TTH leaves computed along with the SHA-1.
+ */
+const struct tth *
+verify_sha1_tth_leaves(const struct verify *ctx)
+{
+	const struct verify_sha1_state *vs;
+
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+
+	vs = verify_hash_context(ctx);
+	g_return_val_if_fail(vs->with_tth, NULL);
+
+	return tt_leaves(vs->tth_context);
+}
+
+/**
+ * @return the amount of TTH leaves computed along with the SHA-1.
+ */
+size_t
+verify_sha1_tth_leave_count(const struct verify *ctx)
+{
+	const struct verify_sha1_state *vs;
+
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
+
+	vs = verify_hash_context(ctx);
+	g_return_val_if_fail(vs->with_tth, 0);
+
+	return tt_leave_count(vs->tth_context);
 }
 
 static void G_COLD
@@ -43,6 +43,10 @@ int verify_sha1_enqueue(int high_priority,
 	verify_callback callback, void *user_data);
 
 const struct sha1 *verify_sha1_digest(const struct verify *);
+void verify_sha1_want_tth(const struct verify *);
+const struct tth *verify_sha1_tth(const struct verify *);
+const struct tth *verify_sha1_tth_leaves(const struct verify *);
+size_t verify_sha1_tth_leave_count(const struct verify *);
 
 void verify_sha1_init(void);
 void verify_sha1_close(void);
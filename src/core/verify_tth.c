@@ -48,14 +48,21 @@
 #include "lib/tiger.h"
 #include "lib/tigertree.h"
 #include "lib/tm.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last inclusion */
 
 static struct {
 	struct verify	*verify;
+} verify_tth;
+
+/**
+ * Per-worker TTH computation state.
+ */
+struct verify_tth_state {
 	TTH_CONTEXT		*context;
 	struct tth		digest;
-} verify_tth;
+};
 
 static const char *
 verify_tth_name(void)
@@ -63,35 +70,55 @@ verify_tth_name(void)
 	return "TTH";
 }
 
+static void *
+verify_tth_alloc(void)
+{
+	struct verify_tth_state *vt;
+
+	WALLOC0(vt);
+	vt->context = halloc(tt_size());
+	return vt;
+}
+
+static void
+verify_tth_free(void *hctx)
+{
+	struct verify_tth_state *vt = hctx;
+
+	HFREE_NULL(vt->context);
+	WFREE(vt);
+}
+
 static void
-verify_tth_reset(filesize_t size)
+verify_tth_reset(void *hctx, filesize_t size)
 {
-	if G_LIKELY(verify_tth.context != NULL)
-		tt_init(verify_tth.context, size);
+	struct verify_tth_state *vt = hctx;
+
+	tt_init(vt->context, size);
 }
 
 static int
-verify_tth_update(const void *data, size_t size)
+verify_tth_update(void *hctx, const void *data, size_t size)
 {
-	if G_UNLIKELY(NULL == verify_tth.context)
-		return -1;
+	struct verify_tth_state *vt = hctx;
 
-	tt_update(verify_tth.context, data, size);
+	tt_update(vt->context, data, size);
 	return 0;
 }
 
 static int
-verify_tth_final(void)
+verify_tth_final(void *hctx)
 {
-	if G_UNLIKELY(NULL == verify_tth.context)
-		return -1;
+	struct verify_tth_state *vt = hctx;
 
-	tt_digest(verify_tth.context, &verify_tth.digest);
+	tt_digest(vt->context, &vt->digest);
 	return 0;
 }
 
 static const struct verify_hash verify_hash_tth = {
 	verify_tth_name,
+	verify_tth_alloc,
+	verify_tth_free,
 	verify_tth_reset,
 	verify_tth_update,
 	verify_tth_final,
@@ -100,28 +127,39 @@ static const struct verify_hash verify_hash_tth = {
 const struct tth *
 verify_tth_digest(const struct verify *ctx)
 {
+	const struct verify_tth_state *vt;
+
 	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_tth.digest;
+
+	vt = verify_hash_context(ctx);
+	return &vt->digest;
 }
 
 const struct tth *
 verify_tth_leaves(const struct verify *ctx)
 {
+	const struct verify_tth_state *vt;
+
 	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return tt_leaves(verify_tth.context);
+
+	vt = verify_hash_context(ctx);
+	return tt_leaves(vt->context);
 }
 
 size_t
 verify_tth_leave_count(const struct verify *ctx)
 {
+	const struct verify_tth_state *vt;
+
 	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
-	return tt_leave_count(verify_tth.context);
+
+	vt = verify_hash_context(ctx);
+	return tt_leave_count(vt->context);
 }
 
 static void G_COLD
 verify_tth_init_once(void)
 {
-	verify_tth.context = halloc(tt_size());
 	verify_tth.verify = verify_new(&verify_hash_tth);
 }
 
@@ -152,15 +190,6 @@ verify_tth_shutdown(void)
 	verify_free(&verify_tth.verify);
 }
 
-/**
- * Release memory resources used by tigertree verification.
- */
-void G_COLD
-verify_tth_close(void)
-{
-	HFREE_NULL(verify_tth.context);
-}
-
 static bool
 request_tigertree_callback(const struct verify *ctx, enum verify_status status,
 	void *user_data)
@@ -246,7 +275,7 @@ request_tigertree_callback(const struct verify *ctx, enum verify_status status,
 
 done:
 	shared_file_unref(&sf);
-	gnet_prop_set_boolean_val(PROP_TTH_REBUILDING, FALSE);
+	gnet_prop_set_boolean_val(PROP_TTH_REBUILDING, verify_pool_busy(ctx));
 	return TRUE;
 }
 
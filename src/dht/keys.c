@@ -1670,6 +1670,13 @@ keys_init(void)
 		kv, packing, KEYS_DB_CACHE_SIZE, kuid_hash, kuid_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbstore_set_pagesize(db_keydata, GNET_PROPERTY(dht_storage_page_size));
+	dbmw_set_map_mmap(db_keydata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bloom(db_keydata, GNET_PROPERTY(dht_storage_bloom));
+	dbstore_set_batched(db_keydata, settings_dht_db_dir(), db_keybase,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
+
 	for (i = 0; i < N_ITEMS(decimation_factor); i++)
 		decimation_factor[i] = pow(KEYS_DECIMATION_BASE, i);
 
@@ -1036,8 +1036,8 @@ roots_sync(void *unused_obj)
 {
 	(void) unused_obj;
 
-	dbstore_sync(db_rootdata);
-	dbstore_sync(db_contact);
+	dbstore_sync_flush(db_rootdata);
+	dbstore_sync_flush(db_contact);
 
 	return TRUE;
 }
@@ -1141,6 +1141,12 @@ roots_init(void)
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	dbmw_set_map_cache(db_contact, CONTACT_MAP_CACHE_SIZE);
+	dbstore_set_batched(db_rootdata, settings_dht_db_dir(), db_rootdata_base,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
+	dbstore_set_batched(db_contact, settings_dht_db_dir(), db_contact_base,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
 
 	roots_init_rootinfo();
 	cq_periodic_add(roots_cq, ROOTS_SYNC_PERIOD, roots_sync, NULL);
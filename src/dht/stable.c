@@ -482,7 +482,7 @@ stable_sync(void *unused_obj)
 {
 	(void) unused_obj;
 
-	dbstore_sync(db_lifedata);
+	dbstore_sync_flush(db_lifedata);
 	return TRUE;		/* Keep calling */
 }
 
@@ -533,6 +533,9 @@ stable_init(void)
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	dbmw_set_map_cache(db_lifedata, STABLE_MAP_CACHE_SIZE);
+	dbstore_set_batched(db_lifedata, settings_dht_db_dir(), db_stable_base,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
 
 	if (!crash_was_restarted())
 		stable_prune_old();
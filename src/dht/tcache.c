@@ -422,7 +422,7 @@ tcache_init(void)
 
 	db_tokdata = dbstore_create(db_tcache_what, settings_dht_db_dir(),
 		db_tcache_base, kv, packing, TOK_DB_CACHE_SIZE, kuid_hash, kuid_eq,
-		GNET_PROPERTY(dht_storage_in_memory));
+		GNET_PROPERTY(dht_storage_in_memory) ? DBMAP_MAP : DBMAP_SDBM);
 
 	dbmw_set_map_cache(db_tokdata, TOK_MAP_CACHE_SIZE);
 	dbmw_set_debugging(db_tokdata, &tcache_dbmw_dbg);
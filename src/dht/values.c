@@ -2161,13 +2161,34 @@ values_init(void)
 		uint64_mem_hash, uint64_mem_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
-	db_rawdata = dbstore_open(db_rawwhat, settings_dht_db_dir(), db_rawbase,
-		raw_kv, no_packing, RAW_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
+	/*
+	 * Raw values are written once and deleted when they expire, which
+	 * the log store back-end handles without rewriting whole pages.
+	 */
+
+	db_rawdata = dbstore_open_type(db_rawwhat, settings_dht_db_dir(),
+		db_rawbase, raw_kv, no_packing, RAW_DB_CACHE_SIZE,
+		uint64_mem_hash, uint64_mem_eq,
+		GNET_PROPERTY(dht_storage_log) ? DBMAP_LOG : DBMAP_SDBM,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbstore_set_pagesize(db_valuedata, GNET_PROPERTY(dht_storage_page_size));
+	dbstore_set_pagesize(db_rawdata, GNET_PROPERTY(dht_storage_page_size));
+	dbmw_set_map_mmap(db_valuedata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_mmap(db_rawdata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bloom(db_valuedata, GNET_PROPERTY(dht_storage_bloom));
+	dbmw_set_map_bloom(db_rawdata, GNET_PROPERTY(dht_storage_bloom));
+	dbstore_set_batched(db_valuedata, settings_dht_db_dir(), db_valbase,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
+	dbstore_set_batched(db_rawdata, settings_dht_db_dir(), db_rawbase,
+		GNET_PROPERTY(dht_storage_batch_commits),
+		GNET_PROPERTY(dht_storage_journal));
+
 	db_expired = dbstore_create(db_expwhat, settings_dht_db_dir(), db_expbase,
 		expired_kv, no_packing, 0, kuid_pair_hash, kuid_pair_eq,
-		GNET_PROPERTY(dht_storage_in_memory));
+		GNET_PROPERTY(dht_storage_in_memory) ? DBMAP_MAP :
+		GNET_PROPERTY(dht_storage_log) ? DBMAP_LOG : DBMAP_SDBM);
 
 	values_per_ip = acct_net_create();
 	values_per_class_c = acct_net_create();
@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sun Oct 18 02:02:50 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -135,6 +135,10 @@ static const char *stats_symbols[] = {
 	"udp_rx_compressed",
 	"udp_compression_attempts",
 	"udp_larger_hence_not_compressed",
+	"tx_deflate_streams",
+	"tx_deflate_streams_released",
+	"tx_deflate_memory",
+	"tx_deflate_memory_saved",
 	"udp_sched_directly_sent_prio_data",
 	"udp_sched_directly_sent_prio_control",
 	"udp_sched_directly_sent_prio_urgent",
@@ -571,6 +575,10 @@ static const char *stats_text[] = {
 	N_("Compressed UDP messages received"),
 	N_("Candidates for UDP message compression"),
 	N_("Uncompressed UDP messages due to no gain"),
+	N_("Allocated TCP compression streams"),
+	N_("Idle TCP compression streams released"),
+	N_("Memory used by TCP compression streams"),
+	N_("Memory saved on TCP compression streams"),
 	N_("UDP scheduler directly sent (P_DATA)"),
 	N_("UDP scheduler directly sent (P_CONTROL)"),
 	N_("UDP scheduler directly sent (P_URGENT)"),
@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Sun Oct 18 02:02:50 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -8,7 +8,7 @@
 #define _if_gen_gnr_stats_h_
 
 /*
- * Enum count: 415
+ * Enum count: 419
  */
 typedef enum {
 	GNR_ROUTING_ERRORS = 0,
@@ -131,6 +131,10 @@ typedef enum {
 	GNR_UDP_RX_COMPRESSED,
 	GNR_UDP_COMPRESSION_ATTEMPTS,
 	GNR_UDP_LARGER_HENCE_NOT_COMPRESSED,
+	GNR_TX_DEFLATE_STREAMS,
+	GNR_TX_DEFLATE_STREAMS_RELEASED,
+	GNR_TX_DEFLATE_MEMORY,
+	GNR_TX_DEFLATE_MEMORY_SAVED,
 	GNR_UDP_SCHED_DIRECTLY_SENT_PRIO_DATA,
 	GNR_UDP_SCHED_DIRECTLY_SENT_PRIO_CONTROL,
 	GNR_UDP_SCHED_DIRECTLY_SENT_PRIO_URGENT,
@@ -1164,6 +1164,34 @@ guint64  gnet_property_variable_bc_loopback_in		= 0;
 static const guint64  gnet_property_variable_bc_loopback_in_default = 0;
 guint64  gnet_property_variable_bc_private_in		= 0;
 static const guint64  gnet_property_variable_bc_private_in_default = 0;
+guint32  gnet_property_variable_verify_workers		= 0;
+static const guint32  gnet_property_variable_verify_workers_default = 0;
+gboolean gnet_property_variable_sha1_with_tth		= TRUE;
+static const gboolean gnet_property_variable_sha1_with_tth_default = TRUE;
+gboolean gnet_property_variable_search_trigram_index		= TRUE;
+static const gboolean gnet_property_variable_search_trigram_index_default = TRUE;
+gboolean gnet_property_variable_search_batch_queries		= TRUE;
+static const gboolean gnet_property_variable_search_batch_queries_default = TRUE;
+guint32  gnet_property_variable_qrp_compress_workers		= 2;
+static const guint32  gnet_property_variable_qrp_compress_workers_default = 2;
+gboolean gnet_property_variable_use_io_uring		= TRUE;
+static const gboolean gnet_property_variable_use_io_uring_default = TRUE;
+gboolean gnet_property_variable_tx_deflate_low_memory		= FALSE;
+static const gboolean gnet_property_variable_tx_deflate_low_memory_default = FALSE;
+guint32  gnet_property_variable_tx_deflate_workers		= 0;
+static const guint32  gnet_property_variable_tx_deflate_workers_default = 0;
+gboolean gnet_property_variable_dht_storage_mmap		= TRUE;
+static const gboolean gnet_property_variable_dht_storage_mmap_default = TRUE;
+gboolean gnet_property_variable_dht_storage_batch_commits		= TRUE;
+static const gboolean gnet_property_variable_dht_storage_batch_commits_default = TRUE;
+gboolean gnet_property_variable_dht_storage_journal		= FALSE;
+static const gboolean gnet_property_variable_dht_storage_journal_default = FALSE;
+gboolean gnet_property_variable_dht_storage_log		= FALSE;
+static const gboolean gnet_property_variable_dht_storage_log_default = FALSE;
+guint32  gnet_property_variable_dht_storage_page_size		= 4096;
+static const guint32  gnet_property_variable_dht_storage_page_size_default = 4096;
+gboolean gnet_property_variable_dht_storage_bloom		= TRUE;
+static const gboolean gnet_property_variable_dht_storage_bloom_default = TRUE;
 
 static prop_set_t *gnet_property;
 
@@ -11778,6 +11806,294 @@ gnet_prop_init(void) {
 	gnet_property->props[503].data.guint64.max	= (guint64) -1;
 	gnet_property->props[503].data.guint64.min	= 0x0000000000000000;
 
+
+	/*
+	 * PROP_VERIFY_WORKERS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[504].name = "verify_workers";
+	gnet_property->props[504].desc = _("Amount of files each hash verification (SHA-1, TTH) can compute concurrently, each in its own worker thread. Zero means the amount is derived from the number of CPUs available. Changes are taken into account at the next startup.");
+	gnet_property->props[504].ev_changed = event_new("verify_workers_changed");
+	gnet_property->props[504].save = TRUE;
+	gnet_property->props[504].internal = FALSE;
+	gnet_property->props[504].vector_size = 1;
+	mutex_init(&gnet_property->props[504].lock);
+
+	/* Type specific data: */
+	gnet_property->props[504].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[504].data.guint32.def	= (void *) &gnet_property_variable_verify_workers_default;
+	gnet_property->props[504].data.guint32.value = (void *) &gnet_property_variable_verify_workers;
+	gnet_property->props[504].data.guint32.choices = NULL;
+	gnet_property->props[504].data.guint32.max	= 8;
+	gnet_property->props[504].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_SHA1_WITH_TTH:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[505].name = "sha1_with_tth";
+	gnet_property->props[505].desc = _("Whether the SHA-1 and the TTH of shared files should be computed together, reading each file only once, instead of through two separate passes over the file data.");
+	gnet_property->props[505].ev_changed = event_new("sha1_with_tth_changed");
+	gnet_property->props[505].save = TRUE;
+	gnet_property->props[505].internal = FALSE;
+	gnet_property->props[505].vector_size = 1;
+	mutex_init(&gnet_property->props[505].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[505].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[505].data.boolean.def	= (void *) &gnet_property_variable_sha1_with_tth_default;
+	gnet_property->props[505].data.boolean.value = (void *) &gnet_property_variable_sha1_with_tth;
+
+
+	/*
+	 * PROP_SEARCH_TRIGRAM_INDEX:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[506].name = "search_trigram_index";
+	gnet_property->props[506].desc = _("Whether to maintain a trigram index of shared file names, to speed up query matching at the expense of more memory. Enabling it only takes effect at the next library rescan, whereas disabling it immediately reverts to the sole 2-char bins for matching.");
+	gnet_property->props[506].ev_changed = event_new("search_trigram_index_changed");
+	gnet_property->props[506].save = TRUE;
+	gnet_property->props[506].internal = FALSE;
+	gnet_property->props[506].vector_size = 1;
+	mutex_init(&gnet_property->props[506].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[506].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[506].data.boolean.def	= (void *) &gnet_property_variable_search_trigram_index_default;
+	gnet_property->props[506].data.boolean.value = (void *) &gnet_property_variable_search_trigram_index;
+
+
+	/*
+	 * PROP_SEARCH_BATCH_QUERIES:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[507].name = "search_batch_queries";
+	gnet_property->props[507].desc = _("Whether incoming queries received within the same event loop tick are matched together against the library, sharing the work for common words.");
+	gnet_property->props[507].ev_changed = event_new("search_batch_queries_changed");
+	gnet_property->props[507].save = TRUE;
+	gnet_property->props[507].internal = FALSE;
+	gnet_property->props[507].vector_size = 1;
+	mutex_init(&gnet_property->props[507].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[507].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[507].data.boolean.def	= (void *) &gnet_property_variable_search_batch_queries_default;
+	gnet_property->props[507].data.boolean.value = (void *) &gnet_property_variable_search_batch_queries;
+
+
+	/*
+	 * PROP_QRP_COMPRESS_WORKERS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[508].name = "qrp_compress_workers";
+	gnet_property->props[508].desc = _("Amount of threads used to compress the query routing table patches sent to our neighbours, so that the main thread does not have to run zlib. When set to 0, compression is done incrementally in the main thread. Changes are taken into account at the next startup.");
+	gnet_property->props[508].ev_changed = event_new("qrp_compress_workers_changed");
+	gnet_property->props[508].save = TRUE;
+	gnet_property->props[508].internal = FALSE;
+	gnet_property->props[508].vector_size = 1;
+	mutex_init(&gnet_property->props[508].lock);
+
+	/* Type specific data: */
+	gnet_property->props[508].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[508].data.guint32.def	= (void *) &gnet_property_variable_qrp_compress_workers_default;
+	gnet_property->props[508].data.guint32.value = (void *) &gnet_property_variable_qrp_compress_workers;
+	gnet_property->props[508].data.guint32.choices = NULL;
+	gnet_property->props[508].data.guint32.max	= 8;
+	gnet_property->props[508].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_USE_IO_URING:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[509].name = "use_io_uring";
+	gnet_property->props[509].desc = _("Whether to use the Linux io_uring asynchronous I/O engine, when available, so that slow disk reads do not stall the main event loop.  Changes are taken into account at the next startup.");
+	gnet_property->props[509].ev_changed = event_new("use_io_uring_changed");
+	gnet_property->props[509].save = TRUE;
+	gnet_property->props[509].internal = FALSE;
+	gnet_property->props[509].vector_size = 1;
+	mutex_init(&gnet_property->props[509].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[509].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[509].data.boolean.def	= (void *) &gnet_property_variable_use_io_uring_default;
+	gnet_property->props[509].data.boolean.value = (void *) &gnet_property_variable_use_io_uring;
+
+
+	/*
+	 * PROP_TX_DEFLATE_LOW_MEMORY:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[510].name = "tx_deflate_low_memory";
+	gnet_property->props[510].desc = _("Whether to use smaller compression windows on Gnutella connections, trading some compression efficiency for less memory per connection.");
+	gnet_property->props[510].ev_changed = event_new("tx_deflate_low_memory_changed");
+	gnet_property->props[510].save = TRUE;
+	gnet_property->props[510].internal = FALSE;
+	gnet_property->props[510].vector_size = 1;
+	mutex_init(&gnet_property->props[510].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[510].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[510].data.boolean.def	= (void *) &gnet_property_variable_tx_deflate_low_memory_default;
+	gnet_property->props[510].data.boolean.value = (void *) &gnet_property_variable_tx_deflate_low_memory;
+
+
+	/*
+	 * PROP_TX_DEFLATE_WORKERS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[511].name = "tx_deflate_workers";
+	gnet_property->props[511].desc = _("Amount of worker threads compressing outgoing Gnutella traffic, 0 meaning that compression is done by the main thread.  Capped to the amount of CPUs minus one.");
+	gnet_property->props[511].ev_changed = event_new("tx_deflate_workers_changed");
+	gnet_property->props[511].save = TRUE;
+	gnet_property->props[511].internal = FALSE;
+	gnet_property->props[511].vector_size = 1;
+	mutex_init(&gnet_property->props[511].lock);
+
+	/* Type specific data: */
+	gnet_property->props[511].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[511].data.guint32.def	= (void *) &gnet_property_variable_tx_deflate_workers_default;
+	gnet_property->props[511].data.guint32.value = (void *) &gnet_property_variable_tx_deflate_workers;
+	gnet_property->props[511].data.guint32.choices = NULL;
+	gnet_property->props[511].data.guint32.max	= 32;
+	gnet_property->props[511].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_DHT_STORAGE_MMAP:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[512].name = "dht_storage_mmap";
+	gnet_property->props[512].desc = _("If TRUE, the on-disk DHT key and value stores read their pages in place from a memory mapping of the page file, instead of copying each page into the page cache with a system call. Only affects stores opened after the change.");
+	gnet_property->props[512].ev_changed = event_new("dht_storage_mmap_changed");
+	gnet_property->props[512].save = TRUE;
+	gnet_property->props[512].internal = FALSE;
+	gnet_property->props[512].vector_size = 1;
+	mutex_init(&gnet_property->props[512].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[512].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[512].data.boolean.def	= (void *) &gnet_property_variable_dht_storage_mmap_default;
+	gnet_property->props[512].data.boolean.value = (void *) &gnet_property_variable_dht_storage_mmap;
+
+
+	/*
+	 * PROP_DHT_STORAGE_BATCH_COMMITS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[513].name = "dht_storage_batch_commits";
+	gnet_property->props[513].desc = _("If TRUE, the on-disk DHT stores flush their dirty cached values sorted by target page during periodic syncs, so that the pages are written back as a sequential I/O burst. Only affects stores opened after the change.");
+	gnet_property->props[513].ev_changed = event_new("dht_storage_batch_commits_changed");
+	gnet_property->props[513].save = TRUE;
+	gnet_property->props[513].internal = FALSE;
+	gnet_property->props[513].vector_size = 1;
+	mutex_init(&gnet_property->props[513].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[513].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[513].data.boolean.def	= (void *) &gnet_property_variable_dht_storage_batch_commits_default;
+	gnet_property->props[513].data.boolean.value = (void *) &gnet_property_variable_dht_storage_batch_commits;
+
+
+	/*
+	 * PROP_DHT_STORAGE_JOURNAL:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[514].name = "dht_storage_journal";
+	gnet_property->props[514].desc = _("If TRUE, the batched commits of the on-disk DHT stores are first appended to a journal file and synced to disk, so that an interrupted commit can be replayed at the next startup. Implies batched commits. Only affects stores opened after the change.");
+	gnet_property->props[514].ev_changed = event_new("dht_storage_journal_changed");
+	gnet_property->props[514].save = TRUE;
+	gnet_property->props[514].internal = FALSE;
+	gnet_property->props[514].vector_size = 1;
+	mutex_init(&gnet_property->props[514].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[514].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[514].data.boolean.def	= (void *) &gnet_property_variable_dht_storage_journal_default;
+	gnet_property->props[514].data.boolean.value = (void *) &gnet_property_variable_dht_storage_journal;
+
+
+	/*
+	 * PROP_DHT_STORAGE_LOG:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[515].name = "dht_storage_log";
+	gnet_property->props[515].desc = _("Whether DHT values should be stored in an append-only log instead of an SDBM database.  The log suits data written once and expired later on, since disk space is reclaimed by dropping whole log segments holding expired values only.  Existing data are migrated when this setting changes, on the next startup.");
+	gnet_property->props[515].ev_changed = event_new("dht_storage_log_changed");
+	gnet_property->props[515].save = TRUE;
+	gnet_property->props[515].internal = FALSE;
+	gnet_property->props[515].vector_size = 1;
+	mutex_init(&gnet_property->props[515].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[515].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[515].data.boolean.def	= (void *) &gnet_property_variable_dht_storage_log_default;
+	gnet_property->props[515].data.boolean.value = (void *) &gnet_property_variable_dht_storage_log;
+
+
+	/*
+	 * PROP_DHT_STORAGE_PAGE_SIZE:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[516].name = "dht_storage_page_size";
+	gnet_property->props[516].desc = _("Size of the pages of the SDBM databases holding DHT keys and values, in bytes, as a power of 2.  Larger pages mean fewer page splits and directory lookups on large databases.  Existing databases are migrated to the new page size on the next startup.");
+	gnet_property->props[516].ev_changed = event_new("dht_storage_page_size_changed");
+	gnet_property->props[516].save = TRUE;
+	gnet_property->props[516].internal = FALSE;
+	gnet_property->props[516].vector_size = 1;
+	mutex_init(&gnet_property->props[516].lock);
+
+	/* Type specific data: */
+	gnet_property->props[516].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[516].data.guint32.def	= (void *) &gnet_property_variable_dht_storage_page_size_default;
+	gnet_property->props[516].data.guint32.value = (void *) &gnet_property_variable_dht_storage_page_size;
+	gnet_property->props[516].data.guint32.choices = NULL;
+	gnet_property->props[516].data.guint32.max	= 16384;
+	gnet_property->props[516].data.guint32.min	= 1024;
+
+
+	/*
+	 * PROP_DHT_STORAGE_BLOOM:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[517].name = "dht_storage_bloom";
+	gnet_property->props[517].desc = _("Whether per-page bloom filters should be kept in memory for the SDBM databases holding DHT keys and values, so that looking up a missing key does not need to read a page from disk.");
+	gnet_property->props[517].ev_changed = event_new("dht_storage_bloom_changed");
+	gnet_property->props[517].save = TRUE;
+	gnet_property->props[517].internal = FALSE;
+	gnet_property->props[517].vector_size = 1;
+	mutex_init(&gnet_property->props[517].lock);
+
+
+	/* Type specific data: */
+	gnet_property->props[517].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[517].data.boolean.def	= (void *) &gnet_property_variable_dht_storage_bloom_default;
+	gnet_property->props[517].data.boolean.value = (void *) &gnet_property_variable_dht_storage_bloom;
+
 	gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
 	for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
 		htable_insert(gnet_property->by_name,
@@ -540,6 +540,20 @@ typedef enum {
 	PROP_BC_DHT_IN,
 	PROP_BC_LOOPBACK_IN,
 	PROP_BC_PRIVATE_IN,
+	PROP_VERIFY_WORKERS,
+	PROP_SHA1_WITH_TTH,
+	PROP_SEARCH_TRIGRAM_INDEX,
+	PROP_SEARCH_BATCH_QUERIES,
+	PROP_QRP_COMPRESS_WORKERS,
+	PROP_USE_IO_URING,
+	PROP_TX_DEFLATE_LOW_MEMORY,
+	PROP_TX_DEFLATE_WORKERS,
+	PROP_DHT_STORAGE_MMAP,
+	PROP_DHT_STORAGE_BATCH_COMMITS,
+	PROP_DHT_STORAGE_JOURNAL,
+	PROP_DHT_STORAGE_LOG,
+	PROP_DHT_STORAGE_PAGE_SIZE,
+	PROP_DHT_STORAGE_BLOOM,
 	GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -554,6 +554,20 @@ extern const guint64	gnet_property_variable_bc_gnet_udp_in;
 extern const guint64	gnet_property_variable_bc_dht_in;
 extern const guint64	gnet_property_variable_bc_loopback_in;
 extern const guint64	gnet_property_variable_bc_private_in;
+extern const guint32	gnet_property_variable_verify_workers;
+extern const gboolean	gnet_property_variable_sha1_with_tth;
+extern const gboolean	gnet_property_variable_search_trigram_index;
+extern const gboolean	gnet_property_variable_search_batch_queries;
+extern const guint32	gnet_property_variable_qrp_compress_workers;
+extern const gboolean	gnet_property_variable_use_io_uring;
+extern const gboolean	gnet_property_variable_tx_deflate_low_memory;
+extern const guint32	gnet_property_variable_tx_deflate_workers;
+extern const gboolean	gnet_property_variable_dht_storage_mmap;
+extern const gboolean	gnet_property_variable_dht_storage_batch_commits;
+extern const gboolean	gnet_property_variable_dht_storage_journal;
+extern const gboolean	gnet_property_variable_dht_storage_log;
+extern const guint32	gnet_property_variable_dht_storage_page_size;
+extern const gboolean	gnet_property_variable_dht_storage_bloom;
 
 
 prop_set_t *gnet_prop_init(void);
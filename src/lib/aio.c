@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Asynchronous I/O engine.
+ *
+ * On Linux, this is built on top of io_uring, driven through raw system
+ * calls so that we do not depend on any external library.  Requests are
+ * submitted to the kernel immediately and their completions are signalled
+ * through an eventfd which is monitored by the main event loop, so that
+ * the completion callbacks are invoked from the main thread, like any other
+ * I/O callback.
+ *
+ * This is strictly an optional engine: when it is not compiled in, when the
+ * kernel does not support io_uring (or is too old to support the operations
+ * we need), when it has been disabled by the user, or when the ring is full,
+ * the submission routines return NULL and callers simply perform their I/O
+ * synchronously as they always did.
+ *
+ * The engine can only be used from the main thread.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "aio.h"
+
+#ifdef HAS_IO_URING
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "atomic.h"
+#include "fd.h"
+#include "hset.h"
+#include "inputevt.h"
+#include "misc.h"				/* For is_temporary_error() */
+#include "stringify.h"			/* For PLURAL() */
+#include "thread.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#if defined(HAS_IO_URING) && defined(IORING_FEAT_FAST_POLL)
+#define USE_IO_URING
+#endif
+
+#define AIO_RING_ENTRIES	256		/**< Amount of submission queue entries */
+
+enum aio_req_magic { AIO_REQ_MAGIC = 0x1b0e6c2a };
+
+/**
+ * An asynchronous I/O request.
+ */
+struct aio_req {
+	enum aio_req_magic magic;
+	aio_cb_t cb;				/**< Completion callback */
+	void *arg;					/**< Callback argument */
+	void *buf;					/**< Buffer to release, once cancelled */
+	free_fn_t release;			/**< Buffer release routine, once cancelled */
+	unsigned cancelled:1;		/**< Request was cancelled by user */
+};
+
+static inline void
+aio_req_check(const struct aio_req * const ar)
+{
+	g_assert(ar != NULL);
+	g_assert(AIO_REQ_MAGIC == ar->magic);
+}
+
+#ifdef USE_IO_URING
+/**
+ * The io_uring ring, along with the pointers into the kernel-shared areas.
+ */
+static struct aio_ring {
+	int fd;						/**< The io_uring file descriptor */
+	int efd;					/**< eventfd signalling completions */
+	unsigned evid;				/**< Event ID for the eventfd */
+	void *sq_ptr;				/**< Mapped submission ring */
+	size_t sq_len;				/**< Length of mapped submission ring */
+	void *cq_ptr;				/**< Mapped completion ring */
+	size_t cq_len;				/**< Length of mapped completion ring */
+	struct io_uring_sqe *sqes;	/**< Mapped submission entries */
+	size_t sqes_len;			/**< Length of mapped submission entries */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;		/**< Size of submission ring */
+	unsigned cq_entries;		/**< Size of completion ring */
+	hset_t *pending;			/**< Requests submitted to the kernel */
+} aio_ring = { -1, -1, 0, NULL, 0, NULL, 0, NULL, 0, NULL, NULL, NULL,
+	NULL, NULL, NULL, NULL, 0, 0, NULL };
+#endif	/* USE_IO_URING */
+
+static bool aio_active;
+
+/**
+ * @return whether the asynchronous I/O engine is active.
+ */
+bool
+aio_is_active(void)
+{
+	return aio_active;
+}
+
+/**
+ * Allocate a new request.
+ */
+static aio_req_t *
+aio_req_alloc(aio_cb_t cb, void *arg)
+{
+	aio_req_t *ar;
+
+	WALLOC0(ar);
+	ar->magic = AIO_REQ_MAGIC;
+	ar->cb = cb;
+	ar->arg = arg;
+
+	return ar;
+}
+
+/**
+ * Free request.
+ */
+static void
+aio_req_free(aio_req_t *ar)
+{
+	aio_req_check(ar);
+
+	ar->magic = 0;
+	WFREE(ar);
+}
+
+/**
+ * Dispose of a completed request, invoking the user callback unless the
+ * request was cancelled, in which case we release the buffer on behalf
+ * of the user.
+ */
+static void
+aio_req_done(aio_req_t *ar, ssize_t r, int error)
+{
+	aio_req_check(ar);
+
+	if (ar->cancelled) {
+		if (ar->release != NULL)
+			(*ar->release)(ar->buf);
+	} else {
+		(*ar->cb)(ar->arg, r, error);
+	}
+
+	aio_req_free(ar);
+}
+
+#ifdef USE_IO_URING
+static int
+aio_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+aio_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, aio_ring.fd,
+		to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+aio_uring_register(unsigned opcode, void *arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, aio_ring.fd, opcode, arg, nargs);
+}
+
+/**
+ * Reap all the completion entries available.
+ *
+ * @return amount of completions processed.
+ */
+static unsigned
+aio_uring_reap(void)
+{
+	unsigned head, n = 0;
+
+	head = *aio_ring.cq_head;
+
+	while (head != atomic_uint_get(aio_ring.cq_tail)) {
+		struct io_uring_cqe *cqe;
+		aio_req_t *ar;
+		int res;
+
+		cqe = &aio_ring.cqes[head & *aio_ring.cq_mask];
+		ar = ulong_to_pointer(cqe->user_data);
+		res = cqe->res;
+
+		/*
+		 * Release the slot before invoking the callback, since the latter
+		 * can submit new requests.
+		 */
+
+		atomic_mb();
+		atomic_uint_set(aio_ring.cq_head, ++head);
+
+		aio_req_check(ar);
+		g_assert(hset_contains(aio_ring.pending, ar));
+
+		hset_remove(aio_ring.pending, ar);
+		n++;
+
+		if (res < 0)
+			aio_req_done(ar, -1, -res);
+		else
+			aio_req_done(ar, res, 0);
+	}
+
+	return n;
+}
+
+/**
+ * Input callback invoked when the kernel signals completions.
+ */
+static void
+aio_uring_completed(void *unused_data, int fd, inputevt_cond_t unused_cond)
+{
+	uint64 count;
+
+	(void) unused_data;
+	(void) unused_cond;
+
+	g_assert(fd == aio_ring.efd);
+
+	if (-1 == read(fd, &count, sizeof count) && !is_temporary_error(errno))
+		s_warning("%s(): read() on eventfd failed: %m", G_STRFUNC);
+
+	aio_uring_reap();
+}
+
+/**
+ * Submit a new request to the kernel.
+ *
+ * @return the request, NULL with errno set if it could not be submitted.
+ */
+static aio_req_t *
+aio_uring_submit(int op, int fd, void *buf, size_t len, uint64 offset,
+	aio_cb_t cb, void *arg)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+	aio_req_t *ar;
+
+	g_assert(thread_is_main());
+	g_assert(cb != NULL);
+
+	if (!aio_active) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	/*
+	 * Since we enter the kernel at each submission, the submission ring is
+	 * always empty when we come here.  We limit the amount of in-flight
+	 * requests to the size of the completion ring so that no completion
+	 * can ever be dropped.
+	 */
+
+	if (hset_count(aio_ring.pending) >= aio_ring.cq_entries) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	ar = aio_req_alloc(cb, arg);
+
+	tail = *aio_ring.sq_tail;
+	idx = tail & *aio_ring.sq_mask;
+	sqe = &aio_ring.sqes[idx];
+
+	ZERO(sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = pointer_to_ulong(buf);
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = pointer_to_ulong(ar);
+
+	aio_ring.sq_array[idx] = idx;
+	atomic_mb();
+	atomic_uint_set(aio_ring.sq_tail, tail + 1);
+
+	/*
+	 * Without SQPOLL, the kernel only consumes submission entries from
+	 * io_uring_enter(), so if that fails we can safely take back the entry.
+	 */
+
+	if (-1 == aio_uring_enter(1, 0, 0)) {
+		int saved_errno = errno;
+		atomic_uint_set(aio_ring.sq_tail, tail);
+		aio_req_free(ar);
+		if (EBUSY == saved_errno)
+			saved_errno = EAGAIN;
+		errno = saved_errno;
+		return NULL;
+	}
+
+	hset_insert(aio_ring.pending, ar);
+	return ar;
+}
+
+/**
+ * Unmap the io_uring areas and close the file descriptors.
+ */
+static void
+aio_uring_teardown(void)
+{
+	inputevt_remove(&aio_ring.evid);
+
+	if (aio_ring.sqes != NULL)
+		munmap(aio_ring.sqes, aio_ring.sqes_len);
+	if (aio_ring.cq_ptr != NULL && aio_ring.cq_ptr != aio_ring.sq_ptr)
+		munmap(aio_ring.cq_ptr, aio_ring.cq_len);
+	if (aio_ring.sq_ptr != NULL)
+		munmap(aio_ring.sq_ptr, aio_ring.sq_len);
+
+	aio_ring.sqes = aio_ring.cq_ptr = aio_ring.sq_ptr = NULL;
+
+	fd_close(&aio_ring.efd);
+	fd_close(&aio_ring.fd);
+	hset_free_null(&aio_ring.pending);
+}
+
+/**
+ * Create the io_uring instance.
+ *
+ * @return TRUE on success.
+ */
+static bool
+aio_uring_create(void)
+{
+	struct io_uring_params p;
+	void *ptr;
+
+	ZERO(&p);
+	aio_ring.fd = aio_uring_setup(AIO_RING_ENTRIES, &p);
+
+	if (-1 == aio_ring.fd) {
+		s_info("AIO io_uring not available: %m");
+		return FALSE;
+	}
+
+	/*
+	 * We need the read opcode which appeared with Linux 5.6.  There is no
+	 * feature flag for it, so use the internal polling support, which
+	 * appeared with Linux 5.7, as the marker.
+	 */
+
+	if (!(p.features & IORING_FEAT_FAST_POLL)) {
+		s_info("AIO io_uring too old (features=0x%x), not using it",
+			p.features);
+		goto failed;
+	}
+
+	fd_set_close_on_exec(aio_ring.fd);
+
+	aio_ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	aio_ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		aio_ring.sq_len = aio_ring.cq_len = MAX(aio_ring.sq_len, aio_ring.cq_len);
+
+	ptr = mmap(NULL, aio_ring.sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, aio_ring.fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ptr)
+		goto mmap_failed;
+	aio_ring.sq_ptr = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aio_ring.cq_ptr = ptr;
+	} else {
+		ptr = mmap(NULL, aio_ring.cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, aio_ring.fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ptr)
+			goto mmap_failed;
+		aio_ring.cq_ptr = ptr;
+	}
+
+	aio_ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, aio_ring.sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, aio_ring.fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ptr)
+		goto mmap_failed;
+	aio_ring.sqes = ptr;
+
+	aio_ring.sq_tail  = ptr_add_offset(aio_ring.sq_ptr, p.sq_off.tail);
+	aio_ring.sq_mask  = ptr_add_offset(aio_ring.sq_ptr, p.sq_off.ring_mask);
+	aio_ring.sq_array = ptr_add_offset(aio_ring.sq_ptr, p.sq_off.array);
+	aio_ring.cq_head  = ptr_add_offset(aio_ring.cq_ptr, p.cq_off.head);
+	aio_ring.cq_tail  = ptr_add_offset(aio_ring.cq_ptr, p.cq_off.tail);
+	aio_ring.cq_mask  = ptr_add_offset(aio_ring.cq_ptr, p.cq_off.ring_mask);
+	aio_ring.cqes     = ptr_add_offset(aio_ring.cq_ptr, p.cq_off.cqes);
+	aio_ring.sq_entries = p.sq_entries;
+	aio_ring.cq_entries = p.cq_entries;
+
+	aio_ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == aio_ring.efd) {
+		s_warning("%s(): cannot create eventfd: %m", G_STRFUNC);
+		goto failed;
+	}
+
+	if (-1 == aio_uring_register(IORING_REGISTER_EVENTFD, &aio_ring.efd, 1)) {
+		s_warning("%s(): cannot register eventfd: %m", G_STRFUNC);
+		goto failed;
+	}
+
+	aio_ring.pending = hset_create(HASH_KEY_SELF, 0);
+	aio_ring.evid = inputevt_add(aio_ring.efd, INPUT_EVENT_RX,
+		aio_uring_completed, NULL);
+
+	s_info("AIO using io_uring with %u/%u entries",
+		aio_ring.sq_entries, aio_ring.cq_entries);
+
+	return TRUE;
+
+mmap_failed:
+	s_warning("%s(): cannot map io_uring: %m", G_STRFUNC);
+	/* FALL THROUGH */
+
+failed:
+	aio_uring_teardown();
+	return FALSE;
+}
+
+/**
+ * Wait for all the pending requests to complete, then destroy the ring.
+ */
+static void
+aio_uring_close(void)
+{
+	while (0 != hset_count(aio_ring.pending)) {
+		if (0 != aio_uring_reap())
+			continue;
+		if (-1 == aio_uring_enter(0, 1, IORING_ENTER_GETEVENTS)) {
+			if (EINTR == errno)
+				continue;
+			s_warning("%s(): cannot wait for %zu pending request%s: %m",
+				G_STRFUNC, PLURAL(hset_count(aio_ring.pending)));
+			break;
+		}
+	}
+
+	aio_uring_teardown();
+}
+#endif	/* USE_IO_URING */
+
+/**
+ * Submit an asynchronous positional read.
+ *
+ * The buffer must remain valid until the callback is invoked, or be handed
+ * over to the engine via aio_cancel().
+ *
+ * @param fd		the file descriptor to read from
+ * @param buf		buffer where data is to be read
+ * @param len		amount of bytes to read
+ * @param offset	file offset where reading starts
+ * @param cb		callback to invoke on completion
+ * @param arg		additional callback argument
+ *
+ * @return the request, NULL with errno set if the request could not be
+ * submitted, in which case the caller must perform the I/O synchronously.
+ */
+aio_req_t *
+aio_pread(int fd, void *buf, size_t len, filesize_t offset,
+	aio_cb_t cb, void *arg)
+{
+#ifdef USE_IO_URING
+	return aio_uring_submit(IORING_OP_READ,
+		fd, buf, len, offset, cb, arg);
+#else
+	(void) fd; (void) buf; (void) len; (void) offset; (void) cb; (void) arg;
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+/**
+ * Cancel a pending request: its callback will not be invoked.
+ *
+ * Since the kernel may still be transferring data to or from the buffer,
+ * the latter is handed over to the engine which will release it once the
+ * request completes.
+ *
+ * @param req_ptr	pointer to the request, nullified on return
+ * @param buf		the buffer used by the request
+ * @param release	if non-NULL, routine to free the buffer
+ */
+void
+aio_cancel(aio_req_t **req_ptr, void *buf, free_fn_t release)
+{
+	aio_req_t *ar = *req_ptr;
+
+	if (ar != NULL) {
+		aio_req_check(ar);
+		g_assert(!ar->cancelled);
+
+		ar->cancelled = TRUE;
+		ar->buf = buf;
+		ar->release = release;
+		*req_ptr = NULL;
+	}
+}
+
+/**
+ * Initialize the asynchronous I/O engine.
+ *
+ * @param enabled		whether the user wants to use the engine
+ */
+void
+aio_init(bool enabled)
+{
+	g_assert(thread_is_main());
+
+	if (!enabled)
+		return;
+
+#ifdef USE_IO_URING
+	aio_active = aio_uring_create();
+#endif
+}
+
+/**
+ * Shutdown the asynchronous I/O engine, waiting for pending requests.
+ */
+void
+aio_close(void)
+{
+	if (!aio_active)
+		return;
+
+	aio_active = FALSE;
+
+#ifdef USE_IO_URING
+	aio_uring_close();
+#endif
+}
+
+/* vi: set ts=4 sw=4 cindent: */
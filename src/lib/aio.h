@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Asynchronous I/O engine.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _aio_h_
+#define _aio_h_
+
+struct aio_req;
+typedef struct aio_req aio_req_t;
+
+/**
+ * Completion callback.
+ *
+ * @param arg		user-supplied argument
+ * @param r			amount of bytes transferred, -1 on error
+ * @param error		the errno value when r is -1, 0 otherwise
+ */
+typedef void (*aio_cb_t)(void *arg, ssize_t r, int error);
+
+/*
+ * Public interface.
+ */
+
+void aio_init(bool enabled);
+void aio_close(void);
+bool aio_is_active(void);
+
+aio_req_t *aio_pread(int fd, void *buf, size_t len, filesize_t offset,
+	aio_cb_t cb, void *arg);
+
+void aio_cancel(aio_req_t **req_ptr, void *buf, free_fn_t release);
+
+#endif /* _aio_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * CPU feature detection, for runtime selection of optimized routines.
+ *
+ * Detection is performed once, lazily, and the result is cached.  There is
+ * no need for locking: concurrent threads computing the flags for the first
+ * time will all compute the same value.
+ *
+ * On non-x86 architectures, or when the compiler cannot generate code for
+ * specific instruction set extensions, no features are ever reported and
+ * callers simply stick to their portable implementation.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cpufeat.h"
+
+#ifdef CPUFEAT_X86
+#include <cpuid.h>
+#endif
+
+#include "misc.h"				/* For clamp_strcat() */
+
+#include "override.h"			/* Must be the last header included */
+
+static uint32 cpufeat_mask;
+static bool cpufeat_done;
+
+#ifdef CPUFEAT_X86
+/**
+ * Read the extended control register XCR0, to determine which register
+ * states the OS saves on context switches.
+ */
+static uint32
+cpufeat_xgetbv(void)
+{
+	uint32 eax, edx;
+
+	__asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0"	/* xgetbv */
+		: "=a" (eax), "=d" (edx) : "c" (0));
+
+	(void) edx;
+	return eax;
+}
+
+/**
+ * Probe the CPU through the CPUID instruction.
+ *
+ * @return the set of supported features.
+ */
+static uint32
+cpufeat_probe(void)
+{
+	uint32 eax, ebx, ecx, edx, max;
+	uint32 mask = 0;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 1)
+		return 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (edx & bit_SSE2)
+		mask |= CPUFEAT_SSE2;
+	if (ecx & bit_SSSE3)
+		mask |= CPUFEAT_SSSE3;
+	if (ecx & bit_SSE4_1)
+		mask |= CPUFEAT_SSE41;
+	if (ecx & bit_SSE4_2)
+		mask |= CPUFEAT_SSE42;
+	if (ecx & bit_POPCNT)
+		mask |= CPUFEAT_POPCNT;
+
+	if (max >= 7) {
+		bool ymm = FALSE;
+
+		/*
+		 * AVX2 is only usable if the OS saves the YMM registers, which
+		 * we check through XCR0 (bits 1 and 2 for SSE and AVX states).
+		 */
+
+		if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+			ymm = 0x6 == (cpufeat_xgetbv() & 0x6);
+
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+		if (ymm && (ebx & bit_AVX2))
+			mask |= CPUFEAT_AVX2;
+		if (ebx & (1U << 29))		/* bit_SHA is missing in older GCCs */
+			mask |= CPUFEAT_SHA;
+	}
+
+	return mask;
+}
+#endif	/* CPUFEAT_X86 */
+
+/**
+ * @return the set of CPU features we can use, as a CPUFEAT_* bitmask.
+ */
+uint32
+cpufeat_flags(void)
+{
+	if G_UNLIKELY(!cpufeat_done) {
+#ifdef CPUFEAT_X86
+		cpufeat_mask = cpufeat_probe();
+#endif
+		cpufeat_done = TRUE;
+	}
+
+	return cpufeat_mask;
+}
+
+/**
+ * Check whether the CPU supports all the specified features.
+ *
+ * @param features		the CPUFEAT_* bitmask of features we need
+ *
+ * @return TRUE if all the specified features are available.
+ */
+bool
+cpufeat_has(uint32 features)
+{
+	return features == (cpufeat_flags() & features);
+}
+
+/**
+ * @return a string listing the available CPU features, for logging.
+ */
+const char *
+cpufeat_to_string(void)
+{
+	static const struct {
+		uint32 feature;
+		const char *name;
+	} names[] = {
+		{ CPUFEAT_SSE2,		"sse2" },
+		{ CPUFEAT_SSSE3,	"ssse3" },
+		{ CPUFEAT_SSE41,	"sse4.1" },
+		{ CPUFEAT_SSE42,	"sse4.2" },
+		{ CPUFEAT_POPCNT,	"popcnt" },
+		{ CPUFEAT_AVX2,		"avx2" },
+		{ CPUFEAT_SHA,		"sha" },
+	};
+	static char buf[64];
+	static bool done;
+	uint32 mask;
+	uint i;
+
+	if (done)
+		goto done;
+
+	mask = cpufeat_flags();
+
+	for (i = 0; i < N_ITEMS(names); i++) {
+		if (0 == (mask & names[i].feature))
+			continue;
+		if ('\0' != buf[0])
+			clamp_strcat(ARYLEN(buf), " ");
+		clamp_strcat(ARYLEN(buf), names[i].name);
+	}
+
+	done = TRUE;
+
+done:
+	return '\0' == buf[0] ? "none" : buf;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
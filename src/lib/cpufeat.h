@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * CPU feature detection, for runtime selection of optimized routines.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _cpufeat_h_
+#define _cpufeat_h_
+
+/*
+ * When CPUFEAT_X86 is defined, routines can be compiled for a specific
+ * instruction set extension by tagging them with CPUFEAT_TARGET(), which
+ * enables the corresponding intrinsics from <immintrin.h> without requiring
+ * that the whole program be compiled for that instruction set.
+ *
+ * Such routines must only be called after cpufeat_has() confirmed that the
+ * running CPU supports the needed extensions.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(4, 9) || defined(__clang__)) && !defined(MINGW32)
+#define CPUFEAT_X86
+#define CPUFEAT_TARGET(x)	__attribute__((target(x)))
+#endif
+
+/**
+ * CPU features we know about, as a bitmask.
+ */
+enum cpufeat {
+	CPUFEAT_SSE2	= (1U << 0),	/**< SSE2 */
+	CPUFEAT_SSSE3	= (1U << 1),	/**< Supplemental SSE3 (pshufb) */
+	CPUFEAT_SSE41	= (1U << 2),	/**< SSE4.1 */
+	CPUFEAT_SSE42	= (1U << 3),	/**< SSE4.2 (pcmpestri) */
+	CPUFEAT_AVX2	= (1U << 4),	/**< AVX2, with OS support for YMM state */
+	CPUFEAT_SHA		= (1U << 5),	/**< SHA extensions (SHA-NI) */
+	CPUFEAT_POPCNT	= (1U << 6)		/**< POPCNT */
+};
+
+/*
+ * Public interface.
+ */
+
+uint32 cpufeat_flags(void);
+bool cpufeat_has(uint32 features);
+const char *cpufeat_to_string(void);
+
+#endif /* _cpufeat_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
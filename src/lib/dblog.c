@@ -0,0 +1,1625 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Append-only log-structured key/value store.
+ *
+ * All the updates are appended to the current segment file, a new segment
+ * being started when the current one is full: writes are therefore always
+ * sequential.  An in-memory hash table indexes the location of the latest
+ * value of each key, and is rebuilt by replaying all the segments, oldest
+ * first, when the store is opened.  Deletions are recorded by appending a
+ * tombstone for the key.
+ *
+ * Space is reclaimed from the oldest segment.  When all the keys it holds
+ * have been removed or superseded, the segment file is simply unlinked,
+ * which is what happens when values written once are expired in the order
+ * they were stored.  Otherwise, once enough of its data is dead, the live
+ * records of the oldest segment are copied at the end of the log, a few at
+ * a time after each update so that this compaction proceeds in the
+ * background, until the segment can be dropped.
+ *
+ * Since space is only reclaimed from the oldest segment, tombstones never
+ * need to be copied: there is no older segment whose records they could
+ * still be shadowing.
+ *
+ * The segments are kept in a directory, each segment file being named
+ * after its number, in hexadecimal.  Each segment starts with a small
+ * header, followed by records laid out as:
+ *
+ *    u8   type ('P' for a key/value pair, 'D' for a deletion)
+ *    be16 key length
+ *    be32 value length (0 for deletions)
+ *    be32 CRC32 of the preceding header bytes, the key and the value
+ *    key bytes
+ *    value bytes
+ *
+ * A torn record at the end of the last segment, following a crash, is
+ * discarded when the store is opened.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "dblog.h"
+
+#include "compat_pio.h"
+#include "crc.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "hevset.h"
+#include "hstrfn.h"
+#include "log.h"
+#include "mempcpy.h"
+#include "misc.h"				/* For create_directory() */
+#include "parse.h"
+#include "path.h"
+#include "str.h"
+#include "stringify.h"			/* For plural() */
+#include "vsort.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define DBLOG_SEGFEXT		".seg"		/* Extension of segment files */
+#define DBLOG_SEG_MAGIC		0x474c4f47	/* "GLOG" */
+#define DBLOG_SEG_VERSION	1
+#define DBLOG_SEG_HDR		12			/* Segment header size */
+#define DBLOG_REC_HDR		11			/* Record header size */
+#define DBLOG_SEG_MAX		(4 * 1024 * 1024)	/* Segment size target */
+#define DBLOG_WBUF			(64 * 1024)	/* Write buffer size */
+#define DBLOG_GARBAGE		50			/* Dead % in the log to start compacting */
+#define DBLOG_STEP			(16 * 1024)	/* Bytes compacted after each update */
+
+#define DBLOG_PUT			'P'			/* Record holding a key/value pair */
+#define DBLOG_DEL			'D'			/* Tombstone record */
+
+enum dblog_magic { DBLOG_MAGIC = 0x3e0cb1a5 };
+
+/**
+ * A segment of the log.
+ */
+struct dblog_seg {
+	uint32 num;				/* Segment number, increasing with age */
+	int fd;					/* Opened segment file */
+	filesize_t size;		/* Bytes written, including buffered ones */
+	filesize_t live;		/* Bytes held by live records */
+	size_t items;			/* Amount of live records */
+	unsigned unsynced:1;	/* Written to since last fdatasync() */
+};
+
+/**
+ * A key in the index.
+ */
+struct dblog_key {
+	const void *data;		/* Key bytes */
+	size_t len;				/* Key length */
+};
+
+/**
+ * An entry of the index, locating the latest value of a key.
+ */
+struct dblog_entry {
+	struct dblog_key k;		/* The key (embedded in the set) */
+	struct dblog_seg *seg;	/* Segment holding the record */
+	filesize_t off;			/* Offset of the record in the segment */
+	uint32 vlen;			/* Length of the value */
+};
+
+/**
+ * The log store.
+ */
+struct dblog {
+	enum dblog_magic magic;
+	char *name;				/* Name for logging */
+	char *path;				/* Path of the segment directory */
+	int mode;				/* Permissions for segment files */
+	hevset_t *index;		/* Index of keys, struct dblog_entry */
+	struct dblog_seg **segs;/* Segments, oldest first */
+	size_t nsegs;			/* Amount of segments */
+	uint32 next_num;		/* Number of the next segment to create */
+	char *wbuf;				/* Write buffer, for the last segment */
+	size_t wfill;			/* Amount of buffered bytes */
+	char *rbuf;				/* Read buffer, holding returned values */
+	size_t rsize;			/* Size of read buffer */
+	filesize_t cursor;		/* Compaction offset within oldest segment */
+	int error;				/* Last errno value consecutive to an error */
+	unsigned rdonly:1;		/* Opened read-only */
+	unsigned is_volatile:1;	/* Files removed when closed */
+	unsigned compacting:1;	/* Compacting the oldest segment */
+	unsigned ioerr:1;		/* Last operation raised an I/O error */
+};
+
+static inline void
+dblog_check(const struct dblog * const dl)
+{
+	g_assert(dl != NULL);
+	g_assert(DBLOG_MAGIC == dl->magic);
+}
+
+static uint
+dblog_key_hash(const void *key)
+{
+	const struct dblog_key *k = key;
+
+	return binary_hash(k->data, k->len);
+}
+
+static uint
+dblog_key_hash2(const void *key)
+{
+	const struct dblog_key *k = key;
+
+	return binary_hash2(k->data, k->len);
+}
+
+static bool
+dblog_key_eq(const void *a, const void *b)
+{
+	const struct dblog_key *ka = a, *kb = b;
+
+	return ka->len == kb->len && 0 == memcmp(ka->data, kb->data, ka->len);
+}
+
+/**
+ * @return length of record holding a key and value of given lengths.
+ */
+static inline size_t
+dblog_reclen(size_t klen, size_t vlen)
+{
+	return DBLOG_REC_HDR + klen + vlen;
+}
+
+/**
+ * @return the last segment, where records are appended.
+ */
+static inline struct dblog_seg *
+dblog_active(const dblog_t *dl)
+{
+	g_assert(dl->nsegs != 0);
+
+	return dl->segs[dl->nsegs - 1];
+}
+
+/**
+ * Record I/O error.
+ */
+static void
+dblog_ioerr(dblog_t *dl, const char *what)
+{
+	dl->ioerr = TRUE;
+	dl->error = errno;
+
+	s_warning("DBLOG \"%s\" I/O error whilst %s: %m", dl->name, what);
+}
+
+/**
+ * @return path of segment file, to be freed via hfree().
+ */
+static char *
+dblog_seg_path(const dblog_t *dl, uint32 num)
+{
+	char file[UINT32_HEX_BUFLEN + CONST_STRLEN(DBLOG_SEGFEXT) + 1];
+
+	str_bprintf(ARYLEN(file), "%08x%s", num, DBLOG_SEGFEXT);
+	return make_pathname(dl->path, file);
+}
+
+/**
+ * Append a segment to the list of segments.
+ */
+static struct dblog_seg *
+dblog_seg_add(dblog_t *dl, uint32 num, int fd)
+{
+	struct dblog_seg *s;
+
+	WALLOC0(s);
+	s->num = num;
+	s->fd = fd;
+	s->size = DBLOG_SEG_HDR;
+
+	HREALLOC_ARRAY(dl->segs, dl->nsegs + 1);
+	dl->segs[dl->nsegs++] = s;
+
+	if (num >= dl->next_num)
+		dl->next_num = num + 1;
+
+	return s;
+}
+
+/**
+ * Close segment and free it, unlinking its file if requested.
+ */
+static void
+dblog_seg_free(dblog_t *dl, struct dblog_seg *s, bool unlinked)
+{
+	fd_close(&s->fd);
+
+	if (unlinked) {
+		char *path = dblog_seg_path(dl, s->num);
+
+		if (-1 == unlink(path) && ENOENT != errno)
+			s_warning("DBLOG \"%s\" cannot unlink %s: %m", dl->name, path);
+		HFREE_NULL(path);
+	}
+
+	WFREE(s);
+}
+
+/**
+ * Create a new segment, which becomes the active one.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_seg_create(dblog_t *dl)
+{
+	char hdr[DBLOG_SEG_HDR];
+	char *path;
+	int fd;
+
+	g_assert(0 == dl->wfill);
+
+	path = dblog_seg_path(dl, dl->next_num);
+	fd = file_create(path, O_RDWR | O_TRUNC, dl->mode);
+	HFREE_NULL(path);
+
+	if (-1 == fd)
+		return -1;
+
+	poke_be32(&hdr[0], DBLOG_SEG_MAGIC);
+	poke_be32(&hdr[4], DBLOG_SEG_VERSION);
+	poke_be32(&hdr[8], dl->next_num);
+
+	if (sizeof hdr != compat_pwrite(fd, ARYLEN(hdr), 0)) {
+		if (0 == errno)
+			errno = EIO;
+		fd_close(&fd);
+		return -1;
+	}
+
+	dblog_seg_add(dl, dl->next_num, fd);
+	return 0;
+}
+
+/**
+ * Write buffered records to the active segment.
+ *
+ * @return amount of bytes written, -1 on error with errno set.
+ */
+static ssize_t
+dblog_flush(dblog_t *dl)
+{
+	const struct dblog_seg *s;
+	ssize_t r;
+
+	if (0 == dl->wfill)
+		return 0;
+
+	s = dblog_active(dl);
+	r = compat_pwrite(s->fd, dl->wbuf, dl->wfill, s->size - dl->wfill);
+
+	if (UNSIGNED(r) != dl->wfill) {
+		if (r >= 0)
+			errno = ENOSPC;
+		return -1;
+	}
+
+	dl->wfill = 0;
+	return r;
+}
+
+/**
+ * Append record to the log.
+ *
+ * @param dl		the log
+ * @param type		the record type
+ * @param key		the key
+ * @param klen		the key length
+ * @param value		the value (NULL for tombstones)
+ * @param vlen		the value length
+ * @param seg		where the segment holding the record is returned
+ * @param off		where the offset of the record is returned
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_append(dblog_t *dl, char type, const void *key, size_t klen,
+	const void *value, size_t vlen, struct dblog_seg **seg, filesize_t *off)
+{
+	char hdr[DBLOG_REC_HDR];
+	size_t len = dblog_reclen(klen, vlen);
+	struct dblog_seg *s = dblog_active(dl);
+	uint32 crc;
+
+	g_assert(klen <= MAX_INT_VAL(uint16));
+	g_assert(vlen <= MAX_INT_VAL(uint32) - DBLOG_SEG_HDR - DBLOG_REC_HDR - klen);
+
+	if (s->size > DBLOG_SEG_HDR && s->size + len > DBLOG_SEG_MAX) {
+		if (-1 == dblog_flush(dl) || -1 == dblog_seg_create(dl))
+			return -1;
+		s = dblog_active(dl);
+	}
+
+	hdr[0] = type;
+	poke_be16(&hdr[1], klen);
+	poke_be32(&hdr[3], vlen);
+	crc = crc32_update(0, hdr, 7);
+	crc = crc32_update(crc, key, klen);
+	if (vlen != 0)
+		crc = crc32_update(crc, value, vlen);
+	poke_be32(&hdr[7], crc);
+
+	if (dl->wfill + len > DBLOG_WBUF && -1 == dblog_flush(dl))
+		return -1;
+
+	if (len > DBLOG_WBUF) {
+		iovec_t iov[3];
+		ssize_t r;
+
+		/*
+		 * Record too large for the write buffer, which is empty: write it
+		 * directly to the segment.
+		 */
+
+		iovec_set(&iov[0], hdr, sizeof hdr);
+		iovec_set(&iov[1], key, klen);
+		iovec_set(&iov[2], value, vlen);
+
+		r = compat_pwritev(s->fd, iov, N_ITEMS(iov), s->size);
+		if (UNSIGNED(r) != len) {
+			if (r >= 0)
+				errno = ENOSPC;
+			return -1;
+		}
+	} else {
+		char *p = &dl->wbuf[dl->wfill];
+
+		p = mempcpy(p, hdr, sizeof hdr);
+		p = mempcpy(p, key, klen);
+		if (vlen != 0)
+			mempcpy(p, value, vlen);
+		dl->wfill += len;
+	}
+
+	*seg = s;
+	*off = s->size;
+	s->size += len;
+	s->unsynced = TRUE;
+
+	return 0;
+}
+
+/**
+ * Read data from a segment, which may still be in the write buffer.
+ *
+ * Records are never split between the buffer and the file, so the data
+ * of a record is either entirely buffered or entirely written.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_read(dblog_t *dl, const struct dblog_seg *s, filesize_t off,
+	void *dest, size_t len)
+{
+	ssize_t r;
+
+	if (s == dblog_active(dl) && off >= s->size - dl->wfill) {
+		size_t start = off - (s->size - dl->wfill);
+
+		g_assert(start + len <= dl->wfill);
+
+		memcpy(dest, &dl->wbuf[start], len);
+		return 0;
+	}
+
+	r = compat_pread(s->fd, dest, len, off);
+	if (UNSIGNED(r) != len) {
+		if (r >= 0)
+			errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Make sure the read buffer can hold `len' bytes.
+ */
+static void
+dblog_rbuf_grow(dblog_t *dl, size_t len)
+{
+	if (len > dl->rsize) {
+		dl->rsize = MAX(len, 2 * dl->rsize);
+		dl->rbuf = hrealloc(dl->rbuf, dl->rsize);
+	}
+}
+
+/**
+ * Account for the record of an entry becoming dead.
+ */
+static void
+dblog_entry_dead(struct dblog_entry *e)
+{
+	struct dblog_seg *s = e->seg;
+	size_t len = dblog_reclen(e->k.len, e->vlen);
+
+	g_assert(s->items != 0);
+	g_assert(s->live >= len);
+
+	s->items--;
+	s->live -= len;
+}
+
+/**
+ * Account for the record of an entry becoming live.
+ */
+static void
+dblog_entry_live(struct dblog_entry *e, struct dblog_seg *s, filesize_t off)
+{
+	e->seg = s;
+	e->off = off;
+	s->items++;
+	s->live += dblog_reclen(e->k.len, e->vlen);
+}
+
+/**
+ * Free index entry.
+ */
+static void
+dblog_entry_free(struct dblog_entry *e)
+{
+	wfree(deconstify_pointer(e->k.data), e->k.len);
+	WFREE(e);
+}
+
+/**
+ * Record that key has a value of given length in a record at some location.
+ */
+static void
+dblog_index_put(dblog_t *dl, const void *key, size_t klen, uint32 vlen,
+	struct dblog_seg *s, filesize_t off)
+{
+	struct dblog_key k;
+	struct dblog_entry *e;
+
+	k.data = key;
+	k.len = klen;
+
+	e = hevset_lookup(dl->index, &k);
+
+	if (e != NULL) {
+		dblog_entry_dead(e);
+	} else {
+		WALLOC(e);
+		e->k.data = wcopy(key, klen);
+		e->k.len = klen;
+		hevset_insert(dl->index, e);
+	}
+
+	e->vlen = vlen;
+	dblog_entry_live(e, s, off);
+}
+
+/**
+ * Remove key from the index.
+ *
+ * @return whether key was present.
+ */
+static bool
+dblog_index_remove(dblog_t *dl, const void *key, size_t klen)
+{
+	struct dblog_key k;
+	struct dblog_entry *e;
+
+	k.data = key;
+	k.len = klen;
+
+	e = hevset_lookup(dl->index, &k);
+
+	if (NULL == e)
+		return FALSE;
+
+	dblog_entry_dead(e);
+	hevset_remove(dl->index, &e->k);
+	dblog_entry_free(e);
+
+	return TRUE;
+}
+
+/**
+ * Make sure all the records written so far reached the storage device.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_sync_data(dblog_t *dl)
+{
+	size_t i;
+
+	if (-1 == dblog_flush(dl))
+		return -1;
+
+	for (i = 0; i < dl->nsegs; i++) {
+		struct dblog_seg *s = dl->segs[i];
+
+		if (s->unsynced) {
+			if (-1 == fd_fdatasync(s->fd))
+				return -1;
+			s->unsynced = FALSE;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Drop the oldest segment, which holds no live records.
+ *
+ * Its records were either copied forward or superseded by newer ones, which
+ * may not have reached the disk yet: pending records are synced first so
+ * that a crash cannot lose both the old and the new values.
+ *
+ * @return 0 if OK, -1 on error with errno set, the segment being kept.
+ */
+static int
+dblog_drop_oldest(dblog_t *dl)
+{
+	struct dblog_seg *s = dl->segs[0];
+
+	g_assert(dl->nsegs > 1);
+	g_assert(0 == s->items);
+
+	if (-1 == dblog_sync_data(dl))
+		return -1;
+
+	dl->nsegs--;
+	memmove(&dl->segs[0], &dl->segs[1], dl->nsegs * sizeof dl->segs[0]);
+	dl->cursor = DBLOG_SEG_HDR;
+	dl->compacting = FALSE;
+
+	dblog_seg_free(dl, s, TRUE);
+	return 0;
+}
+
+/**
+ * Copy live records of the oldest segment at the end of the log.
+ *
+ * @param dl		the log
+ * @param budget	maximum amount of bytes to process
+ *
+ * @return amount of bytes processed, -1 on error with errno set.
+ */
+static ssize_t
+dblog_copy_forward(dblog_t *dl, size_t budget)
+{
+	struct dblog_seg *s = dl->segs[0];
+	size_t done = 0;
+
+	g_assert(dl->nsegs > 1);
+
+	while (dl->cursor < s->size && done < budget) {
+		char hdr[DBLOG_REC_HDR];
+		struct dblog_key k;
+		struct dblog_entry *e;
+		size_t klen, vlen;
+
+		if (-1 == dblog_read(dl, s, dl->cursor, ARYLEN(hdr)))
+			return -1;
+
+		klen = peek_be16(&hdr[1]);
+		vlen = peek_be32(&hdr[3]);
+
+		/*
+		 * Tombstones are dropped, and so are records superseded by a more
+		 * recent one, which are not referenced by the index.
+		 */
+
+		if (DBLOG_PUT == hdr[0]) {
+			filesize_t rec = dl->cursor + DBLOG_REC_HDR;
+
+			dblog_rbuf_grow(dl, klen + vlen);
+			if (-1 == dblog_read(dl, s, rec, dl->rbuf, klen))
+				return -1;
+
+			k.data = dl->rbuf;
+			k.len = klen;
+			e = hevset_lookup(dl->index, &k);
+
+			if (e != NULL && e->seg == s && e->off == dl->cursor) {
+				struct dblog_seg *ns;
+				filesize_t noff;
+
+				if (-1 == dblog_read(dl, s, rec + klen, &dl->rbuf[klen], vlen))
+					return -1;
+
+				if (
+					-1 == dblog_append(dl, DBLOG_PUT, e->k.data, klen,
+						&dl->rbuf[klen], vlen, &ns, &noff)
+				)
+					return -1;
+
+				dblog_entry_dead(e);
+				dblog_entry_live(e, ns, noff);
+			}
+		}
+
+		dl->cursor += dblog_reclen(klen, vlen);
+		done += dblog_reclen(klen, vlen);
+	}
+
+	return done;
+}
+
+/**
+ * @return percentage of dead data in the log.
+ */
+static uint
+dblog_garbage(const dblog_t *dl)
+{
+	filesize_t data = 0, live = 0;
+	size_t i;
+
+	for (i = 0; i < dl->nsegs; i++) {
+		const struct dblog_seg *s = dl->segs[i];
+
+		data += s->size - DBLOG_SEG_HDR;
+		live += s->live;
+	}
+
+	return 0 == data ? 0 : (data - live) * 100 / data;
+}
+
+/**
+ * Reclaim space from the oldest segments.
+ *
+ * Segments holding no live records are dropped.  When the log holds enough
+ * dead data, or when compaction of the oldest segment was already started,
+ * at most `budget' bytes of the records of the oldest segment are processed.
+ *
+ * Values which expire in the order they were written are therefore never
+ * copied: their segments are dropped once all their records are dead.
+ *
+ * @param dl		the log
+ * @param budget	maximum amount of bytes to compact
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_reclaim(dblog_t *dl, size_t budget)
+{
+	while (dl->nsegs > 1) {
+		struct dblog_seg *s = dl->segs[0];
+		ssize_t n;
+
+		if (0 == s->items) {
+			if (-1 == dblog_drop_oldest(dl))
+				return -1;
+			continue;
+		}
+
+		if (0 == budget)
+			break;
+
+		if (!dl->compacting && dblog_garbage(dl) < DBLOG_GARBAGE)
+			break;
+
+		dl->compacting = TRUE;
+		n = dblog_copy_forward(dl, budget);
+		if (-1 == n)
+			return -1;
+
+		budget -= MIN(budget, UNSIGNED(n));
+
+		g_assert(dl->cursor < s->size || 0 == s->items);
+	}
+
+	return 0;
+}
+
+/**
+ * Replay segment, updating the index.
+ *
+ * The segment is read entirely and its records are checked: the segment
+ * is truncated to its last valid record, dropping a record torn by a crash.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_replay(dblog_t *dl, struct dblog_seg *s)
+{
+	filestat_t buf;
+	char *data;
+	size_t size, off;
+	int ret = 0;
+
+	if (-1 == fstat(s->fd, &buf))
+		return -1;
+
+	if (buf.st_size < DBLOG_SEG_HDR) {
+		size = 0;
+		data = NULL;
+		goto truncated;
+	}
+
+	size = buf.st_size;
+	data = halloc(size);
+
+	if (UNSIGNED(compat_pread(s->fd, data, size, 0)) != size) {
+		if (0 == errno)
+			errno = EIO;
+		ret = -1;
+		goto done;
+	}
+
+	if (
+		DBLOG_SEG_MAGIC != peek_be32(&data[0]) ||
+		peek_be32(&data[8]) != s->num
+	) {
+		s_warning("DBLOG \"%s\" segment #%u has a corrupted header",
+			dl->name, s->num);
+		size = 0;
+		goto truncated;
+	}
+
+	if (peek_be32(&data[4]) > DBLOG_SEG_VERSION) {
+		s_warning("DBLOG \"%s\" segment #%u has unknown version %u",
+			dl->name, s->num, peek_be32(&data[4]));
+		errno = EINVAL;
+		ret = -1;
+		goto done;
+	}
+
+	for (off = DBLOG_SEG_HDR; off < size; /* empty */) {
+		const char *p = &data[off];
+		size_t klen, vlen, len;
+		uint32 crc;
+
+		if (size - off < DBLOG_REC_HDR)
+			break;
+
+		klen = peek_be16(&p[1]);
+		vlen = peek_be32(&p[3]);
+		len = dblog_reclen(klen, vlen);
+
+		if (len > size - off)
+			break;
+
+		crc = crc32_update(0, p, 7);
+		crc = crc32_update(crc, &p[DBLOG_REC_HDR], klen + vlen);
+
+		if (crc != peek_be32(&p[7]))
+			break;
+
+		switch (p[0]) {
+		case DBLOG_PUT:
+			dblog_index_put(dl, &p[DBLOG_REC_HDR], klen, vlen, s, off);
+			break;
+		case DBLOG_DEL:
+			dblog_index_remove(dl, &p[DBLOG_REC_HDR], klen);
+			break;
+		default:
+			goto invalid;
+		}
+
+		off += len;
+	}
+
+	/* FALL THROUGH */
+
+invalid:
+	if (off == size)
+		goto done;
+
+	s_warning("DBLOG \"%s\" discarding %zu trailing byte%s in segment #%u",
+		dl->name, PLURAL(size - off), s->num);
+
+	size = off;
+
+	/* FALL THROUGH */
+
+truncated:
+	if (dl->rdonly) {
+		size = MAX(size, DBLOG_SEG_HDR);
+		goto done;
+	}
+
+	if (size < DBLOG_SEG_HDR) {
+		char hdr[DBLOG_SEG_HDR];
+
+		poke_be32(&hdr[0], DBLOG_SEG_MAGIC);
+		poke_be32(&hdr[4], DBLOG_SEG_VERSION);
+		poke_be32(&hdr[8], s->num);
+
+		if (sizeof hdr != compat_pwrite(s->fd, ARYLEN(hdr), 0)) {
+			if (0 == errno)
+				errno = EIO;
+			ret = -1;
+			goto done;
+		}
+		size = DBLOG_SEG_HDR;
+	}
+
+	if (-1 == ftruncate(s->fd, size))
+		ret = -1;
+
+	/* FALL THROUGH */
+
+done:
+	s->size = size;
+	HFREE_NULL(data);
+	return ret;
+}
+
+static int
+dblog_num_cmp(const void *a, const void *b)
+{
+	const uint32 *na = a, *nb = b;
+
+	return CMP(*na, *nb);
+}
+
+/**
+ * Load all the segments of the log from disk, rebuilding the index.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+dblog_load(dblog_t *dl)
+{
+	DIR *d;
+	struct dirent *dentry;
+	uint32 *nums = NULL;
+	size_t i, n = 0;
+	int ret = 0;
+
+	d = opendir(dl->path);
+	if (NULL == d)
+		return -1;
+
+	while (NULL != (dentry = readdir(d))) {
+		const char *filename = dir_entry_filename(dentry);
+		const char *ext = strchr(filename, '.');
+		uint32 num;
+		int error;
+
+		if (NULL == ext || 0 != strcmp(ext, DBLOG_SEGFEXT))
+			continue;
+
+		num = parse_uint32(filename, &ext, 16, &error);
+		if (error || 0 != strcmp(ext, DBLOG_SEGFEXT))
+			continue;
+
+		HREALLOC_ARRAY(nums, n + 1);
+		nums[n++] = num;
+	}
+
+	closedir(d);
+
+	vsort(nums, n, sizeof nums[0], dblog_num_cmp);
+
+	for (i = 0; i < n; i++) {
+		char *path = dblog_seg_path(dl, nums[i]);
+		int fd = file_open(path, dl->rdonly ? O_RDONLY : O_RDWR, 0);
+		struct dblog_seg *s;
+
+		HFREE_NULL(path);
+
+		if (-1 == fd) {
+			ret = -1;
+			break;
+		}
+
+		s = dblog_seg_add(dl, nums[i], fd);
+
+		if (-1 == dblog_replay(dl, s)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	HFREE_NULL(nums);
+	return ret;
+}
+
+/**
+ * Open log store.
+ *
+ * When opened read-write, a new segment is started if the last one is full
+ * or when there are no segments yet.
+ *
+ * @param name		name of the log store, for logging (may be NULL)
+ * @param path		path of the directory holding the segments
+ * @param flags		opening flags (O_CREAT, O_TRUNC, O_RDONLY, O_RDWR)
+ * @param mode		permissions for the segment files
+ *
+ * @return the opened store, NULL on error with errno set.
+ */
+dblog_t *
+dblog_open(const char *name, const char *path, int flags, int mode)
+{
+	dblog_t *dl;
+
+	g_assert(path != NULL);
+
+	if ((flags & O_CREAT) && !(flags & O_ACCMODE)) {
+		errno = EINVAL;			/* Cannot create read-only */
+		return NULL;
+	}
+
+	if (flags & O_TRUNC) {
+		if (-1 == dblog_unlink(path) && ENOENT != errno)
+			return NULL;
+	}
+
+	if (flags & O_CREAT) {
+		if (-1 == create_directory(path, mode | S_IXUSR))
+			return NULL;
+	}
+
+	WALLOC0(dl);
+	dl->magic = DBLOG_MAGIC;
+	dl->path = h_strdup(path);
+	dl->name = h_strdup(NULL == name ? path : name);
+	dl->mode = mode;
+	dl->rdonly = !(flags & O_ACCMODE);
+	dl->cursor = DBLOG_SEG_HDR;
+	dl->index = hevset_create_any(offsetof(struct dblog_entry, k),
+		dblog_key_hash, dblog_key_hash2, dblog_key_eq);
+	dl->rsize = 512;
+	dl->rbuf = halloc(dl->rsize);
+
+	if (!dl->rdonly)
+		dl->wbuf = halloc(DBLOG_WBUF);
+
+	if (-1 == dblog_load(dl))
+		goto failed;
+
+	if (!dl->rdonly) {
+		if (0 == dl->nsegs || dblog_active(dl)->size >= DBLOG_SEG_MAX) {
+			if (-1 == dblog_seg_create(dl))
+				goto failed;
+		}
+	} else if (0 == dl->nsegs) {
+		errno = ENOENT;
+		goto failed;
+	}
+
+	return dl;
+
+failed:
+	{
+		int error = errno;
+		dblog_close(dl);
+		errno = error;
+	}
+	return NULL;
+}
+
+/**
+ * Free index entry, iterator callback.
+ */
+static void
+dblog_entry_free_cb(void *data, void *unused)
+{
+	(void) unused;
+
+	dblog_entry_free(data);
+}
+
+/**
+ * Close log store.
+ *
+ * Buffered records are written, unless the store is volatile, in which
+ * case all its files are removed.
+ */
+void
+dblog_close(dblog_t *dl)
+{
+	size_t i;
+
+	dblog_check(dl);
+
+	if (!dl->is_volatile && -1 == dblog_flush(dl))
+		dblog_ioerr(dl, "closing");
+
+	for (i = 0; i < dl->nsegs; i++) {
+		dblog_seg_free(dl, dl->segs[i], FALSE);
+	}
+
+	if (dl->is_volatile && -1 == dblog_unlink(dl->path) && ENOENT != errno)
+		s_warning("DBLOG \"%s\" cannot remove %s: %m", dl->name, dl->path);
+
+	hevset_foreach(dl->index, dblog_entry_free_cb, NULL);
+	hevset_free_null(&dl->index);
+	HFREE_NULL(dl->segs);
+	HFREE_NULL(dl->wbuf);
+	HFREE_NULL(dl->rbuf);
+	HFREE_NULL(dl->path);
+	HFREE_NULL(dl->name);
+	dl->magic = 0;
+	WFREE(dl);
+}
+
+/**
+ * Remove the segment directory of a log store, along with its segments.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+dblog_unlink(const char *path)
+{
+	DIR *d;
+	struct dirent *dentry;
+
+	d = opendir(path);
+	if (NULL == d)
+		return -1;
+
+	while (NULL != (dentry = readdir(d))) {
+		const char *filename = dir_entry_filename(dentry);
+		size_t len = strlen(filename);
+		char *file;
+
+		if (NULL == is_strsuffix(filename, len, DBLOG_SEGFEXT))
+			continue;
+
+		file = make_pathname(path, filename);
+		if (-1 == unlink(file))
+			s_warning("%s(): cannot unlink %s: %m", G_STRFUNC, file);
+		HFREE_NULL(file);
+	}
+
+	closedir(d);
+
+	return rmdir(path);
+}
+
+/**
+ * Check that we can update the store.
+ */
+static bool
+dblog_writable(dblog_t *dl)
+{
+	dblog_check(dl);
+
+	dl->ioerr = FALSE;
+
+	if G_UNLIKELY(dl->rdonly) {
+		errno = EPERM;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Store key/value pair, replacing any existing value.
+ *
+ * @param dl		the log store
+ * @param key		the key
+ * @param klen		the key length
+ * @param value		the value (may be NULL when vlen is 0)
+ * @param vlen		the value length
+ * @param existed	if non-NULL, set to whether the key was present
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+dblog_store(dblog_t *dl, const void *key, size_t klen,
+	const void *value, size_t vlen, bool *existed)
+{
+	struct dblog_key k;
+	struct dblog_seg *s;
+	filesize_t off;
+
+	if (!dblog_writable(dl))
+		return -1;
+
+	if (klen > MAX_INT_VAL(uint16) || vlen > DBLOG_SEG_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (-1 == dblog_append(dl, DBLOG_PUT, key, klen, value, vlen, &s, &off))
+		goto ioerr;
+
+	k.data = key;
+	k.len = klen;
+
+	if (existed != NULL)
+		*existed = hevset_contains(dl->index, &k);
+
+	dblog_index_put(dl, key, klen, vlen, s, off);
+
+	if (-1 == dblog_reclaim(dl, DBLOG_STEP))
+		goto ioerr;
+
+	return 0;
+
+ioerr:
+	dblog_ioerr(dl, "storing");
+	return -1;
+}
+
+/**
+ * Delete key.
+ *
+ * @return 0 if OK, -1 on error with errno set, errno being 0 when the
+ * key was not present.
+ */
+int
+dblog_delete(dblog_t *dl, const void *key, size_t klen)
+{
+	struct dblog_key k;
+	struct dblog_seg *s;
+	filesize_t off;
+
+	if (!dblog_writable(dl))
+		return -1;
+
+	k.data = key;
+	k.len = klen;
+
+	if (!hevset_contains(dl->index, &k)) {
+		errno = 0;
+		return -1;
+	}
+
+	if (-1 == dblog_append(dl, DBLOG_DEL, key, klen, NULL, 0, &s, &off))
+		goto ioerr;
+
+	dblog_index_remove(dl, key, klen);
+
+	if (-1 == dblog_reclaim(dl, DBLOG_STEP))
+		goto ioerr;
+
+	return 0;
+
+ioerr:
+	dblog_ioerr(dl, "deleting");
+	return -1;
+}
+
+/**
+ * Check whether key exists.
+ *
+ * This is answered from the index, without any I/O.
+ *
+ * @return 1 if the key exists, 0 otherwise.
+ */
+int
+dblog_exists(const dblog_t *dl, const void *key, size_t klen)
+{
+	struct dblog_key k;
+
+	dblog_check(dl);
+
+	k.data = key;
+	k.len = klen;
+
+	return hevset_contains(dl->index, &k) ? 1 : 0;
+}
+
+/**
+ * Read the value of an index entry into the read buffer.
+ *
+ * @return pointer to the value, NULL on error with errno set.
+ */
+static void *
+dblog_value(dblog_t *dl, const struct dblog_entry *e)
+{
+	dblog_rbuf_grow(dl, e->vlen);
+
+	if (
+		0 != e->vlen &&
+		-1 == dblog_read(dl, e->seg, e->off + DBLOG_REC_HDR + e->k.len,
+			dl->rbuf, e->vlen)
+	) {
+		dblog_ioerr(dl, "reading value");
+		return NULL;
+	}
+
+	return dl->rbuf;
+}
+
+/**
+ * Fetch value of key.
+ *
+ * The returned value is held in a buffer which is only valid until the
+ * next call on the store.
+ *
+ * @param dl		the log store
+ * @param key		the key
+ * @param klen		the key length
+ * @param vlen		where the length of the value is returned
+ *
+ * @return pointer to the value, NULL if the key is missing (errno set to 0)
+ * or on error.
+ */
+void *
+dblog_fetch(dblog_t *dl, const void *key, size_t klen, size_t *vlen)
+{
+	struct dblog_key k;
+	const struct dblog_entry *e;
+
+	dblog_check(dl);
+	g_assert(vlen != NULL);
+
+	dl->ioerr = FALSE;
+
+	k.data = key;
+	k.len = klen;
+	e = hevset_lookup(dl->index, &k);
+
+	if (NULL == e) {
+		errno = 0;
+		*vlen = 0;
+		return NULL;
+	}
+
+	*vlen = e->vlen;
+	return dblog_value(dl, e);
+}
+
+/**
+ * Collect index entry, iterator callback.
+ */
+static void
+dblog_collect(void *data, void *udata)
+{
+	struct dblog_entry ***ep = udata;
+
+	*(*ep)++ = data;
+}
+
+static int
+dblog_entry_cmp(const void *a, const void *b)
+{
+	const struct dblog_entry * const *ea = a, * const *eb = b;
+	const struct dblog_entry *x = *ea, *y = *eb;
+
+	return x->seg == y->seg ?
+		CMP(x->off, y->off) : CMP(x->seg->num, y->seg->num);
+}
+
+/**
+ * @return array of all the index entries, sorted by record location so
+ * that values can be read sequentially, to be freed via hfree().
+ */
+static struct dblog_entry **
+dblog_entries(const dblog_t *dl, size_t *count)
+{
+	struct dblog_entry **entries, **ep;
+	size_t n = hevset_count(dl->index);
+
+	HALLOC_ARRAY(entries, MAX(n, 1));
+	ep = entries;
+	hevset_foreach(dl->index, dblog_collect, &ep);
+	g_assert(UNSIGNED(ep - entries) == n);
+
+	vsort(entries, n, sizeof entries[0], dblog_entry_cmp);
+	*count = n;
+
+	return entries;
+}
+
+/**
+ * Iterate over all the key/value pairs, in the order they were written.
+ *
+ * The callback must not update the store.
+ *
+ * @return the amount of pairs traversed.
+ */
+size_t
+dblog_foreach(dblog_t *dl, dblog_cb_t cb, void *arg)
+{
+	struct dblog_entry **entries;
+	size_t i, n, count = 0;
+
+	dblog_check(dl);
+	g_assert(cb != NULL);
+
+	dl->ioerr = FALSE;
+	entries = dblog_entries(dl, &n);
+
+	for (i = 0; i < n; i++) {
+		const struct dblog_entry *e = entries[i];
+		const void *value = dblog_value(dl, e);
+
+		if (NULL == value)
+			continue;
+
+		(*cb)(e->k.data, e->k.len, value, e->vlen, arg);
+		count++;
+	}
+
+	HFREE_NULL(entries);
+	return count;
+}
+
+/**
+ * Iterate over all the key/value pairs, in the order they were written,
+ * removing the pair when the callback returns TRUE.
+ *
+ * The callback must not update the store.
+ *
+ * @return the amount of pairs kept.
+ */
+size_t
+dblog_foreach_remove(dblog_t *dl, dblog_cbr_t cbr, void *arg)
+{
+	struct dblog_entry **entries;
+	size_t i, n;
+
+	dblog_check(dl);
+	g_assert(cbr != NULL);
+
+	dl->ioerr = FALSE;
+	entries = dblog_entries(dl, &n);
+
+	for (i = 0; i < n; i++) {
+		struct dblog_entry *e = entries[i];
+		const void *value = dblog_value(dl, e);
+		struct dblog_seg *s;
+		filesize_t off;
+
+		if (NULL == value)
+			continue;
+
+		if (!(*cbr)(e->k.data, e->k.len, value, e->vlen, arg))
+			continue;
+
+		if (dl->rdonly) {
+			errno = EPERM;
+			dblog_ioerr(dl, "deleting");
+			continue;
+		}
+
+		if (
+			-1 == dblog_append(dl, DBLOG_DEL, e->k.data, e->k.len, NULL, 0,
+				&s, &off)
+		) {
+			dblog_ioerr(dl, "deleting");
+			continue;
+		}
+
+		dblog_entry_dead(e);
+		hevset_remove(dl->index, &e->k);
+		dblog_entry_free(e);
+	}
+
+	HFREE_NULL(entries);
+
+	if (!dl->rdonly && -1 == dblog_reclaim(dl, 0))
+		dblog_ioerr(dl, "dropping segments");
+
+	return hevset_count(dl->index);
+}
+
+/**
+ * Write buffered records to disk.
+ *
+ * @return 1 if records were written, 0 if none were buffered, -1 on error.
+ */
+ssize_t
+dblog_sync(dblog_t *dl)
+{
+	ssize_t r;
+
+	dblog_check(dl);
+
+	if (dl->rdonly)
+		return 0;
+
+	r = dblog_flush(dl);
+
+	if (-1 == r) {
+		dblog_ioerr(dl, "syncing");
+		return -1;
+	}
+
+	return 0 == r ? 0 : 1;
+}
+
+/**
+ * Write buffered records to disk and wait for them to reach the storage
+ * device, so that they survive a system crash.
+ *
+ * @return 1 if records were written, 0 if none were buffered, -1 on error.
+ */
+ssize_t
+dblog_sync_durable(dblog_t *dl)
+{
+	ssize_t r;
+
+	r = dblog_sync(dl);
+
+	if (-1 == r || dl->rdonly)
+		return r;
+
+	if (-1 == dblog_sync_data(dl)) {
+		dblog_ioerr(dl, "syncing");
+		return -1;
+	}
+
+	return r;
+}
+
+/**
+ * Drop the oldest segments when they no longer hold live records.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+dblog_shrink(dblog_t *dl)
+{
+	if (!dblog_writable(dl))
+		return -1;
+
+	return dblog_reclaim(dl, 0);
+}
+
+/**
+ * Compact the whole log, copying all the live records to fresh segments.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+dblog_compact(dblog_t *dl)
+{
+	const struct dblog_seg *fresh;
+
+	if (!dblog_writable(dl))
+		return -1;
+
+	if (1 == dl->nsegs && DBLOG_SEG_HDR == dblog_active(dl)->size)
+		return 0;		/* Empty log */
+
+	if (-1 == dblog_flush(dl) || -1 == dblog_seg_create(dl))
+		goto ioerr;
+
+	/*
+	 * All the segments preceding the one we just created are compacted,
+	 * oldest first, and dropped.
+	 */
+
+	fresh = dblog_active(dl);
+
+	while (dl->segs[0] != fresh) {
+		if (0 == dl->segs[0]->items) {
+			if (-1 == dblog_drop_oldest(dl))
+				goto ioerr;
+		} else {
+			dl->compacting = TRUE;
+			if (-1 == dblog_copy_forward(dl, DBLOG_SEG_MAX))
+				goto ioerr;
+		}
+	}
+
+	return 0;
+
+ioerr:
+	dblog_ioerr(dl, "compacting");
+	return -1;
+}
+
+/**
+ * Discard all the data of the store.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+dblog_clear(dblog_t *dl)
+{
+	size_t i;
+
+	if (!dblog_writable(dl))
+		return -1;
+
+	dl->wfill = 0;
+
+	for (i = 0; i < dl->nsegs; i++) {
+		dblog_seg_free(dl, dl->segs[i], TRUE);
+	}
+
+	dl->nsegs = 0;
+	dl->cursor = DBLOG_SEG_HDR;
+	dl->compacting = FALSE;
+	hevset_foreach(dl->index, dblog_entry_free_cb, NULL);
+	hevset_clear(dl->index);
+
+	if (-1 == dblog_seg_create(dl)) {
+		dblog_ioerr(dl, "clearing");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Set whether the store is volatile, i.e. whether its files are removed
+ * when it is closed.
+ */
+void
+dblog_set_volatile(dblog_t *dl, bool is_volatile)
+{
+	dblog_check(dl);
+
+	dl->is_volatile = booleanize(is_volatile);
+}
+
+/**
+ * @return amount of keys held in the store.
+ */
+size_t
+dblog_count(const dblog_t *dl)
+{
+	dblog_check(dl);
+
+	return hevset_count(dl->index);
+}
+
+/**
+ * @return name of the store, for logging.
+ */
+const char *
+dblog_name(const dblog_t *dl)
+{
+	dblog_check(dl);
+
+	return dl->name;
+}
+
+/**
+ * @return whether the last operation raised an I/O error.
+ */
+bool
+dblog_error(const dblog_t *dl)
+{
+	dblog_check(dl);
+
+	return dl->ioerr;
+}
+
+/**
+ * Clear the I/O error indication.
+ */
+void
+dblog_clearerr(dblog_t *dl)
+{
+	dblog_check(dl);
+
+	dl->ioerr = FALSE;
+	dl->error = 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
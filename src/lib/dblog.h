@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Append-only log-structured key/value store.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _dblog_h_
+#define _dblog_h_
+
+#define DBLOG_DIREXT	".log"	/**< Extension of the segment directory */
+
+struct dblog;
+typedef struct dblog dblog_t;
+
+/**
+ * Log "foreach" iterator callbacks.
+ */
+typedef void (*dblog_cb_t)(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg);
+typedef bool (*dblog_cbr_t)(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg);
+
+/*
+ * Public interface.
+ */
+
+dblog_t *dblog_open(const char *name, const char *path, int flags, int mode);
+void dblog_close(dblog_t *dl);
+int dblog_unlink(const char *path);
+
+int dblog_store(dblog_t *dl, const void *key, size_t klen,
+	const void *value, size_t vlen, bool *existed);
+int dblog_delete(dblog_t *dl, const void *key, size_t klen);
+int dblog_exists(const dblog_t *dl, const void *key, size_t klen);
+void *dblog_fetch(dblog_t *dl, const void *key, size_t klen, size_t *vlen);
+
+size_t dblog_foreach(dblog_t *dl, dblog_cb_t cb, void *arg);
+size_t dblog_foreach_remove(dblog_t *dl, dblog_cbr_t cbr, void *arg);
+
+ssize_t dblog_sync(dblog_t *dl);
+ssize_t dblog_sync_durable(dblog_t *dl);
+int dblog_shrink(dblog_t *dl);
+int dblog_compact(dblog_t *dl);
+int dblog_clear(dblog_t *dl);
+void dblog_set_volatile(dblog_t *dl, bool is_volatile);
+
+size_t dblog_count(const dblog_t *dl);
+const char *dblog_name(const dblog_t *dl);
+bool dblog_error(const dblog_t *dl);
+void dblog_clearerr(dblog_t *dl);
+
+#endif /* _dblog_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
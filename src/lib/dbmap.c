@@ -39,6 +39,9 @@
  * to an in-core version of a DBM database should there be a problem with
  * initialization of the DBM.
  *
+ * Besides SDBM, maps can be backed by an append-only log store, which is
+ * better suited to values that are written once and later expired.
+ *
  * @author Raphael Manfredi
  * @date 2008
  */
@@ -48,6 +51,7 @@
 #include "dbmap.h"
 
 #include "bstr.h"
+#include "dblog.h"
 #include "debug.h"
 #include "map.h"
 #include "misc.h"				/* For english_strerror() */
@@ -79,6 +83,9 @@ struct dbmap {
 			time_t last_check;		/**< When we last checked keys */
 			unsigned is_volatile:1;	/**< Whether DB can be discarded */
 		} s;
+		struct {
+			dblog_t *log;
+		} l;
 	} u;
 	size_t key_size;		/**< Constant width keys are a requirement */
 	dbmap_keylen_t key_len;	/**< Optional, computes serialized key length */
@@ -292,6 +299,32 @@ dbmap_sdbm_error_check(const dbmap_t *dm)
 	return FALSE;
 }
 
+/**
+ * Check whether last operation reported an I/O error in the log store.
+ *
+ * @return TRUE on error
+ */
+static bool
+dbmap_log_error_check(const dbmap_t *dm)
+{
+	dbmap_t *dmw = deconstify_pointer(dm);
+
+	dbmap_check(dm);
+	g_assert(DBMAP_LOG == dm->type);
+
+	if (dblog_error(dm->u.l.log)) {
+		dmw->ioerr = TRUE;
+		dmw->had_ioerr = TRUE;
+		dmw->error = errno;
+		return TRUE;
+	} else if (dm->ioerr) {
+		dmw->ioerr = FALSE;
+		dmw->error = 0;
+	}
+
+	return FALSE;
+}
+
 /**
  * Helper routine to count keys in an opened SDBM database.
  */
@@ -432,6 +465,22 @@ dbmap_type(const dbmap_t *dm)
 	return dm->type;
 }
 
+/**
+ * @return English description of the DB map type, for logging.
+ */
+const char *
+dbmap_type_to_string(enum dbmap_type type)
+{
+	switch (type) {
+	case DBMAP_MAP:		return "map";
+	case DBMAP_SDBM:	return "sdbm";
+	case DBMAP_LOG:		return "log";
+	case DBMAP_MAXTYPE:	break;
+	}
+
+	return "unknown";
+}
+
 /**
  * @return amount of items held in map
  */
@@ -530,6 +579,49 @@ dbmap_create_sdbm(size_t ksize, dbmap_keylen_t klen,
 	return dm;
 }
 
+/**
+ * Create a DB map implemented as an append-only log store.
+ *
+ * When klen is NULL, ksize is the expected constant key length.
+ * When klen is not NULL, ksize is the expected maximum key length
+ * and the klen routine is used to compute the actual size of the key
+ * based on its serialized form.
+ *
+ * @param ksize		expected constant key length
+ * @param klen		optional, computes serialized key length
+ * @param name		name of the log store, for logging (may be NULL)
+ * @param path		path of the directory holding the log segments
+ * @param flags		opening flags
+ * @param mode		file permissions
+ *
+ * @return the opened store, or NULL if an error occurred during opening.
+ */
+dbmap_t *
+dbmap_create_log(size_t ksize, dbmap_keylen_t klen,
+	const char *name, const char *path, int flags, int mode)
+{
+	dbmap_t *dm;
+	dblog_t *log;
+
+	g_assert(ksize != 0);
+	g_assert(path != NULL);
+
+	log = dblog_open(name, path, flags, mode);
+	if (NULL == log)
+		return NULL;
+
+	WALLOC0(dm);
+	dm->magic = DBMAP_MAGIC;
+	dm->type = DBMAP_LOG;
+	dm->key_size = ksize;
+	dm->key_len = klen;
+	dm->u.l.log = log;
+	dm->count = dblog_count(log);
+	dm->validated = TRUE;		/* Index rebuilt from the log */
+
+	return dm;
+}
+
 /**
  * Create a map out of an existing map.
  * Use dbmap_release() to discard the dbmap encapsulation.
@@ -679,6 +771,22 @@ dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value)
 				dm->count++;
 		}
 		break;
+	case DBMAP_LOG:
+		{
+			bool existed = FALSE;
+
+			errno = dm->error = 0;
+			if (
+				0 != dblog_store(dm->u.l.log, key, dbmap_keylen(dm, key),
+					value.data, value.len, &existed)
+			) {
+				dbmap_log_error_check(dm);
+				return FALSE;
+			}
+			if (!existed)
+				dm->count++;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -757,6 +865,17 @@ dbmap_remove(dbmap_t *dm, const void *key)
 			}
 		}
 		break;
+	case DBMAP_LOG:
+		errno = dm->error = 0;
+		if (0 == dblog_delete(dm->u.l.log, key, dbmap_keylen(dm, key))) {
+			g_assert(dm->count);
+			dm->count--;
+		} else if (errno != 0) {
+			/* Could be that value was not found, errno == 0 then */
+			dbmap_log_error_check(dm);
+			return FALSE;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -792,12 +911,45 @@ dbmap_contains(dbmap_t *dm, const void *key)
 			}
 			return 0 != ret;
 		}
+	case DBMAP_LOG:
+		return 0 != dblog_exists(dm->u.l.log, key, dbmap_keylen(dm, key));
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
 	return FALSE;
 }
 
+/**
+ * Compute the SDBM page where the key lies or would be inserted, so that
+ * updates can be ordered to hit the disk sequentially.
+ *
+ * @return the page number, 0 for in-memory maps and log stores (whose
+ * writes are always sequential), -1 on error.
+ */
+long
+dbmap_page_of(dbmap_t *dm, const void *key)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_LOG:
+		return 0;
+	case DBMAP_SDBM:
+		{
+			datum dkey;
+
+			dkey.dptr = deconstify_pointer(key);
+			dkey.dsize = dbmap_keylen(dm, key);
+
+			return sdbm_page_of(dm->u.s.sdbm, dkey);
+		}
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+	return -1;
+}
+
 /**
  * Lookup a key in the DB map.
  */
@@ -839,6 +991,12 @@ dbmap_lookup(dbmap_t *dm, const void *key)
 			result.len = value.dsize;
 		}
 		break;
+	case DBMAP_LOG:
+		errno = dm->error = 0;
+		result.data = dblog_fetch(dm->u.l.log,
+			key, dbmap_keylen(dm, key), &result.len);
+		dbmap_log_error_check(dm);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -859,6 +1017,8 @@ dbmap_implementation(const dbmap_t *dm)
 		return dm->u.m.map;
 	case DBMAP_SDBM:
 		return dm->u.s.sdbm;
+	case DBMAP_LOG:
+		return dm->u.l.log;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -905,7 +1065,7 @@ free_kv(void *key, void *value, void *u)
  * Destroy a DB map.
  *
  * A memory-backed map is lost.
- * An SDBM-backed map is lost if marked volatile.
+ * An SDBM-backed or log-backed map is lost if marked volatile.
  */
 void
 dbmap_destroy(dbmap_t *dm)
@@ -920,6 +1080,9 @@ dbmap_destroy(dbmap_t *dm)
 	case DBMAP_SDBM:
 		sdbm_close(dm->u.s.sdbm);
 		break;
+	case DBMAP_LOG:
+		dblog_close(dm->u.l.log);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -949,6 +1112,24 @@ insert_key(void *key, void *unused_value, void *u)
 	ctx->sl = pslist_prepend(ctx->sl, kdup);
 }
 
+/**
+ * Log store iterator to insert a copy of the keys into a singly-linked list.
+ */
+static void
+insert_log_key(const void *key, size_t klen,
+	const void *unused_value, size_t unused_vlen, void *u)
+{
+	struct insert_ctx *ctx = u;
+
+	(void) unused_value;
+	(void) unused_vlen;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return;		/* Invalid key, corrupted file? */
+
+	ctx->sl = pslist_prepend(ctx->sl, wcopy(key, klen));
+}
+
 /**
  * Snapshot all the constant-width keys, returning them in a singly linked list.
  * To free the returned keys, use the dbmap_free_all_keys() helper.
@@ -993,6 +1174,17 @@ dbmap_all_keys(const dbmap_t *dm)
 			dbmap_sdbm_error_check(dm);
 		}
 		break;
+	case DBMAP_LOG:
+		{
+			struct insert_ctx ctx;
+
+			ctx.sl = NULL;
+			ctx.dm = dm;
+			dblog_foreach(dm->u.l.log, insert_log_key, &ctx);
+			dbmap_log_error_check(dm);
+			sl = ctx.sl;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1015,8 +1207,8 @@ dbmap_free_all_keys(const dbmap_t *dm, pslist_t *keys)
 }
 
 /**
- * Structure used as context by dbmap_foreach_*trampoline() and
- * dbmap_foreach_*sdbm().
+ * Structure used as context by dbmap_foreach_*trampoline(),
+ * dbmap_foreach_*sdbm() and dbmap_foreach_*log().
  */
 struct foreach_ctx {
 	union {
@@ -1024,8 +1216,8 @@ struct foreach_ctx {
 		dbmap_cbr_t cbr;
 	} u;
 	void *arg;
-	const dbmap_t *dm;		/* Used only by SDBM iterators */
-	size_t deleted;			/* Used only by SDBM removal iterators */
+	const dbmap_t *dm;		/* Used only by SDBM and log iterators */
+	size_t deleted;			/* Used only by SDBM and log removal iterators */
 };
 
 /**
@@ -1103,6 +1295,50 @@ dbmap_foreach_remove_sdbm(const datum key, const datum value, void *arg)
 	return to_remove;
 }
 
+/**
+ * Trampoline to invoke the log store iterator and do the proper casts.
+ */
+static void
+dbmap_foreach_log(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return;		/* Invalid key, corrupted file? */
+
+	d.data = deconstify_pointer(value);
+	d.len  = vlen;
+
+	(*ctx->u.cb)(deconstify_pointer(key), &d, ctx->arg);
+}
+
+/**
+ * Trampoline to invoke the log store iterator and do the proper casts.
+ */
+static bool
+dbmap_foreach_remove_log(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+	bool to_remove;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return FALSE;		/* Invalid key, corrupted file, keep it */
+
+	d.data = deconstify_pointer(value);
+	d.len  = vlen;
+
+	to_remove = (*ctx->u.cbr)(deconstify_pointer(key), &d, ctx->arg);
+
+	if (to_remove)
+		ctx->deleted++;
+
+	return to_remove;
+}
+
 /**
  * Reset count of items.
  *
@@ -1157,6 +1393,11 @@ dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg)
 				dbmap_reset_count(dm, count);
 		}
 		break;
+	case DBMAP_LOG:
+		ctx.dm = dm;
+		dblog_foreach(dm->u.l.log, dbmap_foreach_log, &ctx);
+		dbmap_log_error_check(dm);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1205,6 +1446,21 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 			deleted = ctx.deleted;
 		}
 		break;
+	case DBMAP_LOG:
+		{
+			size_t count;
+
+			ctx.dm = dm;
+			ctx.deleted = 0;
+
+			count = dblog_foreach_remove(
+				dm->u.l.log, dbmap_foreach_remove_log, &ctx);
+
+			dbmap_log_error_check(dm);
+			dbmap_reset_count(dm, count);
+			deleted = ctx.deleted;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1222,9 +1478,9 @@ dbmap_store_entry(void *key, dbmap_datum_t *d, void *arg)
  * Store DB map to disk in an SDBM database, at the specified base.
  * Two files are created (using suffixes .pag and .dir).
  *
- * If the map was already backed by an SDBM database and ``inplace'' is TRUE,
- * then the map is simply persisted as such.  It is marked non-volatile as
- * a side effect.
+ * If the map was already backed by an SDBM database or a log store and
+ * ``inplace'' is TRUE, then the map is simply persisted as such.  It is
+ * marked non-volatile as a side effect.
  *
  * @param dm		the DB map to store
  * @param base		base path for the persistent database
@@ -1253,6 +1509,11 @@ dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 		/* FALL THROUGH */
 	}
 
+	if (inplace && DBMAP_LOG == dm->type) {
+		dbmap_set_volatile(dm, FALSE);
+		return -1 != dbmap_sync(dm);
+	}
+
 	if (NULL == base)
 		return FALSE;
 
@@ -1341,6 +1602,32 @@ dbmap_sync(dbmap_t *dm)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_sync(dm->u.s.sdbm);
+	case DBMAP_LOG:
+		return dblog_sync(dm->u.l.log);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Synchronize map, making sure the data reached the storage device.
+ *
+ * @return -1 on error, or the same as dbmap_sync().
+ */
+ssize_t
+dbmap_sync_durable(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_sync_durable(dm->u.s.sdbm);
+	case DBMAP_LOG:
+		return dblog_sync_durable(dm->u.l.log);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1362,6 +1649,8 @@ dbmap_shrink(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return sdbm_shrink(dm->u.s.sdbm);
+	case DBMAP_LOG:
+		return 0 == dblog_shrink(dm->u.l.log);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1383,6 +1672,8 @@ dbmap_rebuild(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return 0 == sdbm_rebuild(dm->u.s.sdbm);
+	case DBMAP_LOG:
+		return 0 == dblog_compact(dm->u.l.log);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1411,6 +1702,13 @@ dbmap_clear(dbmap_t *dm)
 			return TRUE;
 		}
 		return FALSE;
+	case DBMAP_LOG:
+		if (0 == dblog_clear(dm->u.l.log)) {
+			dm->ioerr = FALSE;
+			dm->count = 0;
+			return TRUE;
+		}
+		return FALSE;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1429,6 +1727,7 @@ dbmap_set_cachesize(dbmap_t *dm, long pages)
 
 	switch (dm->type) {
 	case DBMAP_MAP:
+	case DBMAP_LOG:
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_cache(dm->u.s.sdbm, pages);
@@ -1450,6 +1749,7 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 
 	switch (dm->type) {
 	case DBMAP_MAP:
+	case DBMAP_LOG:
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_wdelay(dm->u.s.sdbm, on);
@@ -1460,6 +1760,75 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 	return 0;
 }
 
+/**
+ * Turn SDBM in-place page reads on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_mmap(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_LOG:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_set_mmap(dm->u.s.sdbm, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Turn SDBM per-page bloom filters on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_bloom(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_LOG:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_set_bloom(dm->u.s.sdbm, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Migrate SDBM database to another page size, if it does not use that
+ * page size already.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_pagesize(dbmap_t *dm, size_t pagesize)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_LOG:
+		return 0;
+	case DBMAP_SDBM:
+		if (sdbm_pagesize(dm->u.s.sdbm) == pagesize)
+			return 0;
+		return sdbm_rebuild_pagesize(dm->u.s.sdbm, pagesize);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
 /**
  * Tell SDBM whether it is volatile.
  * @return 0 if OK, -1 on errors with errno set.
@@ -1475,6 +1844,9 @@ dbmap_set_volatile(dbmap_t *dm, bool is_volatile)
 	case DBMAP_SDBM:
 		dm->u.s.is_volatile = booleanize(is_volatile);
 		return sdbm_set_volatile(dm->u.s.sdbm, is_volatile);
+	case DBMAP_LOG:
+		dblog_set_volatile(dm->u.l.log, is_volatile);
+		return 0;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1494,7 +1866,7 @@ dbmap_set_debugging(dbmap_t *dm, const dbg_config_t *dbg)
 
 	if (dbg_ds_debugging(dm->dbg, 1, DBG_DSF_DEBUGGING)) {
 		dbg_ds_log(dm->dbg, dm, "%s: attached with %s back-end (count=%zu)",
-			G_STRFUNC, DBMAP_SDBM == dm->type ? "sdbm" : "map", dm->count);
+			G_STRFUNC, dbmap_type_to_string(dm->type), dm->count);
 	}
 }
 
@@ -45,6 +45,7 @@
 enum dbmap_type {
 	DBMAP_MAP = 0,			/* Map in memory */
 	DBMAP_SDBM,				/* SDBM database */
+	DBMAP_LOG,				/* Append-only log store */
 
 	DBMAP_MAXTYPE
 };
@@ -79,6 +80,8 @@ dbmap_t *dbmap_create_hash(size_t ks, dbmap_keylen_t kl,
 	hash_fn_t hashf, eq_fn_t key_eqf);
 dbmap_t * dbmap_create_sdbm(size_t ks, dbmap_keylen_t kl, const char *name,
 	const char *path, int flags, int mode);
+dbmap_t *dbmap_create_log(size_t ks, dbmap_keylen_t kl, const char *name,
+	const char *path, int flags, int mode);
 dbmap_t *dbmap_create_from_map(size_t ks, dbmap_keylen_t kl, map_t *map);
 dbmap_t *dbmap_create_from_sdbm(const char *name,
 	size_t ks, dbmap_keylen_t kl, DBM *sdbm);
@@ -91,6 +94,7 @@ void dbmap_sdbm_set_name(const dbmap_t *dm, const char *name);
 bool dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value);
 bool dbmap_remove(dbmap_t *dm, const void *key);
 bool dbmap_contains(dbmap_t *dm, const void *key);
+long dbmap_page_of(dbmap_t *dm, const void *key);
 dbmap_datum_t dbmap_lookup(dbmap_t *dm, const void *key);
 void *dbmap_implementation(const dbmap_t *dm);
 void *dbmap_release(dbmap_t *dm);
@@ -101,6 +105,7 @@ dbmap_keylen_t dbmap_key_length(const dbmap_t *dm);
 bool dbmap_has_ioerr(const dbmap_t *dm);
 const char *dbmap_strerror(const dbmap_t *dm);
 enum dbmap_type dbmap_type(const dbmap_t *dm);
+const char *dbmap_type_to_string(enum dbmap_type type);
 size_t dbmap_count(const dbmap_t *dm);
 
 void dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg);
@@ -121,8 +126,12 @@ bool dbmap_shrink(dbmap_t *dm);
 bool dbmap_rebuild(dbmap_t *dm);
 bool dbmap_clear(dbmap_t *dm);
 ssize_t dbmap_sync(dbmap_t *dm);
+ssize_t dbmap_sync_durable(dbmap_t *dm);
 int dbmap_set_cachesize(dbmap_t *dm, long pages);
 int dbmap_set_deferred_writes(dbmap_t *dm, bool on);
+int dbmap_set_mmap(dbmap_t *dm, bool on);
+int dbmap_set_bloom(dbmap_t *dm, bool on);
+int dbmap_set_pagesize(dbmap_t *dm, size_t pagesize);
 int dbmap_set_volatile(dbmap_t *dm, bool is_volatile);
 void dbmap_set_debugging(dbmap_t *dm, const struct dbg_config *dbg);
 
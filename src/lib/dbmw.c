@@ -37,15 +37,24 @@
 #include "dbmw.h"
 
 #include "bstr.h"
+#include "compat_pio.h"
+#include "crc.h"
 #include "dbmap.h"
 #include "debug.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
 #include "hashlist.h"
+#include "hstrfn.h"
 #include "map.h"
 #include "misc.h"				/* For english_strerror() */
 #include "pmsg.h"
 #include "pslist.h"
 #include "stacktrace.h"
+#include "str.h"
 #include "stringify.h"
+#include "vsort.h"
 #include "walloc.h"
 #include "zalloc.h"
 
@@ -53,6 +62,21 @@
 
 #define DBMW_CACHE	128			/**< Default amount of items to cache */
 
+/*
+ * Journal records.
+ *
+ * Each record is made of a 1-byte operation code, the key length (16-bit)
+ * and the value length (32-bit), both in big-endian order, followed by the
+ * key and value bytes.  A batch of records is terminated by a commit record
+ * holding the amount of records in the batch and the CRC32 of all the bytes
+ * of the batch preceding the commit record.
+ */
+#define DBMW_JNL_STORE	'S'		/**< Store key/value */
+#define DBMW_JNL_DELETE	'D'		/**< Delete key */
+#define DBMW_JNL_COMMIT	'C'		/**< End of batch */
+#define DBMW_JNL_HDRLEN	7		/**< Length of record header */
+#define DBMW_JNL_CMTLEN	9		/**< Length of commit record */
+
 enum dbmw_magic { DBMW_MAGIC = 0x28e7e7d2U };
 
 /**
@@ -81,10 +105,14 @@ struct dbmw {
 	dbmw_free_t valfree;		/**< Free routine for deserialized values */
 	const dbg_config_t *dbg;	/**< Optional debugging */
 	dbg_config_t *dbmap_dbg;	/**< Object created for DBMAP debugging */
+	str_t *jbuf;				/**< Journal batch being built */
+	char *jpath;				/**< Journal path, NULL if not journaling */
+	int jfd;					/**< Journal file descriptor, -1 if none */
 	int error;					/**< Last errno value */
 	unsigned ioerr:1;			/**< Had I/O error */
 	unsigned count_needs_sync:1;/**< Whether we need to sync to get count */
 	unsigned is_volatile:1;		/**< Whether database dies when map dies */
+	unsigned batched:1;			/**< Flush dirty entries in page order */
 };
 
 static inline void
@@ -216,6 +244,7 @@ dbmw_create(dbmap_t *dm, const char *name,
 	dw->magic = DBMW_MAGIC;
 	dw->dm = dm;
 	dw->name = name;
+	dw->jfd = -1;
 
 	dw->key_size = dbmap_key_size(dm);
 	dw->key_len = dbmap_key_length(dm);
@@ -285,28 +314,29 @@ dbmw_create(dbmap_t *dm, const char *name,
 		s_debug("DBMW created \"%s\" with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 
 	return dw;
 }
 
 /**
- * Write back cached value to disk.
+ * Serialize dirty cached value into the datum to write to the map.
+ *
+ * When a serialization routine is used, the returned datum points to our
+ * reused message block and is therefore only valid until the next call.
+ *
  * @return TRUE on success
  */
 static bool
-write_back(dbmw_t *dw, const void *key, struct cached *value)
+serialize_value(dbmw_t *dw, const struct cached *value, dbmap_datum_t *dval)
 {
-	dbmap_datum_t dval;
-	bool ok;
-
 	g_assert(value->dirty);
 
 	if (value->absent) {
 		/* Key not present, value is null item */
-		dval.data = NULL;
-		dval.len = 0;
+		dval->data = NULL;
+		dval->len = 0;
 	} else {
 		/*
 		 * Serialize value into our reused message block if a
@@ -317,8 +347,8 @@ write_back(dbmw_t *dw, const void *key, struct cached *value)
 			pmsg_reset(dw->mb);
 			(*dw->pack)(dw->mb, value->data);
 
-			dval.data = deconstify_pointer(pmsg_start(dw->mb));
-			dval.len = pmsg_size(dw->mb);
+			dval->data = deconstify_pointer(pmsg_start(dw->mb));
+			dval->len = pmsg_size(dw->mb);
 
 			/*
 			 * We allocated the message block one byte larger than the
@@ -326,7 +356,7 @@ write_back(dbmw_t *dw, const void *key, struct cached *value)
 			 * overflows.
 			 */
 
-			if (dval.len > dw->value_data_size) {
+			if (dval->len > dw->value_data_size) {
 				/* Don't s_carp() as this is asynchronous wrt data change */
 				s_critical("DBMW \"%s\" serialization overflow in %s() "
 					"whilst flushing dirty entry",
@@ -334,11 +364,26 @@ write_back(dbmw_t *dw, const void *key, struct cached *value)
 				return FALSE;
 			}
 		} else {
-			dval.data = value->data;
-			dval.len = value->len;
+			dval->data = value->data;
+			dval->len = value->len;
 		}
 	}
 
+	return TRUE;
+}
+
+/**
+ * Write back serialized value of dirty cached entry to disk.
+ * @return TRUE on success
+ */
+static bool
+write_back_datum(dbmw_t *dw, const void *key, struct cached *value,
+	dbmap_datum_t dval)
+{
+	bool ok;
+
+	g_assert(value->dirty);
+
 	/*
 	 * If cached entry is absent, delete the key.
 	 * Otherwise store the serialized value.
@@ -377,6 +422,21 @@ write_back(dbmw_t *dw, const void *key, struct cached *value)
 	return ok;
 }
 
+/**
+ * Write back cached value to disk.
+ * @return TRUE on success
+ */
+static bool
+write_back(dbmw_t *dw, const void *key, struct cached *value)
+{
+	dbmap_datum_t dval;
+
+	if (!serialize_value(dw, value, &dval))
+		return FALSE;
+
+	return write_back_datum(dw, key, value, dval);
+}
+
 /**
  * Free memory used to hold the value in the cache.
  *
@@ -717,6 +777,438 @@ flush_dirty(void *key, void *value, void *data)
 	}
 }
 
+/**
+ * A dirty entry collected for a batched commit.
+ */
+struct dbmw_dirty {
+	const void *key;			/**< Cached key */
+	struct cached *entry;		/**< Cached entry, NULL if not serializable */
+	long page;					/**< Map page where key is expected to live */
+	size_t offset;				/**< Offset of serialized value in batch */
+	size_t len;					/**< Length of serialized value */
+};
+
+/**
+ * Context for batched commits.
+ */
+struct batch_context {
+	dbmw_t *dw;
+	struct dbmw_dirty *dirty;	/**< Dirty entries collected */
+	size_t count;				/**< Amount of entries collected */
+	size_t capacity;			/**< Amount of entries allocated */
+	unsigned deleted_only:1;
+};
+
+/**
+ * Map iterator to collect dirty cached entries for a batched commit.
+ */
+static void
+batch_collect(void *key, void *value, void *data)
+{
+	struct batch_context *ctx = data;
+	struct cached *entry = value;
+	struct dbmw_dirty *d;
+
+	if (!entry->dirty)
+		return;
+	if (!entry->absent && ctx->deleted_only)
+		return;
+
+	g_assert(ctx->count < ctx->capacity);
+
+	d = &ctx->dirty[ctx->count++];
+	d->key = key;
+	d->entry = entry;
+	d->page = dbmap_page_of(ctx->dw->dm, key);
+	d->offset = d->len = 0;
+}
+
+/**
+ * vsort() callback to order dirty entries by map page.
+ */
+static int
+batch_page_cmp(const void *a, const void *b)
+{
+	const struct dbmw_dirty *da = a, *db = b;
+
+	return CMP(da->page, db->page);
+}
+
+/**
+ * Append a record to the journal batch being built.
+ *
+ * @return offset of the value within the batch.
+ */
+static size_t
+journal_record(dbmw_t *dw, int op, const void *key, dbmap_datum_t dval)
+{
+	char hdr[DBMW_JNL_HDRLEN];
+	size_t klen = dbmw_keylen(dw, key);
+	size_t offset;
+
+	g_assert(klen <= MAX_INT_VAL(uint16));
+
+	hdr[0] = op;
+	poke_be16(&hdr[1], klen);
+	poke_be32(&hdr[3], dval.len);
+
+	str_cat_len(dw->jbuf, hdr, sizeof hdr);
+	str_cat_len(dw->jbuf, key, klen);
+	offset = str_len(dw->jbuf);
+	if (dval.len != 0)
+		str_cat_len(dw->jbuf, dval.data, dval.len);
+
+	return offset;
+}
+
+/**
+ * Discard the journal content, once all the batches it holds have reached
+ * the map on disk.
+ *
+ * @return TRUE on success.
+ */
+static bool
+journal_truncate(dbmw_t *dw)
+{
+	if (-1 == dw->jfd)
+		return TRUE;
+
+	if (-1 == ftruncate(dw->jfd, 0)) {
+		s_warning("DBMW \"%s\" cannot truncate journal \"%s\": %m",
+			dw->name, dw->jpath);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Stop journaling, removing the journal if it holds no pending batch.
+ */
+static void
+journal_close(dbmw_t *dw)
+{
+	filestat_t buf;
+
+	if (-1 == dw->jfd)
+		return;
+
+	if (0 == fstat(dw->jfd, &buf) && 0 == buf.st_size) {
+		if (-1 == unlink(dw->jpath)) {
+			s_warning("DBMW \"%s\" cannot unlink journal \"%s\": %m",
+				dw->name, dw->jpath);
+		}
+	}
+
+	fd_close(&dw->jfd);
+	HFREE_NULL(dw->jpath);
+	str_destroy_null(&dw->jbuf);
+}
+
+/**
+ * Terminate the journal batch being built and write it to disk.
+ *
+ * On failure, the journal is truncated since a partially written batch
+ * would prevent any later batch from being replayed: the batch will then
+ * be applied to the map without protection.
+ *
+ * @param dw		the DBM wrapper
+ * @param count		amount of records in the batch
+ *
+ * @return TRUE if the batch was durably written.
+ */
+static bool
+journal_commit(dbmw_t *dw, size_t count)
+{
+	char cmt[DBMW_JNL_CMTLEN];
+	const char *p;
+	size_t len;
+
+	len = str_len(dw->jbuf);
+
+	cmt[0] = DBMW_JNL_COMMIT;
+	poke_be32(&cmt[1], count);
+	poke_be32(&cmt[5], crc32_update(0, str_2c(dw->jbuf), len));
+	str_cat_len(dw->jbuf, cmt, sizeof cmt);
+
+	p = str_2c(dw->jbuf);
+	len = str_len(dw->jbuf);
+
+	while (len != 0) {
+		ssize_t r = write(dw->jfd, p, len);
+
+		if G_UNLIKELY(-1 == r) {
+			if (EINTR == errno)
+				continue;
+			goto failed;
+		}
+		p += r;
+		len -= r;
+	}
+
+	if (-1 == fd_fdatasync(dw->jfd))
+		goto failed;
+
+	return TRUE;
+
+failed:
+	s_warning("DBMW \"%s\" cannot write journal \"%s\": %m",
+		dw->name, dw->jpath);
+	journal_truncate(dw);
+	return FALSE;
+}
+
+/**
+ * Flush dirty cached entries in page order.
+ *
+ * Sorting the dirty keys by the map page they belong to coalesces all the
+ * updates to a given page, and the dirty pages are then written back as a
+ * sequential burst on the next map synchronization.
+ *
+ * When a journal is configured, the whole batch is first appended to the
+ * journal and synced to disk, then applied to the map which is synced in
+ * turn, after which the journal is truncated.  Should we crash in-between,
+ * the batch will be replayed when the journal is configured again.
+ */
+static void
+flush_batched(struct flush_context *fctx)
+{
+	dbmw_t *dw = fctx->dw;
+	struct batch_context ctx;
+	size_t i, records = 0;
+	bool journaled = FALSE;
+	const char *base = NULL;
+
+	ctx.dw = dw;
+	ctx.count = 0;
+	ctx.capacity = map_count(dw->values);
+	ctx.deleted_only = fctx->deleted_only;
+
+	if (0 == ctx.capacity)
+		return;
+
+	HALLOC_ARRAY(ctx.dirty, ctx.capacity);
+	map_foreach(dw->values, batch_collect, &ctx);
+
+	if (0 == ctx.count)
+		goto done;
+
+	vsort(ctx.dirty, ctx.count, sizeof ctx.dirty[0], batch_page_cmp);
+
+	/*
+	 * Without a journal, we can write back values as we serialize them.
+	 */
+
+	if (-1 == dw->jfd) {
+		for (i = 0; i < ctx.count; i++) {
+			struct dbmw_dirty *d = &ctx.dirty[i];
+
+			if (write_back(dw, d->key, d->entry))
+				fctx->amount++;
+			else
+				fctx->error = TRUE;
+		}
+		goto done;
+	}
+
+	/*
+	 * Serialize all the values in the journal batch first, since values
+	 * are serialized in a reused message block.
+	 */
+
+	str_reset(dw->jbuf);
+
+	for (i = 0; i < ctx.count; i++) {
+		struct dbmw_dirty *d = &ctx.dirty[i];
+		dbmap_datum_t dval;
+
+		if (!serialize_value(dw, d->entry, &dval)) {
+			d->entry = NULL;
+			fctx->error = TRUE;
+			continue;
+		}
+
+		d->len = dval.len;
+		d->offset = journal_record(dw,
+			d->entry->absent ? DBMW_JNL_DELETE : DBMW_JNL_STORE, d->key, dval);
+		records++;
+	}
+
+	if (0 == records)
+		goto done;
+
+	journaled = journal_commit(dw, records);
+	base = str_2c(dw->jbuf);
+
+	for (i = 0; i < ctx.count; i++) {
+		struct dbmw_dirty *d = &ctx.dirty[i];
+		dbmap_datum_t dval;
+
+		if (NULL == d->entry)
+			continue;
+
+		dval.data = 0 == d->len ? NULL : deconstify_pointer(base + d->offset);
+		dval.len = d->len;
+
+		if (write_back_datum(dw, d->key, d->entry, dval))
+			fctx->amount++;
+		else
+			fctx->error = TRUE;
+	}
+
+	/*
+	 * The journal can only be discarded once the map is safely on disk,
+	 * not merely handed over to the kernel.  If anything failed, keep the
+	 * batch around: the entries that could not be written are still dirty
+	 * and will be journaled again anyway.
+	 */
+
+	if (journaled && !fctx->error) {
+		if (-1 == dbmap_sync_durable(dw->dm))
+			fctx->error = TRUE;
+		else
+			journal_truncate(dw);
+	}
+
+	str_reset(dw->jbuf);
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(ctx.dirty);
+}
+
+/**
+ * Apply the records of a committed journal batch to the map.
+ *
+ * @param dw		the DBM wrapper
+ * @param p			start of the batch
+ * @param end		end of the batch (start of its commit record)
+ *
+ * @return TRUE if all the records were applied.
+ */
+static bool
+journal_apply(dbmw_t *dw, const char *p, const char *end)
+{
+	bool ok = TRUE;
+
+	while (p < end) {
+		size_t klen = peek_be16(&p[1]);
+		size_t vlen = peek_be32(&p[3]);
+		const char *key = &p[DBMW_JNL_HDRLEN];
+		dbmap_datum_t dval;
+
+		dval.data = 0 == vlen ? NULL : deconstify_pointer(key + klen);
+		dval.len = vlen;
+
+		if (dbmw_keylen(dw, key) != klen) {
+			s_warning("DBMW \"%s\" skipping journaled key of bad length %zu",
+				dw->name, klen);
+			ok = FALSE;
+		} else if (DBMW_JNL_STORE == p[0]) {
+			if (!dbmap_insert(dw->dm, key, dval))
+				ok = FALSE;
+		} else {
+			if (!dbmap_remove(dw->dm, key))
+				ok = FALSE;
+		}
+
+		p = key + klen + vlen;
+	}
+
+	return ok;
+}
+
+/**
+ * Replay the committed batches held in the journal into the map.
+ *
+ * Parsing stops at the first incomplete or corrupted batch, which is the
+ * one we were writing when we crashed: since its commit record did not make
+ * it to disk, it was never applied to the map.
+ *
+ * @return amount of batches replayed, -1 on error.
+ */
+static ssize_t
+journal_replay(dbmw_t *dw)
+{
+	filestat_t buf;
+	char *data;
+	const char *p, *end, *batch;
+	size_t size, records = 0;
+	ssize_t r, batches = 0;
+	bool ok = TRUE;
+
+	if (-1 == fstat(dw->jfd, &buf)) {
+		s_warning("DBMW \"%s\" cannot stat journal \"%s\": %m",
+			dw->name, dw->jpath);
+		return -1;
+	}
+
+	if (0 == buf.st_size)
+		return 0;
+
+	size = buf.st_size;
+	data = halloc(size);
+	r = compat_pread(dw->jfd, data, size, 0);
+
+	if (r < 0 || (size_t) r != size) {
+		s_warning("DBMW \"%s\" cannot read journal \"%s\": %s",
+			dw->name, dw->jpath, r < 0 ? english_strerror(errno) : "EOF");
+		hfree(data);
+		return -1;
+	}
+
+	p = batch = data;
+	end = data + size;
+
+	while (p < end) {
+		if (DBMW_JNL_COMMIT == p[0]) {
+			if ((size_t) (end - p) < DBMW_JNL_CMTLEN)
+				break;
+			if (
+				peek_be32(&p[1]) != records ||
+				peek_be32(&p[5]) != crc32_update(0, batch, p - batch)
+			)
+				break;
+			if (!journal_apply(dw, batch, p))
+				ok = FALSE;
+			batches++;
+			records = 0;
+			p += DBMW_JNL_CMTLEN;
+			batch = p;
+		} else if (DBMW_JNL_STORE == p[0] || DBMW_JNL_DELETE == p[0]) {
+			size_t klen, vlen;
+
+			if ((size_t) (end - p) < DBMW_JNL_HDRLEN)
+				break;
+			klen = peek_be16(&p[1]);
+			vlen = peek_be32(&p[3]);
+			if (klen > dw->key_size || vlen > dw->value_data_size)
+				break;
+			if ((size_t) (end - p) - DBMW_JNL_HDRLEN < klen + vlen)
+				break;
+			records++;
+			p += DBMW_JNL_HDRLEN + klen + vlen;
+		} else {
+			break;
+		}
+	}
+
+	if (batch != end) {
+		s_warning("DBMW \"%s\" discarding %zu trailing byte%s "
+			"from journal \"%s\"",
+			dw->name, PLURAL((size_t) (end - batch)), dw->jpath);
+	}
+
+	if (batches != 0) {
+		s_info("DBMW \"%s\" replayed %zd batch%s from journal \"%s\"",
+			dw->name, PLURAL_ES(batches), dw->jpath);
+	}
+
+	hfree(data);
+	return ok ? batches : -1;
+}
+
 /**
  * Synchronize dirty values.
  *
@@ -732,6 +1224,9 @@ flush_dirty(void *key, void *value, void *data)
  * If DBMW_DELETED_ONLY is specified along with DBMW_SYNC_CACHE, only the
  * dirty values that are marked as pending deletion are flushed.
  *
+ * If DBMW_SYNC_DURABLE is specified along with DBMW_SYNC_MAP, the map files
+ * are also synced to the storage device.
+ *
  * @return amount of value flushes plus amount of sdbm page flushes, -1 if
  * an error occurred.
  */
@@ -757,7 +1252,10 @@ dbmw_sync(dbmw_t *dw, int which)
 				G_STRFUNC, ctx.deleted_only ? " (deleted only)" : "");
 		}
 
-		map_foreach(dw->values, flush_dirty, &ctx);
+		if (dw->batched)
+			flush_batched(&ctx);
+		else
+			map_foreach(dw->values, flush_dirty, &ctx);
 
 		if (!ctx.error && !ctx.deleted_only)
 			dw->count_needs_sync = FALSE;
@@ -781,7 +1279,8 @@ dbmw_sync(dbmw_t *dw, int which)
 		if (dbg_ds_debugging(dw->dbg, 6, DBG_DSF_CACHING))
 			dbg_ds_log(dw->dbg, dw, "%s: syncing map", G_STRFUNC);
 
-		ret = dbmap_sync(dw->dm);
+		ret = (which & DBMW_SYNC_DURABLE) ?
+			dbmap_sync_durable(dw->dm) : dbmap_sync(dw->dm);
 		if (-1 == ret) {
 			error = TRUE;
 		} else {
@@ -1298,6 +1797,7 @@ dbmw_clear(dbmw_t *dw)
 		return FALSE;
 
 	dbmw_clear_cache(dw);
+	journal_truncate(dw);
 	dw->ioerr = FALSE;
 	dw->count_needs_sync = FALSE;
 	dw->cached = 0;
@@ -1317,7 +1817,7 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 		s_debug("DBMW destroying \"%s\" with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
 			"write cache hits = %.2f%% on %s request%s)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
@@ -1328,7 +1828,7 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 		dbg_ds_log(dw->dbg, dw, "%s: with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
 			"write cache hits = %.2f%% on %s request%s)",
-			G_STRFUNC, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			G_STRFUNC, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
@@ -1345,6 +1845,7 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 	}
 
 	dbmw_clear_cache(dw);
+	journal_close(dw);
 	hash_list_free(&dw->keys);
 	map_destroy(dw->values);
 
@@ -1703,6 +2204,138 @@ dbmw_set_map_cache(dbmw_t *dw, long pages)
 	return 0 == dbmap_set_cachesize(dw->dm, pages);
 }
 
+/**
+ * Set whether map pages should be read in place from a memory mapping.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_map_mmap(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_mmap(dw->dm, on);
+}
+
+/**
+ * Set whether lookups of missing keys should be answered by per-page
+ * bloom filters.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_map_bloom(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_bloom(dw->dm, on);
+}
+
+/**
+ * Migrate the map to another page size, if it does not use it already.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_map_pagesize(dbmw_t *dw, size_t pagesize)
+{
+	dbmw_check(dw);
+
+	/*
+	 * Like dbmw_rebuild(), the map needs to know the latest state.
+	 */
+
+	dbmw_sync(dw, DBMW_SYNC_CACHE);
+
+	return 0 == dbmap_set_pagesize(dw->dm, pagesize);
+}
+
+/**
+ * Set whether dirty cached entries should be flushed in map page order
+ * when synchronizing the cache.
+ *
+ * Turning batched commits off also stops journaling.
+ */
+void
+dbmw_set_batched(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	dw->batched = booleanize(on);
+
+	if (!on)
+		journal_close(dw);
+}
+
+/**
+ * Journal the batched commits into the given file, which implies batched
+ * commits.  A NULL path stops journaling.
+ *
+ * Batches left in the journal by a previous session are replayed into the
+ * map, so this should be called right after the database is opened.
+ *
+ * Journaling is only supported when the database is backed by SDBM.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_journal(dbmw_t *dw, const char *path)
+{
+	int fd;
+
+	dbmw_check(dw);
+
+	journal_close(dw);
+
+	if (NULL == path)
+		return TRUE;
+
+	if (dbmw_map_type(dw) != DBMAP_SDBM) {
+		s_warning("DBMW \"%s\" can only journal SDBM maps", dw->name);
+		return FALSE;
+	}
+
+	fd = file_create(path, O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+	if (-1 == fd)
+		return FALSE;
+
+	/*
+	 * Make sure the map reflects the latest state before replaying, and
+	 * drop the cache since replayed batches may supersede cached values.
+	 */
+
+	dbmw_sync(dw, DBMW_SYNC_CACHE);
+	dbmw_clear_cache(dw);
+
+	dw->jfd = fd;
+	dw->jpath = h_strdup(path);
+	dw->jbuf = str_new(0);
+	dw->batched = TRUE;
+
+	/*
+	 * The replayed batches must be safely on disk before the journal can
+	 * be discarded.  Should replaying fail, journaling is not enabled and
+	 * the journal is left untouched, so that its batches can be replayed
+	 * again next time instead of being truncated by our next commit.
+	 */
+
+	switch (journal_replay(dw)) {
+	case -1:
+		s_warning("DBMW \"%s\" keeping journal \"%s\" after failed replay",
+			dw->name, dw->jpath);
+		journal_close(dw);
+		return FALSE;
+	case 0:
+		break;
+	default:
+		if (-1 == dbmap_sync_durable(dw->dm)) {
+			s_warning("DBMW \"%s\" cannot sync map after journal replay: %s",
+				dw->name, dbmap_strerror(dw->dm));
+			return TRUE;		/* Keep journal content around */
+		}
+	}
+
+	journal_truncate(dw);
+	return TRUE;
+}
+
 /**
  * Flag whether database is volatile (never outlives a close).
  *
@@ -1731,7 +2364,7 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 		dbg_ds_log(dw->dbg, dw, "%s: attached with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)", G_STRFUNC,
-			dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 	}
 
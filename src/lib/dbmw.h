@@ -90,6 +90,7 @@ typedef bool (*dbmw_cbr_t)(void *key, void *value, size_t len, void *u);
 #define DBMW_SYNC_CACHE		(1 << 0)	/**< Sync DBMW local cache */
 #define DBMW_SYNC_MAP		(1 << 1)	/**< Sync DBMW underlying map */
 #define DBMW_DELETED_ONLY	(1 << 2)	/**< Only sync deleted keys */
+#define DBMW_SYNC_DURABLE	(1 << 3)	/**< Map sync must reach the disk */
 
 struct dbg_config;
 
@@ -110,6 +111,11 @@ size_t dbmw_count(dbmw_t *dw);
 bool dbmw_has_ioerr(const dbmw_t *dw);
 const char *dbmw_name(const dbmw_t *dw);
 bool dbmw_set_map_cache(dbmw_t *dw, long pages);
+bool dbmw_set_map_mmap(dbmw_t *dw, bool on);
+bool dbmw_set_map_bloom(dbmw_t *dw, bool on);
+bool dbmw_set_map_pagesize(dbmw_t *dw, size_t pagesize);
+void dbmw_set_batched(dbmw_t *dw, bool on);
+bool dbmw_set_journal(dbmw_t *dw, const char *path);
 bool dbmw_set_volatile(dbmw_t *dw, bool is_volatile);
 void dbmw_set_debugging(dbmw_t *dw, const struct dbg_config *dbg);
 bool dbmw_shrink(dbmw_t *dw);
@@ -42,17 +42,21 @@
 #include "if/gnet_property_priv.h"
 
 #include "atoms.h"
+#include "dblog.h"
 #include "dbmap.h"
 #include "dbmw.h"
 #include "file.h"
 #include "halloc.h"
 #include "hstrfn.h"
 #include "log.h"
+#include "misc.h"			/* For is_directory() */
 #include "path.h"
 #include "stringify.h"
 
 #include "override.h"		/* Must be the last header included */
 
+#define DBSTORE_JNLFEXT	".jnl"	/**< Extension of commit journals */
+
 static const mode_t STORAGE_FILE_MODE = S_IRUSR | S_IWUSR; /* 0600 */
 static unsigned dbstore_debug;
 
@@ -66,10 +70,40 @@ dbstore_set_debug(unsigned level)
 }
 
 /**
- * Creates a disk database with an SDBM or memory map back-end.
+ * @return path of the commit journal for SDBM files, to be freed via hfree().
+ */
+static char *
+dbstore_journal_path(const char *dir, const char *base)
+{
+	char *path, *jpath;
+
+	path = make_pathname(dir, base);
+	jpath = h_strconcat(path, DBSTORE_JNLFEXT, NULL_PTR);
+	HFREE_NULL(path);
+
+	return jpath;
+}
+
+/**
+ * @return path of the log store directory, to be freed via hfree().
+ */
+static char *
+dbstore_log_path(const char *dir, const char *base)
+{
+	char *path, *lpath;
+
+	path = make_pathname(dir, base);
+	lpath = h_strconcat(path, DBLOG_DIREXT, NULL_PTR);
+	HFREE_NULL(path);
+
+	return lpath;
+}
+
+/**
+ * Creates a disk database with an SDBM, log store or memory map back-end.
  *
- * If we can't create the SDBM files on disk, we'll transparently use
- * an in-core version.
+ * If we can't create the SDBM files or the log store on disk, we'll
+ * transparently use an in-core version.
  *
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
@@ -80,7 +114,7 @@ dbstore_set_debug(unsigned level)
  * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
  * @param hash_func			Key hash function
  * @param eq_func			Key equality test function
- * @param incore			If TRUE, use a RAM-only database
+ * @param type				the back-end to use (DBMAP_MAP for RAM-only)
  *
  * @return the DBMW wrapping object.
  */
@@ -88,13 +122,13 @@ static dbmw_t *
 dbstore_create_internal(const char *name, const char *dir, const char *base,
 	int flags, dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
-	bool incore)
+	enum dbmap_type type)
 {
 	dbmap_t *dm;
 	dbmw_t *dw;
 	size_t adjusted_cache_size = cache_size;
 
-	if (!incore) {
+	if (DBMAP_SDBM == type) {
 		char *path;
 
 		g_assert(base != NULL);
@@ -115,6 +149,18 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 			s_warning("DBSTORE cannot open SDBM at %s for %s: %m", path, name);
 		}
 		HFREE_NULL(path);
+	} else if (DBMAP_LOG == type) {
+		char *path;
+
+		g_assert(base != NULL);
+
+		path = dbstore_log_path(dir, base);
+		dm = dbmap_create_log(kv.key_size, kv.key_len,
+				name, path, flags, STORAGE_FILE_MODE);
+
+		if (NULL == dm)
+			s_warning("DBSTORE cannot open log at %s for %s: %m", path, name);
+		HFREE_NULL(path);
 	} else {
 		dm = NULL;
 	}
@@ -137,21 +183,23 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 }
 
 /**
- * Creates a disk database with an SDBM back-end.
+ * Creates a disk database with an SDBM or log store back-end.
  *
- * If we can't create the SDBM files on disk, we'll transparently use
- * an in-core version.
+ * If we can't create the SDBM files or the log store on disk, we'll
+ * transparently use an in-core version.
+ *
+ * The log store back-end is better suited to values written once and
+ * expired later on, whereas SDBM suits values which are frequently updated.
  *
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
  * @param base				the base name of SDBM files
- * @param flags				the sdbm_open() flags
  * @param kv				key/value description
  * @param packing			key/value serialization description
  * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
  * @param hash_func			Key hash function
  * @param eq_func			Key equality test function
- * @param incore			If TRUE, use a RAM-only database
+ * @param type				the back-end to use (DBMAP_MAP for RAM-only)
  *
  * @return the DBMW wrapping object.
  */
@@ -159,47 +207,234 @@ dbmw_t *
 dbstore_create(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
-	bool incore)
+	enum dbmap_type type)
 {
 	dbmw_t *dw;
 
+	g_assert(type < DBMAP_MAXTYPE);
+
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_TRUNC | O_RDWR,
-			kv, packing, cache_size, hash_func, eq_func, incore);
+			kv, packing, cache_size, hash_func, eq_func, type);
 
 	dbmw_set_volatile(dw, TRUE);
 
 	return dw;
 }
 
+static void
+dbstore_unlink_file(const char *path, const char *ext)
+{
+	char *file = h_strconcat(path, ext, NULL_PTR);
+
+	if (file_exists(file)) {
+		if (-1 == unlink(file)) {
+			s_carp("could not unlink \"%s\": %m", file);
+		}
+	}
+
+	HFREE_NULL(file);
+}
+
 /**
- * Opens or create a disk database with an SDBM back-end.
+ * Remove SDBM files from "dir", along with any commit journal.
+ */
+static void
+dbstore_unlink_sdbm(const char *dir, const char *base)
+{
+	char *path;
+
+	path = make_pathname(dir, base);
+
+	dbstore_unlink_file(path, DBM_DIRFEXT);
+	dbstore_unlink_file(path, DBM_PAGFEXT);
+	dbstore_unlink_file(path, DBM_DATFEXT);
+	dbstore_unlink_file(path, DBSTORE_JNLFEXT);
+
+	HFREE_NULL(path);
+}
+
+/**
+ * Replay any commit journal left over by a previous session on an SDBM
+ * database, regardless of whether journaling is still requested.
+ */
+static void
+dbstore_replay_journal(dbmw_t *dw, const char *dir, const char *base)
+{
+	char *path;
+
+	if (NULL == dw || dbmw_map_type(dw) != DBMAP_SDBM)
+		return;
+
+	path = dbstore_journal_path(dir, base);
+
+	if (file_exists(path)) {
+		if (dbstore_debug > 0) {
+			g_debug("DBSTORE replaying journal of DBMW \"%s\" from %s",
+				dbmw_name(dw), path);
+		}
+		dbmw_set_journal(dw, path);
+		dbmw_set_batched(dw, FALSE);	/* Closes journal */
+	}
+	HFREE_NULL(path);
+}
+
+/**
+ * @return whether there are files on disk for the given back-end.
+ */
+static bool
+dbstore_exists(const char *dir, const char *base, enum dbmap_type type)
+{
+	char *path, *file;
+	bool exists;
+
+	switch (type) {
+	case DBMAP_SDBM:
+		path = make_pathname(dir, base);
+		file = h_strconcat(path, DBM_PAGFEXT, NULL_PTR);
+		exists = file_exists(file);
+		HFREE_NULL(file);
+		HFREE_NULL(path);
+		return exists;
+	case DBMAP_LOG:
+		path = dbstore_log_path(dir, base);
+		exists = is_directory(path);
+		HFREE_NULL(path);
+		return exists;
+	case DBMAP_MAP:
+	case DBMAP_MAXTYPE:
+		break;
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Import data persisted by another on-disk back-end into the database,
+ * then remove the files of that back-end.
  *
- * If we can't access the SDBM files on disk, we'll transparently use
+ * This lets data survive a change of the back-end used by a database
+ * between two sessions.
+ *
+ * @return FALSE if the data could not be imported, in which case the files
+ * of the other back-end are left untouched.
+ */
+static bool
+dbstore_import(dbmw_t *dw, const char *name, const char *dir,
+	const char *base, dbstore_kv_t kv, dbstore_packing_t packing,
+	hash_fn_t hash_func, eq_fn_t eq_func, enum dbmap_type type)
+{
+	dbmw_t *old;
+	size_t count;
+
+	old = dbstore_create_internal(name, dir, base, O_RDWR,
+			kv, packing, 0, hash_func, eq_func, type);
+
+	if (dbmw_map_type(old) != type) {
+		g_warning("DBSTORE cannot import %s data into DBMW \"%s\"",
+			dbmap_type_to_string(type), dbmw_name(dw));
+		dbmw_destroy(old, TRUE);
+		return TRUE;		/* Nothing we can import */
+	}
+
+	dbstore_replay_journal(old, dir, base);
+	count = dbmw_count(old);
+
+	/*
+	 * The files of the old back-end are only removed once its data are
+	 * safely held by the new one: on failure, they are kept.
+	 */
+
+	if (
+		!dbmw_copy(old, dw) ||
+		-1 == dbmw_sync(dw,
+			DBMW_SYNC_CACHE | DBMW_SYNC_MAP | DBMW_SYNC_DURABLE)
+	) {
+		g_warning("DBSTORE could not import %s data into DBMW \"%s\" "
+			"(%zu key%s)", dbmap_type_to_string(type),
+			dbmw_name(dw), PLURAL(count));
+		dbmw_destroy(old, TRUE);
+		return FALSE;
+	}
+
+	if (dbstore_debug > 0) {
+		g_debug("DBSTORE imported %zu %s key%s into DBMW \"%s\"",
+			count, dbmap_type_to_string(type), plural(count), dbmw_name(dw));
+	}
+
+	dbmw_set_volatile(old, TRUE);	/* Removes its files when destroyed */
+	dbmw_destroy(old, TRUE);
+
+	if (DBMAP_SDBM == type)
+		dbstore_unlink_sdbm(dir, base);
+
+	return TRUE;
+}
+
+/**
+ * Opens or create a disk database with an SDBM or log store back-end.
+ *
+ * If we can't access the files on disk, we'll transparently use
  * an in-core version.
  *
+ * Data persisted by the other on-disk back-end, should the back-end of the
+ * database have changed since last session, are imported.
+ *
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
  * @param base				the base name of SDBM files
- * @param flags				the sdbm_open() flags
  * @param kv				key/value description
  * @param packing			key/value serialization description
  * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
  * @param hash_func			Key hash function
  * @param eq_func			Key equality test function
- * @param incore			If TRUE, allow fallback to a RAM-only database
+ * @param type				the on-disk back-end, DBMAP_SDBM or DBMAP_LOG
+ * @param incore			If TRUE, load data into a RAM-only database
  *
  * @return the DBMW wrapping object.
  */
 dbmw_t *
-dbstore_open(const char *name, const char *dir, const char *base,
+dbstore_open_type(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
-	bool incore)
+	enum dbmap_type type, bool incore)
 {
 	dbmw_t *dw;
+	enum dbmap_type other;
+
+	g_assert(DBMAP_SDBM == type || DBMAP_LOG == type);
+
+	other = DBMAP_SDBM == type ? DBMAP_LOG : DBMAP_SDBM;
 
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_RDWR,
-			kv, packing, cache_size, hash_func, eq_func, FALSE);
+			kv, packing, cache_size, hash_func, eq_func, type);
+
+	dbstore_replay_journal(dw, dir, base);
+
+	if (
+		dw != NULL && dbmw_map_type(dw) == type &&
+		dbstore_exists(dir, base, other)
+	) {
+		/*
+		 * If we cannot import the data of the other back-end, keep using it
+		 * for this session: writing to the new back-end would only get the
+		 * new data superseded by the older ones on the next import attempt.
+		 */
+
+		if (
+			!dbstore_import(dw, name, dir, base, kv, packing,
+				hash_func, eq_func, other)
+		) {
+			g_warning("DBSTORE keeping %s back-end for DBMW \"%s\"",
+				dbmap_type_to_string(other), dbmw_name(dw));
+
+			dbmw_set_volatile(dw, TRUE);	/* Removes partial import */
+			dbmw_destroy(dw, TRUE);
+
+			dw = dbstore_create_internal(name, dir, base, O_CREAT | O_RDWR,
+					kv, packing, cache_size, hash_func, eq_func, other);
+			dbstore_replay_journal(dw, dir, base);
+		}
+	}
 
 	if (dw != NULL && dbstore_debug > 0) {
 		size_t count = dbmw_count(dw);
@@ -222,7 +457,7 @@ dbstore_open(const char *name, const char *dir, const char *base,
 		}
 
 		dram = dbstore_create_internal(name, NULL, NULL, 0,
-				kv, packing, cache_size, hash_func, eq_func, TRUE);
+				kv, packing, cache_size, hash_func, eq_func, DBMAP_MAP);
 
 		if (!dbmw_copy(dw, dram)) {
 			g_warning("DBSTORE could not load DBMW \"%s\" (%u key%s) from %s",
@@ -236,6 +471,34 @@ dbstore_open(const char *name, const char *dir, const char *base,
 	return dw;
 }
 
+/**
+ * Opens or create a disk database with an SDBM back-end.
+ *
+ * If we can't access the SDBM files on disk, we'll transparently use
+ * an in-core version.
+ *
+ * @param name				the name of the storage created, for logs
+ * @param dir				the directory where SDBM files will be put
+ * @param base				the base name of SDBM files
+ * @param kv				key/value description
+ * @param packing			key/value serialization description
+ * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
+ * @param hash_func			Key hash function
+ * @param eq_func			Key equality test function
+ * @param incore			If TRUE, load data into a RAM-only database
+ *
+ * @return the DBMW wrapping object.
+ */
+dbmw_t *
+dbstore_open(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	return dbstore_open_type(name, dir, base, kv, packing,
+		cache_size, hash_func, eq_func, DBMAP_SDBM, incore);
+}
+
 /**
  * Synchronize a DBMW database, flushing its SDBM cache.
  */
@@ -282,6 +545,65 @@ dbstore_sync_flush(dbmw_t *dw)
 	dbstore_sync(dw);		/* ...then sync database layer */
 }
 
+/**
+ * Configure batched commits for a DBMW database, optionally journaled in
+ * a file stored alongside its SDBM files.
+ *
+ * This has no effect on RAM-only databases.
+ *
+ * @param dw				the DBMW database, freshly opened
+ * @param dir				the directory where SDBM files are stored
+ * @param base				the base name of SDBM files
+ * @param batched			whether to flush dirty values in page order
+ * @param journal			whether to journal batched commits
+ */
+void
+dbstore_set_batched(dbmw_t *dw, const char *dir, const char *base,
+	bool batched, bool journal)
+{
+	if (dbmw_map_type(dw) != DBMAP_SDBM)
+		return;
+
+	dbmw_set_batched(dw, batched || journal);
+
+	if (journal) {
+		char *path = dbstore_journal_path(dir, base);
+
+		if (!dbmw_set_journal(dw, path)) {
+			g_warning("DBSTORE cannot journal DBMW \"%s\" in %s",
+				dbmw_name(dw), path);
+		} else if (dbstore_debug > 0) {
+			g_debug("DBSTORE journaling DBMW \"%s\" in %s",
+				dbmw_name(dw), path);
+		}
+		HFREE_NULL(path);
+	}
+}
+
+/**
+ * Set the page size of the SDBM database, migrating its existing data
+ * when the database was created with another page size.
+ *
+ * This has no effect on RAM-only databases.
+ *
+ * @param dw				the DBMW database, freshly opened
+ * @param pagesize			the page size (power of 2, 1 to 16 KiB)
+ */
+void
+dbstore_set_pagesize(dbmw_t *dw, size_t pagesize)
+{
+	if (dbmw_map_type(dw) != DBMAP_SDBM)
+		return;
+
+	if (!dbmw_set_map_pagesize(dw, pagesize)) {
+		g_warning("DBSTORE cannot use %zu-byte pages for DBMW \"%s\": %m",
+			pagesize, dbmw_name(dw));
+	} else if (dbstore_debug > 0) {
+		g_debug("DBSTORE DBMW \"%s\" uses %zu-byte pages",
+			dbmw_name(dw), pagesize);
+	}
+}
+
 /**
  * Close DM map, keeping the SDBM file around.
  *
@@ -368,6 +690,23 @@ dbstore_compact(dbmw_t *dw)
 	}
 }
 
+static void
+dbstore_move_log(const char *old_path, const char *new_path)
+{
+	char *old_dir = h_strconcat(old_path, DBLOG_DIREXT, NULL_PTR);
+	char *new_dir = h_strconcat(new_path, DBLOG_DIREXT, NULL_PTR);
+
+	if (is_directory(old_dir)) {
+		if (-1 == rename(old_dir, new_dir)) {
+			s_carp("could not rename \"%s\" as \"%s\": %m",
+				old_dir, new_dir);
+		}
+	}
+
+	HFREE_NULL(old_dir);
+	HFREE_NULL(new_dir);
+}
+
 static void
 dbstore_move_file(const char *old_path, const char *new_path, const char *ext)
 {
@@ -386,7 +725,7 @@ dbstore_move_file(const char *old_path, const char *new_path, const char *ext)
 }
 
 /**
- * Move SDBM files from "src" to "dst".
+ * Move SDBM files, or the log store, from "src" to "dst".
  *
  * @param src				the old directory where SDBM files where
  * @param dst				the new directory where SDBM files should be put
@@ -404,27 +743,15 @@ dbstore_move(const char *src, const char *dst, const char *base)
 	dbstore_move_file(old_path, new_path, DBM_DIRFEXT);
 	dbstore_move_file(old_path, new_path, DBM_PAGFEXT);
 	dbstore_move_file(old_path, new_path, DBM_DATFEXT);
+	dbstore_move_file(old_path, new_path, DBSTORE_JNLFEXT);
+	dbstore_move_log(old_path, new_path);
 
 	HFREE_NULL(old_path);
 	HFREE_NULL(new_path);
 }
 
-static void
-dbstore_unlink_file(const char *path, const char *ext)
-{
-	char *file = h_strconcat(path, ext, NULL_PTR);
-
-	if (file_exists(file)) {
-		if (-1 == unlink(file)) {
-			s_carp("could not unlink \"%s\": %m", file);
-		}
-	}
-
-	HFREE_NULL(file);
-}
-
 /**
- * Remove SDBM files from "dir".
+ * Remove SDBM files, or the log store, from "dir".
  *
  * @param dir				the directory where SDBM files are stored
  * @param base				the base name of SDBM files
@@ -434,11 +761,12 @@ dbstore_unlink(const char *dir, const char *base)
 {
 	char *path;
 
-	path = make_pathname(dir, base);
+	dbstore_unlink_sdbm(dir, base);
 
-	dbstore_unlink_file(path, DBM_DIRFEXT);
-	dbstore_unlink_file(path, DBM_PAGFEXT);
-	dbstore_unlink_file(path, DBM_DATFEXT);
+	path = dbstore_log_path(dir, base);
+
+	if (is_directory(path) && -1 == dblog_unlink(path))
+		s_carp("could not remove \"%s\": %m", path);
 
 	HFREE_NULL(path);
 }
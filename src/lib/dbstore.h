@@ -72,7 +72,12 @@ void dbstore_set_debug(unsigned level);
 dbmw_t *dbstore_create(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
-	bool incore);
+	enum dbmap_type type);
+
+dbmw_t *dbstore_open_type(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	enum dbmap_type type, bool incore);
 
 dbmw_t *dbstore_open(const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
@@ -82,6 +87,9 @@ dbmw_t *dbstore_open(const char *name, const char *dir, const char *base,
 void dbstore_sync(dbmw_t *dw);
 void dbstore_flush(dbmw_t *dw);
 void dbstore_sync_flush(dbmw_t *dw);
+void dbstore_set_pagesize(dbmw_t *dw, size_t pagesize);
+void dbstore_set_batched(dbmw_t *dw, const char *dir, const char *base,
+	bool batched, bool journal);
 void dbstore_close(dbmw_t *dw, const char *dir, const char *base);
 void dbstore_delete(dbmw_t *dw);
 void dbstore_compact(dbmw_t *dw);
@@ -0,0 +1,359 @@
+/*
+ * inputevt-test -- polling contexts unit tests.
+ *
+ * Copyright (c) 2026 agent
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "atomic.h"
+#include "fd.h"
+#include "inputevt.h"
+#include "progname.h"
+#include "thread.h"
+
+#define TEST_TIMEOUT	100		/* ms, when no event is expected */
+#define TEST_WAIT		1000	/* ms, when an event is expected */
+
+static bool verbose;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv]\n"
+			"  -h : prints this help message\n"
+			"  -v : verbose mode\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * State shared with the event handlers.
+ */
+struct test_io {
+	int fd[2];					/* The socketpair */
+	unsigned rcalls;			/* Amount of read callbacks */
+	unsigned wcalls;			/* Amount of write callbacks */
+	size_t to_read;				/* Bytes to read per read callback */
+	size_t received;			/* Total amount of bytes read */
+	char buf[64];				/* Reception buffer */
+};
+
+static void
+test_io_open(struct test_io *t)
+{
+	ZERO(t);
+
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, t->fd))
+		s_error("%s(): socketpair() failed: %m", G_STRFUNC);
+
+	fd_set_nonblocking(t->fd[0]);
+	fd_set_nonblocking(t->fd[1]);
+}
+
+static void
+test_io_close(struct test_io *t)
+{
+	fd_close(&t->fd[0]);
+	fd_close(&t->fd[1]);
+}
+
+static void
+test_io_send(struct test_io *t, size_t len)
+{
+	static const char buf[64];
+
+	g_assert(len <= sizeof buf);
+
+	if ((ssize_t) len != write(t->fd[1], buf, len))
+		s_error("%s(): write() failed: %m", G_STRFUNC);
+}
+
+static void
+test_read_handler(void *data, int fd, inputevt_cond_t cond)
+{
+	struct test_io *t = data;
+	ssize_t r;
+
+	g_assert(fd == t->fd[0] || fd == t->fd[1]);
+	g_assert(cond & INPUT_EVENT_R);
+	g_assert(t->to_read <= sizeof t->buf);
+
+	t->rcalls++;
+
+	r = read(fd, t->buf, t->to_read);
+	if (r > 0)
+		t->received += r;
+}
+
+static void
+test_write_handler(void *data, int fd, inputevt_cond_t cond)
+{
+	struct test_io *t = data;
+
+	g_assert(fd == t->fd[1]);
+	g_assert(cond & INPUT_EVENT_W);
+
+	t->wcalls++;
+}
+
+static void
+test_dispatch(inputevt_ctx_t *ctx, int timeout_ms)
+{
+	if (-1 == inputevt_ctx_dispatch(ctx, timeout_ms))
+		s_error("%s(): dispatching \"%s\" failed: %m",
+			G_STRFUNC, inputevt_ctx_name(ctx));
+}
+
+#define TEST_EXPECT(what, value, expected) G_STMT_START {		\
+	if ((value) != (expected)) {								\
+		s_error("%s(): %s: expected %u %s, got %u",				\
+			G_STRFUNC, inputevt_ctx_name(ctx),					\
+			(uint) (expected), (what), (uint) (value));			\
+	}															\
+} G_STMT_END
+
+/**
+ * Leave data in the socket after each read callback: a level-triggered
+ * context must report it again, an edge-triggered one only when new data
+ * comes in.
+ */
+static void
+test_read(bool edge)
+{
+	inputevt_ctx_t *ctx;
+	struct test_io t;
+	unsigned id, calls;
+
+	ctx = inputevt_ctx_create(edge ? "read-edge" : "read-level", edge);
+	if (NULL == ctx) {
+		s_info("%s(): no kernel event queue, skipped", G_STRFUNC);
+		return;
+	}
+
+	test_io_open(&t);
+	t.to_read = 1;
+	id = inputevt_ctx_add(ctx, t.fd[0], INPUT_EVENT_RX, test_read_handler, &t);
+
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("read callbacks", t.rcalls, 0);
+
+	test_io_send(&t, 4);
+	test_dispatch(ctx, TEST_WAIT);
+	TEST_EXPECT("read callbacks", t.rcalls, 1);
+
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("read callbacks", t.rcalls, edge ? 1 : 2);
+
+	test_io_send(&t, 1);
+	test_dispatch(ctx, TEST_WAIT);
+	TEST_EXPECT("read callbacks", t.rcalls, edge ? 2 : 3);
+
+	/*
+	 * Drain the socket: nothing is reported afterwards, in both modes.
+	 * An edge-triggered context needs new data to report the socket again.
+	 */
+
+	t.to_read = sizeof t.buf;
+	test_io_send(&t, 1);
+	test_dispatch(ctx, TEST_WAIT);
+	TEST_EXPECT("bytes read", t.received, 6);
+
+	calls = t.rcalls;
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("read callbacks once drained", t.rcalls, calls);
+
+	inputevt_remove(&id);
+	test_io_send(&t, 1);
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("read callbacks after removal", t.rcalls, calls);
+
+	test_io_close(&t);
+	inputevt_ctx_free(&ctx);
+
+	if (verbose)
+		s_info("%s(): %s OK", G_STRFUNC, edge ? "edge" : "level");
+}
+
+/**
+ * Register read interest first, then write interest on the same descriptor:
+ * adding interest must re-arm the descriptor so that the writability, which
+ * was already there, is reported.  Afterwards, writability is reported once
+ * by an edge-triggered context and every time by a level-triggered one.
+ */
+static void
+test_write(bool edge)
+{
+	inputevt_ctx_t *ctx;
+	struct test_io t;
+	unsigned rid, wid;
+
+	ctx = inputevt_ctx_create(edge ? "write-edge" : "write-level", edge);
+	if (NULL == ctx) {
+		s_info("%s(): no kernel event queue, skipped", G_STRFUNC);
+		return;
+	}
+
+	test_io_open(&t);
+	t.to_read = 1;
+	rid = inputevt_ctx_add(ctx, t.fd[1], INPUT_EVENT_RX,
+		test_read_handler, &t);
+
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("read callbacks", t.rcalls, 0);
+
+	wid = inputevt_ctx_add(ctx, t.fd[1], INPUT_EVENT_WX,
+		test_write_handler, &t);
+
+	test_dispatch(ctx, TEST_WAIT);
+	TEST_EXPECT("write callbacks", t.wcalls, 1);
+
+	test_dispatch(ctx, TEST_TIMEOUT);
+	TEST_EXPECT("write callbacks", t.wcalls, edge ? 1 : 2);
+	TEST_EXPECT("read callbacks", t.rcalls, 0);
+
+	inputevt_remove(&wid);
+	inputevt_remove(&rid);
+
+	test_io_close(&t);
+	inputevt_ctx_free(&ctx);
+
+	if (verbose)
+		s_info("%s(): %s OK", G_STRFUNC, edge ? "edge" : "level");
+}
+
+/**
+ * Context driven by a dedicated thread, as it is meant to be used.
+ */
+struct test_thread {
+	inputevt_ctx_t *ctx;
+	struct test_io *io;
+	bool done;
+};
+
+static void
+test_thread_handler(void *data, int fd, inputevt_cond_t cond)
+{
+	struct test_thread *tt = data;
+
+	tt->io->to_read = 1;
+	test_read_handler(tt->io, fd, cond);
+
+	if (tt->io->received != 0)
+		atomic_bool_set(&tt->done, TRUE);
+}
+
+static void *
+test_thread_main(void *arg)
+{
+	struct test_thread *tt = arg;
+	unsigned i;
+
+	for (i = 0; i < 10 && !atomic_bool_get(&tt->done); i++)
+		test_dispatch(tt->ctx, TEST_WAIT);
+
+	return NULL;
+}
+
+static void
+test_thread(void)
+{
+	struct test_thread tt;
+	struct test_io t;
+	unsigned id;
+	int tid;
+
+	ZERO(&tt);
+	tt.ctx = inputevt_ctx_create("thread", TRUE);
+	if (NULL == tt.ctx) {
+		s_info("%s(): no kernel event queue, skipped", G_STRFUNC);
+		return;
+	}
+
+	test_io_open(&t);
+	tt.io = &t;
+	id = inputevt_ctx_add(tt.ctx, t.fd[0], INPUT_EVENT_RX,
+		test_thread_handler, &tt);
+
+	tid = thread_create(test_thread_main, &tt, 0, 0);
+	if (-1 == tid)
+		s_error("%s(): cannot create thread: %m", G_STRFUNC);
+
+	test_io_send(&t, 1);
+
+	if (-1 == thread_join(tid, NULL))
+		s_error("%s(): cannot join thread: %m", G_STRFUNC);
+
+	if (!atomic_bool_get(&tt.done))
+		s_error("%s(): event not dispatched by thread", G_STRFUNC);
+
+	inputevt_remove(&id);
+	test_io_close(&t);
+	inputevt_ctx_free(&tt.ctx);
+
+	if (verbose)
+		s_info("%s(): OK", G_STRFUNC);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	int c;
+	const char options[] = "hv";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'v':			/* verbose mode */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+			/* FALL THROUGH */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (0 != (argc -= optind))
+		usage();
+
+	test_read(FALSE);
+	test_read(TRUE);
+	test_write(FALSE);
+	test_write(TRUE);
+	test_thread();
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
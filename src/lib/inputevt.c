@@ -34,6 +34,17 @@
  * The intent here is to break the GDK dependency but retain
  * the same behavior, to avoid disturbing too much of the existing code.
  *
+ * Besides the global context, hooked into the GLib main loop, additional
+ * polling contexts can be created with inputevt_ctx_create().  Each of them
+ * is driven by the thread calling inputevt_ctx_dispatch() on it, allowing
+ * I/O processing to be spread over several threads.  Such contexts require
+ * a pollable kernel event queue (kqueue or epoll) and can optionally run
+ * in edge-triggered mode, in which case the handlers must consume all the
+ * pending input (or write until the kernel buffer is full) before returning.
+ *
+ * Event IDs returned by inputevt_add() and inputevt_ctx_add() encode the
+ * context to which they belong, so inputevt_remove() works for all of them.
+ *
  * @author ko (ko-@wanadoo.fr)
  * @date 2002
  * @author Christian Biere
@@ -120,6 +131,7 @@ typedef struct {
 #include "mutex.h"
 #include "plist.h"
 #include "pslist.h"
+#include "spinlock.h"
 #include "stacktrace.h"
 #include "stringify.h"
 #include "thread.h"			/* For thread_in_syscall_set() */
@@ -227,7 +239,11 @@ struct poll_ctx {
 	unsigned num_poll_idx;		/**< Length of used_poll_idx array */
 	unsigned max_poll_idx;
 	unsigned num_ready;			/**< Used for /dev/poll only */
+	const char *name;			/**< Context name, for logging */
+	unsigned index;				/**< Index in the context table */
+	unsigned owner;				/**< Thread dispatching events */
 	unsigned initialized:1;		/**< TRUE if the context has been initialized */
+	unsigned edge:1;			/**< TRUE if edge-triggered */
 	unsigned dispatching:1;		/**< TRUE if dispatching events */
 	unsigned collecting:1;		/**< TRUE when collecing / waiting for events */
 
@@ -262,6 +278,22 @@ struct poll_ctx {
 #define CTX_UNLOCK(c)		mutex_unlock(&c->lock)
 #define CTX_IS_LOCKED(c)	mutex_is_owned(&c->lock)
 
+/*
+ * Event IDs carry the index of their context in the upper bits.  The
+ * global context has index 0, hence its IDs are the plain local IDs.
+ */
+
+#define INPUTEVT_CTX_BITS	5
+#define INPUTEVT_CTX_MAX	(1U << INPUTEVT_CTX_BITS)
+#define INPUTEVT_ID_SHIFT	(32 - INPUTEVT_CTX_BITS)
+#define INPUTEVT_ID_MASK	((1U << INPUTEVT_ID_SHIFT) - 1)
+
+static struct poll_ctx *inputevt_ctx[INPUTEVT_CTX_MAX];
+static spinlock_t inputevt_ctx_slk = SPINLOCK_INIT;
+
+#define INPUTEVT_CTX_LOCK		spinlock(&inputevt_ctx_slk)
+#define INPUTEVT_CTX_UNLOCK		spinunlock(&inputevt_ctx_slk)
+
 static unsigned data_available;
 
 static void inputevt_process_added(struct poll_ctx *ctx);
@@ -283,6 +315,35 @@ get_global_poll_ctx(void)
 	return &ctx;
 }
 
+/**
+ * Find the context to which an event ID belongs.
+ *
+ * @param id		the event ID
+ * @param local		where the ID local to the context is written
+ *
+ * @return the polling context owning the event.
+ */
+static struct poll_ctx *
+inputevt_id_ctx(unsigned id, unsigned *local)
+{
+	unsigned idx = id >> INPUTEVT_ID_SHIFT;
+	struct poll_ctx *ctx;
+
+	*local = id & INPUTEVT_ID_MASK;
+
+	if G_LIKELY(0 == idx)
+		return get_global_poll_ctx();
+
+	INPUTEVT_CTX_LOCK;
+	ctx = inputevt_ctx[idx];
+	INPUTEVT_CTX_UNLOCK;
+
+	g_assert_log(ctx != NULL, "%s(): unknown context #%u in event ID %u",
+		G_STRFUNC, idx, id);
+
+	return ctx;
+}
+
 /**
  * Start "collecting" events through a possibly blocking system call.
  */
@@ -440,7 +501,7 @@ event_set_mask_with_kqueue(struct poll_ctx *ctx, int fd,
 	struct kevent kev[2];
 	size_t i;
 	void *udata;
-	int ret;
+	int ret, add;
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
@@ -449,17 +510,18 @@ event_set_mask_with_kqueue(struct poll_ctx *ctx, int fd,
 
 	i = 0;
 	udata = int_to_pointer(fd);
+	add = ctx->edge ? (EV_ADD | EV_CLEAR) : EV_ADD;
 
 	if ((INPUT_EVENT_R & old) != (INPUT_EVENT_R & cur)) {
 		EV_SET(&kev[i], fd, EVFILT_READ,
-			(INPUT_EVENT_R & cur) ? EV_ADD : (EV_DELETE | EV_DISABLE),
+			(INPUT_EVENT_R & cur) ? add : (EV_DELETE | EV_DISABLE),
 			0, 0, PTR_TO_KEVENT_UDATA(udata));
 		i++;
 	}
 
 	if ((INPUT_EVENT_W & old) != (INPUT_EVENT_W & cur)) {
 		EV_SET(&kev[i], fd, EVFILT_WRITE,
-			(INPUT_EVENT_W & cur) ? EV_ADD : (EV_DELETE | EV_DISABLE),
+			(INPUT_EVENT_W & cur) ? add : (EV_DELETE | EV_DISABLE),
 			0, 0, PTR_TO_KEVENT_UDATA(udata));
 		i++;
 	}
@@ -520,10 +582,29 @@ event_set_mask_with_epoll(struct poll_ctx *ctx, int fd,
 	ev = zero_ev;
 	ev.data.ptr = int_to_pointer(fd);
 
-	if (INPUT_EVENT_R & cur)
-		ev.events |= EPOLLIN | EPOLLPRI;
-	if (INPUT_EVENT_W & cur)
-		ev.events |= EPOLLOUT;
+	if (ctx->edge) {
+		/*
+		 * In edge-triggered mode, the descriptor is always registered for
+		 * both reading and writing: events nobody is interested in are
+		 * filtered out by inputevt_handle(), and since they are reported
+		 * only on state transitions, they do not keep triggering.
+		 *
+		 * This saves an epoll_ctl() call each time interest is dropped.
+		 * When new interest appears though, we must re-arm the descriptor
+		 * since the transition may have been reported already: a
+		 * modification makes epoll re-evaluate the readiness.
+		 */
+
+		if (0 != old && 0 != cur && 0 == (cur & ~old))
+			return 0;		/* Interest dropped, filtered on dispatch */
+
+		ev.events = EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLET;
+	} else {
+		if (INPUT_EVENT_R & cur)
+			ev.events |= EPOLLIN | EPOLLPRI;
+		if (INPUT_EVENT_W & cur)
+			ev.events |= EPOLLOUT;
+	}
 
 	if (0 == old)
 		op = EPOLL_CTL_ADD;
@@ -1208,11 +1289,10 @@ inputevt_remove(unsigned *id_ptr)
 	unsigned id;
 	int fd;
 
-	id = *id_ptr;
-	if G_UNLIKELY(0 == id)
+	if G_UNLIKELY(0 == *id_ptr)
 		return;
 
-	ctx = get_global_poll_ctx();
+	ctx = inputevt_id_ctx(*id_ptr, &id);
 	g_assert(ctx->initialized);
 	g_assert(ctx->ht);
 	g_assert(0 != id);
@@ -1455,7 +1535,6 @@ init_with_kqueue(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "kqueue()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1485,7 +1564,6 @@ init_with_devpoll(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "/dev/poll";
 	ctx->collect_events = collect_events_with_devpoll;
@@ -1515,7 +1593,6 @@ init_with_epoll(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "epoll()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1567,19 +1644,18 @@ inputevt_thread_id(void)
 }
 
 /**
- * Performs module initialization.
- * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ * Initialize the data structures of a polling context.
  */
-void
-inputevt_init(int use_poll)
+static void
+inputevt_ctx_setup(struct poll_ctx *ctx, const char *name, unsigned index)
 {
-	struct poll_ctx *ctx;
-
-	ctx = get_global_poll_ctx();
-	inputevt_stid = thread_small_id();
-
 	g_assert(!ctx->initialized);
+
 	ctx->initialized = TRUE;
+	ctx->name = name;
+	ctx->index = index;
+	ctx->owner = THREAD_INVALID_ID;
+	ctx->master_fd = -1;
 	ctx->ht = htable_create(HASH_KEY_SELF, 0);
 	ctx->readable = hash_list_new(NULL, NULL);
 	mutex_init(&ctx->lock);
@@ -1590,6 +1666,50 @@ inputevt_init(int use_poll)
 	 */
 
 	htable_thread_safe(ctx->ht);
+}
+
+/**
+ * Release the resources held by a polling context.
+ */
+static void
+inputevt_ctx_teardown(struct poll_ctx *ctx)
+{
+	CTX_LOCK(ctx);
+
+	inputevt_purge_removed(ctx);
+	htable_free_null(&ctx->ht);
+	hash_list_free(&ctx->readable);
+	HFREE_NULL(ctx->used_poll_idx);
+	HFREE_NULL(ctx->used_event_id);
+	XFREE_NULL(ctx->relay);
+	XFREE_NULL(ctx->pfd_arr);
+#ifdef HAS_KQUEUE
+	XFREE_NULL(ctx->kev_arr);
+#endif
+#ifdef HAS_EPOLL
+	XFREE_NULL(ctx->ep_arr);
+#endif
+	fd_close(&ctx->master_fd);
+	ctx->initialized = FALSE;
+
+	CTX_UNLOCK(ctx);
+	mutex_destroy(&ctx->lock);
+}
+
+/**
+ * Performs module initialization.
+ * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ */
+void
+inputevt_init(int use_poll)
+{
+	struct poll_ctx *ctx;
+
+	ctx = get_global_poll_ctx();
+	inputevt_stid = thread_small_id();
+
+	inputevt_ctx_setup(ctx, "main", 0);
+	inputevt_ctx[0] = ctx;
 
 	CTX_LOCK(ctx);
 
@@ -1603,6 +1723,14 @@ inputevt_init(int use_poll)
 		}
 	}
 
+	/*
+	 * When we have a master file descriptor, GLib can poll it for us and
+	 * we no longer need to intercept its polling.
+	 */
+
+	if (is_valid_fd(ctx->master_fd))
+		g_main_context_set_poll_func(NULL, default_poll_func);
+
 	CTX_UNLOCK(ctx);
 
 	if (is_valid_fd(ctx->master_fd)) {
@@ -1626,18 +1754,15 @@ inputevt_init(int use_poll)
 }
 
 /**
- * Adds an event source to the main GLIB monitor queue.
+ * Adds an event source to the specified polling context.
  *
- * A replacement for gdk_input_add().
- * Behaves exactly the same, except destroy notification has
- * been removed (since gtkg does not use it).
+ * @return the event ID, including the context index.
  */
-unsigned
-inputevt_add(int fd, inputevt_cond_t cond,
+static unsigned
+inputevt_add_to(struct poll_ctx *ctx, int fd, inputevt_cond_t cond,
 	inputevt_handler_t handler, void *data)
 {
 	inputevt_relay_t *relay;
-	struct poll_ctx *ctx;
 	uint id;
 
 	g_assert(is_valid_fd(fd));
@@ -1646,8 +1771,6 @@ inputevt_add(int fd, inputevt_cond_t cond,
 	safety_assert(is_open_fd(fd));
 	safety_assert(is_a_socket(fd) || is_a_fifo(fd));
 
-	ctx = get_global_poll_ctx();
-
 	g_assert(ctx->initialized);
 	g_assert(ctx->ht != NULL);
 
@@ -1708,6 +1831,10 @@ cond_is_okay:
 			id = 1;
 			ctx->num_ev_reserved = 1;
 		}
+
+		g_assert_log(id <= INPUTEVT_ID_MASK,
+			"%s(): too many event sources in context \"%s\"",
+			G_STRFUNC, ctx->name);
 	}
 
 	if (ctx->collecting) {
@@ -1723,7 +1850,40 @@ cond_is_okay:
 
 	CTX_UNLOCK(ctx);
 
-	return id;
+	return (ctx->index << INPUTEVT_ID_SHIFT) | id;
+}
+
+/**
+ * Adds an event source to the main GLIB monitor queue.
+ *
+ * A replacement for gdk_input_add().
+ * Behaves exactly the same, except destroy notification has
+ * been removed (since gtkg does not use it).
+ */
+unsigned
+inputevt_add(int fd, inputevt_cond_t cond,
+	inputevt_handler_t handler, void *data)
+{
+	return inputevt_add_to(get_global_poll_ctx(), fd, cond, handler, data);
+}
+
+/**
+ * Adds an event source to a polling context created by inputevt_ctx_create().
+ *
+ * The handler will be invoked from the thread dispatching events for that
+ * context.  When the context is edge-triggered, the handler must process
+ * all the pending input, or write until it would block.
+ *
+ * @return the event ID, to be given to inputevt_remove().
+ */
+unsigned
+inputevt_ctx_add(inputevt_ctx_t *ctx, int fd, inputevt_cond_t cond,
+	inputevt_handler_t handler, void *data)
+{
+	g_assert(ctx != NULL);
+	g_assert(ctx->index != 0);
+
+	return inputevt_add_to(ctx, fd, cond, handler, data);
 }
 
 /**
@@ -1740,6 +1900,169 @@ inputevt_dispatch(void)
 	inputevt_timer(ctx);
 }
 
+/**
+ * Create a new polling context, whose events will be dispatched by the
+ * thread calling inputevt_ctx_dispatch() on it.
+ *
+ * @param name		the context name, for logging (static string)
+ * @param edge		whether events should be edge-triggered
+ *
+ * @return the new context, NULL if we cannot create one, in which case
+ * the caller should use the global context through inputevt_add().
+ */
+inputevt_ctx_t *
+inputevt_ctx_create(const char *name, bool edge)
+{
+	struct poll_ctx *ctx;
+	uint i;
+
+	g_assert(name != NULL);
+
+	WALLOC0(ctx);
+
+	INPUTEVT_CTX_LOCK;
+
+	for (i = 1; i < N_ITEMS(inputevt_ctx); i++) {
+		if (NULL == inputevt_ctx[i]) {
+			inputevt_ctx[i] = ctx;
+			break;
+		}
+	}
+
+	INPUTEVT_CTX_UNLOCK;
+
+	if (N_ITEMS(inputevt_ctx) == i) {
+		s_warning("%s(): cannot create \"%s\": too many polling contexts",
+			G_STRFUNC, name);
+		WFREE(ctx);
+		return NULL;
+	}
+
+	inputevt_ctx_setup(ctx, name, i);
+	ctx->edge = booleanize(edge);
+
+	/*
+	 * We need a master file descriptor we can wait on: poll() and /dev/poll
+	 * are only usable from the global context.
+	 */
+
+	CTX_LOCK(ctx);
+
+	if (0 != init_with_kqueue(ctx) && 0 != init_with_epoll(ctx)) {
+		CTX_UNLOCK(ctx);
+		if (inputevt_debug) {
+			s_debug("%s(): cannot create \"%s\": no kernel event queue",
+				G_STRFUNC, name);
+		}
+		inputevt_ctx_free(&ctx);
+		return NULL;
+	}
+
+	CTX_UNLOCK(ctx);
+
+	fd_set_close_on_exec(ctx->master_fd);
+
+	if (inputevt_debug) {
+		s_debug("%s(): \"%s\" using %s%s", G_STRFUNC, name,
+			ctx->polling_method, ctx->edge ? ", edge-triggered" : "");
+	}
+
+	return ctx;
+}
+
+/**
+ * Wait for I/O events on a polling context and dispatch them.
+ *
+ * A context is owned by the first thread dispatching its events, and only
+ * that thread may dispatch events for it afterwards.
+ *
+ * @param ctx			the polling context
+ * @param timeout_ms	maximum waiting time, in ms (-1 = infinite)
+ *
+ * @return the amount of events reported by the kernel queue (0 or 1), or -1
+ * on error with errno set.
+ */
+int
+inputevt_ctx_dispatch(inputevt_ctx_t *ctx, int timeout_ms)
+{
+	struct pollfd pfd;
+	int r;
+
+	g_assert(ctx != NULL);
+	g_assert(ctx->initialized);
+	g_assert(ctx->index != 0);
+
+	if G_UNLIKELY(THREAD_INVALID_ID == ctx->owner)
+		ctx->owner = thread_small_id();
+
+	g_assert_log(thread_small_id() == ctx->owner,
+		"%s(): context \"%s\" owned by %s, called from %s",
+		G_STRFUNC, ctx->name, thread_id_name(ctx->owner), thread_name());
+
+	pfd.fd = ctx->master_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	CTX_LOCK(ctx);
+
+	/* No timeout given: compat_poll() flags the thread as being in syscall */
+	inputevt_collect_start(ctx, 0);
+	r = compat_poll(&pfd, 1, timeout_ms);
+	inputevt_collect_end(ctx, 0);
+
+	if (ctx->removed != NULL)
+		inputevt_purge_removed(ctx);
+
+	CTX_UNLOCK(ctx);
+
+	if (r > 0) {
+		inputevt_timer(ctx);
+	} else if (-1 == r && !is_temporary_error(errno)) {
+		s_warning("%s(): waiting on \"%s\" (fd #%d) failed: %m",
+			G_STRFUNC, ctx->name, ctx->master_fd);
+	}
+
+	return r;
+}
+
+/**
+ * @return the name of the polling context.
+ */
+const char *
+inputevt_ctx_name(const inputevt_ctx_t *ctx)
+{
+	g_assert(ctx != NULL);
+
+	return ctx->name;
+}
+
+/**
+ * Free polling context created by inputevt_ctx_create(), nullifying its
+ * pointer.
+ *
+ * All the event sources registered in the context must have been removed.
+ */
+void
+inputevt_ctx_free(inputevt_ctx_t **ctx_ptr)
+{
+	struct poll_ctx *ctx = *ctx_ptr;
+
+	if (ctx != NULL) {
+		g_assert(ctx->index != 0);
+		g_assert(!ctx->dispatching);
+
+		inputevt_ctx_teardown(ctx);
+
+		INPUTEVT_CTX_LOCK;
+		g_assert(ctx == inputevt_ctx[ctx->index]);
+		inputevt_ctx[ctx->index] = NULL;
+		INPUTEVT_CTX_UNLOCK;
+
+		WFREE(ctx);
+		*ctx_ptr = NULL;
+	}
+}
+
 /**
  * Performs module cleanup.
  */
@@ -1747,24 +2070,20 @@ void
 inputevt_close(void)
 {
 	struct poll_ctx *ctx;
+	uint i;
 
 	ctx = get_global_poll_ctx();
 	inputevt_stid = THREAD_INVALID_ID;
 
-	CTX_LOCK(ctx);
-
-	inputevt_purge_removed(ctx);
-	htable_free_null(&ctx->ht);
-	hash_list_free(&ctx->readable);
-	HFREE_NULL(ctx->used_poll_idx);
-	HFREE_NULL(ctx->used_event_id);
-	XFREE_NULL(ctx->relay);
-	XFREE_NULL(ctx->pfd_arr);
-	fd_close(&ctx->master_fd);
-	ctx->initialized = FALSE;
+	for (i = 1; i < N_ITEMS(inputevt_ctx); i++) {
+		if (inputevt_ctx[i] != NULL) {
+			s_carp("%s(): polling context \"%s\" was not freed",
+				G_STRFUNC, inputevt_ctx[i]->name);
+		}
+	}
 
-	CTX_UNLOCK(ctx);
-	mutex_destroy(&ctx->lock);
+	inputevt_ctx_teardown(ctx);
+	inputevt_ctx[0] = NULL;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -65,6 +65,11 @@ typedef void (*inputevt_handler_t) (
 	inputevt_cond_t condition
 );
 
+/**
+ * A polling context, driven by its own thread.
+ */
+typedef struct poll_ctx inputevt_ctx_t;
+
 /*
  * Module initialization and cleanup functions.
  */
@@ -88,6 +93,13 @@ size_t inputevt_data_available(void);
 void inputevt_remove(unsigned *id_ptr);
 void inputevt_set_readable(int fd);
 
+inputevt_ctx_t *inputevt_ctx_create(const char *name, bool edge);
+unsigned inputevt_ctx_add(inputevt_ctx_t *ctx, int fd, inputevt_cond_t cond,
+	inputevt_handler_t handler, void *data);
+int inputevt_ctx_dispatch(inputevt_ctx_t *ctx, int timeout_ms);
+const char *inputevt_ctx_name(const inputevt_ctx_t *ctx);
+void inputevt_ctx_free(inputevt_ctx_t **ctx_ptr);
+
 #endif  /* _inputevt_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -39,6 +39,7 @@
 #include "progname.h"
 #include "random.h"
 #include "stats.h"
+#include "str.h"
 #include "stringify.h"
 #include "tm.h"
 #include "unsigned.h"
@@ -57,11 +58,12 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-			"Usage: %s [-ahpuz] [-A size] [-L size] [-b sp] [-i level]\n"
+			"Usage: %s [-ahpuz] [-A size] [-L size] [-b spf] [-i level]\n"
 			"  -A : sets upper limit for alphabet size (absolute max %zu)\n"
 			"  -L : sets lower limit for alphabet size (absolute min 1)\n"
 			"  -a : run all tests\n"
 			"  -b : what to benchmark: s or S = strstr(), p or P = pattern_*()\n"
+			"       f = pattern_match() versus pattern_simd() on file names\n"
 			"  -i : verbose level for pattern_init()\n"
 			"  -h : prints this help message\n"
 			"  -u : use un-matchable patterns\n"
@@ -414,6 +416,157 @@ benchmark_strstr(size_t asize)
 	xfree(haystack);
 }
 
+/*
+ * Vocabulary used to generate realistic shared file names.
+ */
+static const char *filename_words[] = {
+	"the", "of", "and", "love", "live", "night", "day", "dream", "world",
+	"music", "best", "greatest", "hits", "remix", "edit", "original", "mix",
+	"album", "track", "disc", "part", "chapter", "episode", "season",
+	"collection", "complete", "deluxe", "edition", "remastered", "version",
+	"concert", "acoustic", "session", "radio", "club", "extended", "feat",
+	"Blue", "Red", "Black", "White", "Summer", "Winter", "River", "Moon",
+	"Sun", "Heart", "Fire", "Rain", "Road", "Home", "Girl", "Boy", "City",
+	"Linux", "Ubuntu", "Debian", "kernel", "source", "manual", "guide",
+	"book", "ebook", "paper", "thesis", "report", "notes", "photo", "img",
+	"DSC", "holiday", "wedding", "birthday", "family", "backup", "setup",
+};
+
+static const char *filename_seps[] = {
+	" ", " ", " ", "_", "-", " - ", ".", "(", ")", " [", "] ",
+};
+
+static const char *filename_exts[] = {
+	".mp3", ".ogg", ".flac", ".avi", ".mkv", ".mp4", ".jpg", ".png",
+	".pdf", ".epub", ".txt", ".zip", ".iso", ".tar.gz",
+};
+
+/**
+ * Generate a random file name in buffer, looking like the ones we find
+ * in shared libraries.
+ *
+ * @return the length of the generated name.
+ */
+static size_t
+fill_filename(char *buf, size_t size)
+{
+	size_t len = 0, words = 2 + random_value(8), i;
+	char tmp[32];
+
+#define FILENAME_APPEND(x) G_STMT_START {	\
+	const char *x_ = (x);					\
+	size_t l_ = strlen(x_);					\
+	if (len + l_ >= size)					\
+		goto done;							\
+	memcpy(&buf[len], x_, l_);				\
+	len += l_;								\
+} G_STMT_END
+
+	for (i = 0; i < words; i++) {
+		if (i != 0)
+			FILENAME_APPEND(filename_seps[
+				random_value(N_ITEMS(filename_seps) - 1)]);
+		if (0 == random_value(5)) {
+			str_bprintf(ARYLEN(tmp), "%02u", random_value(2020));
+			FILENAME_APPEND(tmp);
+		} else {
+			FILENAME_APPEND(filename_words[
+				random_value(N_ITEMS(filename_words) - 1)]);
+		}
+	}
+
+	FILENAME_APPEND(filename_exts[random_value(N_ITEMS(filename_exts) - 1)]);
+
+#undef FILENAME_APPEND
+
+done:
+	buf[len] = '\0';
+	return len;
+}
+
+#define FILENAME_COUNT	20000
+#define FILENAME_MAXLEN	128
+#define FILENAME_RUNS	5
+
+/**
+ * Benchmark pattern_match_force() against pattern_simd_force() on a corpus
+ * of file names, as done when matching queries against our shared files.
+ */
+static void
+benchmark_filenames(void)
+{
+	char *names;
+	size_t lens[FILENAME_COUNT];
+	size_t i, w, total = 0;
+
+	names = xmalloc(FILENAME_COUNT * FILENAME_MAXLEN);
+
+	for (i = 0; i < FILENAME_COUNT; i++) {
+		lens[i] = fill_filename(&names[i * FILENAME_MAXLEN], FILENAME_MAXLEN);
+		total += lens[i];
+	}
+
+	s_info("%s(): %zu file names, average length is %zu bytes",
+		G_STRFUNC, (size_t) FILENAME_COUNT, total / FILENAME_COUNT);
+
+	for (w = 0; w < N_ITEMS(filename_words); w += 7) {
+		const char *word = filename_words[w];
+		cpattern_t *pc = pattern_compile(word, FALSE);
+		size_t hits[2] = { 0, 0 };
+		double elapsed[2];
+		uint k;
+
+		/*
+		 * Keep the best of several runs for each routine, to limit the
+		 * influence of preemption and cache effects.
+		 */
+
+		for (k = 0; k < N_ITEMS(elapsed) * FILENAME_RUNS; k++) {
+			tm_nano_t start, end;
+			uint r = k % N_ITEMS(elapsed);
+			size_t n = 0;
+			double e;
+
+			tm_precise_time(&start);
+
+			for (i = 0; i < FILENAME_COUNT; i++) {
+				const char *name = &names[i * FILENAME_MAXLEN];
+				const char *m;
+
+				m = 0 == r ?
+					pattern_match_force(pc, name, lens[i], 0, qs_begin) :
+					pattern_simd_force(pc, name, lens[i], 0, qs_begin);
+
+				if (m != NULL)
+					n++;
+			}
+
+			tm_precise_time(&end);
+			e = tm_precise_elapsed_f(&end, &start);
+
+			if (k < N_ITEMS(elapsed) || e < elapsed[r])
+				elapsed[r] = e;
+			hits[r] = n;
+		}
+
+		g_assert_log(hits[0] == hits[1],
+			"%s(): word=\"%s\", match=%zu, simd=%zu",
+			G_STRFUNC, word, hits[0], hits[1]);
+
+		s_info("%s(): \"%s\" matches %zu name%s:", G_STRFUNC, word,
+			PLURAL(hits[0]));
+		s_info("\tmatch(): %'zu ns, %.1f MB/s", (size_t) (elapsed[0] * 1e9),
+			total / elapsed[0] / 1e6);
+		s_info("\tsimd():  %'zu ns, %.1f MB/s (%u%% of match() time)",
+			(size_t) (elapsed[1] * 1e9), total / elapsed[1] / 1e6,
+			(uint) (100.0 * elapsed[1] / elapsed[0]));
+
+		pattern_free(pc);
+	}
+
+	xfree(names);
+}
+
 static void
 test_strstr(bool low_letters)
 {
@@ -1031,6 +1184,69 @@ test_qs_flags(pattern_search_fn_t *fn, const char *name)
 	s_info("%s(): all OK for %s()", G_STRFUNC, name);
 }
 
+static void
+test_simd(void)
+{
+	size_t i;
+	char haystack[1024];
+
+	/*
+	 * The SIMD kernels only kick in on texts larger than their window,
+	 * so we need longer haystacks than the ones used by test_qs_flags().
+	 */
+
+	for (i = 0; i < 10000; i++) {
+		size_t hlen, nlen, offset;
+		char needle[32];
+		cpattern_t *pc;
+		qsearch_mode_t word = random_value(qs_whole);
+		const char *rm, *rs;
+
+		if (i & 0x1) {
+			hlen = fill_filename(ARYLEN(haystack));
+			if (0 == hlen)
+				continue;
+		} else {
+			hlen = 1 + random_value(sizeof haystack - 2);
+			fill_random_asize_string(haystack, hlen + 1, 1 + (i % 8));
+		}
+
+		/*
+		 * Take needle from the haystack most of the time, otherwise
+		 * pick a random word that may or may not be there.
+		 */
+
+		if (random_value(3) != 0) {
+			nlen = 1 + random_value(MIN(hlen, sizeof needle - 1) - 1);
+			offset = random_value(hlen - nlen);
+			memcpy(needle, &haystack[offset], nlen);
+			needle[nlen] = '\0';
+		} else {
+			const char *w =
+				filename_words[random_value(N_ITEMS(filename_words) - 1)];
+			nlen = strlen(w);
+			memcpy(needle, w, nlen + 1);
+		}
+
+		pc = pattern_compile_fast(needle, nlen, FALSE);
+		offset = random_value(hlen / 4);
+
+		rm = pattern_match_force(pc, haystack, hlen, offset, word);
+		rs = pattern_simd_force(pc, haystack, hlen, offset, word);
+
+		g_assert_log(rm == rs,
+			"%s(): i=%zu, qs_%s, rm=%p (offset %zd), rs=%p (offset %zd), "
+			"h=\"%s\", n=\"%s\"",
+			G_STRFUNC, i, qs2str(word),
+			rm, rm ? rm - haystack : -1, rs, rs ? rs - haystack : -1,
+			haystack, needle);
+
+		pattern_free(pc);
+	}
+
+	s_info("%s(): all OK", G_STRFUNC);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1038,7 +1254,7 @@ main(int argc, char **argv)
 	extern char *optarg;
 	int c;
 	const char options[] = "A:L:ab:i:huz";
-	const char all_benchmarks[] = "spSP";
+	const char all_benchmarks[] = "spSPf";
 	int default_init_level = PATTERN_INIT_PROGRESS | PATTERN_INIT_SELECTED;
 	int init_level = default_init_level;
 	const char *benchmarks = "";
@@ -1123,9 +1339,13 @@ main(int argc, char **argv)
 
 	test_pattern_case(FN(pattern_qsearch));
 	test_pattern_case(FN(pattern_match));
+	test_pattern_case(FN(pattern_simd));
 
 	test_qs_flags(FN(pattern_qsearch));
 	test_qs_flags(FN(pattern_match));
+	test_qs_flags(FN(pattern_simd));
+
+	test_simd();
 
 	/*
 	 * OK, seems the above are correct, benchmark our routines.
@@ -1147,6 +1367,9 @@ main(int argc, char **argv)
 		case 'P':
 			benchmark_pattern(MIN(alphabet_min, small_size));
 			break;
+		case 'f':
+			benchmark_filenames();
+			break;
 		default:
 			s_warning("skipping unknown benchmark code '%c'", c);
 			break;
@@ -38,6 +38,7 @@
 #include "pattern.h"
 
 #include "ascii.h"
+#include "cpufeat.h"
 #include "endian.h"
 #include "misc.h"
 #include "op.h"
@@ -50,6 +51,10 @@
 #include "walloc.h"
 #include "xmalloc.h"
 
+#ifdef CPUFEAT_X86
+#include <immintrin.h>
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 #define ALPHA_SIZE	256			/**< Alphabet size */
@@ -1645,6 +1650,247 @@ pattern_match_force(
 	}
 }
 
+/*
+ * SIMD kernels for texts of known length.
+ *
+ * They look for the first and the last byte of the pattern at once, for all
+ * the positions of a 16-byte (SSE2) or 32-byte (AVX2) window: only positions
+ * where both bytes match are candidates, which we confirm by comparing the
+ * inner bytes of the pattern.  Filtering on two bytes that are (len - 1)
+ * apart is much more selective than looking for the first byte only, so on
+ * real text the confirmation step is rarely needed.
+ *
+ * Only case-sensitive patterns of at least 2 bytes are handled: the others,
+ * as well as the tail of the text which does not fill a whole window, are
+ * deferred to the 2-way algorithm.
+ *
+ * Confirming a candidate costs O(m), so a pathological text could make
+ * us degenerate into O(m*n): when too many candidates turn out to be false
+ * positives, we also defer the remaining of the text to the 2-way algorithm.
+ *
+ * We do not use the SSE4.2 string instructions (pcmpestri), which are
+ * slower than these plain byte comparisons on all the CPUs we measured.
+ */
+
+/*
+ * Amount of false positives we tolerate, per window, before deferring to
+ * the 2-way algorithm.
+ */
+#define PATTERN_SIMD_MISSES	4
+
+#ifdef CPUFEAT_X86
+/**
+ * Confirm candidate matches flagged in the mask.
+ *
+ * @param p			compiled pattern
+ * @param hp		start of the window where candidates were flagged
+ * @param mask		bit i set when hp[i] is a potential match start
+ * @param haystack	start of text
+ * @param end		first byte beyond the end of the text
+ * @param word		the word matching constraint
+ * @param misses	incremented for each candidate that does not match
+ *
+ * @return pointer to the first confirmed match, NULL if none.
+ */
+static inline const char *
+pattern_simd_confirm(const cpattern_t *p, const uchar *hp, uint32 mask,
+	const uchar *haystack, const uchar *end, qsearch_mode_t word,
+	size_t *misses)
+{
+	while (mask != 0) {
+		const uchar *tp = hp + ctz(mask);
+
+		if (
+			0 == memcmp(tp + 1, p->pattern + 1, p->len - 2) &&
+			pattern_has_matched(p, tp, haystack, end, word)
+		)
+			return (const char *) tp;
+
+		(*misses)++;
+		mask &= mask - 1;		/* Clear lowest bit set */
+	}
+
+	return NULL;
+}
+
+/**
+ * SSE2 version of pattern_match_known(), processing 16 positions at a time.
+ */
+static const char * G_HOT CPUFEAT_TARGET("sse2")
+pattern_simd_known_sse2(
+	const cpattern_t *p, const uchar *haystack, size_t hlen, size_t hoffset,
+	qsearch_mode_t word)
+{
+	const uchar *hp, *end, *needle;
+	size_t nlen, misses = 0, windows = 1;
+	__m128i first, last;
+
+	pattern_check(p);
+
+	if G_UNLIKELY(p->icase || p->len < 2)
+		return pattern_match_known(p, haystack, hlen, hoffset, word);
+
+	if G_UNLIKELY(hlen < p->len)
+		return NULL;
+
+	needle = (const uchar *) p->pattern;
+	nlen = p->len;
+	hp = haystack + hoffset;
+	end = haystack + hlen;
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[nlen - 1]);
+
+	while (ptr_diff(end, hp) >= nlen - 1 + sizeof(__m128i)) {
+		__m128i bf = _mm_loadu_si128((const __m128i *) hp);
+		__m128i bl = _mm_loadu_si128((const __m128i *) (hp + nlen - 1));
+		uint32 mask = _mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+
+		if G_UNLIKELY(mask != 0) {
+			const char *m = pattern_simd_confirm(p, hp, mask,
+				haystack, end, word, &misses);
+			if (m != NULL)
+				return m;
+			if G_UNLIKELY(misses > windows * PATTERN_SIMD_MISSES)
+				break;
+		}
+
+		windows++;
+
+		hp += sizeof(__m128i);
+	}
+
+	return pattern_match_known(p, haystack, hlen, ptr_diff(hp, haystack), word);
+}
+
+/**
+ * AVX2 version of pattern_match_known(), processing 32 positions at a time.
+ */
+static const char * G_HOT CPUFEAT_TARGET("avx2")
+pattern_simd_known_avx2(
+	const cpattern_t *p, const uchar *haystack, size_t hlen, size_t hoffset,
+	qsearch_mode_t word)
+{
+	const uchar *hp, *end, *needle;
+	size_t nlen, misses = 0, windows = 1;
+	__m256i first, last;
+
+	pattern_check(p);
+
+	if G_UNLIKELY(p->icase || p->len < 2)
+		return pattern_match_known(p, haystack, hlen, hoffset, word);
+
+	if G_UNLIKELY(hlen < p->len)
+		return NULL;
+
+	needle = (const uchar *) p->pattern;
+	nlen = p->len;
+	hp = haystack + hoffset;
+	end = haystack + hlen;
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[nlen - 1]);
+
+	while (ptr_diff(end, hp) >= nlen - 1 + sizeof(__m256i)) {
+		__m256i bf = _mm256_loadu_si256((const __m256i *) hp);
+		__m256i bl = _mm256_loadu_si256((const __m256i *) (hp + nlen - 1));
+		uint32 mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+
+		if G_UNLIKELY(mask != 0) {
+			const char *m = pattern_simd_confirm(p, hp, mask,
+				haystack, end, word, &misses);
+			if (m != NULL)
+				return m;
+			if G_UNLIKELY(misses > windows * PATTERN_SIMD_MISSES)
+				break;
+		}
+
+		windows++;
+
+		hp += sizeof(__m256i);
+	}
+
+	/*
+	 * Finish with the SSE2 kernel, which can still handle a 16-byte window
+	 * before deferring to the scalar code.
+	 */
+
+	return pattern_simd_known_sse2(p, haystack, hlen, ptr_diff(hp, haystack),
+		word);
+}
+#endif	/* CPUFEAT_X86 */
+
+/**
+ * Select the best SIMD kernel supported by the running CPU.
+ *
+ * @param name		if non-NULL, written with the name of the selected kernel
+ *
+ * @return the SIMD kernel to use for known-length texts, NULL if none.
+ */
+static pattern_dflt_known_t *
+pattern_simd_best(const char **name)
+{
+	pattern_dflt_known_t *kernel = NULL;
+	const char *kname = NULL;
+
+#ifdef CPUFEAT_X86
+	if (cpufeat_has(CPUFEAT_AVX2)) {
+		kernel = pattern_simd_known_avx2;
+		kname = "pattern_simd_known_avx2";
+	} else if (cpufeat_has(CPUFEAT_SSE2)) {
+		kernel = pattern_simd_known_sse2;
+		kname = "pattern_simd_known_sse2";
+	}
+#endif	/* CPUFEAT_X86 */
+
+	if (name != NULL)
+		*name = kname;
+
+	return kernel;
+}
+
+/**
+ * SIMD matching, using the best kernel supported by the CPU.
+ *
+ * This is intended to be used by tests and benchmarks, to compare the
+ * SIMD kernels with the scalar 2-way matching, which is used when the
+ * text length is unknown or when the CPU lacks SIMD support.
+ *
+ * This version is immune to benchmarking!
+ *
+ * @return pointer to beginning of matching substring, NULL if not found.
+ */
+const char *
+pattern_simd_force(
+	const cpattern_t *cpat,	/**< Compiled pattern */
+	const char *text,		/**< Text we're scanning */
+	size_t tlen,			/**< Text length, 0 = unknown */
+	size_t toffset,			/**< Offset within text for search start */
+	qsearch_mode_t word)	/**< Beginning/whole word matching? */
+{
+	static pattern_dflt_known_t *kernel;
+
+	if (0 == tlen)
+		return pattern_match_force(cpat, text, tlen, toffset, word);
+
+	G_PREFETCH_R(text + toffset);
+	g_assert_log(toffset <= tlen,
+		"%s(): toffset=%'zu, tlen=%'zu",
+		G_STRFUNC, toffset, tlen);
+
+	/*
+	 * No locking needed: concurrent threads will select the same kernel.
+	 */
+
+	if G_UNLIKELY(NULL == kernel) {
+		kernel = pattern_simd_best(NULL);
+		if (NULL == kernel)
+			kernel = pattern_match_known;
+	}
+
+	return (*kernel)(cpat, (uchar *) text, tlen, toffset, word);
+}
+
 /*
  * @note
  *
@@ -3183,10 +3429,62 @@ pattern_benchmark_dflt(int verbose, struct pattern_benchmark_context *ctx)
 	/*
 	 * With known text lengths, always use the 2-Way String Matching
 	 * algorithm since it is guaranteed to be O(n) and is consistently
-	 * faster anyway.
+	 * faster anyway, unless pattern_benchmark_simd() finds a faster
+	 * SIMD kernel.
 	 */
 }
 
+/**
+ * Benchmark the best SIMD kernel supported by the CPU against the scalar
+ * routine used for texts of known length, and switch to the SIMD kernel
+ * if it is faster.
+ */
+static void
+pattern_benchmark_simd(int verbose, struct pattern_benchmark_context *ctx)
+{
+	size_t n;
+	char needle[PATTERN_NEEDLE_LEN + 1];
+	size_t sum = 0;
+	pattern_dflt_known_t *kernel;
+	const char *name;
+
+	kernel = pattern_simd_best(&name);
+
+	if (NULL == kernel) {
+		if (verbose & PATTERN_INIT_SELECTED) {
+			s_info("no SIMD pattern matching, CPU features: %s",
+				cpufeat_to_string());
+		}
+		return;
+	}
+
+	ctx->needle = needle;
+	ctx->use_text = TRUE;	/* More representative of real text */
+
+	ctx->name[0] = pattern_dflt_name_k;
+	ctx->u.pk[0] = pattern_dflt_known;
+	ctx->name[1] = name;
+	ctx->u.pk[1] = kernel;
+
+	ctx->direction = PATTERN_FORWARD;
+
+	for (n = 3; n < 3 + PATTERN_BENCH_DFLT_NEEDLES; n++) {
+		ctx->nlen = n;		/* Typical needle length */
+		sum += pattern_benchmark_n_times(3,
+			PATTERN_BENCH_DFLT_KNOWN, verbose, ctx);
+	}
+
+	if (sum > PATTERN_BENCH_DFLT_NEEDLES / 2) {
+		pattern_dflt_known = kernel;
+		pattern_dflt_name_k = name;
+	}
+
+	if (verbose & PATTERN_INIT_SELECTED) {
+		s_info("will use %s() for texts of known length",
+			pattern_dflt_name_k);
+	}
+}
+
 #define PATTERN_BENCH_CUTOFF_CLOSE		8	/* When are we closing-in? */
 #define PATTERN_BENCH_CUTOFF_LOW		2	/* Lowest needle length */
 #define PATTERN_BENCH_RETRIES			3
@@ -3410,6 +3708,7 @@ pattern_init(int verbose)
 	pattern_benchmark_strrchr(verbose, &ctx);
 	pattern_benchmark_strlen(verbose, &ctx);
 	pattern_benchmark_dflt(verbose, &ctx);
+	pattern_benchmark_simd(verbose, &ctx);
 	pattern_benchmark_cutoff_strstr_len(verbose, &ctx);
 	pattern_benchmark_cutoff_strstr(verbose, &ctx);
 
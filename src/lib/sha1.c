@@ -65,16 +65,49 @@
  */
 
 #include "common.h"
+#include "cpufeat.h"
 #include "endian.h"
 #include "sha1.h"
 #include "misc.h"			/* For RCSID */
+#include "stringify.h"		/* For PLURAL() */
+
+#ifdef CPUFEAT_X86
+#include <immintrin.h>
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 #define SHA1_BLEN	64		/**< Message block length */
 
+/**
+ * Signature of the routines processing consecutive 64-byte message blocks.
+ *
+ * The data pointer must be aligned on a 32-bit boundary, since the generic
+ * version reads the data as 32-bit words.
+ */
+typedef void (*SHA1_blocks_fn_t)(uint32 *ihash, const void *data, size_t n);
+
 /* Local Function Prototyptes */
 static void SHA1_pad_message(SHA1_context *);
-static void SHA1_process_message_block(SHA1_context *, const void *mblock);
+static void SHA1_process_blocks_generic(uint32 *, const void *, size_t);
+static void SHA1_process_blocks_init(uint32 *, const void *, size_t);
+
+/**
+ * The block processing routine, selected at runtime depending on the
+ * features supported by the CPU.  The first call goes through
+ * SHA1_process_blocks_init() which installs the proper routine.
+ */
+static SHA1_blocks_fn_t SHA1_process_blocks = SHA1_process_blocks_init;
+
+/**
+ * Process the single message block held in the context.
+ */
+static inline void
+SHA1_process_message_block(SHA1_context *context, const void *mblock)
+{
+	(*SHA1_process_blocks)(context->ihash, mblock, 1);
+	context->midx = 0;
+}
 
 /**
  *  SHA1_reset
@@ -252,16 +285,26 @@ SHA1_input(SHA1_context *context, const void *data, size_t length)
 		goto slowpath;
 
 fastpath:
-	for (/**/; length >= SHA1_BLEN; mp += SHA1_BLEN, length -= SHA1_BLEN) {
-		context->length += 8 * SHA1_BLEN;		/* Counts bits, not bytes */
+	/*
+	 * Hand all the complete blocks at once to the processing routine, so
+	 * that hardware-accelerated versions can keep the intermediate hash
+	 * in registers across blocks.
+	 */
+
+	if (length >= SHA1_BLEN) {
+		size_t blocks = length / SHA1_BLEN;
+		uint64 bits = (uint64) blocks * 8 * SHA1_BLEN;	/* Counts bits */
 
-		if G_UNLIKELY(context->length < 8 * SHA1_BLEN) {
+		if G_UNLIKELY(context->length + bits < context->length) {
 			/* Message is too long */
 			context->corrupted = SHA_INPUT_TOO_LONG;
 			return SHA_INPUT_TOO_LONG;
 		}
 
-		SHA1_process_message_block(context, mp);
+		context->length += bits;
+		(*SHA1_process_blocks)(context->ihash, mp, blocks);
+		mp += blocks * SHA1_BLEN;
+		length -= blocks * SHA1_BLEN;
 	}
 
 	/* FALL THROUGH */
@@ -292,13 +335,15 @@ slowpath:
 }
 
 /**
- *  SHA1_process_message_block
+ *  SHA1_process_block
  *
  *  Description:
  *      This function will process the next 512 bits of the message
  *      stored in the mblock parameter.
  *
  *  Parameters:
+ *      ihash: [in/out]
+ *          The intermediate message digest
  *      mblock: [in]
  *          Start of the next 64 message bytes to process
  *
@@ -310,8 +355,8 @@ slowpath:
  *      single character names, were used because those were the
  *      names used in the publication.
  */
-static void G_HOT
-SHA1_process_message_block(SHA1_context *context, const void *mblock)
+static inline void G_HOT
+SHA1_process_block(uint32 *ihash, const void *mblock)
 {
 	const uint32 K[] = {       /* Constants defined in SHA-1 */
 		0x5A827999,
@@ -365,11 +410,11 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 		CRUNCH; wp++;		/* t+9 */
 	}
 
-	a = context->ihash[0];
-	b = context->ihash[1];
-	c = context->ihash[2];
-	d = context->ihash[3];
-	e = context->ihash[4];
+	a = ihash[0];
+	b = ihash[1];
+	c = ihash[2];
+	d = ihash[3];
+	e = ihash[4];
 
 	wp = &W[0];
 
@@ -489,13 +534,181 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 	ROTATE(3, c, d, e, a, b, M3);
 	ROTATE(3, b, c, d, e, a, M3);
 
-	context->ihash[0] += a;
-	context->ihash[1] += b;
-	context->ihash[2] += c;
-	context->ihash[3] += d;
-	context->ihash[4] += e;
+	ihash[0] += a;
+	ihash[1] += b;
+	ihash[2] += c;
+	ihash[3] += d;
+	ihash[4] += e;
+}
 
-	context->midx = 0;
+#undef INIT
+#undef CRUNCH
+#undef ROTATE
+
+/**
+ * Portable processing of consecutive message blocks.
+ *
+ * @param ihash		the intermediate message digest to update
+ * @param data		start of message blocks, aligned on a 32-bit boundary
+ * @param n			amount of 64-byte blocks to process
+ */
+static void G_HOT
+SHA1_process_blocks_generic(uint32 *ihash, const void *data, size_t n)
+{
+	const uint8 *p = data;
+
+	while (n-- != 0) {
+		SHA1_process_block(ihash, p);
+		p += SHA1_BLEN;
+	}
+}
+
+#ifdef CPUFEAT_X86
+/**
+ * Processing of consecutive message blocks using the Intel SHA extensions.
+ *
+ * The state is kept in two SSE registers: ABCD in one (with A in the highest
+ * 32-bit lane), and E in the highest lane of the other.  The message schedule
+ * is computed 4 words at a time by sha1msg1/sha1msg2, and each sha1rnds4
+ * instruction performs 4 rounds.
+ *
+ * @param ihash		the intermediate message digest to update
+ * @param data		start of message blocks, no alignment constraint
+ * @param n			amount of 64-byte blocks to process
+ */
+static void G_HOT CPUFEAT_TARGET("sha,ssse3,sse4.1")
+SHA1_process_blocks_shani(uint32 *ihash, const void *data, size_t n)
+{
+	const __m128i mask =
+		_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	const uint8 *p = data;
+	__m128i abcd, e0, e1, m0, m1, m2, m3;
+
+	abcd = _mm_loadu_si128((const __m128i *) ihash);
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);	/* Put A in highest lane */
+	e0 = _mm_set_epi32(ihash[4], 0, 0, 0);
+
+	/*
+	 * Rounds 4*i to 4*i+3, for i >= 4, all follow the same pattern: the
+	 * message words mc are consumed whilst the schedule for the next words
+	 * is being prepared in m1, m2 and m3 (next ones, in that order).
+	 */
+
+#define SHANI_ROUNDS(ea, eb, mc, m1, m2, m3, f)					\
+	ea = _mm_sha1nexte_epu32(ea, mc);							\
+	eb = abcd;													\
+	m1 = _mm_sha1msg2_epu32(m1, mc);							\
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f);					\
+	m3 = _mm_sha1msg1_epu32(m3, mc);							\
+	m2 = _mm_xor_si128(m2, mc);
+
+#define SHANI_LOAD(m, off)										\
+	m = _mm_shuffle_epi8(										\
+		_mm_loadu_si128((const __m128i *) (p + (off))), mask)
+
+	while (n-- != 0) {
+		__m128i abcd_save = abcd, e0_save = e0;
+
+		/* Rounds 0-3 */
+		SHANI_LOAD(m0, 0);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		/* Rounds 4-7 */
+		SHANI_LOAD(m1, 16);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		/* Rounds 8-11 */
+		SHANI_LOAD(m2, 32);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		/* Rounds 12-15 */
+		SHANI_LOAD(m3, 48);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);	/* Rounds 16-19 */
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);	/* Rounds 20-23 */
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);	/* Rounds 24-27 */
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);	/* Rounds 28-31 */
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);	/* Rounds 32-35 */
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);	/* Rounds 36-39 */
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);	/* Rounds 40-43 */
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);	/* Rounds 44-47 */
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);	/* Rounds 48-51 */
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);	/* Rounds 52-55 */
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);	/* Rounds 56-59 */
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);	/* Rounds 60-63 */
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);	/* Rounds 64-67 */
+
+		/* Rounds 68-71 */
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+
+		/* Rounds 72-75 */
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		/* Rounds 76-79 */
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		/* Add this block's result to the intermediate hash */
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		p += SHA1_BLEN;
+	}
+
+#undef SHANI_ROUNDS
+#undef SHANI_LOAD
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	_mm_storeu_si128((__m128i *) ihash, abcd);
+	ihash[4] = _mm_extract_epi32(e0, 3);
+}
+#endif	/* CPUFEAT_X86 */
+
+/**
+ * Select the fastest block processing routine supported by the CPU.
+ *
+ * @return the selected routine.
+ */
+static SHA1_blocks_fn_t
+SHA1_process_blocks_select(void)
+{
+#ifdef CPUFEAT_X86
+	if (cpufeat_has(CPUFEAT_SHA | CPUFEAT_SSSE3 | CPUFEAT_SSE41))
+		return SHA1_process_blocks_shani;
+#endif
+
+	return SHA1_process_blocks_generic;
+}
+
+/**
+ * Initial block processing routine: installs the proper routine for the
+ * running CPU and then processes the blocks through it.
+ *
+ * This needs no locking: concurrent threads would install the same routine.
+ */
+static void
+SHA1_process_blocks_init(uint32 *ihash, const void *data, size_t n)
+{
+	SHA1_process_blocks = SHA1_process_blocks_select();
+	(*SHA1_process_blocks)(ihash, data, n);
 }
 
 /**
@@ -554,4 +767,105 @@ SHA1_pad_message(SHA1_context *context)
 	SHA1_process_message_block(context, context->mblock);
 }
 
+/**
+ * Make sure the block processing routine selected for the CPU computes the
+ * same thing as the portable version, reverting to the latter otherwise.
+ */
+static void
+sha1_check_blocks(void)
+{
+	static uint32 data[4 * SHA1_BLEN + 1];		/* Aligned */
+	static const size_t blocks[] = { 1, 2, 3, 16 };
+	SHA1_blocks_fn_t fn = SHA1_process_blocks_select();
+	uint8 *p = (uint8 *) data;
+	uint i;
+
+	if (SHA1_process_blocks_generic == fn)
+		return;
+
+	for (i = 0; i < sizeof data; i++) {
+		p[i] = (i * 31 + 7) & 0xff;
+	}
+
+	for (i = 0; i < N_ITEMS(blocks); i++) {
+		SHA1_context c1, c2;
+
+		g_assert(blocks[i] * SHA1_BLEN <= sizeof data);
+
+		SHA1_reset(&c1);
+		SHA1_reset(&c2);
+
+		SHA1_process_blocks_generic(c1.ihash, data, blocks[i]);
+		(*fn)(c2.ihash, data, blocks[i]);
+
+		if (0 != memcmp(c1.ihash, c2.ihash, sizeof c1.ihash)) {
+			g_warning("%s(): accelerated SHA-1 is broken for %zu block%s, "
+				"using portable version", G_STRFUNC, PLURAL(blocks[i]));
+			SHA1_process_blocks = SHA1_process_blocks_generic;
+			return;
+		}
+	}
+
+	SHA1_process_blocks = fn;
+}
+
+/**
+ * Check the SHA-1 implementation against the test vectors of RFC 3174.
+ */
+void
+sha1_check(void)
+{
+	static const struct {
+		const char *r;		/* Expected digest, base32-encoded */
+		const char *s;		/* Data to hash */
+		size_t repeat;		/* Amount of times data is fed */
+	} tests[] = {
+		{ "3I42H3S6NNFQ2MSVX7XZKYAYSCX5QBYJ", "", 1 },
+		{ "VGMT4NSHA2AWVOR6EVYXQUGCNSONBWE5", "abc", 1 },
+		{ "QSMD4RA4HPJG5OVOJKQ7SUJJ4XSUM4HR",
+			"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1 },
+		{ "32RVNIWN3WIMPJ7M5XC6XNLDSNHUMBCS",
+			"01234567012345670123456701234567"
+			"01234567012345670123456701234567", 10 },
+	};
+	static uint32 a[250];	/* 1000 'a', aligned to use the fast path */
+	SHA1_context ctx;
+	struct sha1 digest;
+	const char *hash;
+	uint i, j;
+
+	sha1_check_blocks();
+
+	for (i = 0; i < N_ITEMS(tests); i++) {
+		SHA1_reset(&ctx);
+		for (j = 0; j < tests[i].repeat; j++) {
+			SHA1_input(&ctx, tests[i].s, strlen(tests[i].s));
+		}
+		SHA1_result(&ctx, &digest);
+		hash = sha1_base32(&digest);
+
+		if (0 != strcmp(tests[i].r, hash)) {
+			g_warning("i=%u, hash=\"%s\"", i, hash);
+			g_assert_not_reached();
+		}
+	}
+
+	/*
+	 * Third test vector from RFC 3174: one million repetitions of 'a'.
+	 */
+
+	memset(a, 'a', sizeof a);
+	SHA1_reset(&ctx);
+	for (j = 0; j < 1000; j++) {
+		SHA1_input(&ctx, a, sizeof a);
+	}
+	SHA1_result(&ctx, &digest);
+	hash = sha1_base32(&digest);
+
+	if (0 != strcmp("GSVJOPGUYTNKJ5Q65MV5XLJHGFSTIALP", hash)) {
+		g_warning("million 'a', hash=\"%s\"", hash);
+		g_assert_not_reached();
+	}
+}
+
 /* vi: set ts=4 sw=4 cindent: */
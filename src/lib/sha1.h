@@ -85,6 +85,8 @@ int SHA1_input(SHA1_context *, const void *, size_t);
 int SHA1_result(SHA1_context *, struct sha1 *digest);
 int SHA1_intermediate(const SHA1_context *, struct sha1 *digest);
 
+void sha1_check(void);
+
 /**
  * Feed the SHA1 context with the content of a variable.
  */
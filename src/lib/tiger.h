@@ -38,6 +38,8 @@
 
 void tiger_check(void);
 void tiger(const void *data, uint64 length, char hash[24]);
+void tiger_prefixed(uint8 prefix, const void *data, size_t len, size_t n,
+	void *hashes);
 
 #endif /* _tiger_h_ */
 /* vi: set ts=4 sw=4 cindent: */
@@ -97,6 +97,9 @@
  * longer than 2^64 in size), havoc may ensue. */
 #define TTH_STACKSIZE	(TIGERSIZE * 56)
 
+/* amount of leaves hashed in one batch from the input data */
+#define TTH_BATCH		64
+
 enum {
 	TTH_F_INITIALIZED	= 1 << 0,
 	TTH_F_FINISHED		= 1 << 1
@@ -301,19 +304,20 @@ tt_collapse(TTH_CONTEXT *ctx)
 	}
 }
 
+/**
+ * Push the hash of the next leaf block on the stack.
+ */
 static void
-tt_block(TTH_CONTEXT *ctx)
+tt_leaf(TTH_CONTEXT *ctx, const struct tth *leaf)
 {
 	g_assert(ctx);
 
-	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
+	ctx->stack[ctx->si] = *leaf;
 	if (ctx->bpl == 1) {
 		ctx->leaves[ctx->li] = ctx->stack[ctx->si];
 		ctx->li++;
 	}
 
-	ctx->block_fill = 1;
-
 	ctx->si++;
 	ctx->n++;
 
@@ -324,6 +328,51 @@ tt_block(TTH_CONTEXT *ctx)
 	tt_collapse(ctx);
 }
 
+static void
+tt_block(TTH_CONTEXT *ctx)
+{
+	struct tth leaf;
+
+	g_assert(ctx);
+
+	tiger(ctx->block.bytes, ctx->block_fill, leaf.data);
+	ctx->block_fill = 1;
+	tt_leaf(ctx, &leaf);
+}
+
+/**
+ * Hash as many complete leaf blocks as possible directly from the data,
+ * computing several leaves at once.
+ *
+ * This can only be done when there is no pending data in the context.
+ *
+ * @return the amount of bytes consumed.
+ */
+static size_t
+tt_blocks(TTH_CONTEXT *ctx, const void *data, size_t size)
+{
+	struct tth leaves[TTH_BATCH];
+	const char *p = data;
+	size_t n, i, done = 0;
+
+	g_assert(1 == ctx->block_fill);
+
+	while (size - done >= TTH_BLOCKSIZE) {
+		n = (size - done) / TTH_BLOCKSIZE;
+		n = MIN(n, N_ITEMS(leaves));
+
+		tiger_prefixed(0x00, &p[done], TTH_BLOCKSIZE, n, leaves);
+
+		for (i = 0; i < n; i++) {
+			tt_leaf(ctx, &leaves[i]);
+		}
+
+		done += n * TTH_BLOCKSIZE;
+	}
+
+	return done;
+}
+
 static void
 tt_finish(TTH_CONTEXT *ctx)
 {
@@ -367,12 +416,19 @@ tt_finish(TTH_CONTEXT *ctx)
 size_t
 tt_compute_parents(struct tth *dst, const struct tth *src, size_t src_leaves)
 {
-	size_t i, n;
+	size_t i;
+
+	/*
+	 * Pairs of consecutive nodes are the data of their parent, hence all
+	 * the parents can be computed in one batch.  This works in place as
+	 * well, since each parent is stored before the pair of the next one.
+	 */
+
+	STATIC_ASSERT(TIGERSIZE == sizeof src[0]);
+
+	i = src_leaves / 2;
+	tiger_prefixed(0x01, src, TTH_NODESIZE, i, dst);
 
-	n = src_leaves / 2;
-	for (i = 0; i < n; i++) {
-		tt_internal_hash(&src[i * 2], &src[i * 2 + 1], &dst[i]);
-	}
 	if (src_leaves & 1) {
 		dst[i] = src[i * 2];
 		i++;
@@ -431,6 +487,13 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	while (size > 0) {
 		size_t n = sizeof ctx->block.bytes - ctx->block_fill;
 
+		if (1 == ctx->block_fill && size >= TTH_BLOCKSIZE) {
+			n = tt_blocks(ctx, block, size);
+			block += n;
+			size -= n;
+			continue;
+		}
+
 		n = MIN(n, size);
 		memmove(&ctx->block.bytes[ctx->block_fill], block, n);
 		ctx->block_fill += n;
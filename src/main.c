@@ -96,6 +96,7 @@
 #include "core/topless.h"
 #include "core/tsync.h"
 #include "core/tx.h"
+#include "core/tx_deflate.h"
 #include "core/udp.h"
 #include "core/uhc.h"
 #include "core/upload_stats.h"
@@ -110,6 +111,7 @@
 
 #include "lib/adns.h"
 #include "lib/aging.h"
+#include "lib/aio.h"
 #include "lib/atoms.h"
 #include "lib/bg.h"
 #include "lib/bsearch.h"
@@ -728,6 +730,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(verify_tth_shutdown);
 	DO(download_close);
 	DO(file_info_store_if_dirty);	/* In case downloads had buffered data */
+	DO(aio_close);					/* After all asynchronous I/O users */
 	DO(parq_close);
 	DO(pproxy_close);
 	DO(uhc_close);
@@ -947,6 +950,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(file_info_close);
 	DO(ext_close);
 	DO(node_close);
+	DO(tx_deflate_close_workers);	/* After node_close() */
 	DO(g2_node_close);
 	DO(share_close);	/* After node_close() */
 	DO(udp_close);
@@ -987,7 +991,6 @@ gtk_gnutella_exit(int exit_code)
 	DO(tls_global_close);
 	DO(misc_close);
 	DO(mingw_close);
-	DO(verify_tth_close);
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(wq_close);
@@ -2490,6 +2493,7 @@ main(int argc, char **argv)
 	inputevt_init(OPT(use_poll));
 	teq_io_create();
 	teq_set_throttle(70, 50);	/* 70 ms max for TEQ events, every 50 ms */
+	sha1_check();
 	tiger_check();
 	tt_check();
 	tea_test();
@@ -2577,6 +2581,7 @@ main(int argc, char **argv)
 	routing_init();
 	search_init();
 	share_init();
+	aio_init(GNET_PROPERTY(use_io_uring));
 	dmesh_init();			/* MUST be done BEFORE download_init() */
 	download_init();		/* MUST be done AFTER file_info_init() */
 	upload_init();
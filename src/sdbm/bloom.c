@@ -0,0 +1,312 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Per-page bloom filters, for negative lookups.
+ * author: agent <agent@local>
+ * status: public domain.
+ *
+ * @ingroup sdbm
+ * @file
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "private.h"
+#include "bloom.h"
+#include "pair.h"
+
+#include "lib/bit_array.h"
+#include "lib/halloc.h"
+#include "lib/hashing.h"
+#include "lib/log.h"
+#include "lib/pow2.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define BLOOM_PROBES	3		/* Amount of bits tested per key */
+#define BLOOM_RATIO		32		/* Page size / filter size ratio */
+
+enum sdbm_bloom_magic { SDBM_BLOOM_MAGIC = 0x29b7d1c3 };
+
+/**
+ * The bloom filters of a database.
+ *
+ * Each page of the database gets its own small filter, recording the hashes
+ * of the keys it holds, so that looking up a missing key can be answered
+ * without reading the page, provided the filter of the page is known.
+ *
+ * Filters are kept in memory only: the filter of a page is built from the
+ * page data the first time the page is accessed, then updated as keys are
+ * inserted.  Deleting a key leaves the filter untouched (it can only yield
+ * a false positive, which is harmless) whereas splitting a page invalidates
+ * the filters of the two pages involved, forcing their reconstruction.
+ *
+ * Pages holding big keys get saturated filters, since hashing these keys
+ * would require reading them from the .dat file.
+ */
+struct sdbm_bloom {
+	enum sdbm_bloom_magic magic;	/* Magic number */
+	size_t fbits;			/* Amount of bits in each page filter */
+	size_t fwords;			/* Amount of words in each page filter */
+	long pages;				/* Amount of page filters allocated */
+	bit_array_t *filter;	/* Page filters, `fwords' words each */
+	bit_array_t *valid;		/* Which page filters are up-to-date */
+	ulong probes;			/* Stats: amount of filter lookups */
+	ulong absent;			/* Stats: lookups which avoided a page access */
+	ulong fills;			/* Stats: filters built from page data */
+	ulong saturated;		/* Stats: filters saturated by big keys */
+};
+
+static inline void
+bloom_check(const struct sdbm_bloom * const b)
+{
+	g_assert(b != NULL);
+	g_assert(SDBM_BLOOM_MAGIC == b->magic);
+}
+
+/**
+ * Allocate bloom filters for pages of the given size.
+ */
+struct sdbm_bloom *
+bloom_alloc(size_t pagesize)
+{
+	struct sdbm_bloom *b;
+
+	g_assert(IS_POWER_OF_2(pagesize));
+	g_assert(pagesize >= DBM_PBLKSIZ && pagesize <= DBM_PBLKMAX);
+
+	WALLOC0(b);
+	b->magic = SDBM_BLOOM_MAGIC;
+	b->fbits = pagesize / BLOOM_RATIO * CHAR_BIT;
+	b->fwords = b->fbits / BIT_ARRAY_BITSIZE;
+
+	return b;
+}
+
+/**
+ * Free bloom filters and nullify their pointer.
+ */
+void
+bloom_free_null(struct sdbm_bloom **b_ptr)
+{
+	struct sdbm_bloom *b = *b_ptr;
+
+	if (b != NULL) {
+		bloom_check(b);
+		HFREE_NULL(b->filter);
+		HFREE_NULL(b->valid);
+		b->magic = 0;
+		WFREE(b);
+		*b_ptr = NULL;
+	}
+}
+
+/**
+ * @return the filter of page `num', which must have been allocated.
+ */
+static inline bit_array_t *
+bloom_filter(const struct sdbm_bloom *b, long num)
+{
+	g_assert(num >= 0 && num < b->pages);
+
+	return &b->filter[num * b->fwords];
+}
+
+/**
+ * Make sure we have a filter for page `num'.
+ */
+static void
+bloom_grow(struct sdbm_bloom *b, long num)
+{
+	long pages;
+
+	if G_LIKELY(num < b->pages)
+		return;
+
+	pages = MAX(num + 1, 2 * b->pages);
+	b->filter = hrealloc(b->filter, pages * b->fwords * sizeof b->filter[0]);
+	bit_array_resize(&b->valid, b->pages, pages);
+	b->pages = pages;
+}
+
+/**
+ * Compute the bits to probe for a key hashing to `hash'.
+ *
+ * All the keys held on a page share the trailing bits of their hash value,
+ * so we need to mix all the bits before deriving the probes, which we do
+ * through double hashing.
+ */
+static inline void
+bloom_probes(const struct sdbm_bloom *b, long hash, size_t *bits)
+{
+	uint32 h1 = hashing_mix32(hash);
+	uint32 h2 = hashing_mix32(h1 ^ GOLDEN_RATIO_32) | 1;
+	uint i;
+
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		bits[i] = (h1 + i * h2) & (b->fbits - 1);
+	}
+}
+
+/**
+ * Record a key hashing to `hash' in the filter.
+ */
+static inline void
+bloom_set(const struct sdbm_bloom *b, bit_array_t *f, long hash)
+{
+	size_t bits[BLOOM_PROBES];
+	uint i;
+
+	bloom_probes(b, hash, bits);
+
+	for (i = 0; i < N_ITEMS(bits); i++) {
+		bit_array_set(f, bits[i]);
+	}
+}
+
+/**
+ * @return whether the filter of page `num' is up-to-date.
+ */
+bool
+bloom_is_valid(const struct sdbm_bloom *b, long num)
+{
+	bloom_check(b);
+	g_assert(num >= 0);
+
+	return num < b->pages && bit_array_get(b->valid, num);
+}
+
+/**
+ * Check whether a key hashing to `hash' is known to be absent from page `num'.
+ *
+ * @return TRUE if the key is absent, FALSE if it may be present.
+ */
+bool
+bloom_absent(struct sdbm_bloom *b, long num, long hash)
+{
+	size_t bits[BLOOM_PROBES];
+	const bit_array_t *f;
+	uint i;
+
+	b->probes++;
+
+	if (!bloom_is_valid(b, num))
+		return FALSE;
+
+	f = bloom_filter(b, num);
+	bloom_probes(b, hash, bits);
+
+	for (i = 0; i < N_ITEMS(bits); i++) {
+		if (!bit_array_get(f, bits[i])) {
+			b->absent++;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Record that a key hashing to `hash' was inserted in page `num'.
+ *
+ * If the filter of the page is not known yet, nothing is done: it will be
+ * built from the page data the next time the page is accessed.
+ */
+void
+bloom_add(struct sdbm_bloom *b, long num, long hash)
+{
+	if (bloom_is_valid(b, num))
+		bloom_set(b, bloom_filter(b, num), hash);
+}
+
+/**
+ * Build the filter of page `num' from the keys held in the page.
+ *
+ * @param db		the database
+ * @param num		the page number
+ * @param pag		the page data (already sanity-checked)
+ */
+void
+bloom_fill(DBM *db, long num, const char *pag)
+{
+	struct sdbm_bloom *b = db->bloom;
+	const unsigned short *ino = INO(pag);
+	unsigned off = db->pblksiz;
+	unsigned i, n;
+	bit_array_t *f;
+
+	bloom_check(b);
+	g_assert(num >= 0);
+
+	bloom_grow(b, num);
+	f = bloom_filter(b, num);
+	memset(f, 0, b->fwords * sizeof f[0]);
+
+	n = ino[0];
+
+	for (i = 1; i < n; i += 2) {
+		unsigned short koff = poffset(ino[i]);
+
+		if G_UNLIKELY(is_big(ino[i]) || koff > off) {
+			memset(f, 0xff, b->fwords * sizeof f[0]);
+			b->saturated++;
+			break;
+		}
+
+		bloom_set(b, f, sdbm_hash(pag + koff, off - koff));
+		off = poffset(ino[i + 1]);
+	}
+
+	bit_array_set(b->valid, num);
+	b->fills++;
+}
+
+/**
+ * Invalidate the filter of page `num', whose keys were moved around.
+ */
+void
+bloom_invalidate(struct sdbm_bloom *b, long num)
+{
+	bloom_check(b);
+	g_assert(num >= 0);
+
+	if (num < b->pages)
+		bit_array_clear(b->valid, num);
+}
+
+/**
+ * Invalidate all the filters, after the database was cleared.
+ */
+void
+bloom_reset(struct sdbm_bloom *b)
+{
+	bloom_check(b);
+
+	if (b->pages != 0)
+		bit_array_clear_range(b->valid, 0, b->pages - 1);
+}
+
+/**
+ * Log bloom filter statistics.
+ */
+void
+bloom_log_stats(const DBM *db)
+{
+	const struct sdbm_bloom *b = db->bloom;
+
+	bloom_check(b);
+
+	s_info("sdbm: \"%s\" bloom filters: %.2f%% negative on %lu lookup%s, "
+		"%lu fill%s (%lu saturated), %zu-byte filters for %ld page%s",
+		sdbm_name(db), b->absent * 100.0 / MAX(b->probes, 1),
+		PLURAL(b->probes), PLURAL(b->fills), b->saturated,
+		b->fwords * sizeof b->filter[0], PLURAL(b->pages));
+}
+
+/* vi: set ts=4 sw=4 cindent: */
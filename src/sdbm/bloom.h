@@ -0,0 +1,22 @@
+/* Mini EMBED (bloom.c) */
+#define bloom_alloc sdbm__bloom_alloc
+#define bloom_free_null sdbm__bloom_free_null
+#define bloom_absent sdbm__bloom_absent
+#define bloom_add sdbm__bloom_add
+#define bloom_is_valid sdbm__bloom_is_valid
+#define bloom_fill sdbm__bloom_fill
+#define bloom_invalidate sdbm__bloom_invalidate
+#define bloom_reset sdbm__bloom_reset
+#define bloom_log_stats sdbm__bloom_log_stats
+
+struct sdbm_bloom *bloom_alloc(size_t);
+void bloom_free_null(struct sdbm_bloom **);
+bool bloom_absent(struct sdbm_bloom *, long, long);
+void bloom_add(struct sdbm_bloom *, long, long);
+bool bloom_is_valid(const struct sdbm_bloom *, long);
+void bloom_fill(DBM *, long, const char *);
+void bloom_invalidate(struct sdbm_bloom *, long);
+void bloom_reset(struct sdbm_bloom *);
+void bloom_log_stats(const DBM *);
+
+/* vi: set ts=4 sw=4 cindent: */
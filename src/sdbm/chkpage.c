@@ -21,10 +21,13 @@
 #include "lib/override.h"		/* Must be the last header included */
 
 /**
- * Check page sanity.
+ * Check sanity of a page of the specified size.
+ *
+ * @param pag		the page to check
+ * @param size		the page size of the database the page belongs to
  */
 bool
-sdbm_chkpage(const char *pag)
+sdbm_chkpage_size(const char *pag, size_t size)
 {
 	unsigned n;
 	unsigned off;
@@ -32,12 +35,14 @@ sdbm_chkpage(const char *pag)
 
 	/*
 	 * This static assertion makes sure that the leading bit of the shorts
-	 * used for storing offsets will always remain clear with the current
+	 * used for storing offsets will always remain clear with the largest
 	 * DBM page size, so that it can safely be used as a marker to flag
 	 * big keys/values.
 	 */
 
-	STATIC_ASSERT(DBM_PBLKSIZ < 0x8000);
+	STATIC_ASSERT(DBM_PBLKMAX < 0x8000);
+
+	g_assert(size <= DBM_PBLKMAX);
 
 	/*
 	 * number of entries should be something reasonable,
@@ -45,7 +50,7 @@ sdbm_chkpage(const char *pag)
 	 * this could be made more rigorous.
 	 */
 
-	if G_UNLIKELY((n = ino[0]) > INO_MAX)
+	if G_UNLIKELY((n = ino[0]) > INO_MAX(size))
 		return FALSE;
 
 	if G_UNLIKELY(n & 0x1)
@@ -53,7 +58,7 @@ sdbm_chkpage(const char *pag)
 
 	if (n > 0) {
 		unsigned ino_end = (n + 1) * sizeof(unsigned short);
-		off = DBM_PBLKSIZ;
+		off = size;
 		for (ino++; n > 0; ino += 2) {
 			unsigned short koff = poffset(ino[0]);
 			unsigned short voff = poffset(ino[1]);
@@ -68,4 +73,13 @@ sdbm_chkpage(const char *pag)
 	return TRUE;
 }
 
+/**
+ * Check sanity of a page, for databases using the default page size.
+ */
+bool
+sdbm_chkpage(const char *pag)
+{
+	return sdbm_chkpage_size(pag, DBM_PBLKSIZ);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -12,12 +12,13 @@
 #include "sdbm.h"
 
 extern void oops(char *fmt, ...) G_PRINTF(1, 2);
-void sdump(int, long);
+void sdump(int, int, long);
 void bdump(int);
 
 static bool summary_only;
 static bool filled_only;
 static bool on_tty;
+static size_t pblksiz = DBM_PBLKSIZ;
 
 static void G_NORETURN
 usage(void)
@@ -72,6 +73,7 @@ main(int argc, char **argv)
 		int datf;
 		char *name;
 		int n;
+		int base;
 		long npag;
 		filestat_t buf;
 
@@ -88,8 +90,11 @@ main(int argc, char **argv)
 		if (-1 == fstat(pagf, &buf))
 			oops("cannot fstat opened %s", name);
 
-		npag = buf.st_size / DBM_PBLKSIZ;
-		sdump(pagf, npag);
+		if (-1 == (base = sdbm_pagfile_format(pagf, &pblksiz)))
+			oops("cannot read format of %s", name);
+
+		npag = buf.st_size / pblksiz - base;
+		sdump(pagf, base, npag);
 		free(name);
 
 		name = (char *) malloc(n + sizeof(DBM_DATFEXT));
@@ -137,7 +142,7 @@ pagestat(char *pag,
 			printf("no entries.\n");
 	} else {
 		unsigned i;
-		unsigned off = DBM_PBLKSIZ;
+		unsigned off = pblksiz;
 
 		for (i = 1; i < n; i+= 2) {
 			unsigned short koff = offset(ino[i]);
@@ -155,9 +160,9 @@ pagestat(char *pag,
 		if (!summary_only) {
 			printf("%3d entr%-3s, %2d%% used, keys %3d, values %3d, free %3d%s",
 				PLURAL_Y(n / 2),
-				((DBM_PBLKSIZ - pfree) * 100) / DBM_PBLKSIZ,
+				(int) (((pblksiz - pfree) * 100) / pblksiz),
 				keysize, valsize, pfree,
-				(DBM_PBLKSIZ - pfree) / (n/2) * (1+n/2) > DBM_PBLKSIZ ?
+				(pblksiz - pfree) / (n/2) * (1+n/2) > pblksiz ?
 					" (LOW)" : "");
 
 			if (lk != 0) printf(" (LKEY %d)", lk);
@@ -180,7 +185,7 @@ page_is_empty(const char *pag)
 }
 
 void
-sdump(int pagf, long npag)
+sdump(int pagf, int base, long npag)
 {
 	int b;
 	int n = 0;
@@ -191,12 +196,15 @@ sdump(int pagf, long npag)
 	int e;
 	int bad = 0;
 	unsigned ksize = 0, vsize = 0;
-	char pag[DBM_PBLKSIZ];
+	char pag[DBM_PBLKMAX];
+
+	if ((fileoffset_t) -1 == lseek(pagf, base * pblksiz, SEEK_SET))
+		oops("seek failed: offset %lu", (unsigned long) (base * pblksiz));
 
-	while ((b = read(pagf, pag, DBM_PBLKSIZ)) > 0) {
+	while ((b = read(pagf, pag, pblksiz)) > 0) {
 		int lk, lv;
 		unsigned ks, vs;
-		bool is_bad = !sdbm_chkpage(pag);
+		bool is_bad = !sdbm_chkpage_size(pag, pblksiz);
 		bool is_empty = page_is_empty(pag);
 
 		if (summary_only && 0 == n % 1000) show_progress(n, npag);
@@ -15,6 +15,8 @@ extern void oops();
 
 #define empty(page)	(((short *) page)[0] == 0)
 
+static size_t pblksiz = DBM_PBLKSIZ;
+
 int
 main(int argc, char **argv)
 {
@@ -49,10 +51,17 @@ sdump(int pagf)
 	register r;
 	register n = 0;
 	register o = 0;
-	char pag[DBM_PBLKSIZ];
+	int base;
+	char pag[DBM_PBLKMAX];
+
+	if (-1 == (base = sdbm_pagfile_format(pagf, &pblksiz)))
+		oops("cannot read .pag format");
+
+	if ((fileoffset_t) -1 == lseek(pagf, base * pblksiz, SEEK_SET))
+		oops("seek failed: block %d", base);
 
-	while ((r = read(pagf, pag, DBM_PBLKSIZ)) > 0) {
-		if (!sdbm_chkpage(pag))
+	while ((r = read(pagf, pag, pblksiz)) > 0) {
+		if (!sdbm_chkpage_size(pag, pblksiz))
 			fprintf(stderr, "%d: bad page.\n", n);
 		else if (empty(pag))
 			o++;
@@ -98,7 +107,7 @@ dispage(char *pag)
 	register off;
 	register short *ino = (short *) pag;
 
-	off = DBM_PBLKSIZ;
+	off = pblksiz;
 	for (i = 1; i < ino[0]; i += 2) {
 		for (n = ino[i]; n < off; n++)
 			if (pag[n] != 0)
@@ -43,6 +43,7 @@
 #include "lib/stringify.h"	/* For plural() */
 #include "lib/thread.h"
 #include "lib/tm.h"
+#include "lib/xmalloc.h"
 
 #include "lib/override.h"
 
@@ -56,8 +57,12 @@ static bool unlink_db;
 static bool all_keys;
 static bool large_keys, large_values, common_head_tail;
 static bool loose_delete;
+static bool mmap_reads;
+static bool bloom_filters;
+static size_t page_size;
 static bool async_rebuild, async_rebuild_launched;
 static int async_thread = -1;
+static long readers;
 
 #define WR_DELAY	(1 << 0)
 #define WR_VOLATILE	(1 << 1)
@@ -68,8 +73,8 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-abdeiklprstvwyABCDEKSTUVX] [-R seed] [-c pages]\n"
-		"       dbname [count]\n"
+		"Usage: %s [-abdeiklprstvwyABCDEFKMSTUVX] [-R seed] [-c pages]\n"
+		"       [-N threads] [-P pagesize] dbname [count]\n"
 		"  -a : rebuild the database asynchronously whilst testing\n"
 		"  -b : rebuild the database\n"
 		"  -c : set LRU cache size\n"
@@ -91,7 +96,11 @@ usage(void)
 		"  -C : count database items\n"
 		"  -D : enable LRU cache write delay\n"
 		"  -E : empty existing database on write test\n"
+		"  -F : use per-page bloom filters for missing keys\n"
 		"  -K : use large keys with common head/tail parts\n"
+		"  -M : read pages in place from a memory mapping\n"
+		"  -N : perform concurrent read test with that many threads\n"
+		"  -P : page size when creating (or rebuilding with -B) the database\n"
 		"  -R : seed for repeatable random key sequence\n"
 		"  -S : shrink database before testing\n"
 		"  -T : make database handle thread-safe\n"
@@ -125,12 +134,16 @@ open_db(const char *name, bool writeable, long cache, int wflags)
 	if (WR_EMPTY == (wflags & (WR_EMPTY|WR_DELETING)))
 		flags |= O_TRUNC;
 
-	db = sdbm_open(name, flags, 0777);
+	db = 0 == page_size ?
+		sdbm_open(name, flags, 0777) :
+		sdbm_open_pagesize(name, flags, 0777, page_size);
 	if (NULL == db) {
 		oops("error opening database \"%s\" in %s mode",
 			name, writeable ? "writing" : "reading");
 	}
-	if (thread_safe)
+	if (readers != 0)
+		sdbm_thread_safe_rw(db);
+	else if (thread_safe)
 		sdbm_thread_safe(db);
 	if (cache != 0) {
 		if (-1 == sdbm_set_cache(db, cache)) {
@@ -147,6 +160,12 @@ open_db(const char *name, bool writeable, long cache, int wflags)
 		oops("error %sabling write delay for \"%s\"",
 			(wflags & WR_DELAY) ? "en" : "dis", name);
 	}
+	if (mmap_reads && -1 == sdbm_set_mmap(db, TRUE)) {
+		oops("error enabling in-place page reads for \"%s\"", name);
+	}
+	if (bloom_filters && -1 == sdbm_set_bloom(db, TRUE)) {
+		oops("error enabling bloom filters for \"%s\"", name);
+	}
 	if (shrink)
 		sdbm_shrink(db);
 
@@ -161,11 +180,17 @@ open_db(const char *name, bool writeable, long cache, int wflags)
 		tm_t start, end;
 		printf("Rebuilding database...\n");
 		tm_now_exact(&start);
-		if (-1 == sdbm_rebuild(db)) {
-			oops("error rebuilding \"%s\"", name);
+		if (0 == page_size) {
+			if (-1 == sdbm_rebuild(db))
+				oops("error rebuilding \"%s\"", name);
+		} else {
+			if (-1 == sdbm_rebuild_pagesize(db, page_size))
+				oops("error rebuilding \"%s\" with %zu-byte pages",
+					name, page_size);
 		}
 		tm_now_exact(&end);
-		printf("Done in %.3f secs.\n", tm_elapsed_f(&end, &start));
+		printf("Done in %.3f secs (%zu-byte pages).\n",
+			tm_elapsed_f(&end, &start), sdbm_pagesize(db));
 	}
 	return db;
 }
@@ -606,6 +631,137 @@ loose_db(const char *name, long count, long cache, int safe, tm_t *done)
 	sdbm_close(db);
 }
 
+struct reader_args {
+	DBM *db;
+	long count;
+	long first;			/* First item to read */
+	long items;			/* Amount of items read */
+};
+
+static void *
+reader_thread(void *arg)
+{
+	struct reader_args *a = arg;
+	char buf[1024];
+	datum key;
+	long n;
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	/*
+	 * Each reader starts at a different item so that readers do not all
+	 * request the same pages at the same time.
+	 */
+
+	for (n = 0; n < a->count; n++) {
+		long i = (a->first + n) % a->count;
+		datum val;
+
+		fill_key(ARYLEN(buf), i);
+		val = sdbm_fetch(a->db, key);
+		if (NULL == val.dptr) {
+			if (sdbm_error(a->db))
+				oops("read error at item #%ld", i);
+			oops("item #%ld not found", i);
+		}
+		if (0 != memcmp(val.dptr, key.dptr, NORMAL_KEY_LEN))
+			oops("item #%ld has wrong value", i);
+		a->items++;
+	}
+
+	sdbm_unref(&a->db);
+
+	return NULL;
+}
+
+static void
+concurrent_db(const char *name, long count, long cache, int safe, tm_t *done)
+{
+	DBM *db = open_db(name, TRUE, cache, 0);
+	long cpage = 0 == cache ? 64 : cache;
+	struct reader_args *args;
+	int *t;
+	char buf[1024];
+	ulong nop = 0, items = 0;
+	datum key;
+	long i, running;
+
+	(void) safe;
+
+	printf("Starting concurrent read test (%ld item%s, %ld thread%s), "
+		"cache=%ld page%s...\n",
+		PLURAL(count), PLURAL(readers), PLURAL(cpage));
+
+	XMALLOC0_ARRAY(args, readers);
+	XMALLOC_ARRAY(t, readers);
+
+	for (i = 0; i < readers; i++) {
+		args[i].db = sdbm_ref(db);
+		args[i].count = count;
+		args[i].first = count / readers * i;
+		t[i] = thread_create(reader_thread, &args[i], THREAD_F_PANIC, 0);
+	}
+
+	/*
+	 * Perturb the reading threads by doing random NOP updates.
+	 */
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	do {
+		datum val;
+
+		for (running = 0, i = 0; i < readers; i++) {
+			thread_info_t info;
+
+			if (-1 == thread_get_info(t[i], &info)) {
+				if (ESRCH != errno)
+					oops("%s(): cannot get thread info", G_STRFUNC);
+			} else if (!info.exited)
+				running++;
+		}
+
+		if (0 == count)
+			continue;
+
+		fill_key(ARYLEN(buf), random_value(count - 1));
+
+		sdbm_lock(db);
+		val = sdbm_fetch(db, key);
+		if (NULL != val.dptr) {
+			if (-1 == sdbm_store(db, key, val, DBM_REPLACE))
+				oops("%s(): cannot rewrite key", G_STRFUNC);
+			nop++;
+		}
+		sdbm_unlock(db);
+
+		if (progress && 0 == nop % 50) {
+			atomic_mb();
+			for (items = 0, i = 0; i < readers; i++) {
+				items += args[i].items;
+			}
+			show_progress(items / readers, count);
+		}
+	} while (running != 0);
+
+	for (items = 0, i = 0; i < readers; i++) {
+		if (-1 == thread_join(t[i], NULL))
+			oops("%s(): cannot join with reading thread", G_STRFUNC);
+		items += args[i].items;
+	}
+
+	show_done(done);
+
+	printf("Read %lu item%s whilst issuing %lu concurrent NOP update%s\n",
+		PLURAL(items), PLURAL(nop));
+
+	XFREE_NULL(args);
+	XFREE_NULL(t);
+	sdbm_close(db);
+}
+
 static void
 count_db(const char *name, long count, long cache, int safe, tm_t *done)
 {
@@ -652,14 +808,14 @@ main(int argc, char **argv)
 	extern int optind;
 	extern char *optarg;
 	bool wflag = 0, rflag = 0, iflag = 0, tflag = 0, sflag = 0;
-	bool eflag = 0, dflag = 0, bflag = 0, lflag = 0, xflag = 0;
+	bool eflag = 0, dflag = 0, bflag = 0, lflag = 0, xflag = 0, nflag = 0;
 	bool stats = 0, count_items = 0;
 	int wflags = 0;
 	int c;
 	const char *name;
 	long count;
 	long cache = 0;
-	const char options[] = "aAbBc:CdDeEiklKprR:sStTUvVwxXy";
+	const char options[] = "aAbBc:CdDeEFiklKMN:pP:rR:sStTUvVwxXy";
 
 	progstart(argc, argv);
 
@@ -693,6 +849,9 @@ main(int argc, char **argv)
 		case 'E':			/* empty database on write tests */
 			wflags |= WR_EMPTY;
 			break;
+		case 'F':			/* bloom filters */
+			bloom_filters++;
+			break;
 		case 'e':			/* exists test */
 			eflag++;
 			break;
@@ -710,9 +869,20 @@ main(int argc, char **argv)
 			lflag++;
 			thread_safe++;
 			break;
+		case 'M':			/* in-place page reads */
+			mmap_reads++;
+			break;
+		case 'N':			/* concurrent reads (implies -T) */
+			nflag++;
+			readers = atol(optarg);
+			thread_safe++;
+			break;
 		case 'p':			/* show test progress */
 			progress++;
 			break;
+		case 'P':			/* page size */
+			page_size = atol(optarg);
+			break;
 		case 'r':			/* read test */
 			rflag++;
 			break;
@@ -830,6 +1000,12 @@ main(int argc, char **argv)
 	if (count < 0)
 		oops("count must be positive (is %ld)", count);
 
+	if (nflag && (readers <= 0 || readers > 32))
+		oops("reading threads must be within 1..32 (is %ld)", readers);
+
+	if (nflag && randomize)
+		oops("cannot use random keys with concurrent reads");
+
 	if (count_items)
 		timeit(count_db, name, count, cache, tflag, 0, "count test");
 
@@ -848,6 +1024,9 @@ main(int argc, char **argv)
 	if (lflag)
 		timeit(loose_db, name, count, cache, tflag, sflag, "loose test");
 
+	if (nflag)
+		timeit(concurrent_db, name, count, cache, tflag, 0, "concurrent test");
+
 	if (eflag)
 		timeit(exist_db, name, count, cache, tflag, 0, "existence test");
 
@@ -24,12 +24,17 @@
 #include "lib/debug.h"
 #include "lib/elist.h"
 #include "lib/fd.h"
+#include "lib/halloc.h"
 #include "lib/hevset.h"
 #include "lib/log.h"
+#include "lib/misc.h"			/* For compact_size() */
+#include "lib/pslist.h"
 #include "lib/qlock.h"
+#include "lib/rwlock.h"
 #include "lib/stacktrace.h"
 #include "lib/stringify.h"		/* For plural() */
 #include "lib/vmm.h"
+#include "lib/vsort.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -47,6 +52,17 @@ enum sdbm_lru_magic { SDBM_LRU_MAGIC = 0x6a6daa37 };
  * When the SDBM layer wires pages, they are put in the `wired' list and
  * can no longer be reclaimed, regardless of the configured amount of
  * cached pages, until they are un-wired.
+ *
+ * When in-place reads are enabled, the .pag file is mapped read-only and
+ * pages not held in the cache are read directly from the mapping, without
+ * any system call or copy.  Such pages are copied into the cache before
+ * being modified, the cached copy superseding the mapped one until it is
+ * flushed back to disk.
+ *
+ * When the database allows concurrent readers, these can access mapped pages
+ * outside of the database lock: a mapping superseded whilst readers may be
+ * active is therefore retired instead of being released, until the next
+ * time the mapping is released by a writer.
  */
 struct lru_cache {
 	enum sdbm_lru_magic magic;	/* Magic number */
@@ -54,7 +70,13 @@ struct lru_cache {
 	elist_t lru;				/* LRU-ordered list of cached pages */
 	elist_t wired;				/* Wired (non-removable) cached pages */
 	uint pages;					/* Configured amount of pages to cache */
+	uint pagesize;				/* Size of the cached pages */
 	uint8 write_deferred;		/* Whether writes should be deferred */
+	uint8 mmapped;				/* Whether pages can be read in place */
+	char *map;					/* Read-only mapping of the .pag file */
+	size_t map_len;				/* Length of the mapping */
+	fileoffset_t map_valid;		/* Mapped length backed by the file */
+	pslist_t *retired;			/* Retired mappings, still in use */
 	unsigned long rhits;		/* Stats: amount of cache hits on reads */
 	unsigned long rmisses;		/* Stats: amount of cache misses on reads */
 	unsigned long whits;		/* Stats: amount of cache hits on writes */
@@ -67,6 +89,9 @@ struct lru_cache {
 	unsigned long cp_mod_wired;	/* Stats: cached pages modified whilst wired */
 	unsigned long cp_dirtied;	/* Stats: cached pages marked dirty */
 	unsigned long cp_flushed;	/* Stats: cached pages flushed */
+	unsigned long cp_cow;		/* Stats: mapped pages copied on write */
+	unsigned long mhits;		/* Stats: pages read in place from mapping */
+	unsigned long remaps;		/* Stats: mappings of the .pag file */
 };
 
 static inline void
@@ -105,7 +130,7 @@ struct lru_cpage {
 };
 
 #define LRU_EMBEDDED_OFFSET		offsetof(struct lru_cpage, page)
-#define LRU_CPAGE_LEN			(DBM_PBLKSIZ + LRU_EMBEDDED_OFFSET)
+#define LRU_CPAGE_LEN(c)		((c)->pagesize + LRU_EMBEDDED_OFFSET)
 
 static inline void
 sdbm_lru_cpage_check(const struct lru_cpage * const c)
@@ -134,14 +159,13 @@ sdbm_lru_cpage_alloc(DBM *db)
 	struct lru_cpage *cp;
 
 	sdbm_check(db);
+	sdbm_lru_check(db->cache);
 
-	cp = walloc(LRU_CPAGE_LEN);
+	cp = walloc(LRU_CPAGE_LEN(db->cache));
 	ZERO(cp);
 	cp->magic = SDBM_LRU_CPAGE_MAGIC;
 	cp->db = db;
 
-	sdbm_lru_check(db->cache);
-
 	db->cache->cp_created++;
 
 	return cp;
@@ -159,15 +183,16 @@ sdbm_lru_cpage_free(struct lru_cpage *cp)
 
 	{
 		DBM *db = cp->db;
+		struct lru_cache *cache;
 
 		sdbm_check(db);
-		sdbm_lru_check(db->cache);
+		cache = db->cache;
+		sdbm_lru_check(cache);
 
-		db->cache->cp_freed++;
+		cache->cp_freed++;
+		ZERO(cp);
+		wfree(cp, LRU_CPAGE_LEN(cache));
 	}
-
-	ZERO(cp);
-	wfree(cp, LRU_CPAGE_LEN);
 }
 
 /**
@@ -203,11 +228,158 @@ sdbm_lru_cpage_get(const DBM *db, const char *pag, bool safe)
 	return deconstify_pointer(cp);
 }
 
+#ifdef HAS_MMAP
+/**
+ * @return whether page address lies within the mapping of the .pag file.
+ */
+static inline bool
+lru_is_mapped(const struct lru_cache *cache, const char *pag)
+{
+	return cache->map != NULL &&
+		pag >= cache->map && pag < cache->map + cache->map_len;
+}
+
+/**
+ * A retired mapping of the .pag file.
+ */
+struct lru_retired {
+	char *map;					/* Start of mapping */
+	size_t len;					/* Length of mapping */
+};
+
+/**
+ * Release all the retired mappings.
+ */
+static void
+lru_unmap_retired(struct lru_cache *cache)
+{
+	struct lru_retired *r;
+
+	while (NULL != (r = pslist_shift(&cache->retired))) {
+		vmm_munmap(r->map, r->len);
+		WFREE(r);
+	}
+}
+
+/**
+ * Release the mapping of the .pag file, if any.
+ *
+ * If db->pagbuf was referring to a mapped page, it is invalidated.
+ *
+ * When concurrent readers may still be accessing mapped pages, the mapping
+ * is retired instead, to be released later by a writer.
+ */
+static void
+lru_unmap(DBM *db)
+{
+	struct lru_cache *cache = db->cache;
+
+	if (!sdbm_has_readers(db))
+		lru_unmap_retired(cache);
+
+	if (NULL == cache->map)
+		return;
+
+	if (lru_is_mapped(cache, db->pagbuf)) {
+		db->pagbuf = NULL;
+		db->pagbno = -1;
+	}
+
+	if G_UNLIKELY(sdbm_has_readers(db)) {
+		struct lru_retired *r;
+
+		WALLOC(r);
+		r->map = cache->map;
+		r->len = cache->map_len;
+		cache->retired = pslist_prepend(cache->retired, r);
+	} else {
+		vmm_munmap(cache->map, cache->map_len);
+	}
+
+	cache->map = NULL;
+	cache->map_len = 0;
+	cache->map_valid = 0;
+}
+
+/**
+ * Make sure the mapping of the .pag file extends at least up to `end'.
+ *
+ * The file is mapped with some room for growth, so that we do not need
+ * to remap it each time it is extended: only the part backed by the file
+ * (up to `map_valid') is ever accessed.
+ *
+ * @return TRUE if the data up to `end' is mapped.
+ */
+static bool
+lru_map(DBM *db, fileoffset_t end)
+{
+	struct lru_cache *cache = db->cache;
+	filestat_t buf;
+	fileoffset_t size;
+	size_t len;
+	void *p;
+
+	if G_UNLIKELY(-1 == fstat(db->pagf, &buf))
+		return FALSE;
+
+	size = buf.st_size - buf.st_size % db->pblksiz;		/* Only full pages */
+
+	if (size < end)
+		return FALSE;		/* Page is a hole past the end of the file */
+
+	if (cache->map != NULL && size <= (fileoffset_t) cache->map_len) {
+		cache->map_valid = size;
+		return TRUE;
+	}
+
+	if G_UNLIKELY((uint64) size > MAX_INT_VAL(size_t) / 3 * 2)
+		goto disable;
+
+	len = round_pagesize(size + size / 2);
+
+	lru_unmap(db);
+
+	p = vmm_mmap(NULL, len, PROT_READ, MAP_SHARED, db->pagf, 0);
+
+	if G_UNLIKELY(MAP_FAILED == p) {
+		s_warning("sdbm: \"%s\": cannot map %s of .pag file: %m",
+			sdbm_name(db), compact_size(len, FALSE));
+		goto disable;
+	}
+
+	cache->map = p;
+	cache->map_len = len;
+	cache->map_valid = size;
+	cache->remaps++;
+
+	return TRUE;
+
+disable:
+	s_warning("sdbm: \"%s\": disabling in-place page reads", sdbm_name(db));
+	cache->mmapped = FALSE;
+	return FALSE;
+}
+#else	/* !HAS_MMAP */
+#define lru_is_mapped(c,p)	((void) (c), (void) (p), FALSE)
+#define lru_unmap(d)		((void) (d))
+#endif	/* HAS_MMAP */
+
+/**
+ * Page `num' is now held in the LRU cache, which supersedes its mapped
+ * version: db->pagbuf can no longer refer to the latter.
+ */
+static inline void
+lru_supersede(DBM *db, long num)
+{
+	if G_UNLIKELY(num == db->pagbno && lru_is_mapped(db->cache, db->pagbuf))
+		db->pagbno = -1;
+}
+
 /**
  * Setup allocated LRU page cache.
  */
 static void
-setup_cache(struct lru_cache *cache, uint pages, bool wdelay)
+setup_cache(struct lru_cache *cache, uint pages, uint pagesize, bool wdelay)
 {
 	struct lru_cpage dummy;
 
@@ -223,6 +395,7 @@ setup_cache(struct lru_cache *cache, uint pages, bool wdelay)
 	elist_init(&cache->wired, offsetof(struct lru_cpage, chain));
 
 	cache->pages = pages;
+	cache->pagesize = pagesize;
 	cache->write_deferred = wdelay;
 }
 
@@ -238,8 +411,14 @@ free_cached_page(void *data, void *unused)
  * Free data structures used by the page cache.
  */
 static void
-free_cache(struct lru_cache *cache)
+free_cache(DBM *db)
 {
+	struct lru_cache *cache = db->cache;
+
+	lru_unmap(db);
+#ifdef HAS_MMAP
+	lru_unmap_retired(cache);	/* Nobody can be reading any more */
+#endif
 	hevset_foreach(cache->pagnum, free_cached_page, NULL);
 	hevset_free_null(&cache->pagnum);
 	elist_discard(&cache->lru);
@@ -247,6 +426,7 @@ free_cache(struct lru_cache *cache)
 	cache->pages = 0;
 	cache->magic = 0;
 	WFREE(cache);
+	db->cache = NULL;
 }
 
 /**
@@ -261,7 +441,7 @@ init_cache(DBM *db, uint pages, bool wdelay)
 
 	WALLOC0(cache);
 	cache->magic = SDBM_LRU_MAGIC;
-	setup_cache(cache, pages, wdelay);
+	setup_cache(cache, pages, db->pblksiz, wdelay);
 	db->cache = cache;
 
 	return 0;		/* Always OK */
@@ -306,6 +486,12 @@ log_lrustats(DBM *db)
 		sdbm_name(db), cache->cp_wired, cache->cp_mod_wired);
 	s_info("sdbm: \"%s\" LRU pages dirtied = %lu, flushed = %lu",
 		sdbm_name(db), cache->cp_dirtied, cache->cp_flushed);
+
+	if (cache->mmapped || cache->remaps != 0) {
+		s_info("sdbm: \"%s\" in-place page reads = %lu, "
+			"copied-on-write = %lu, file mappings = %lu",
+			sdbm_name(db), cache->mhits, cache->cp_cow, cache->remaps);
+	}
 }
 
 /**
@@ -382,9 +568,24 @@ flush_cpage(struct lru_cpage *cp, ssize_t *amount, int *error)
 	return TRUE;	/* Everything OK, page was clean */
 }
 
+/**
+ * vsort() callback to order cached pages by increasing page number.
+ */
+static int
+lru_cpage_numpag_cmp(const void *a, const void *b)
+{
+	const struct lru_cpage * const *cpa = a, * const *cpb = b;
+
+	return CMP((*cpa)->numpag, (*cpb)->numpag);
+}
+
 /**
  * Flush all the dirty pages to disk.
  *
+ * Pages are written by increasing page number, turning the flush into a
+ * sequential burst of writes instead of writes scattered over the file
+ * in LRU order.
+ *
  * @return the amount of pages successfully flushed as a positive number
  * if everything was fine, 0 if there was nothing to flush, and -1 if there
  * were I/O errors (errno is set).
@@ -393,9 +594,10 @@ ssize_t
 flush_dirtypag(const DBM *db)
 {
 	const struct lru_cache *cache = db->cache;
-	struct lru_cpage *cp;
+	struct lru_cpage *cp, **dirty;
 	ssize_t amount = 0;
 	int saved_errno = 0;
+	size_t i, n = 0;
 
 	if G_UNLIKELY(NULL == cache)
 		return 0;		/* No cache, nothing to flush */
@@ -405,8 +607,29 @@ flush_dirtypag(const DBM *db)
 
 	ELIST_FOREACH_DATA(&cache->lru, cp) {
 		sdbm_lru_cpage_valid(cp, db);
-		if (!flush_cpage(cp, &amount, &saved_errno))
-			break;
+		if (cp->dirty)
+			n++;
+	}
+
+	if (n != 0) {
+		HALLOC_ARRAY(dirty, n);
+
+		i = 0;
+		ELIST_FOREACH_DATA(&cache->lru, cp) {
+			if (cp->dirty)
+				dirty[i++] = cp;
+		}
+
+		g_assert(i == n);
+
+		vsort(dirty, n, sizeof dirty[0], lru_cpage_numpag_cmp);
+
+		for (i = 0; i < n; i++) {
+			if (!flush_cpage(dirty[i], &amount, &saved_errno))
+				break;
+		}
+
+		HFREE_NULL(dirty);
 	}
 
 	if (saved_errno != 0) {
@@ -439,6 +662,20 @@ getcache(const DBM *db)
 	return cache->pages;
 }
 
+/**
+ * @return whether the cache holds wired pages.
+ */
+bool
+lru_has_wired(const DBM *db)
+{
+	const struct lru_cache *cache = db->cache;
+
+	if (NULL == cache)
+		return FALSE;
+
+	return 0 != elist_count(&cache->wired);
+}
+
 /**
  * Set the page cache size, i.e. the maximum amount of pages we can cache.
  *
@@ -537,8 +774,7 @@ setcache(DBM *db, uint pages)
 		 */
 
 		if (0 == wired) {
-			free_cache(cache);
-			db->cache = NULL;
+			free_cache(db);
 		} else {
 			s_carp_once("%s(): attempting to disable cache on SDBM \"%s\""
 				"whilst still holding %zu wired page%s",
@@ -563,10 +799,10 @@ setcache(DBM *db, uint pages)
 	 * provided it is not already wired..
 	 *
 	 * Note that db->pagbuf MUST be a cached page since caching was on,
-	 * provided that db->pagbno is valid.
+	 * provided that db->pagbno is valid and the page was not read in place.
 	 */
 
-	if (db->pagbno != -1) {
+	if (db->pagbno != -1 && !lru_is_mapped(cache, db->pagbuf)) {
 		struct lru_cpage *cp = sdbm_lru_cpage_get(db, db->pagbuf, TRUE);
 
 		g_assert_log(cp != NULL,
@@ -662,8 +898,7 @@ lru_close(DBM *db)
 		if (common_stats)
 			log_lrustats(db);
 
-		free_cache(cache);
-		db->cache = NULL;
+		free_cache(db);
 	}
 }
 
@@ -751,6 +986,7 @@ lru_wire(DBM *db, long num, ulong *mstamp)
 		}
 		cp->numpag = num;
 		hevset_insert(cache->pagnum, cp);
+		lru_supersede(db, num);
 	}
 
 	g_assert(cp->wired);
@@ -872,8 +1108,7 @@ freepage:
 		0 == cache->pages &&
 		0 == elist_count(&cache->wired) + elist_count(&cache->lru)
 	) {
-		free_cache(cache);
-		db->cache = NULL;
+		free_cache(db);
 	}
 }
 
@@ -1023,6 +1258,7 @@ getcpage(DBM *db, long num)
 
 	cp->numpag = num;
 	hevset_insert(cache->pagnum, cp);
+	lru_supersede(db, num);
 
 	g_assert_log(hevset_count(cache->pagnum) ==
 		elist_count(&cache->lru) + elist_count(&cache->wired),
@@ -1098,9 +1334,9 @@ lru_discard_wired_page(struct lru_cpage *cp, long bno)
 		ATOMIC_INC(&cp->mstamp);
 		cp->dirty = FALSE;
 		cp->invalid = TRUE;
-		memset(cp->page, 0, DBM_PBLKSIZ);
-
 		sdbm_lru_check(cp->db->cache);
+		memset(cp->page, 0, cp->db->cache->pagesize);
+
 		cp->db->cache->cp_discarded++;
 	}
 }
@@ -1118,6 +1354,14 @@ lru_discard(DBM *db, long bno)
 	sdbm_lru_check(cache);
 	assert_sdbm_locked(db);
 
+	/*
+	 * The file is about to be truncated or superseded: accessing the
+	 * mapping past the new end of file would fault, so drop it.  It will
+	 * be re-established on the next in-place read.
+	 */
+
+	lru_unmap(db);
+
 	elist_foreach_remove(&cache->lru, lru_discard_page, long_to_pointer(bno));
 
 	ELIST_FOREACH_DATA(&cache->wired, cp) {
@@ -1180,7 +1424,8 @@ lru_invalidate(DBM *db, long bno)
 /**
  * Compute the file offset right after the last dirty page of the cache.
  *
- * @return 0 if no dirty page, the offset after the last dirty one otherwise.
+ * @return the offset of the first page if no dirty page, the offset after
+ * the last dirty one otherwise.
  */
 fileoffset_t
 lru_tail_offset(const DBM *db)
@@ -1204,7 +1449,7 @@ lru_tail_offset(const DBM *db)
 			bno = MAX(bno, cp->numpag);
 	}
 
-	return OFF_PAG(bno + 1);
+	return OFF_PAG(db, bno + 1);
 }
 
 /**
@@ -1255,6 +1500,137 @@ readbuf(DBM *db, long num, bool *loaded)
 	return TRUE;
 }
 
+/**
+ * Attempt to read page `num' in place from the mapping of the .pag file,
+ * setting db->pagbuf accordingly.
+ *
+ * This is only possible when in-place reads are enabled, when the page is
+ * not held in the cache (the mapping would not reflect pending changes),
+ * and when the page lies within the file.  Corrupted pages are not read in
+ * place either, letting readpag() deal with them.
+ *
+ * @return TRUE if db->pagbuf now refers to the mapped page.
+ */
+bool
+readmap(DBM *db, long num)
+{
+#ifdef HAS_MMAP
+	struct lru_cache *cache = db->cache;
+	fileoffset_t end = OFF_PAG(db, num + 1);
+	char *pag;
+
+	sdbm_lru_check(cache);
+	g_assert(num >= 0);
+	assert_sdbm_locked(db);
+
+	if (!cache->mmapped || hevset_contains(cache->pagnum, &num))
+		return FALSE;
+
+	if (end > cache->map_valid && !lru_map(db, end))
+		return FALSE;
+
+	pag = &cache->map[OFF_PAG(db, num)];
+
+	if G_UNLIKELY(!sdbm_chkpage_size(pag, db->pblksiz))
+		return FALSE;
+
+	db->pagbuf = pag;
+	cache->mhits++;
+
+	return TRUE;
+#else
+	(void) db;
+	(void) num;
+
+	return FALSE;
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Make sure the current page held in db->pagbuf can be modified.
+ *
+ * When the page was read in place from the .pag file mapping, it is copied
+ * into the cache, where it can be modified and later flushed.
+ *
+ * @return TRUE if OK, FALSE if we could not get a cached page, in which
+ * case db->pagbno is reset.
+ */
+bool
+privatepag(DBM *db)
+{
+	struct lru_cache *cache = db->cache;
+	struct lru_cpage *cp;
+	long num = db->pagbno;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+	if G_LIKELY(!lru_is_mapped(cache, db->pagbuf))
+		return TRUE;
+
+	g_assert(num >= 0);
+
+	cp = getcpage(db, num);		/* Resets db->pagbno */
+	if G_UNLIKELY(NULL == cp)
+		return FALSE;
+
+	memcpy(cp->page, db->pagbuf, db->pblksiz);
+	db->pagbuf = cp->page;
+	db->pagbno = num;
+	cache->cp_cow++;
+
+	return TRUE;
+}
+
+/**
+ * @return whether the page was read in place from the .pag file mapping.
+ */
+bool
+mappedpag(const DBM *db, const char *pag)
+{
+	const struct lru_cache *cache = db->cache;
+
+	return cache != NULL && lru_is_mapped(cache, pag);
+}
+
+/**
+ * Turn in-place reads of pages from a mapping of the .pag file on or off.
+ * @return -1 on error with errno set, 0 if OK.
+ */
+int
+setmmap(DBM *db, bool on)
+{
+	struct lru_cache *cache = db->cache;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+#ifdef HAS_MMAP
+	if (!on)
+		lru_unmap(db);
+
+	cache->mmapped = booleanize(on);
+	return 0;
+#else
+	if (!on)
+		return 0;
+
+	errno = ENOTSUP;
+	return -1;
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * @return whether pages can be read in place from a mapping of the .pag file.
+ */
+bool
+getmmap(const DBM *db)
+{
+	const struct lru_cache *cache = db->cache;
+
+	return cache != NULL && cache->mmapped;
+}
+
 /**
  * Cache new page held in memory if there are deferred writes configured.
  * @return TRUE on success.
@@ -1324,7 +1700,7 @@ cachepag(DBM *db, char *pag, long num)
 		 * Supersede cached page with new page created by makroom().
 		 */
 
-		memmove(cpag, pag, DBM_PBLKSIZ);
+		memmove(cpag, pag, db->pblksiz);
 
 		if (cache->write_deferred) {
 			cp->dirty = TRUE;
@@ -1337,7 +1713,7 @@ cachepag(DBM *db, char *pag, long num)
 		if (NULL == cp)
 			return FALSE;
 
-		memmove(cp->page, pag, DBM_PBLKSIZ);
+		memmove(cp->page, pag, db->pblksiz);
 		cp->dirty = TRUE;
 		return TRUE;
 	} else {
@@ -1355,10 +1731,10 @@ cachepag(DBM *db, char *pag, long num)
 static bool
 lru_chkpage(DBM *db, char *pag, long num)
 {
-	if G_UNLIKELY(!sdbm_chkpage(pag)) {
+	if G_UNLIKELY(!sdbm_chkpage_size(pag, db->pblksiz)) {
 		s_critical("sdbm: \"%s\": corrupted page #%ld, clearing",
 			sdbm_name(db), num);
-		memset(pag, 0, DBM_PBLKSIZ);
+		memset(pag, 0, db->pblksiz);
 		db->bad_pages++;
 		return FALSE;
 	}
@@ -1388,14 +1764,14 @@ readpag(DBM *db, char *pag, long num)
 	 */
 
 	db->pagread++;
-	got = compat_pread(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+	got = compat_pread(db->pagf, pag, db->pblksiz, OFF_PAG(db, num));
 	if G_UNLIKELY(got < 0) {
 		s_critical("sdbm: \"%s\": cannot read page #%ld: %m",
 			sdbm_name(db), num);
 		ioerr(db, FALSE);
 		return FALSE;
 	}
-	if G_UNLIKELY(got < DBM_PBLKSIZ) {
+	if G_UNLIKELY(got < (ssize_t) db->pblksiz) {
 		if (got > 0) {
 			s_critical("sdbm: \"%s\": partial read (%u bytes) of page #%ld",
 				sdbm_name(db), (unsigned) got, num);
@@ -1417,7 +1793,7 @@ readpag(DBM *db, char *pag, long num)
 				sdbm_name(db), num, PLURAL(n));
 		}
 
-		memset(pag, 0, DBM_PBLKSIZ);
+		memset(pag, 0, db->pblksiz);
 	}
 
 	(void) lru_chkpage(db, pag, num);
@@ -1453,9 +1829,9 @@ flushpag(DBM *db, char *pag, long num)
 	}
 
 	db->pagwrite++;
-	w = compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+	w = compat_pwrite(db->pagf, pag, db->pblksiz, OFF_PAG(db, num));
 
-	if (w < 0 || w != DBM_PBLKSIZ) {
+	if (w < 0 || w != (ssize_t) db->pblksiz) {
 		if (w < 0) {
 			if G_UNLIKELY(db->flags & DBM_RDONLY)
 				errno = EPERM;		/* Instead of EBADF on linux */
@@ -7,6 +7,7 @@
 #define lru_tail_offset sdbm__lru_tail_offset
 #define lru_wire sdbm__lru_wire
 #define lru_unwire sdbm__lru_unwire
+#define lru_has_wired sdbm__lru_has_wired
 #define lru_page_log sdbm__lru_page_log
 #define readbuf sdbm__readbuf
 #define flushpag sdbm__flushpag
@@ -19,10 +20,16 @@
 #define getwdelay sdbm__getwdelay
 #define cachepag sdbm__cachepag
 #define readpag sdbm__readpag
+#define readmap sdbm__readmap
+#define privatepag sdbm__privatepag
+#define mappedpag sdbm__mappedpag
 
 void lru_init(DBM *);
 void lru_close(DBM *);
 bool readbuf(DBM *, long, bool *);
+bool readmap(DBM *, long);
+bool privatepag(DBM *);
+bool mappedpag(const DBM *, const char *);
 void modifypag(const DBM *, const char *);
 bool dirtypag(DBM *, bool);
 bool flushpag(DBM *, char *, long);
@@ -32,6 +39,8 @@ int setcache(DBM *, uint);
 uint getcache(const DBM *);
 int setwdelay(DBM *, bool);
 bool getwdelay(const DBM *);
+int setmmap(DBM *, bool);
+bool getmmap(const DBM *);
 bool cachepag(DBM *, char *, long);
 char *lru_cached_page(DBM *, long);
 void lru_discard(DBM *, long);
@@ -40,6 +49,7 @@ fileoffset_t lru_tail_offset(const DBM *);
 const char *lru_wire(DBM *, long, ulong *);
 ulong lru_wired_mstamp(DBM *, const char *);
 void lru_unwire(DBM *, const char *);
+bool lru_has_wired(const DBM *);
 void lru_page_log(const DBM *, const char *);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -6,6 +6,7 @@
 #define getnkey sdbm__getnkey
 #define getnval sdbm__getnval
 #define getpair sdbm__getpair
+#define lookpair sdbm__lookpair
 #define putpair sdbm__putpair
 #define splpage sdbm__splpage
 #define delnpair sdbm__delnpair
@@ -18,7 +19,7 @@
 #define readpairv sdbm__readpairv
 
 #define INO(p)		((unsigned short *) (p))
-#define INO_MAX		(DBM_PBLKSIZ / sizeof(unsigned short) - 1)
+#define INO_MAX(s)	((s) / sizeof(unsigned short) - 1)	/* `s' is page size */
 
 #define BIG_FLAG	(1 << 15)
 #define BIG_MASK	(BIG_FLAG - 1)
@@ -67,6 +68,7 @@ extern bool fitpair(const DBM *, const char *, size_t);
 extern bool putpair(DBM *, char *, datum, datum);
 extern datum getpair(DBM *, char *, datum);
 extern bool exipair(DBM *, const char *, datum);
+extern int lookpair(uint, const char *, datum, datum *);
 extern bool delpair(DBM *, char *, datum);
 extern bool delnpair(DBM *, char *, int);
 extern bool delipair(DBM *, char *, int, bool);
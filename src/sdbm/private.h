@@ -6,7 +6,9 @@
 
 struct DBMBIG;
 struct qlock;			/* Avoid including "qlock.h" here */
+struct rwlock;			/* Avoid including "rwlock.h" here */
 struct lru_cache;
+struct sdbm_bloom;
 
 enum sdbm_magic { SDBM_MAGIC = 0x1dac340e };
 
@@ -24,15 +26,18 @@ struct DBM {
 	struct DBMBIG *big;	/* big key/value data management */
 	char *datname;		/* file name for .dat (created only when needed) */
 #endif
-	char *pagbuf;		/* page file block buffer (size: DBM_PBLKSIZ) */
+	char *pagbuf;		/* page file block buffer (size: pblksiz) */
 	char *dirbuf;		/* directory file block buffer (size: DBM_DBLKSIZ) */
+	char *splitbuf;		/* page split buffers (size: 2 * pblksiz) */
 #ifdef LRU
 	struct lru_cache *cache;	/* LRU page cache */
 #endif
 #ifdef THREADS
 	struct qlock *lock;	/* thread-safe lock at the API level */
+	struct rwlock *rwlock;	/* if non-NULL, allows concurrent readers */
 	int refcnt;			/* reference count */
 #endif
+	struct sdbm_bloom *bloom;	/* per-page bloom filters, if enabled */
 	struct DBM *rdb;	/* if non-NULL, concurrent DB rebuild in progress */
 	fileoffset_t pagtail;	/* end of page file descriptor, for iterating */
 	long maxbno;		/* size of dirfile in bits */
@@ -42,6 +47,9 @@ struct DBM {
 	long pagbno;		/* current page in pagbuf */
 	long dirbno;		/* current block in dirbuf */
 	long delta;			/* algebraic count of pairs added (deleted if <0) */
+	uint pblksiz;		/* size of a page within the .pag file */
+	uint pagbase;		/* amount of header pages at the start of .pag */
+	int spltmax;		/* maximum allowed page splits for an insertion */
 	int dirf;			/* directory file descriptor */
 	int pagf;			/* page file descriptor */
 	int flags;			/* status/error flags, see below */
@@ -78,6 +86,7 @@ struct DBM {
 #endif
 #ifdef THREADS
 	struct dbm_returns *returned;	/* per-thread returned values */
+	struct dbm_returns *pagcopy;	/* per-thread page copies for readers */
 	uint iterid;		/* thread small ID for iterating */
 #endif
 };
@@ -88,9 +97,17 @@ struct DBM {
 
 #ifdef THREADS
 
+/*
+ * When concurrent readers are allowed, the rwlock is taken for writing
+ * before the qlock in all the routines that can modify the database, and
+ * for reading by sdbm_fetch() and sdbm_exists().
+ */
+
 #define sdbm_synchronize(s) G_STMT_START {		\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		DBM *ws = deconstify_pointer(s);		\
+		if (ws->rwlock != NULL)					\
+			rwlock_wlock(ws->rwlock);			\
 		qlock_lock(ws->lock);					\
 	}											\
 } G_STMT_END
@@ -98,20 +115,28 @@ struct DBM {
 #define sdbm_synchronize_yield(s) G_STMT_START {\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		DBM *ws = deconstify_pointer(s);		\
-		qlock_rotate(ws->lock);					\
+		if (ws->rwlock != NULL)					\
+			sdbm_rotate(ws);					\
+		else									\
+			qlock_rotate(ws->lock);				\
 	}											\
 } G_STMT_END
 
+#define sdbm_release(s) G_STMT_START {			\
+	DBM *ws = deconstify_pointer(s);			\
+	qlock_unlock(ws->lock);						\
+	if (ws->rwlock != NULL)						\
+		rwlock_wunlock(ws->rwlock);				\
+} G_STMT_END
+
 #define sdbm_unsynchronize(s) G_STMT_START {	\
-	if G_UNLIKELY((s)->lock != NULL) { 			\
-		DBM *ws = deconstify_pointer(s);		\
-		qlock_unlock(ws->lock);					\
-	}											\
+	if G_UNLIKELY((s)->lock != NULL) 			\
+		sdbm_release(s);						\
 } G_STMT_END
 
 #define sdbm_return(s, v) G_STMT_START {		\
 	if G_UNLIKELY((s)->lock != NULL) 			\
-		qlock_unlock((s)->lock);				\
+		sdbm_release(s);						\
 	return v;									\
 } G_STMT_END
 
@@ -119,7 +144,7 @@ struct DBM {
 	datum *rv = &(v);							\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		rv = sdbm_thread_datum((s), &(v));		\
-		qlock_unlock((s)->lock);				\
+		sdbm_release(s);						\
 	}											\
 	return *rv;									\
 } G_STMT_END
@@ -129,6 +154,13 @@ struct DBM {
 		assert_qlock_is_owned((s)->lock);		\
 } G_STMT_END
 
+/*
+ * Whether concurrent readers may be accessing the database whilst we hold
+ * the qlock, i.e. whether they are allowed and we are not the writer.
+ */
+#define sdbm_has_readers(s) \
+	((s)->rwlock != NULL && !rwlock_is_owned((s)->rwlock))
+
 #else	/* !THREADS */
 
 #define sdbm_synchronize(s)
@@ -138,6 +170,7 @@ struct DBM {
 #define sdbm_return_datum(s, v)		return v
 #define sdbm_return_idatum(s, v)	return v
 #define assert_sdbm_locked(s)
+#define sdbm_has_readers(s)		((void) (s), FALSE)
 
 #endif	/* THREADS */
 
@@ -148,10 +181,10 @@ sdbm_check(const DBM * const db)
 	g_assert(SDBM_MAGIC == db->magic);
 }
 
-static inline long
-OFF_PAG(unsigned long off)
+static inline fileoffset_t
+OFF_PAG(const DBM *db, unsigned long off)
 {
-	return off * DBM_PBLKSIZ;
+	return (fileoffset_t) (off + db->pagbase) * db->pblksiz;
 }
 
 static inline long
@@ -177,6 +210,9 @@ ioerr(DBM *db, bool on_write)
  */
 
 void sdbm_return_free(struct dbm_returns *r);
+#ifdef THREADS
+void sdbm_rotate(DBM *db);
+#endif
 datum *sdbm_datum_copy(datum *v, struct dbm_returns *r);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -23,7 +23,9 @@
 #include "lib/halloc.h"
 #include "lib/hstrfn.h"
 #include "lib/log.h"
+#include "lib/pow2.h"
 #include "lib/qlock.h"
+#include "lib/rwlock.h"
 #include "lib/random.h"
 #include "lib/str.h"
 
@@ -92,6 +94,7 @@ sdbm_attr_propagate(DBM *ndb, const DBM *db)
 
 	if (sdbm_is_volatile(db))	sdbm_set_volatile(ndb, TRUE);
 	if (sdbm_get_wdelay(db))	sdbm_set_wdelay(ndb, TRUE);
+	if (sdbm_get_bloom(db))		sdbm_set_bloom(ndb, TRUE);
 	if (cache != 0)				sdbm_set_cache(ndb, cache);
 }
 
@@ -141,8 +144,12 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 #ifdef THREADS
 	g_assert(NULL == ndb->lock);		/* Since `ndb' was not thread-safe */
 	g_assert(NULL == ndb->returned);
+	g_assert(NULL == ndb->rwlock);
+	g_assert(NULL == ndb->pagcopy);
 	ndb->lock = db->lock;
+	ndb->rwlock = db->rwlock;
 	ndb->returned = db->returned;
+	ndb->pagcopy = db->pagcopy;
 	ndb->refcnt = db->refcnt;
 #endif
 #ifdef BIGDATA
@@ -150,17 +157,29 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 	ndb->big = db->big;			/* We're going to keep this db->big object */
 #endif
 #ifdef LRU
-	lru_close(ndb);				/* We only keep the current LRU cache */
-	lru_discard(db, 0);			/* All pages invalid since DB was rebuilt */
-	ndb->cache = db->cache;		/* Keep current DB cache (invalidated) */
-	db->cache = NULL;			/* Must not be freed by sdbm_close_internal() */
+	if (ndb->pblksiz == db->pblksiz) {
+		lru_close(ndb);				/* We only keep the current LRU cache */
+		lru_discard(db, 0);			/* All pages invalid since DB was rebuilt */
+		ndb->cache = db->cache;		/* Keep current DB cache (invalidated) */
+		db->cache = NULL;			/* Must not be freed by sdbm_close_internal() */
+	} else if (ndb->cache != NULL) {
+		/*
+		 * The page size changed, so we cannot reuse the cached pages of
+		 * the original database: keep the (emptied) cache of the new one,
+		 * whose pages would otherwise still refer to the `ndb' descriptor.
+		 */
+
+		lru_discard(ndb, 0);
+	}
 #endif
 	sdbm_close_internal(db, TRUE, FALSE);		/* Keep object around */
 	*db = *ndb;									/* struct copy */
 	db->pagbno = -1;							/* Restarting, no cached data */
 #ifdef THREADS
 	ndb->lock = NULL;							/* was copied over */
+	ndb->rwlock = NULL;
 	ndb->returned = NULL;
+	ndb->pagcopy = NULL;
 #endif
 
 	/*
@@ -222,11 +241,12 @@ rebuild_copy(const datum key, const datum value, void *arg)
  *
  * @param db		the database to rebuild
  * @param async		TRUE if rebuild happens concurrently
+ * @param pagesize	page size of the rebuilt database, 0 to keep the current one
  *
  * @return 0 if OK, -1 on failure.
  */
 static int
-sdbm_rebuild_internal(DBM *db, bool async)
+sdbm_rebuild_internal(DBM *db, bool async, size_t pagesize)
 {
 	DBM *ndb;
 	char ext[11];
@@ -242,6 +262,21 @@ sdbm_rebuild_internal(DBM *db, bool async)
 	if (!sdbm_can_rebuild(db, async))
 		goto failed;		/* errno was already set */
 
+	if (0 == pagesize)
+		pagesize = db->pblksiz;
+
+	/*
+	 * Changing the page size means we cannot keep the cached pages, hence
+	 * there must be no wired pages, which are used by loose iterations.
+	 */
+
+#ifdef LRU
+	if (pagesize != db->pblksiz && lru_has_wired(db)) {
+		errno = EBUSY;
+		goto failed;
+	}
+#endif
+
 	str_bprintf(ARYLEN(ext), ".%08x%c", random_u32(), async ? '~' : '\0');
 	dirname = h_strconcat(db->dirname, ext, NULL_PTR);
 	pagname = h_strconcat(db->pagname, ext, NULL_PTR);
@@ -265,8 +300,8 @@ sdbm_rebuild_internal(DBM *db, bool async)
 	 * has been done and we are ready to replace the old descriptor.
 	 */
 
-	ndb = sdbm_prep(dirname, pagname, datname,
-		O_WRONLY | O_CREAT | O_EXCL, db->openmode);
+	ndb = sdbm_prep_pagesize(dirname, pagname, datname,
+		O_WRONLY | O_CREAT | O_EXCL, db->openmode, pagesize);
 
 	if (NULL == ndb) {
 		error = errno;
@@ -280,6 +315,17 @@ sdbm_rebuild_internal(DBM *db, bool async)
 
 	sdbm_attr_propagate(ndb, db);
 
+	/*
+	 * When moving to smaller pages, all the keys of an original page share
+	 * the trailing bits of their hash value, up to the depth of the page in
+	 * the original directory tree.  Inserting them one after the other in
+	 * the new database can therefore require that many splits before the
+	 * keys get separated, so we allow for them.
+	 */
+
+	if (ndb->pblksiz < db->pblksiz)
+		ndb->spltmax += 1 + highest_bit_set64(db->maxbno);
+
 	/*
 	 * If rebuild is done asynchronously, the database is not kept locked.
 	 * We are going to loosely iterate over the database, copying each page
@@ -415,7 +461,7 @@ failed:
 int
 sdbm_rebuild(DBM *db)
 {
-	return sdbm_rebuild_internal(db, FALSE);
+	return sdbm_rebuild_internal(db, FALSE, 0);
 }
 
 /**
@@ -439,7 +485,33 @@ sdbm_rebuild_async(DBM *db)
 
 	sdbm_warn_if_not_separate(db, G_STRFUNC);
 
-	return sdbm_rebuild_internal(db, TRUE);
+	return sdbm_rebuild_internal(db, TRUE, 0);
+}
+
+/**
+ * Rebuild database from scratch using a new page size, which is the way
+ * to migrate existing databases to larger pages.
+ *
+ * The database must not be concurrently iterated over loosely, since the
+ * cached pages of the original database are discarded.
+ *
+ * @param db		the database to rebuild
+ * @param pagesize	the new page size (power of 2, 1 to 16 KiB)
+ *
+ * @return 0 if OK, -1 on failure with errno set.
+ */
+int
+sdbm_rebuild_pagesize(DBM *db, size_t pagesize)
+{
+	if (
+		!IS_POWER_OF_2(pagesize) ||
+		pagesize < DBM_PBLKSIZ || pagesize > DBM_PBLKMAX
+	) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return sdbm_rebuild_internal(db, FALSE, pagesize);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -14,6 +14,7 @@
 #include "pair.h"
 #include "lru.h"
 #include "big.h"
+#include "bloom.h"
 #include "tmp.h"
 #include "private.h"
 
@@ -29,6 +30,7 @@
 #include "lib/misc.h"
 #include "lib/pow2.h"
 #include "lib/qlock.h"
+#include "lib/rwlock.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/vmm.h"
@@ -39,6 +41,26 @@
 
 #define SDBM_COUNT_PAGES	128	/* Amount of pages read by sdbm_count() */
 
+/*
+ * Format header, held in a page at the start of the .pag file when the
+ * database uses another page size than the historical DBM_PBLKSIZ.
+ *
+ * Databases using the default page size have no header, which keeps them
+ * compatible with older versions.  The header cannot be mistaken for a
+ * regular page: its leading "SD" bytes, read as the amount of entries in
+ * the page, yield an odd value with little-endian shorts and a value too
+ * large for any page with big-endian ones.
+ */
+
+#define SDBM_HDR_MAGIC		"SDBM"
+#define SDBM_HDR_VERSION	1
+
+struct sdbm_header {
+	char magic[4];			/* SDBM_HDR_MAGIC */
+	uint8 version;			/* SDBM_HDR_VERSION */
+	uint8 pshift;			/* Page size is 1 << pshift */
+};
+
 const datum nullitem = {0, 0};
 
 /*
@@ -47,6 +69,8 @@ const datum nullitem = {0, 0};
 static bool getdbit(DBM *, long);
 static bool setdbit(DBM *, long);
 static bool getpage(DBM *, long);
+static long getpageb(DBM *, long, bool);
+static bool keyabsent(DBM *, long);
 static datum getnext(DBM *);
 static bool makroom(DBM *, long, size_t);
 static void validpage(DBM *, long);
@@ -146,6 +170,15 @@ sdbm_storage_needs(size_t key_size, size_t value_size, size_t *needed)
 
 		kl = bigkey_length(key_size);
 
+		/*
+		 * Like putpair(), keep small enough values expanded in the page.
+		 * Not accounting for this would underestimate the room we need,
+		 * which matters on large pages that can hold many such pairs.
+		 */
+
+		if (value_size <= DBM_PAIRMAX / 2 && value_size <= DBM_PAIRMAX - kl)
+			vl = value_size;
+
 		if (needed != NULL)
 			*needed = kl + vl;
 		return kl <= DBM_PAIRMAX && DBM_PAIRMAX - kl >= vl;
@@ -167,16 +200,21 @@ sdbm_is_storable(size_t key_size, size_t value_size)
 }
 
 /**
- * Open database with specified flags and mode (like open() arguments).
+ * Open database with specified flags and mode (like open() arguments),
+ * using the specified page size if the database is created.
+ *
+ * The page size of an existing database is the one it was created with,
+ * regardless of the `pagesize' argument.
  *
  * @param file		the basename to use for deriving .pag, .dir and .dat names
  * @param flags		open() flags
  * @param mode		open() mode
+ * @param pagesize	page size for new databases (power of 2, 1 to 16 KiB)
  *
  * @return the created database, or NULL on error with errno set.
  */
 DBM *
-sdbm_open(const char *file, int flags, int mode)
+sdbm_open_pagesize(const char *file, int flags, int mode, size_t pagesize)
 {
 	DBM *db = NULL;
 	char *dirname = NULL;
@@ -206,7 +244,7 @@ sdbm_open(const char *file, int flags, int mode)
 	}
 #endif
 
-	db = sdbm_prep(dirname, pagname, datname, flags, mode);
+	db = sdbm_prep_pagesize(dirname, pagname, datname, flags, mode, pagesize);
 
 	/* FALL THROUGH */
 
@@ -218,6 +256,21 @@ error:
 	return db;
 }
 
+/**
+ * Open database with specified flags and mode (like open() arguments).
+ *
+ * @param file		the basename to use for deriving .pag, .dir and .dat names
+ * @param flags		open() flags
+ * @param mode		open() mode
+ *
+ * @return the created database, or NULL on error with errno set.
+ */
+DBM *
+sdbm_open(const char *file, int flags, int mode)
+{
+	return sdbm_open_pagesize(file, flags, mode, DBM_PBLKSIZ);
+}
+
 static inline DBM *
 sdbm_alloc(void)
 {
@@ -227,6 +280,8 @@ sdbm_alloc(void)
 	db->magic = SDBM_MAGIC;
 	db->pagf = -1;
 	db->dirf = -1;
+	db->pblksiz = DBM_PBLKSIZ;
+	db->spltmax = DBM_SPLTMAX;
 
 #ifdef THREADS
 	db->iterid = THREAD_INVALID_ID;
@@ -259,6 +314,7 @@ sdbm_free(DBM *db)
 
 #ifdef THREADS
 	sdbm_returns_free_null(&db->returned);
+	sdbm_returns_free_null(&db->pagcopy);
 #endif
 
 	db->magic = 0;
@@ -315,7 +371,109 @@ sdbm_name(const DBM *db)
 }
 
 /**
- * Open database with specified files, flags and mode (like open() arguments).
+ * Read the format header of an opened .pag file, determining the page size.
+ *
+ * This is also used by the analysis tools, which read the .pag file directly
+ * and need to know where the first page starts and how large pages are.
+ *
+ * @param pagf		file descriptor of the .pag file
+ * @param pagesize	where the page size of the database is written
+ *
+ * @return the amount of pages taken by the header at the start of the file
+ * (0 or 1), -1 on error with errno set.
+ */
+int
+sdbm_pagfile_format(int pagf, size_t *pagesize)
+{
+	struct sdbm_header hdr;
+	ssize_t r;
+
+	*pagesize = DBM_PBLKSIZ;
+
+	r = compat_pread(pagf, VARLEN(hdr), 0);
+
+	if G_UNLIKELY(-1 == r)
+		return -1;
+
+	if (
+		(ssize_t) sizeof hdr == r &&
+		0 == memcmp(hdr.magic, SDBM_HDR_MAGIC, sizeof hdr.magic)
+	) {
+		size_t size = (size_t) 1 << MIN(hdr.pshift, 8 * sizeof(size_t) - 1);
+
+		if (
+			hdr.version > SDBM_HDR_VERSION ||
+			size < DBM_PBLKSIZ || size > DBM_PBLKMAX
+		) {
+			s_warning("sdbm: cannot handle format #%u with %u-byte pages",
+				hdr.version, 1U << MIN(hdr.pshift, 31));
+			errno = EINVAL;
+			return -1;
+		}
+
+		*pagesize = size;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Read the format header of the .pag file, determining the page size.
+ *
+ * If the .pag file is empty and opened for writing, we are creating the
+ * database: a header is written when the requested page size is not the
+ * default one.
+ *
+ * @param db		the database whose .pag file was just opened
+ * @param pagesize	the page size to use when creating the database
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+static bool
+sdbm_format(DBM *db, size_t pagesize)
+{
+	struct sdbm_header hdr;
+	filestat_t buf;
+	size_t size;
+	int base;
+
+	base = sdbm_pagfile_format(db->pagf, &size);
+
+	if G_UNLIKELY(-1 == base)
+		return FALSE;
+
+	db->pblksiz = size;
+	db->pagbase = base;
+
+	if (0 != base || DBM_PBLKSIZ == pagesize || (db->flags & DBM_RDONLY))
+		return TRUE;
+
+	if (-1 == fstat(db->pagf, &buf))
+		return FALSE;
+
+	if (0 == buf.st_size) {
+		ZERO(&hdr);
+		memcpy(hdr.magic, SDBM_HDR_MAGIC, sizeof hdr.magic);
+		hdr.version = SDBM_HDR_VERSION;
+		hdr.pshift = highest_bit_set(pagesize);
+
+		if (
+			-1 == compat_pwrite(db->pagf, VARLEN(hdr), 0) ||
+			-1 == ftruncate(db->pagf, pagesize)
+		)
+			return FALSE;
+
+		db->pblksiz = pagesize;
+		db->pagbase = 1;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Open database with specified files, flags and mode (like open() arguments),
+ * using the specified page size if the database is created.
  *
  * If the `datname' argument is NULL, large keys/values are disabled for
  * this database.
@@ -325,35 +483,32 @@ sdbm_name(const DBM *db)
  * @param datname	if not-NULL, the file to use for .dat (big keys/values)
  * @param flags		open() flags
  * @param mode		open() mode
+ * @param pagesize	page size for new databases (power of 2, 1 to 16 KiB)
  *
  * @return the created database, or NULL on error with errno set.
  */
 DBM *
-sdbm_prep(const char *dirname, const char *pagname,
-	const char *datname, int flags, int mode)
+sdbm_prep_pagesize(const char *dirname, const char *pagname,
+	const char *datname, int flags, int mode, size_t pagesize)
 {
 	DBM *db;
 	filestat_t dstat;
 
 	if (
-		(db = sdbm_alloc()) == NULL ||
-		(db->dirbuf = walloc(DBM_DBLKSIZ)) == NULL
+		!IS_POWER_OF_2(pagesize) ||
+		pagesize < DBM_PBLKSIZ || pagesize > DBM_PBLKMAX
 	) {
-		errno = ENOMEM;
-		goto error;
+		errno = EINVAL;
+		return NULL;
 	}
 
-	/*
-	 * If configured to use the LRU cache, then db->pagbuf will point to
-	 * pages allocated in the cache, so it need not be allocated separately.
-	 */
-
-#ifndef LRU
-	if ((db->pagbuf = walloc(DBM_PBLKSIZ)) == NULL) {
+	if (
+		(db = sdbm_alloc()) == NULL ||
+		(db->dirbuf = walloc(DBM_DBLKSIZ)) == NULL
+	) {
 		errno = ENOMEM;
 		goto error;
 	}
-#endif
 
 	/*
 	 * adjust user flags so that WRONLY becomes RDWR,
@@ -371,7 +526,10 @@ sdbm_prep(const char *dirname, const char *pagname,
 	 * If we fail anywhere, undo everything, return NULL.
 	 */
 
-	if ((db->pagf = file_open(pagname, flags, mode)) > -1) {
+	if (
+		(db->pagf = file_open(pagname, flags, mode)) > -1 &&
+		sdbm_format(db, pagesize)
+	) {
 		if ((db->dirf = file_open(dirname, flags, mode)) > -1) {
 
 			/*
@@ -405,6 +563,15 @@ error:
 
 success:
 
+	/*
+	 * If configured to use the LRU cache, then db->pagbuf will point to
+	 * pages allocated in the cache, so it need not be allocated separately.
+	 */
+
+#ifndef LRU
+	db->pagbuf = walloc(db->pblksiz);
+#endif
+
 #ifdef BIGDATA
 	if (datname != NULL) {
 		db->datname = h_strdup(datname);
@@ -446,6 +613,28 @@ success:
 	return db;
 }
 
+/**
+ * Open database with specified files, flags and mode (like open() arguments).
+ *
+ * If the `datname' argument is NULL, large keys/values are disabled for
+ * this database.
+ *
+ * @param dirname	the file to use for .dir
+ * @param pagname	the file to use for .pag
+ * @param datname	if not-NULL, the file to use for .dat (big keys/values)
+ * @param flags		open() flags
+ * @param mode		open() mode
+ *
+ * @return the created database, or NULL on error with errno set.
+ */
+DBM *
+sdbm_prep(const char *dirname, const char *pagname,
+	const char *datname, int flags, int mode)
+{
+	return sdbm_prep_pagesize(dirname, pagname, datname,
+		flags, mode, DBM_PBLKSIZ);
+}
+
 #ifdef THREADS
 /**
  * Mark newly created database as being thread-safe.
@@ -463,6 +652,46 @@ sdbm_thread_safe(DBM *db)
 	XMALLOC0_ARRAY(db->returned, THREAD_MAX);
 }
 
+/**
+ * Mark newly created database as being thread-safe, allowing concurrent
+ * readers.
+ *
+ * Threads looking up keys through sdbm_fetch() or sdbm_exists() then only
+ * hold the database lock whilst locating the page where the key lies, the
+ * lookup itself proceeding in parallel with other readers.  All the other
+ * operations, as well as explicit locking through sdbm_lock(), still get
+ * exclusive access to the database.
+ */
+void
+sdbm_thread_safe_rw(DBM *db)
+{
+	sdbm_thread_safe(db);
+
+	WALLOC(db->rwlock);
+	rwlock_init(db->rwlock);
+	XMALLOC0_ARRAY(db->pagcopy, THREAD_MAX);
+}
+
+/**
+ * Let threads waiting for a database allowing concurrent readers access it,
+ * when we hold the database for writing, but not recursively.
+ */
+void
+sdbm_rotate(DBM *db)
+{
+	g_assert(db->rwlock != NULL);
+
+	atomic_mb();
+
+	if (1 != rwlock_writers(db->rwlock) || 0 == db->rwlock->waiters)
+		return;
+
+	qlock_unlock(db->lock);
+	rwlock_wunlock(db->rwlock);
+	rwlock_wlock(db->rwlock);
+	qlock_lock(db->lock);
+}
+
 /**
  * Lock the database to allow a sequence of operations to be atomically
  * conducted.
@@ -479,6 +708,8 @@ sdbm_lock(DBM *db)
 	g_assert_log(db->lock != NULL,
 		"%s(): SDBM \"%s\" not marked thread-safe", G_STRFUNC, sdbm_name(db));
 
+	if (db->rwlock != NULL)
+		rwlock_wlock(db->rwlock);
 	qlock_lock(db->lock);
 }
 
@@ -496,6 +727,8 @@ sdbm_unlock(DBM *db)
 		"%s(): SDBM \"%s\" not marked thread-safe", G_STRFUNC, sdbm_name(db));
 
 	qlock_unlock(db->lock);
+	if (db->rwlock != NULL)
+		rwlock_wunlock(db->rwlock);
 }
 
 /**
@@ -730,6 +963,8 @@ log_sdbmstats(DBM *db)
 	s_info("sdbm: \"%s\" inplace value writes = %.2f%% on %lu occurence%s",
 		sdbm_name(db), db->repl_inplace * 100.0 / MAX(db->repl_stores, 1),
 		PLURAL(db->repl_stores));
+	if (db->bloom != NULL)
+		bloom_log_stats(db);
 }
 
 static void
@@ -797,6 +1032,11 @@ fetch_pagbuf(DBM *db, long pagnum)
 		{
 			bool loaded;
 
+			if (readmap(db, pagnum)) {
+				db->pagbno = pagnum;		/* Read in place, no I/O */
+				return TRUE;
+			}
+
 			if G_UNLIKELY(!readbuf(db, pagnum, &loaded)) {
 				db->pagbno = -1;
 				return FALSE;
@@ -824,6 +1064,22 @@ fetch_pagbuf(DBM *db, long pagnum)
 	return TRUE;
 }
 
+/**
+ * Make sure db->pagbuf can be modified, before changing the current page.
+ * @return TRUE on success
+ */
+static bool
+modify_pagbuf(DBM *db)
+{
+	assert_sdbm_locked(db);
+
+#ifdef LRU
+	return privatepag(db);	/* Page could have been read in place */
+#else
+	return TRUE;
+#endif
+}
+
 /**
  * Flush db->pagbuf to disk.
  * @return TRUE on success
@@ -927,10 +1183,11 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 	if (is_valid_fd(db->pagf))
 		lru_close(db);
 #else
-	WFREE_NULL(db->pagbuf, DBM_PBLKSIZ);
+	WFREE_NULL(db->pagbuf, db->pblksiz);
 #endif	/* LRU */
 
 	WFREE_NULL(db->dirbuf, DBM_DBLKSIZ);
+	WFREE_NULL(db->splitbuf, 2 * db->pblksiz);
 	fd_forget_and_close(&db->dirf);
 	fd_forget_and_close(&db->pagf);
 
@@ -950,6 +1207,7 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 		log_sdbmstats(db);
 	}
 	log_sdbm_warnings(db);
+	bloom_free_null(&db->bloom);
 
 	if (clearfiles) {
 		sdbm_unlink_file(sdbm_name(db), db->dirname);
@@ -972,6 +1230,10 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 			qlock_destroy(db->lock);
 			WFREE(db->lock);
 		}
+		if (db->rwlock != NULL) {
+			rwlock_destroy(db->rwlock);
+			WFREE(db->rwlock);
+		}
 		sdbm_free(db);
 	}
 }
@@ -1098,15 +1360,125 @@ sdbm_close(DBM *db)
 	}													\
 } G_STMT_END
 
+#ifdef THREADS
+/**
+ * Lookup key on behalf of a concurrent reader.
+ *
+ * The page where the key lies is located with the database locked, but the
+ * lookup within the page happens without the lock.  Pages read in place from
+ * the mapping of the .pag file stay valid as long as we hold the read lock,
+ * whereas other pages must be copied since the LRU cache can be updated by
+ * other readers.  Pages holding the key as a big key or with a big value
+ * are looked up again with the database locked.
+ *
+ * @param db		the database, allowing concurrent readers
+ * @param key		the key to look for
+ * @param val		if non-NULL, filled with a thread-private copy of the value
+ *
+ * @return 1 if the key was found, 0 if it is missing, -1 on error.
+ */
+static int
+sdbm_read_concurrent(DBM *db, datum key, datum *val)
+{
+	long hash;
+	const char *pag;
+	datum v;
+	int r;
+	bool locked = TRUE;
+
+	rwlock_rlock(db->rwlock);
+	qlock_lock(db->lock);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		r = -1;
+		goto done;
+	}
+
+	SDBM_WARN_ITERATING(db);
+
+	hash = exhash(key);
+	if (keyabsent(db, hash)) {
+		r = 0;
+		goto done;
+	}
+
+	if G_UNLIKELY(!getpage(db, hash))
+		goto ioerr;
+
+	pag = db->pagbuf;
+
+#ifdef LRU
+	if (!mappedpag(db, pag))
+#endif
+	{
+		datum page;
+
+		page.dptr = db->pagbuf;
+		page.dsize = db->pblksiz;
+		pag = sdbm_thread_datum_copy(db, &page, db->pagcopy)->dptr;
+	}
+
+	qlock_unlock(db->lock);
+	locked = FALSE;
+
+	r = lookpair(db->pblksiz, pag, key, &v);
+
+	if G_UNLIKELY(-1 == r) {
+		qlock_lock(db->lock);
+		locked = TRUE;
+
+		if G_UNLIKELY(!getpage(db, hash))
+			goto ioerr;
+
+		if (NULL == val) {
+			r = exipair(db, db->pagbuf, key);
+		} else {
+			v = getpair(db, db->pagbuf, key);
+			r = NULL == v.dptr ? 0 : 1;
+		}
+	}
+
+	if (1 == r && val != NULL)
+		*val = *sdbm_thread_datum(db, &v);
+
+	/* FALL THROUGH */
+
+done:
+	if (locked)
+		qlock_unlock(db->lock);
+	rwlock_runlock(db->rwlock);
+	return r;
+
+ioerr:
+	ioerr(db, FALSE);
+	r = -1;
+	goto done;
+}
+#endif	/* THREADS */
+
 datum
 sdbm_fetch(DBM *db, datum key)
 {
+	long hash;
+
 	if G_UNLIKELY(db == NULL || bad(key)) {
 		errno = EINVAL;
 		return nullitem;
 	}
 	sdbm_check(db);
 
+#ifdef THREADS
+	if G_UNLIKELY(db->rwlock != NULL) {
+		datum value;
+
+		if (1 == sdbm_read_concurrent(db, key, &value))
+			return value;
+
+		return nullitem;
+	}
+#endif
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -1116,7 +1488,11 @@ sdbm_fetch(DBM *db, datum key)
 
 	SDBM_WARN_ITERATING(db);
 
-	if (getpage(db, exhash(key))) {
+	hash = exhash(key);
+	if (keyabsent(db, hash))
+		goto null;
+
+	if (getpage(db, hash)) {
 		datum value = getpair(db, db->pagbuf, key);
 		sdbm_return_datum(db, value);
 	}
@@ -1134,12 +1510,19 @@ null:
 int
 sdbm_exists(DBM *db, datum key)
 {
+	long hash;
+
 	if G_UNLIKELY(db == NULL || bad(key)) {
 		errno = EINVAL;
 		return -1;
 	}
 	sdbm_check(db);
 
+#ifdef THREADS
+	if G_UNLIKELY(db->rwlock != NULL)
+		return sdbm_read_concurrent(db, key, NULL);
+#endif
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -1147,7 +1530,12 @@ sdbm_exists(DBM *db, datum key)
 		goto error;
 	}
 	SDBM_WARN_ITERATING(db);
-	if (getpage(db, exhash(key))) {
+
+	hash = exhash(key);
+	if (keyabsent(db, hash))
+		sdbm_return(db, 0);
+
+	if (getpage(db, hash)) {
 		int exists = exipair(db, db->pagbuf, key);
 		sdbm_return(db, exists);
 	}
@@ -1157,6 +1545,38 @@ error:
 	sdbm_return(db, -1);
 }
 
+/**
+ * Compute the page where a key lies, or would be inserted, without reading
+ * that page.
+ *
+ * This lets callers order a batch of updates so that each page is modified
+ * once, with pages visited by increasing file offset.  The result is only
+ * valid until the next page split.
+ *
+ * @return the page number, -1 on error with errno set.
+ */
+long
+sdbm_page_of(DBM *db, datum key)
+{
+	long num;
+
+	if G_UNLIKELY(db == NULL || bad(key)) {
+		errno = EINVAL;
+		return -1;
+	}
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		sdbm_return(db, -1);
+	}
+
+	num = getpageb(db, exhash(key), FALSE);
+	sdbm_return(db, num);
+}
+
 /**
  * Delete key from the database.
  *
@@ -1166,6 +1586,7 @@ int
 sdbm_delete(DBM *db, datum key)
 {
 	int status = -1;
+	long hash;
 
 	if G_UNLIKELY(db == NULL || bad(key)) {
 		errno = EINVAL;
@@ -1188,7 +1609,14 @@ sdbm_delete(DBM *db, datum key)
 		goto done;
 	}
 	SDBM_WARN_ITERATING(db);
-	if G_UNLIKELY(!getpage(db, exhash(key))) {
+
+	hash = exhash(key);
+	if (keyabsent(db, hash)) {
+		errno = 0;
+		goto done;
+	}
+
+	if G_UNLIKELY(!getpage(db, hash) || !modify_pagbuf(db)) {
 		ioerr(db, FALSE);
 		goto done;
 	}
@@ -1276,7 +1704,7 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 	}
 
 	hash = exhash(key);
-	if G_UNLIKELY(!getpage(db, hash)) {
+	if G_UNLIKELY(!getpage(db, hash) || !modify_pagbuf(db)) {
 		ioerr(db, FALSE);
 		return -1;
 	}
@@ -1344,6 +1772,9 @@ storepair(DBM *db, datum key, datum val, int flags, bool *existed)
 	if G_UNLIKELY(!putpair(db, db->pagbuf, key, val))
 		result = -1;
 
+	if (db->bloom != NULL)
+		bloom_add(db->bloom, db->pagbno, hash);
+
 	db->delta++;		/* Added one key/pair */
 
 inserted:
@@ -1430,15 +1861,24 @@ static bool
 makroom(DBM *db, long int hash, size_t need)
 {
 	long newp;
-	char twin[DBM_PBLKSIZ];
-	char cur[DBM_PBLKSIZ];
+	char *cur, *New;
 	char *pag = db->pagbuf;
 	long curbno;
-	char *New = (char *) twin;
-	int smax = DBM_SPLTMAX;
+	int smax = db->spltmax;
 
 	assert_sdbm_locked(db);
 
+	/*
+	 * Pages can be large, so the buffers we need to split them are not
+	 * allocated on the stack but kept around with the database.
+	 */
+
+	if G_UNLIKELY(NULL == db->splitbuf)
+		db->splitbuf = walloc(2 * db->pblksiz);
+
+	New = db->splitbuf;
+	cur = New + db->pblksiz;
+
 	do {
 		bool fits;		/* Can we fit new pair in the split page? */
 
@@ -1448,7 +1888,7 @@ makroom(DBM *db, long int hash, size_t need)
 		 * operation and restore the database to a consistent disk image.
 		 */
 
-		memcpy(cur, pag, DBM_PBLKSIZ);
+		memcpy(cur, pag, db->pblksiz);
 		curbno = db->pagbno;
 
 		/*
@@ -1463,6 +1903,15 @@ makroom(DBM *db, long int hash, size_t need)
 
 		newp = (hash & db->hmask) | (db->hmask + 1);
 
+		/*
+		 * Keys moved around: the filters of both pages must be rebuilt.
+		 */
+
+		if (db->bloom != NULL) {
+			bloom_invalidate(db->bloom, curbno);
+			bloom_invalidate(db->bloom, newp);
+		}
+
 		/*
 		 * write delay, read avoidence/cache shuffle:
 		 * select the page for incoming pair: if key is to go to the new page,
@@ -1481,7 +1930,7 @@ makroom(DBM *db, long int hash, size_t need)
 
 #ifdef DOSISH		/* DOS-behaviour -- filesystem holes not supported */
 		{
-			static const char zer[DBM_PBLKSIZ];
+			static const char zer[DBM_PBLKMAX];
 			long oldtail;
 
 			/*
@@ -1490,12 +1939,12 @@ makroom(DBM *db, long int hash, size_t need)
 			 */
 
 			oldtail = lseek(db->pagf, 0L, SEEK_END);
-			while (OFF_PAG(newp) > oldtail) {
+			while (OFF_PAG(db, newp) > oldtail) {
 				if (lseek(db->pagf, 0L, SEEK_END) < 0 ||
-				    write(db->pagf, zer, DBM_PBLKSIZ) < 0) {
+				    write(db->pagf, zer, db->pblksiz) < 0) {
 					return FALSE;
 				}
-				oldtail += DBM_PBLKSIZ;
+				oldtail += db->pblksiz;
 			}
 		}
 #endif	/* DOSISH */
@@ -1509,7 +1958,7 @@ makroom(DBM *db, long int hash, size_t need)
 
 #ifdef LRU
 			if G_UNLIKELY(!force_flush_pagbuf(db, !db->is_volatile)) {
-				memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+				memcpy(pag, cur, db->pblksiz);	/* Undo split */
 				db->spl_errors++;
 				goto aborted;
 			}
@@ -1526,7 +1975,7 @@ makroom(DBM *db, long int hash, size_t need)
 					/* Restore page address of the page we tried to split */
 					if (!readbuf(db, curbno, NULL))
 						g_assert_not_reached();
-					memcpy(db->pagbuf, cur, DBM_PBLKSIZ);	/* Undo split */
+					memcpy(db->pagbuf, cur, db->pblksiz);	/* Undo split */
 					db->pagbno = curbno;
 					db->spl_errors++;
 					goto aborted;
@@ -1537,7 +1986,7 @@ makroom(DBM *db, long int hash, size_t need)
 			pag = db->pagbuf;		/* Must refresh pointer to current page */
 #else
 			if G_UNLIKELY(!flush_pagbuf(db)) {
-				memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+				memcpy(pag, cur, db->pblksiz);	/* Undo split */
 				db->spl_errors++;
 				goto aborted;
 			}
@@ -1550,7 +1999,7 @@ makroom(DBM *db, long int hash, size_t need)
 			 */
 
 			db->pagbno = newp;
-			memcpy(pag, New, DBM_PBLKSIZ);
+			memcpy(pag, New, db->pblksiz);
 		}
 #ifdef LRU
 		else if (db->is_volatile) {
@@ -1567,7 +2016,7 @@ makroom(DBM *db, long int hash, size_t need)
 			 */
 
 			if G_UNLIKELY(!cachepag(db, New, newp)) {
-				memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+				memcpy(pag, cur, db->pblksiz);	/* Undo split */
 				db->spl_errors++;
 				goto aborted;
 			}
@@ -1575,12 +2024,12 @@ makroom(DBM *db, long int hash, size_t need)
 #endif	/* LRU */
 		else if G_UNLIKELY((
 			db->pagwrite++,
-			compat_pwrite(db->pagf, New, DBM_PBLKSIZ, OFF_PAG(newp)) < 0)
+			compat_pwrite(db->pagf, New, db->pblksiz, OFF_PAG(db, newp)) < 0)
 		) {
 			s_warning("sdbm: \"%s\": cannot flush new page #%ld: %m",
 				sdbm_name(db), newp);
 			ioerr(db, TRUE);
-			memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+			memcpy(pag, cur, db->pblksiz);	/* Undo split */
 			db->spl_errors++;
 			goto aborted;
 		}
@@ -1660,8 +2109,8 @@ makroom(DBM *db, long int hash, size_t need)
 	 * we still cannot fit the key. say goodnight.
 	 */
 
-	s_critical("sdbm: \"%s\": cannot insert after DBM_SPLTMAX (%d) attempts",
-		sdbm_name(db), DBM_SPLTMAX);
+	s_critical("sdbm: \"%s\": cannot insert after %d split attempts",
+		sdbm_name(db), db->spltmax);
 
 	return FALSE;
 
@@ -1693,7 +2142,7 @@ restore:
 #endif
 
 		db->pagbno = curbno;
-		memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+		memcpy(pag, cur, db->pblksiz);	/* Undo split */
 
 #ifdef LRU
 		if (!force_flush_pagbuf(db, !db->is_volatile))
@@ -1724,8 +2173,8 @@ restore:
 		g_assert(db->pagbno != newp);
 		lru_invalidate(db, newp);	/* We're about to commit a newer version */
 #endif
-		memset(New, 0, DBM_PBLKSIZ);
-		if (compat_pwrite(db->pagf, New, DBM_PBLKSIZ, OFF_PAG(newp)) < 0) {
+		memset(New, 0, db->pblksiz);
+		if (compat_pwrite(db->pagf, New, db->pblksiz, OFF_PAG(db, newp)) < 0) {
 			s_critical("sdbm: \"%s\": cannot zero-back new split page #%ld: %m",
 				sdbm_name(db), newp);
 			ioerr(db, TRUE);
@@ -1733,7 +2182,7 @@ restore:
 			db->spl_corrupt++;
 		}
 
-		memcpy(pag, cur, DBM_PBLKSIZ);	/* Undo split */
+		memcpy(pag, cur, db->pblksiz);	/* Undo split */
 	}
 
 	/* FALL THROUGH */
@@ -1917,7 +2366,7 @@ sdbm_firstkey(DBM *db)
 	 * Start at page 0, skipping any page we can't read.
 	 */
 
-	for (db->blkptr = 0; OFF_PAG(db->blkptr) <= db->pagtail; db->blkptr++) {
+	for (db->blkptr = 0; OFF_PAG(db, db->blkptr) <= db->pagtail; db->blkptr++) {
 		db->keyptr = 0;
 		if (fetch_pagbuf(db, db->blkptr)) {
 			if (db->flags & DBM_KEYCHECK)
@@ -2084,9 +2533,28 @@ getpage(DBM *db, long int hash)
 	if G_UNLIKELY(!fetch_pagbuf(db, pagb))
 		return FALSE;
 
+	if (db->bloom != NULL && !bloom_is_valid(db->bloom, pagb))
+		bloom_fill(db, pagb, db->pagbuf);
+
 	return TRUE;
 }
 
+/**
+ * Check whether a key hashing to the specified hash is known to be missing
+ * without having to read the page where it would lie, using the bloom
+ * filter of that page.
+ *
+ * @return TRUE if the key is certainly not in the database.
+ */
+static bool
+keyabsent(DBM *db, long int hash)
+{
+	if G_LIKELY(NULL == db->bloom)
+		return FALSE;
+
+	return bloom_absent(db->bloom, getpageb(db, hash, FALSE), hash);
+}
+
 /**
  * Check the page for keys that would not belong to the page and remove
  * them on the fly, logging problems.
@@ -2100,6 +2568,7 @@ validpage(DBM *db, long pagb)
 	unsigned short *ino = (unsigned short *) pag;
 	int removed = 0;
 	int corrupted = 0;
+	bool modifiable = FALSE;
 
 	assert_sdbm_locked(db);
 
@@ -2110,12 +2579,29 @@ validpage(DBM *db, long pagb)
 		long int hash;
 		long kpag;
 		int k = (i + 1) / 2;
+		bool foreign;
 
 		key = getnkey(db, pag, k);
 		hash = exhash(key);
 		kpag = getpageb(db, hash, FALSE);
+		foreign = kpag != pagb;
+
+		if G_LIKELY(!foreign && chkipair(db, pag, i))
+			continue;
+
+		/*
+		 * We need to alter the page: the first time, make sure we are not
+		 * looking at a page read in place.
+		 */
+
+		if G_UNLIKELY(!modifiable) {
+			if (!modify_pagbuf(db))
+				break;
+			pag = db->pagbuf;		/* Same data, possibly at a new address */
+			modifiable = TRUE;
+		}
 
-		if G_UNLIKELY(kpag != pagb) {
+		if (foreign) {
 			if (delipair(db, pag, i, TRUE)) {
 				removed++;
 			} else {
@@ -2124,7 +2610,7 @@ validpage(DBM *db, long pagb)
 					"not belonging to page #%ld",
 					sdbm_name(db), k, n / 2, pagb);
 			}
-		} else if G_UNLIKELY(!chkipair(db, pag, i)) {
+		} else {
 			/* Don't delete big data here, bitmap will be fixed later */
 			if (delipair(db, pag, i, FALSE)) {
 				corrupted++;
@@ -2281,7 +2767,7 @@ getnext(DBM *db)
 		db->keyptr = 0;
 		db->blkptr++;
 
-		if G_UNLIKELY(OFF_PAG(db->blkptr) > db->pagtail)
+		if G_UNLIKELY(OFF_PAG(db, db->blkptr) > db->pagtail)
 			break;
 		else if G_UNLIKELY(!fetch_pagbuf(db, db->blkptr))
 			goto next_page;		/* Skip faulty page */
@@ -2360,6 +2846,11 @@ sdbm_deletekey(DBM *db)
 	 * Delete key number ``db->keyptr'' on the current page.
 	 */
 
+	if G_UNLIKELY(!modify_pagbuf(db)) {
+		ioerr(db, FALSE);
+		goto done;
+	}
+
 	if G_UNLIKELY(!delnpair(db, db->pagbuf, db->keyptr))
 		goto done;
 
@@ -2594,6 +3085,44 @@ done:
 	sdbm_return(db, npag);
 }
 
+/**
+ * Synchronize cached data to disk, then wait for the files to reach the
+ * storage device, so that the data survive a system crash.
+ *
+ * @return the amount of pages flushed, as sdbm_sync() does, -1 on error.
+ */
+ssize_t
+sdbm_sync_durable(DBM *db)
+{
+	ssize_t npag;
+
+	npag = sdbm_sync(db);
+	if G_UNLIKELY(-1 == npag)
+		return -1;
+
+	sdbm_synchronize(db);
+
+	if (
+		-1 == fd_fdatasync(db->pagf) ||
+		(db->dirf != -1 && -1 == fd_fdatasync(db->dirf))
+	) {
+		npag = (ssize_t) -1;
+		goto done;
+	}
+
+#ifdef BIGDATA
+	{
+		int datf = big_datfno(db);
+
+		if (datf != -1 && -1 == fd_fdatasync(datf))
+			npag = (ssize_t) -1;
+	}
+#endif
+
+done:
+	sdbm_return(db, npag);
+}
+
 /**
  * Get algebraic count of added and deleted pairs since counter was last reset.
  *
@@ -2657,12 +3186,12 @@ sdbm_count(const DBM *db)
 	}
 #endif
 
-	if (-1 == seek_to_filepos(db->pagf, 0)) {
+	if (-1 == seek_to_filepos(db->pagf, OFF_PAG(db, 0))) {
 		count = (ssize_t) -1;
 		goto done;
 	}
 
-	len = SDBM_COUNT_PAGES * DBM_PBLKSIZ;
+	len = SDBM_COUNT_PAGES * db->pblksiz;
 	buf = vmm_alloc(len);
 	compat_fadvise_sequential(db->pagf, 0, 0);
 
@@ -2679,11 +3208,11 @@ sdbm_count(const DBM *db)
 			goto abort;
 		}
 
-		n = r / DBM_PBLKSIZ;		/* Amount of pages fully read */
+		n = r / db->pblksiz;		/* Amount of pages fully read */
 		finished = n != SDBM_COUNT_PAGES;
 
-		for (pag = buf; n != 0; n--, pag = ptr_add_offset(pag, DBM_PBLKSIZ)) {
-			if (sdbm_chkpage(pag))
+		for (pag = buf; n != 0; n--, pag = ptr_add_offset(pag, db->pblksiz)) {
+			if (sdbm_chkpage_size(pag, db->pblksiz))
 				count += paircount(pag);
 		}
 
@@ -2740,7 +3269,7 @@ sdbm_shrink(DBM *db)
 
 	paglen = buf.st_size;
 
-	while ((offset = OFF_PAG(bno)) < paglen) {
+	while ((offset = OFF_PAG(db, bno)) < paglen) {
 		unsigned short count;
 		int r;
 
@@ -2779,7 +3308,7 @@ sdbm_shrink(DBM *db)
 		bno++;
 	}
 
-	offset = OFF_PAG(truncate_bno);
+	offset = OFF_PAG(db, truncate_bno);
 
 	if (offset < paglen) {
 		if (-1 == ftruncate(db->pagf, offset))
@@ -3173,10 +3702,12 @@ sdbm_clear(DBM *db)
 	if G_UNLIKELY(db->rdb != NULL)
 		sdbm_clear(db->rdb);		/* Also clear rebuilt DB */
 	db->delta = 0;
-	if G_UNLIKELY(-1 == ftruncate(db->pagf, 0))
+	if G_UNLIKELY(-1 == ftruncate(db->pagf, OFF_PAG(db, 0)))
 		goto error;
 	db->pagbno = -1;
 	db->pagtail = 0L;
+	if (db->bloom != NULL)
+		bloom_reset(db->bloom);
 	if G_UNLIKELY(-1 == ftruncate(db->dirf, 0))
 		goto error;
 	db->dirbno = -1;
@@ -3293,6 +3824,102 @@ sdbm_set_wdelay(DBM *db, bool on)
 	sdbm_return(db, result);
 }
 
+/**
+ * @return whether pages are read in place from a mapping of the page file.
+ */
+bool
+sdbm_get_mmap(const DBM *db)
+{
+	bool mapped;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	mapped = getmmap(db);
+#else
+	mapped = FALSE;
+#endif
+
+	sdbm_return(db, mapped);
+}
+
+/**
+ * Turn in-place reads of pages from a mapping of the page file on or off.
+ */
+int
+sdbm_set_mmap(DBM *db, bool on)
+{
+	int result;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	if G_UNLIKELY(NULL == db->cache)
+		lru_init(db);
+	result = setmmap(db, on);
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+	sdbm_return(db, result);
+}
+
+/**
+ * @return whether negative lookups are answered by per-page bloom filters.
+ */
+bool
+sdbm_get_bloom(const DBM *db)
+{
+	bool on;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+	on = db->bloom != NULL;
+	sdbm_return(db, on);
+}
+
+/**
+ * Turn per-page bloom filters on or off.
+ *
+ * When on, each page gets a small in-memory filter recording the keys it
+ * holds, letting lookups of missing keys avoid reading the page.  The
+ * filters take about 1/32 of the size of the .pag file.
+ *
+ * @return 0 if OK.
+ */
+int
+sdbm_set_bloom(DBM *db, bool on)
+{
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if (on && NULL == db->bloom)
+		db->bloom = bloom_alloc(db->pblksiz);
+	else if (!on)
+		bloom_free_null(&db->bloom);
+
+	sdbm_return(db, 0);
+}
+
+/**
+ * @return the size of the pages in the .pag file.
+ */
+size_t
+sdbm_pagesize(const DBM *db)
+{
+	sdbm_check(db);
+
+	return db->pblksiz;
+}
+
 /**
  * @return whether database was flagged as "volatile".
  */
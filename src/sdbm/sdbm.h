@@ -9,7 +9,8 @@
 #define _sdbm_h_
 
 #define DBM_DBLKSIZ 4096		/* size of a page within ".dir" files */
-#define DBM_PBLKSIZ 1024		/* size of a page within ".pag" files */
+#define DBM_PBLKSIZ 1024		/* default size of a page within ".pag" files */
+#define DBM_PBLKMAX 16384		/* maximum size of a page within ".pag" files */
 #define DBM_BBLKSIZ 1024		/* size of a page within ".dat" files */
 #define DBM_PAIRMAX 1008		/* arbitrary on DBM_PBLKSIZ-N */
 #define DBM_SPLTMAX	10			/* maximum allowed splits for an insertion */
@@ -57,6 +58,7 @@ typedef bool (*sdbm_cbr_t)(const datum key, const datum value, void *arg);
  * ndbm interface
  */
 DBM *sdbm_open(const char *, int, int);
+DBM *sdbm_open_pagesize(const char *, int, int, size_t);
 void sdbm_close(DBM *);
 datum sdbm_fetch(DBM *, datum);
 int sdbm_delete(DBM *, datum);
@@ -69,11 +71,15 @@ void sdbm_endkey(DBM *);
 datum sdbm_value(DBM *);
 int sdbm_deletekey(DBM *);
 int sdbm_exists(DBM *, datum);
+long sdbm_page_of(DBM *, datum);
 
 /*
  * other
  */
 DBM *sdbm_prep(const char *, const char *, const char *, int, int);
+DBM *sdbm_prep_pagesize(const char *, const char *, const char *,
+	int, int, size_t);
+size_t sdbm_pagesize(const DBM *) G_PURE;
 long sdbm_hash(const char *, size_t) G_PURE;
 bool sdbm_rdonly(const DBM *);
 bool sdbm_error(const DBM *);
@@ -85,10 +91,15 @@ bool sdbm_is_storable(size_t, size_t);
 void sdbm_set_name(DBM *, const char *);
 const char *sdbm_name(const DBM *);
 ssize_t sdbm_sync(DBM *);
+ssize_t sdbm_sync_durable(DBM *);
 int sdbm_set_cache(DBM *db, long pages);
 long sdbm_get_cache(const DBM *) G_PURE;
 int sdbm_set_wdelay(DBM *db, bool on);
 bool sdbm_get_wdelay(const DBM *) G_PURE;
+int sdbm_set_mmap(DBM *db, bool on);
+bool sdbm_get_mmap(const DBM *) G_PURE;
+int sdbm_set_bloom(DBM *db, bool on);
+bool sdbm_get_bloom(const DBM *) G_PURE;
 int sdbm_set_volatile(DBM *db, bool yes);
 bool sdbm_is_volatile(const DBM *) G_PURE;
 bool sdbm_shrink(DBM *db);
@@ -101,6 +112,7 @@ int sdbm_rename(DBM *, const char *);
 int sdbm_rename_files(DBM *, const char *, const char *, const char *);
 int sdbm_rebuild(DBM *);
 int sdbm_rebuild_async(DBM *);
+int sdbm_rebuild_pagesize(DBM *, size_t);
 size_t sdbm_foreach(DBM *db, int flags, sdbm_cb_t cb, void *arg);
 size_t sdbm_foreach_remove(DBM *db, int flags, sdbm_cbr_t cb, void *arg);
 
@@ -108,6 +120,7 @@ size_t sdbm_foreach_remove(DBM *db, int flags, sdbm_cbr_t cb, void *arg);
  * only defined if compiled with THREADS set in "tune.h".
  */
 void sdbm_thread_safe(DBM *db);
+void sdbm_thread_safe_rw(DBM *db);
 void sdbm_lock(DBM *db);
 void sdbm_unlock(DBM *db);
 bool sdbm_is_thread_safe(const DBM *db);
@@ -121,6 +134,8 @@ int sdbm_refcnt(const DBM *db);
  * These are not documented.
  */
 bool sdbm_chkpage(const char *);
+bool sdbm_chkpage_size(const char *, size_t);
+int sdbm_pagfile_format(int pagf, size_t *pagesize);
 void sdbm_warn_if_not_separate(const DBM *db, const char *caller);
 
 /*
@@ -176,6 +176,8 @@ gnet_stats_gui_general_to_string_buf(char *dst, size_t size,
 		case GNR_UDP_READ_AHEAD_BYTES_MAX:
 		case GNR_RUDP_TX_BYTES:
 		case GNR_RUDP_RX_BYTES:
+		case GNR_TX_DEFLATE_MEMORY:
+		case GNR_TX_DEFLATE_MEMORY_SAVED:
 			cstr_bcpy(dst, size, compact_size(value, show_metric_units()));
 			break;
 		case GNR_UDP_READ_AHEAD_DELAY_MAX: